@@ -0,0 +1,322 @@
+#ifdef __linux__
+#define _GNU_SOURCE // For sched_getaffinity()
+#include <sched.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+
+// The policies of the "Thread Binding" option order the logical processors
+// the process may run on by their package (socket), their core within the
+// package and their hardware thread (SMT) within the core:
+// - compact: all hardware threads of a core before the next core, so that
+//   threads 2i and 2i+1 share a core;
+// - cores: one hardware thread of every core of the first package, then
+//   of the second package, etc., before the second hardware threads;
+// - scatter: as cores, but alternating between the packages.
+// A list of processors such as "0-7,16-23" binds thread i to its i-th
+// processor. With more threads than processors, the list is repeated.
+
+enum { MaxCpus = 1024 };
+
+typedef struct {
+  uint64_t key;
+  int cpu, package, core, smt;
+} CpuInfo;
+
+typedef struct {
+  CpuInfo *cpus;
+  int num;
+} Binding;
+
+static Binding binding, delayedBinding;
+static bool bindingChanged;
+
+#if defined(__linux__)
+
+static int read_topology(const char *name, int cpu)
+{
+  char path[96];
+  sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+  FILE *F = fopen(path, "r");
+  int value = -1;
+  if (F) {
+    if (fscanf(F, "%d", &value) != 1)
+      value = -1;
+    fclose(F);
+  }
+  return value;
+}
+
+static int read_cpus(CpuInfo *cpus)
+{
+  cpu_set_t avail;
+  if (sched_getaffinity(0, sizeof(avail), &avail) != 0)
+    return 0;
+
+  int n = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && n < MaxCpus; cpu++)
+    if (CPU_ISSET(cpu, &avail)) {
+      cpus[n].cpu = cpu;
+      cpus[n].package = read_topology("physical_package_id", cpu);
+      cpus[n].core = read_topology("core_id", cpu);
+      n++;
+    }
+
+  return n;
+}
+
+#elif defined(_WIN32)
+
+// Only the processors of the first processor group are used.
+
+static int read_cpus(CpuInfo *cpus)
+{
+  DWORD_PTR avail, systemMask;
+  if (!GetProcessAffinityMask(GetCurrentProcess(), &avail, &systemMask))
+    return 0;
+
+  SYSTEM_LOGICAL_PROCESSOR_INFORMATION *buffer = NULL;
+  DWORD len = 0;
+  while (!GetLogicalProcessorInformation(buffer, &len)) {
+    free(buffer);
+    if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+      return 0;
+    buffer = malloc(len);
+  }
+
+  int package[64], core[64];
+  for (int cpu = 0; cpu < 64; cpu++)
+    package[cpu] = core[cpu] = -1;
+  int numCores = 0, numPackages = 0;
+  for (DWORD i = 0; i < len / sizeof(*buffer); i++) {
+    int *id =  buffer[i].Relationship == RelationProcessorCore ? core
+             : buffer[i].Relationship == RelationProcessorPackage ? package
+             : NULL;
+    if (!id)
+      continue;
+    int num = id == core ? numCores++ : numPackages++;
+    for (int cpu = 0; cpu < 8 * (int)sizeof(DWORD_PTR); cpu++)
+      if (buffer[i].ProcessorMask & ((DWORD_PTR)1 << cpu))
+        id[cpu] = num;
+  }
+  free(buffer);
+
+  int n = 0;
+  for (int cpu = 0; cpu < 8 * (int)sizeof(DWORD_PTR); cpu++)
+    if (avail & ((DWORD_PTR)1 << cpu)) {
+      cpus[n].cpu = cpu;
+      cpus[n].package = package[cpu];
+      cpus[n].core = core[cpu];
+      n++;
+    }
+
+  return n;
+}
+
+#else
+
+static int read_cpus(CpuInfo *cpus)
+{
+  (void)cpus;
+  return 0;
+}
+
+#endif
+
+// get_topology() stores the logical processors available to the process
+// in cpus and returns their number. The cores of a package are numbered
+// from 0 in the order of their first processor, and the hardware threads
+// of a core in the order of their processors.
+
+static int get_topology(CpuInfo *cpus)
+{
+  int n = read_cpus(cpus);
+
+  for (int i = 0; i < n; i++) {
+    cpus[i].key = 0;
+    if (cpus[i].package < 0)
+      cpus[i].package = 0;
+    if (cpus[i].core < 0)
+      cpus[i].core = cpus[i].cpu;
+  }
+
+  // A processor is the first hardware thread of its core if no earlier
+  // processor has the same package and core id.
+  int *rank = malloc((n + 1) * sizeof(int));
+  for (int i = 0; i < n; i++) {
+    int j = 0;
+    cpus[i].smt = rank[i] = 0;
+    for (; j < i; j++)
+      if (   cpus[j].package == cpus[i].package
+          && cpus[j].core == cpus[i].core)
+        break;
+    if (j < i) {
+      rank[i] = rank[j];
+      for (; j < i; j++)
+        cpus[i].smt +=   cpus[j].package == cpus[i].package
+                      && cpus[j].core == cpus[i].core;
+    } else
+      for (j = 0; j < i; j++)
+        rank[i] += cpus[j].package == cpus[i].package && cpus[j].smt == 0;
+  }
+  for (int i = 0; i < n; i++)
+    cpus[i].core = rank[i];
+  free(rank);
+
+  return n;
+}
+
+static int cpu_cmp(const void *a, const void *b)
+{
+  const CpuInfo *c1 = a, *c2 = b;
+  if (c1->key != c2->key)
+    return c1->key < c2->key ? -1 : 1;
+  return c1->cpu - c2->cpu;
+}
+
+// parse_list() stores the processors of a list such as "0-3,8" in list
+// and returns their number, or -1 if the list is invalid or contains a
+// processor that is not available.
+
+static int parse_list(char *str, CpuInfo *topo, int n, CpuInfo *list)
+{
+  int num = 0;
+
+  while (*str) {
+    char *end;
+    long first = strtol(str, &end, 10), last = first;
+    if (end == str)
+      return -1;
+    str = end;
+    if (*str == '-') {
+      last = strtol(++str, &end, 10);
+      if (end == str || last < first)
+        return -1;
+      str = end;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      int i = 0;
+      while (i < n && topo[i].cpu != cpu)
+        i++;
+      if (i == n || num == MaxCpus)
+        return -1;
+      list[num++] = topo[i];
+    }
+    while (*str == ',' || *str == ' ')
+      str++;
+  }
+
+  return num;
+}
+
+// read_thread_binding() parses the value of the "Thread Binding" option.
+// The new binding is applied by process_delayed_settings(), which creates
+// the search threads anew.
+
+void read_thread_binding(char *str)
+{
+  CpuInfo *topo = malloc(MaxCpus * sizeof(CpuInfo));
+  CpuInfo *cpus = malloc(MaxCpus * sizeof(CpuInfo));
+  int num = -1;
+
+  if (!*str || strcmp(str, "none") == 0 || strcmp(str, "<empty>") == 0)
+    num = 0;
+  else {
+    int n = get_topology(topo);
+
+    if (n == 0)
+      printf("info string Thread binding not supported by OS.\n");
+    else if (*str >= '0' && *str <= '9')
+      num = parse_list(str, topo, n, cpus);
+    else {
+      int policy =  strcmp(str, "compact") == 0 ? 0
+                  : strcmp(str, "cores") == 0 ? 1
+                  : strcmp(str, "scatter") == 0 ? 2 : -1;
+      for (int i = 0; i < n && policy >= 0; i++) {
+        uint64_t p = topo[i].package, c = topo[i].core, t = topo[i].smt;
+        topo[i].key =  policy == 0 ? p << 40 | c << 20 | t
+                     : policy == 1 ? t << 40 | p << 20 | c
+                     :               t << 40 | c << 20 | p;
+      }
+      if (policy >= 0) {
+        qsort(topo, n, sizeof(CpuInfo), cpu_cmp);
+        memcpy(cpus, topo, n * sizeof(CpuInfo));
+        num = n;
+      }
+    }
+
+    if (num <= 0 && n > 0) {
+      printf("info string Invalid thread binding.\n");
+      num = -1;
+    }
+  }
+  fflush(stdout);
+
+  if (num >= 0) {
+    bindingChanged =   num != binding.num
+                    || (num && memcmp(cpus, binding.cpus, num * sizeof(CpuInfo)));
+    free(delayedBinding.cpus);
+    delayedBinding.cpus = cpus;
+    delayedBinding.num = num;
+  } else
+    free(cpus);
+  free(topo);
+}
+
+bool thread_binding_changed(void)
+{
+  return bindingChanged;
+}
+
+void thread_binding_apply(void)
+{
+  free(binding.cpus);
+  binding.num = delayedBinding.num;
+  binding.cpus = malloc((binding.num + 1) * sizeof(CpuInfo));
+  memcpy(binding.cpus, delayedBinding.cpus, binding.num * sizeof(CpuInfo));
+  bindingChanged = false;
+}
+
+// thread_binding_cpu() returns the logical processor of a search thread,
+// or -1 if threads are not bound.
+
+int thread_binding_cpu(int idx)
+{
+  return binding.num ? binding.cpus[idx % binding.num].cpu : -1;
+}
+
+// bind_thread_to_cpu() is called by a new search thread. It pins the
+// thread to its logical processor and reports where that processor is.
+
+void bind_thread_to_cpu(int idx)
+{
+  if (!binding.num)
+    return;
+
+  CpuInfo *c = &binding.cpus[idx % binding.num];
+  bool ok;
+
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(c->cpu, &set);
+  ok = sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+  ok = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << c->cpu) != 0;
+#else
+  ok = false;
+#endif
+
+  if (ok)
+    printf("info string Binding thread %d to cpu %d (package %d, core %d, "
+           "thread %d).\n", idx, c->cpu, c->package, c->core, c->smt);
+  else
+    printf("info string Unable to bind thread %d to cpu %d.\n", idx, c->cpu);
+  fflush(stdout);
+}
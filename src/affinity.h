@@ -0,0 +1,16 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include "types.h"
+
+// With the "Thread Binding" option, each search thread is pinned to one
+// logical processor, chosen by a placement policy from the processor
+// topology or taken from an explicit list.
+
+void read_thread_binding(char *str);
+bool thread_binding_changed(void);
+void thread_binding_apply(void);
+int thread_binding_cpu(int idx);
+void bind_thread_to_cpu(int idx);
+
+#endif
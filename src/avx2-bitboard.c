@@ -3,6 +3,11 @@ __m256i bishop_mask_v4[64];
 __m128i rook_mask_NS[64];
 uint8_t rook_attacks_EW[64 * 8];
 
+// Tables filled by init_sliding_attacks(), embedded with tables=yes
+#define SLIDER_TABLES(X) \
+  X(queen_mask_v4) X(bishop_mask_v4) X(rook_mask_NS) X(rook_attacks_EW)
+#define SLIDER_POINTERS(X)
+
 static void init_sliding_attacks(void)
 {
   static const int dirs[2][4] = {{ EAST, NORTH, NORTH_EAST, NORTH_WEST }, { WEST, SOUTH, SOUTH_WEST, SOUTH_EAST }};
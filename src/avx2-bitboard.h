@@ -110,3 +110,65 @@ INLINE Bitboard attacks_bb_bishop(Square s, Bitboard occupied)
   const __m128i swaph2l = _mm_set_epi8(15, 14, 13, 12, 11, 10, 9, 8, 8, 9, 10, 11, 12, 13, 14, 15);
   return _mm_cvtsi128_si64(_mm_or_si128(slide2, _mm_shuffle_epi8(slide2, swaph2l)));
 }
+
+// slider_attacks_v4() returns the attacks of four sliders of type Pt
+// (bishop, rook or queen) on the squares s[0..3], one piece per lane.
+// The direction masks of the four squares are transposed so that each
+// ray direction is handled for all four pieces in one pass: left rays
+// take the mask bits up to the LS1B of the blockers, right rays drop the
+// mask bits shadowed by the blockers with a fixed-shift fill.
+
+INLINE void transpose_v4(__m256i r[4])
+{
+  __m256i t0 = _mm256_unpacklo_epi64(r[0], r[1]);
+  __m256i t1 = _mm256_unpackhi_epi64(r[0], r[1]);
+  __m256i t2 = _mm256_unpacklo_epi64(r[2], r[3]);
+  __m256i t3 = _mm256_unpackhi_epi64(r[2], r[3]);
+  r[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+  r[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+  r[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+  r[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+INLINE __m256i left_ray_v4(__m256i occ4, __m256i m)
+{
+  return _mm256_and_si256(blsmsk64x4(_mm256_and_si256(occ4, m)), m);
+}
+
+INLINE __m256i right_ray_v4(__m256i occ4, __m256i m, const int k)
+{
+  __m256i x = _mm256_and_si256(occ4, m);
+  x = _mm256_or_si256(_mm256_srli_epi64(x, k), _mm256_srli_epi64(x, 2 * k));
+  x = _mm256_or_si256(x, _mm256_or_si256(_mm256_srli_epi64(x, 2 * k),
+                                         _mm256_srli_epi64(x, 4 * k)));
+  return _mm256_andnot_si256(x, m);
+}
+
+INLINE __m256i slider_attacks_v4(int Pt, const Square s[4], Bitboard occupied)
+{
+  const __m256i occ4 = _mm256_set1_epi64x(occupied);
+  __m256i l[4], r[4], att = _mm256_setzero_si256();
+
+  for (int i = 0; i < 4; i++) {
+    l[i] = queen_mask_v4[s[i]][0];
+    r[i] = queen_mask_v4[s[i]][1];
+  }
+  transpose_v4(l);
+  transpose_v4(r);
+
+  // l[] holds E, N, NE, NW and r[] holds W, S, SW, SE
+  if (Pt != BISHOP) {
+    att = _mm256_or_si256(att, left_ray_v4(occ4, l[0]));
+    att = _mm256_or_si256(att, left_ray_v4(occ4, l[1]));
+    att = _mm256_or_si256(att, right_ray_v4(occ4, r[0], 1));
+    att = _mm256_or_si256(att, right_ray_v4(occ4, r[1], 8));
+  }
+  if (Pt != ROOK) {
+    att = _mm256_or_si256(att, left_ray_v4(occ4, l[2]));
+    att = _mm256_or_si256(att, left_ray_v4(occ4, l[3]));
+    att = _mm256_or_si256(att, right_ray_v4(occ4, r[2], 9));
+    att = _mm256_or_si256(att, right_ray_v4(occ4, r[3], 7));
+  }
+
+  return att;
+}
@@ -19,12 +19,15 @@
 */
 
 #include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "cluster.h"
 #include "evaluate.h"
 #include "misc.h"
+#include "movepick.h"
 #ifdef NNUE
 #include "nnue.h"
 #endif
@@ -98,6 +101,504 @@ static char *Defaults[] = {
   "setoption name UCI_Chess960 value false"
 };
 
+// read_fens() returns the positions to search: the default positions,
+// the current position or the lines of a file.
+
+static char **read_fens(Position *current, char *fenFile, int *numFens)
+{
+  char **fens;
+
+  if (strcasecmp(fenFile, "default") == 0) {
+    fens = Defaults;
+    *numFens = sizeof(Defaults) / sizeof(char *);
+  }
+  else if (strcasecmp(fenFile, "current") == 0) {
+    fens = malloc(sizeof(*fens));
+    fens[0] = malloc(128);
+    pos_fen(current, fens[0]);
+    *numFens = 1;
+  }
+  else {
+    int maxFens = 100;
+    *numFens = 0;
+    FILE *F = fopen(fenFile, "r");
+    if (!F) {
+      fprintf(stderr, "Unable to open file %s\n", fenFile);
+      return NULL;
+    }
+    fens = malloc(maxFens * sizeof(*fens));
+    fens[0] = NULL;
+    size_t length = 0;
+    while (getline(&fens[*numFens], &length, F) > 0) {
+      (*numFens)++;
+      if (*numFens == maxFens) {
+        maxFens += 100;
+        fens = realloc(fens, maxFens * sizeof(*fens));
+      }
+      fens[*numFens] = NULL;
+      length = 0;
+    }
+    fclose(F);
+  }
+
+  return fens;
+}
+
+static void free_fens(char **fens, int numFens)
+{
+  if (fens != Defaults) {
+    for (int i = 0; i < numFens; i++)
+      free(fens[i]);
+    free(fens);
+  }
+}
+
+static void set_limits(int64_t limit, const char *limitType)
+{
+  if (strcmp(limitType, "time") == 0)
+    Limits.movetime = limit; // movetime is in millisecs
+  else if (strcmp(limitType, "nodes") == 0)
+    Limits.nodes = limit;
+  else if (strcmp(limitType, "mate") == 0)
+    Limits.mate = limit;
+  else
+    Limits.depth = limit;
+}
+
+#if defined(NNUE) && !defined(NNUE_PURE)
+static void set_eval_type(const char *evalType, int j)
+{
+#ifdef EVAL_CACHE
+  int prev = useNNUE;
+#endif
+
+  if (strcasecmp(evalType, "classical") == 0)
+    useNNUE = EVAL_CLASSICAL;
+  else if (strcasecmp(evalType, "nnue") == 0)
+    useNNUE = EVAL_HYBRID;
+  else if (strcasecmp(evalType, "pure") == 0)
+    useNNUE = EVAL_PURE;
+  else if (strcasecmp(evalType, "mixed") == 0)
+    useNNUE = j & 1 ? EVAL_CLASSICAL : EVAL_HYBRID;
+
+#ifdef EVAL_CACHE
+  // Cached evaluations are only valid for the evaluation type they were
+  // computed with.
+  if (useNNUE != prev)
+    for (int idx = 0; idx < Threads.numThreads; idx++)
+      nnue_clear_cache(Threads.pos[idx]);
+#endif
+}
+#endif
+
+static void bench_pos_init(Position *pos)
+{
+  memset(pos, 0, sizeof(*pos));
+  pos->stackAllocation = malloc(63 + 217 * sizeof(*pos->stack));
+  pos->stack = (Stack *)(((uintptr_t)pos->stackAllocation + 0x3f) & ~0x3f);
+  pos->st = pos->stack + 7;
+  pos->moveList = malloc(10000 * sizeof(*pos->moveList));
+}
+
+static void bench_pos_free(Position *pos)
+{
+  free(pos->stackAllocation);
+  free(pos->moveList);
+}
+
+// Results of the micro-benchmarks are summed in benchSink, so that the
+// calls measured cannot be optimised away.
+static volatile uint64_t benchSink;
+
+// fill_history() fills a history table with pseudo-random values in the
+// range of real history scores.
+
+static void fill_history(int16_t *h, size_t n, PRNG *rng)
+{
+  for (size_t i = 0; i < n; i++)
+    h[i] = (int16_t)((prng_rand(rng) & 0x3fff) - 0x2000);
+}
+
+// pick_all() returns the number of moves the move picker returns in the
+// current position, first at the given depth in the main search and then
+// in the quiescence search.
+
+static uint64_t pick_all(Position *pos, Depth depth)
+{
+  uint64_t cnt = 0;
+
+  mp_init(pos, 0, depth, 2);
+  while (next_move(pos, false))
+    cnt++;
+
+  if (!checkers()) {
+    mp_init_q(pos, 0, DEPTH_QS_CHECKS, 0);
+    while (next_move(pos, false))
+      cnt++;
+  }
+
+  return cnt;
+}
+
+// fill_histories() fills the history tables of a thread with pseudo-random
+// values for the movepick benchmark.
+
+static void fill_histories(Position *pos)
+{
+  PRNG rng;
+  prng_init(&rng, 1070372);
+  fill_history(&(*pos->mainHistory)[0][0], sizeof(ButterflyHistory) / 2, &rng);
+  fill_history(&(*pos->captureHistory)[0][0][0],
+               sizeof(CapturePieceToHistory) / 2, &rng);
+  fill_history(&(*pos->lowPlyHistory)[0][0], sizeof(LowPlyHistory) / 2, &rng);
+  fill_history(&(*pos->counterMoveHistory)[0][0][0][0][0][0],
+               sizeof(CounterMoveHistoryStat) / 2, &rng);
+}
+
+// movepick_bench() measures the speed of next_move(). The move picker of
+// the main thread is run the given number of times in the position itself
+// and in each position after one legal move. It returns the number of
+// moves that were picked.
+
+static uint64_t movepick_bench(Position *root, int passes)
+{
+  Position *pos = threads_main();
+
+  copy_root_position(pos, root);
+  Stack *st = pos->st;
+  for (int i = -7; i < 3; i++)
+    memset(SStackBegin(st[i]), 0, SStackSize);
+  for (int i = -7; i < 0; i++)
+    st[i].history = &(*pos->counterMoveHistory)[0][0][0][0];
+
+  ExtMove list[MAX_MOVES];
+  ExtMove *end = generate_legal(pos, list);
+  uint64_t cnt = 0;
+
+  for (int i = 0; i < passes; i++) {
+    cnt += pick_all(pos, 8);
+    for (ExtMove *m = list; m < end; m++) {
+      Move move = m->move;
+      st->currentMove = move;
+      st->history = &(*pos->counterMoveHistory)[!!checkers()]
+                                               [is_capture_or_promotion(pos, move)]
+                                               [hist_piece(moved_piece(move))]
+                                               [to_sq(move)];
+      do_move(pos, move, gives_check(pos, st, move));
+      (pos->st-1)->endMoves = pos->moveList;
+      cnt += pick_all(pos, 7);
+      undo_move(pos, move);
+    }
+  }
+
+  return cnt;
+}
+
+// see_all() tests the SEE of each legal move of the position with the
+// thresholds of capture ordering and of pruning, starting with an empty
+// SEE cache. It returns the number of tests.
+
+static uint64_t see_all(Position *pos)
+{
+  ExtMove list[MAX_MOVES];
+  ExtMove *end = generate_legal(pos, list);
+
+  pos->st->seeSq = SQ_NONE;
+  for (ExtMove *m = list; m < end; m++) {
+    benchSink += see_test(pos, m->move, 0);
+    benchSink += see_test(pos, m->move, -PawnValueMg);
+  }
+
+  return 2 * (end - list);
+}
+
+// see_bench() measures the speed of see_test(). The moves of the position
+// itself and of each position after one legal move are tested the given
+// number of times. It returns the number of tests.
+
+static uint64_t see_bench(Position *root, int passes)
+{
+  Position *pos = threads_main();
+
+  copy_root_position(pos, root);
+
+  ExtMove list[MAX_MOVES];
+  ExtMove *end = generate_legal(pos, list);
+  uint64_t cnt = 0;
+
+  for (int i = 0; i < passes; i++) {
+    cnt += see_all(pos);
+    for (ExtMove *m = list; m < end; m++) {
+      do_move(pos, m->move, gives_check(pos, pos->st, m->move));
+      cnt += see_all(pos);
+      undo_move(pos, m->move);
+    }
+  }
+
+  return cnt;
+}
+
+#ifdef NNUE
+// reset_accumulators() marks the accumulators of a position just copied
+// from the root position as not computed.
+
+static void reset_accumulators(Position *pos)
+{
+  for (int i = -7; i <= 0; i++) {
+    pos->st[i].accumulator.state[WHITE] = ACC_INIT;
+    pos->st[i].accumulator.state[BLACK] = ACC_INIT;
+#ifndef NNUE_PURE
+    pos->st[i].accumulator.smallState[WHITE] = ACC_INIT;
+    pos->st[i].accumulator.smallState[BLACK] = ACC_INIT;
+#endif
+  }
+}
+
+// eval_bench() measures the speed of nnue_evaluate(). The position itself
+// and each position after one legal move are evaluated the given number
+// of times. Only the first evaluation of a position updates its
+// accumulator, so the others time the layers after the feature
+// transformer. It returns the number of evaluations.
+
+static uint64_t eval_bench(Position *root, int passes)
+{
+  Position *pos = threads_main();
+
+  copy_root_position(pos, root);
+  reset_accumulators(pos);
+
+  ExtMove list[MAX_MOVES];
+  ExtMove *end = generate_legal(pos, list);
+  uint64_t cnt = 0;
+
+  for (int i = 0; i < passes; i++)
+    benchSink += nnue_evaluate(pos);
+  cnt += passes;
+  for (ExtMove *m = list; m < end; m++) {
+    do_move(pos, m->move, gives_check(pos, pos->st, m->move));
+    for (int i = 0; i < passes; i++)
+      benchSink += nnue_evaluate(pos);
+    cnt += passes;
+    undo_move(pos, m->move);
+  }
+
+  return cnt;
+}
+#endif
+
+// The speedtest command times single components of the engine in tight
+// loops on the search threads, so that a change in bench nps can be
+// traced to one of them.
+
+enum {
+  SPEED_NNUE, SPEED_CLASSICAL, SPEED_MOVEGEN, SPEED_DO_MOVE, SPEED_SEE,
+  SPEED_TT_PROBE, SPEED_NB
+};
+
+static const char *SpeedNames[SPEED_NB] = {
+  "nnue_evaluate", "evaluate_classical", "generate_legal", "do_move",
+  "see_test", "tt_probe"
+};
+
+static struct {
+  int component, passes;
+  uint64_t calls[MAX_THREADS], usec[MAX_THREADS];
+} speedJob;
+
+// speed_node() calls a component the given number of times in a position
+// and returns the number of calls. A do_move call includes gives_check()
+// and the undo_move() that follows. An SEE pass tests each legal move
+// with an empty SEE cache. The TT is probed with pseudo-random keys.
+
+static uint64_t speed_node(Position *pos, int component, int passes,
+    PRNG *rng)
+{
+  ExtMove list[MAX_MOVES];
+  ExtMove *end = generate_legal(pos, list);
+  bool found;
+  TTEntry ttData;
+
+  switch (component) {
+#ifdef NNUE
+  case SPEED_NNUE:
+    for (int i = 0; i < passes; i++)
+      benchSink += nnue_evaluate(pos);
+    return passes;
+#endif
+#ifndef NNUE_PURE
+  case SPEED_CLASSICAL:
+    if (checkers())
+      return 0;
+    for (int i = 0; i < passes; i++)
+      benchSink += evaluate_classical(pos);
+    return passes;
+#endif
+  case SPEED_MOVEGEN:
+    for (int i = 0; i < passes; i++)
+      benchSink += generate_legal(pos, list) - list;
+    return passes;
+  case SPEED_DO_MOVE:
+    for (int i = 0; i < passes; i++)
+      for (ExtMove *m = list; m < end; m++) {
+        do_move(pos, m->move, gives_check(pos, pos->st, m->move));
+        undo_move(pos, m->move);
+      }
+    return (uint64_t)passes * (end - list);
+  case SPEED_SEE:
+    for (int i = 0; i < passes; i++) {
+      pos->st->seeSq = SQ_NONE;
+      for (ExtMove *m = list; m < end; m++)
+        benchSink += see_test(pos, m->move, 0);
+    }
+    return (uint64_t)passes * (end - list);
+  case SPEED_TT_PROBE:
+    for (int i = 0; i < passes; i++) {
+      tt_probe(prng_rand(rng), &found, &ttData);
+      benchSink += found;
+    }
+    return passes;
+  }
+
+  return 0;
+}
+
+// speedtest_worker() is called by the search threads. Each thread runs
+// the component of the job in the position it was given and in each
+// position after one legal move, and adds the calls and the time taken
+// to its counters.
+
+void speedtest_worker(Position *pos)
+{
+  ExtMove list[MAX_MOVES];
+  ExtMove *end = generate_legal(pos, list);
+  int idx = pos->threadIdx, c = speedJob.component, passes = speedJob.passes;
+  PRNG rng;
+  prng_init(&rng, 1070372 + idx);
+
+  uint64_t start = now_usec();
+  uint64_t calls = speed_node(pos, c, passes, &rng);
+  for (ExtMove *m = list; m < end; m++) {
+    do_move(pos, m->move, gives_check(pos, pos->st, m->move));
+    calls += speed_node(pos, c, passes, &rng);
+    undo_move(pos, m->move);
+  }
+
+  speedJob.calls[idx] += calls;
+  speedJob.usec[idx] += now_usec() - start;
+}
+
+// speedtest() implements the "speedtest" command. For 1, 2, 4, ... threads
+// up to the given maximum (default: the number of logical processors) it
+// runs each component on all threads at once over the bench positions and
+// reports the calls, the time per call measured by each thread and the
+// calls per second of all threads together. The other parameters are the number of passes
+// (default 100) and the file with the positions.
+
+void speedtest(Position *current, char *str)
+{
+  char *token;
+  char **fens;
+  int numFens;
+
+  int maxThreads = (token = strtok(str , " ")) ? atoi(token) : cpu_count();
+  int passes     = (token = strtok(NULL, " ")) ? atoi(token) : 100;
+  char *fenFile  = (token = strtok(NULL, " ")) ? token       : "default";
+
+  maxThreads = clamp(maxThreads, 1, MAX_THREADS);
+  speedJob.passes = max(passes, 1);
+
+  if (!(fens = read_fens(current, fenFile, &numFens)))
+    return;
+
+  int numCounts = 0, counts[16];
+  for (int t = 1; t < maxThreads; t *= 2)
+    counts[numCounts++] = t;
+  counts[numCounts++] = maxThreads;
+
+  double results[16][SPEED_NB][3];
+
+  Position pos;
+  bench_pos_init(&pos);
+
+  for (int c = 0; c < numCounts; c++) {
+    delayedSettings.numThreads = counts[c];
+    process_delayed_settings();
+    fprintf(stderr, "\nThreads: %d\n", counts[c]);
+
+    uint64_t calls[SPEED_NB][MAX_THREADS] = { { 0 } };
+    uint64_t usec[SPEED_NB][MAX_THREADS] = { { 0 } };
+    uint64_t wall[SPEED_NB] = { 0 };
+
+    for (int i = 0; i < numFens; i++) {
+      char buf[128];
+
+      if (strncmp(fens[i], "setoption ", 9) == 0) {
+        strncpy(buf, fens[i] + 10, 127 - 10);
+        buf[127] = 0;
+        setoption(buf);
+        continue;
+      }
+
+      strcpy(buf, "fen ");
+      strncat(buf, fens[i], 127 - 4);
+      buf[127] = 0;
+      position(&pos, buf);
+
+      for (int idx = 0; idx < Threads.numThreads; idx++) {
+        copy_root_position(Threads.pos[idx], &pos);
+#ifdef NNUE
+        reset_accumulators(Threads.pos[idx]);
+#endif
+      }
+
+      for (int k = 0; k < SPEED_NB; k++) {
+        speedJob.component = k;
+        memset(speedJob.calls, 0, sizeof(speedJob.calls));
+        memset(speedJob.usec, 0, sizeof(speedJob.usec));
+        uint64_t start = now_usec();
+        for (int idx = 0; idx < Threads.numThreads; idx++)
+          thread_wake_up(Threads.pos[idx], THREAD_SPEEDTEST);
+        for (int idx = 0; idx < Threads.numThreads; idx++)
+          thread_wait_until_sleeping(Threads.pos[idx]);
+        wall[k] += now_usec() - start;
+        for (int idx = 0; idx < Threads.numThreads; idx++) {
+          calls[k][idx] += speedJob.calls[idx];
+          usec[k][idx] += speedJob.usec[idx];
+        }
+      }
+    }
+
+    // The time per call is that measured by the threads themselves, the
+    // calls per second are those of all threads in the time from waking
+    // them up until the last has finished.
+    for (int k = 0; k < SPEED_NB; k++) {
+      double totalCalls = 0, totalUsec = 0;
+      for (int idx = 0; idx < counts[c]; idx++) {
+        totalCalls += calls[k][idx];
+        totalUsec += usec[k][idx];
+      }
+      results[c][k][0] = totalCalls;
+      results[c][k][1] = totalCalls ? 1000 * totalUsec / totalCalls : 0;
+      results[c][k][2] = 1e6 * totalCalls / max(wall[k], 1);
+    }
+  }
+
+  bench_pos_free(&pos);
+
+  fprintf(stderr, "\n==========================="
+                  "\n%-18s %7s %14s %10s %14s %8s\n",
+                  "Component", "Threads", "Calls", "ns/call", "Calls/sec",
+                  "Scale");
+  for (int k = 0; k < SPEED_NB; k++)
+    for (int c = 0; c < numCounts; c++)
+      if (results[c][k][0])
+        fprintf(stderr, "%-18s %7d %14.0f %10.1f %14.0f %8.2f\n",
+            SpeedNames[k], counts[c], results[c][k][0], results[c][k][1],
+            results[c][k][2], results[c][k][2] / max(results[0][k][2], 1.0));
+
+  free_fens(fens, numFens);
+}
+
 // benchmark() runs a simple benchmark by letting Stockfish analyze a set
 // of positions for a given limit each. There are six optional parameters:
 // - Transposition table size. Default is 16 MB.
@@ -105,7 +606,11 @@ static char *Defaults[] = {
 // - Limit value for each search. Default is (depth) 13.
 // - File name with the positions to search in FEN format. The default
 //   positions are listed above.
-// - Type of the limit value: depth (default), time (in msecs), nodes.
+// - Type of the limit value: depth (default), time (in msecs), nodes,
+//   perft, movepick, see or eval. For movepick the limit is the number of
+//   passes of the move picker over each position and its children, for see
+//   the number of SEE passes over their moves, for eval the number of NNUE
+//   evaluations of each of them.
 // - Evaluation: classical, nnue (hybrid), pure (NNUE only), mixed (default).
 
 void benchmark(Position *current, char *str)
@@ -129,56 +634,23 @@ void benchmark(Position *current, char *str)
   delayedSettings.numThreads = threads;
   process_delayed_settings();
   search_clear();
+  tt_wait_clear(); // Always search with an empty table
 
-  if (strcmp(limitType, "time") == 0)
-    Limits.movetime = limit; // movetime is in millisecs
-  else if (strcmp(limitType, "nodes") == 0)
-    Limits.nodes = limit;
-  else if (strcmp(limitType, "mate") == 0)
-    Limits.mate = limit;
-  else
-    Limits.depth = limit;
+  set_limits(limit, limitType);
 
-  if (strcasecmp(fenFile, "default") == 0) {
-    fens = Defaults;
-    numFens = sizeof(Defaults) / sizeof(char *);
-  }
-  else if (strcasecmp(fenFile, "current") == 0) {
-    fens = malloc(sizeof(*fens));
-    fens[0] = malloc(128);
-    pos_fen(current, fens[0]);
-    numFens = 1;
-  }
-  else {
-    int maxFens = 100;
-    numFens = 0;
-    FILE *F = fopen(fenFile, "r");
-    if (!F) {
-      fprintf(stderr, "Unable to open file %s\n", fenFile);
-      return;
-    }
-    fens = malloc(maxFens * sizeof(*fens));
-    fens[0] = NULL;
-    size_t length = 0;
-    while (getline(&fens[numFens], &length, F) > 0) {
-      numFens++;
-      if (numFens == maxFens) {
-        maxFens += 100;
-        fens = realloc(fens, maxFens * sizeof(*fens));
-      }
-      fens[numFens] = NULL;
-      length = 0;
-    }
-    fclose(F);
-  }
+  if (!(fens = read_fens(current, fenFile, &numFens)))
+    return;
+
+  bool movepick = strcasecmp(limitType, "movepick") == 0;
+  if (movepick)
+    fill_histories(threads_main());
 
   uint64_t nodes = 0;
+#ifdef SEARCH_STATS
+  uint64_t stats[STAT_NB] = { 0 };
+#endif
   Position pos;
-  memset(&pos, 0, sizeof(pos));
-  pos.stackAllocation = malloc(63 + 217 * sizeof(*pos.stack));
-  pos.stack = (Stack *)(((uintptr_t)pos.stackAllocation + 0x3f) & ~0x3f);
-  pos.st = pos.stack + 7;
-  pos.moveList = malloc(10000 * sizeof(*pos.moveList));
+  bench_pos_init(&pos);
   TimePoint elapsed = now();
 
   int numOpts = 0;
@@ -207,22 +679,29 @@ void benchmark(Position *current, char *str)
 
     if (strcasecmp(limitType, "perft") == 0)
       nodes += perft(&pos, Limits.depth);
+    else if (movepick)
+      nodes += movepick_bench(&pos, Limits.depth);
+    else if (strcasecmp(limitType, "see") == 0)
+      nodes += see_bench(&pos, Limits.depth);
+#ifdef NNUE
+    else if (strcasecmp(limitType, "eval") == 0)
+      nodes += eval_bench(&pos, Limits.depth);
+#endif
     else {
 #if defined(NNUE) && !defined(NNUE_PURE)
-      if (strcasecmp(evalType, "classical") == 0)
-        useNNUE = EVAL_CLASSICAL;
-      else if (strcasecmp(evalType, "nnue") == 0)
-        useNNUE = EVAL_HYBRID;
-      else if (strcasecmp(evalType, "pure") == 0)
-        useNNUE = EVAL_PURE;
-      else if (strcasecmp(evalType, "mixed") == 0)
-        useNNUE = j & 1 ? EVAL_CLASSICAL : EVAL_HYBRID;
+      set_eval_type(evalType, j);
 #endif
 
       Limits.startTime = now();
       start_thinking(&pos, false);
       thread_wait_until_sleeping(threads_main());
       nodes += threads_nodes_searched();
+#ifdef SEARCH_STATS
+      uint64_t searchStats[STAT_NB];
+      threads_search_stats(searchStats);
+      for (int k = 0; k < STAT_NB; k++)
+        stats[k] += searchStats[k];
+#endif
     }
   }
 
@@ -233,12 +712,474 @@ void benchmark(Position *current, char *str)
                   "\nNodes searched  : %" PRIu64
                   "\nNodes/second    : %" PRIu64 "\n",
                   elapsed, nodes, 1000 * nodes / elapsed);
+#ifdef TT_LOCKLESS
+  fprintf(stderr, "TT collisions   : %" PRIu64 "\n",
+                  (uint64_t)atomic_load(&TT.collisions));
+#endif
+#ifdef SEARCH_STATS
+  search_print_stats(stderr, "", stats);
+#endif
 
-  if (fens != Defaults) {
-    for (int i = 0; i < numFens; i++)
-      free(fens[i]);
-    free(fens);
+  if (movepick)
+    search_clear();
+
+  free_fens(fens, numFens);
+  bench_pos_free(&pos);
+}
+
+// mean_stddev() computes the mean and the sample standard deviation of
+// the n values in v.
+
+static void mean_stddev(const double *v, int n, double *mean, double *stddev)
+{
+  double sum = 0, sumSq = 0;
+  for (int i = 0; i < n; i++)
+    sum += v[i];
+  *mean = sum / n;
+  for (int i = 0; i < n; i++)
+    sumSq += (v[i] - *mean) * (v[i] - *mean);
+  *stddev = n > 1 ? sqrt(sumSq / (n - 1)) : 0;
+}
+
+// get_samples() stores the nodes, time and nps of every run for position
+// j in v, or the totals of every run if j equals numPos.
+
+static void get_samples(const double *nodes, const double *times, int runs,
+    int numPos, int j, double *v)
+{
+  for (int r = 0; r < runs; r++) {
+    if (j < numPos) {
+      v[r] = nodes[r * numPos + j];
+      v[runs + r] = times[r * numPos + j];
+    } else {
+      v[r] = v[runs + r] = 0;
+      for (int k = 0; k < numPos; k++) {
+        v[r] += nodes[r * numPos + k];
+        v[runs + r] += times[r * numPos + k];
+      }
+    }
+    v[2 * runs + r] = 1000 * v[r] / max(v[runs + r], 1.0);
+  }
+}
+
+static void json_stat(FILE *F, const char *name, const double *v, int n)
+{
+  double mean, stddev;
+  mean_stddev(v, n, &mean, &stddev);
+  fprintf(F, "\"%s\": { \"mean\": %.1f, \"stddev\": %.1f }", name, mean,
+      stddev);
+}
+
+static void json_string(FILE *F, const char *str)
+{
+  fputc('"', F);
+  for (; *str; str++)
+    if (*str == '"' || *str == '\\')
+      fprintf(F, "\\%c", *str);
+    else if ((unsigned char)*str >= ' ')
+      fputc(*str, F);
+  fputc('"', F);
+}
+
+// bench_run() searches the positions once, starting with cleared hash
+// and history tables, and stores the nodes, time in ms and completed depth
+// of each search. Progress lines printed to stderr start with label.
+
+static void bench_run(Position *pos, char **fens, int numFens,
+    const char *limitType, const char *evalType, const char *label,
+    double *nodes, double *times, int *depths)
+{
+  int numPos = 0;
+  for (int i = 0; i < numFens; i++)
+    if (strncmp(fens[i], "setoption ", 9) != 0)
+      numPos++;
+
+  search_clear();
+  tt_wait_clear();
+
+  for (int i = 0, j = 0; i < numFens; i++) {
+    char buf[128];
+
+    if (strncmp(fens[i], "setoption ", 9) == 0) {
+      strncpy(buf, fens[i] + 10, 127 - 10);
+      buf[127] = 0;
+      setoption(buf);
+      continue;
+    }
+
+    strcpy(buf, "fen ");
+    strncat(buf, fens[i], 127 - 4);
+    buf[127] = 0;
+
+    position(pos, buf);
+
+    fprintf(stderr, "\n%sPosition: %d/%d\n", label, j + 1, numPos);
+
+    TimePoint start = now();
+    uint64_t n;
+    int depth;
+    if (strcasecmp(limitType, "perft") == 0) {
+      n = perft(pos, Limits.depth);
+      depth = Limits.depth;
+    } else {
+#if defined(NNUE) && !defined(NNUE_PURE)
+      set_eval_type(evalType, j + 1);
+#else
+      (void)evalType;
+#endif
+      Limits.startTime = start;
+      start_thinking(pos, false);
+      thread_wait_until_sleeping(threads_main());
+      n = cluster_nodes_searched();
+      depth = threads_main()->completedDepth;
+    }
+    times[j] = now() - start;
+    nodes[j] = n;
+    if (depths)
+      depths[j] = depth;
+    j++;
+  }
+}
+
+// benchmark_suite() implements the "benchsuite" command. It runs the
+// benchmark a number of times, each time with cleared hash and history
+// tables, and reports the mean and standard deviation of the nodes, time
+// and nps of every position and of the complete runs. It accepts these
+// keywords, followed by the parameters of benchmark():
+// - runs <n>: Number of runs. Default is 5.
+// - json <file>: Also write the results to a file in JSON format.
+// - pin: Pin the search threads to logical processors.
+
+void benchmark_suite(Position *current, char *str)
+{
+  char *token;
+  char **fens;
+  int numFens, runs = 5;
+  char *jsonFile = NULL;
+  bool pin = false;
+
+  Limits = (struct LimitsType){ 0 };
+
+  for (token = strtok(str, " "); token; token = strtok(NULL, " ")) {
+    if (strcmp(token, "runs") == 0 && (token = strtok(NULL, " ")))
+      runs = max(atoi(token), 1);
+    else if (strcmp(token, "json") == 0 && (token = strtok(NULL, " ")))
+      jsonFile = token;
+    else if (strcmp(token, "pin") == 0)
+      pin = true;
+    else
+      break;
+  }
+
+  int ttSize      = token ? atoi(token) : 16;
+  int threads     = token && (token = strtok(NULL, " ")) ? atoi(token)  : 1;
+  int64_t limit   = token && (token = strtok(NULL, " ")) ? atoll(token) : 13;
+  char *fenFile   = token && (token = strtok(NULL, " ")) ? token : "default";
+  char *limitType = token && (token = strtok(NULL, " ")) ? token : "depth";
+#if defined(NNUE) && !defined(NNUE_PURE)
+  char *evalType  = token && (token = strtok(NULL, " ")) ? token : "mixed";
+#else
+  char *evalType  = "pure";
+#endif
+
+  delayedSettings.ttSize = ttSize;
+  delayedSettings.numThreads = threads;
+  process_delayed_settings();
+
+  set_limits(limit, limitType);
+
+  if (!(fens = read_fens(current, fenFile, &numFens)))
+    return;
+
+  int numPos = 0;
+  for (int i = 0; i < numFens; i++)
+    if (strncmp(fens[i], "setoption ", 9) != 0)
+      numPos++;
+
+  // Nodes and time in ms of each search, indexed by [run][position]
+  double *nodes = calloc(runs * numPos, sizeof(double));
+  double *times = calloc(runs * numPos, sizeof(double));
+
+  if (pin && !threads_pin(true)) {
+    fprintf(stderr, "Thread pinning is not supported.\n");
+    pin = false;
+  }
+
+  Position pos;
+  bench_pos_init(&pos);
+
+  for (int r = 0; r < runs; r++) {
+    char label[32];
+    sprintf(label, "Run: %d/%d ", r + 1, runs);
+    bench_run(&pos, fens, numFens, limitType, evalType, label,
+        nodes + r * numPos, times + r * numPos, NULL);
+  }
+
+  if (pin)
+    threads_pin(false);
+  bench_pos_free(&pos);
+
+  // Nodes, time and nps of each run for one position or the totals
+  double *v = malloc(3 * runs * sizeof(double));
+  double mean[3], stddev[3];
+
+  fprintf(stderr, "\n==========================="
+                  "\nRuns            : %d"
+                  "\n%-8s %12s %20s %24s\n",
+                  runs, "Position", "Nodes", "Time (ms)", "Nodes/second");
+
+  for (int j = 0; j <= numPos; j++) {
+    get_samples(nodes, times, runs, numPos, j, v);
+    for (int k = 0; k < 3; k++)
+      mean_stddev(v + k * runs, runs, &mean[k], &stddev[k]);
+
+    if (j < numPos)
+      fprintf(stderr, "%8d", j + 1);
+    else
+      fprintf(stderr, "%-8s", "Total");
+    fprintf(stderr, " %12.0f %11.1f +- %-6.1f %13.0f +- %.0f\n",
+        mean[0], mean[1], stddev[1], mean[2], stddev[2]);
+  }
+
+  if (jsonFile) {
+    FILE *F = fopen(jsonFile, "w");
+    if (!F)
+      fprintf(stderr, "Unable to open file %s\n", jsonFile);
+    else {
+      fprintf(F, "{\n  \"hash\": %d,\n  \"threads\": %d,\n  \"limit\": %"
+          PRId64 ",\n  \"limitType\": ", ttSize, threads, limit);
+      json_string(F, limitType);
+      fprintf(F, ",\n  \"fenFile\": ");
+      json_string(F, fenFile);
+      fprintf(F, ",\n  \"evalType\": ");
+      json_string(F, evalType);
+      fprintf(F, ",\n  \"runs\": %d,\n  \"pinned\": %s,\n  \"positions\": [",
+          runs, pin ? "true" : "false");
+
+      for (int i = 0, j = 0; j <= numPos; i++) {
+        if (j < numPos && strncmp(fens[i], "setoption ", 9) == 0)
+          continue;
+        get_samples(nodes, times, runs, numPos, j, v);
+        if (j < numPos) {
+          fprintf(F, "%s\n    { \"fen\": ", j ? "," : "");
+          json_string(F, fens[i]);
+          fprintf(F, ",\n      ");
+        } else
+          fprintf(F, "\n  ],\n  \"total\": {\n      ");
+        json_stat(F, "nodes", v, runs);
+        fprintf(F, ",\n      ");
+        json_stat(F, "time_ms", v + runs, runs);
+        fprintf(F, ",\n      ");
+        json_stat(F, "nps", v + 2 * runs, runs);
+        fprintf(F, j < numPos ? " }" : "\n  },\n  \"samples\": [");
+        j++;
+      }
+
+      // Totals of every run, which get_samples() left in v
+      for (int r = 0; r < runs; r++)
+        fprintf(F, "%s\n    { \"nodes\": %.0f, \"time_ms\": %.0f, "
+            "\"nps\": %.0f }", r ? "," : "", v[r], v[runs + r],
+            v[2 * runs + r]);
+      fprintf(F, "\n  ]\n}\n");
+      fclose(F);
+    }
+  }
+
+  free(v);
+  free(nodes);
+  free(times);
+  free_fens(fens, numFens);
+}
+
+// benchmark_scaling() implements the "benchscale" command. It searches the
+// positions with 1, 2, 4, ... threads up to a maximum and reports for each
+// thread count the time, nodes and nps, the nps speedup and time-to-depth
+// speedup relative to one thread, the average completed depth and the
+// effective branching factor. The first parameter is the maximum number
+// of threads, defaulting to the number of logical processors. It is
+// followed by the parameters of benchmark() other than the thread count.
+
+void benchmark_scaling(Position *current, char *str)
+{
+  char *token;
+  char **fens;
+  int numFens;
+
+  Limits = (struct LimitsType){ 0 };
+
+  int maxThreads  = (token = strtok(str , " ")) ? atoi(token)  : cpu_count();
+  int ttSize      = (token = strtok(NULL, " ")) ? atoi(token)  : 16;
+  int64_t limit   = (token = strtok(NULL, " ")) ? atoll(token) : 13;
+  char *fenFile   = (token = strtok(NULL, " ")) ? token        : "default";
+  char *limitType = (token = strtok(NULL, " ")) ? token        : "depth";
+#if defined(NNUE) && !defined(NNUE_PURE)
+  char *evalType  = (token = strtok(NULL, " ")) ? token        : "mixed";
+#else
+  char *evalType  = "pure";
+#endif
+
+  maxThreads = clamp(maxThreads, 1, MAX_THREADS);
+  set_limits(limit, limitType);
+
+  if (!(fens = read_fens(current, fenFile, &numFens)))
+    return;
+
+  int numPos = 0;
+  for (int i = 0; i < numFens; i++)
+    if (strncmp(fens[i], "setoption ", 9) != 0)
+      numPos++;
+
+  int numCounts = 0, counts[16];
+  for (int t = 1; t < maxThreads; t *= 2)
+    counts[numCounts++] = t;
+  counts[numCounts++] = maxThreads;
+
+  double *nodes = malloc(numPos * sizeof(double));
+  double *times = malloc(numPos * sizeof(double));
+  int *depths = malloc(numPos * sizeof(int));
+  double results[16][5];
+
+  Position pos;
+  bench_pos_init(&pos);
+  delayedSettings.ttSize = ttSize;
+
+  for (int c = 0; c < numCounts; c++) {
+    char label[32];
+    sprintf(label, "Threads: %d ", counts[c]);
+    delayedSettings.numThreads = counts[c];
+    process_delayed_settings();
+    bench_run(&pos, fens, numFens, limitType, evalType, label, nodes, times,
+        depths);
+
+    // The effective branching factor of a search is the number of nodes
+    // raised to the power of 1 / depth. It is averaged geometrically.
+    double totalNodes = 0, totalTime = 0, sumDepth = 0, sumLogEbf = 0;
+    int numEbf = 0;
+    for (int j = 0; j < numPos; j++) {
+      totalNodes += nodes[j];
+      totalTime += times[j];
+      sumDepth += depths[j];
+      if (nodes[j] > 1 && depths[j] > 0) {
+        sumLogEbf += log(nodes[j]) / depths[j];
+        numEbf++;
+      }
+    }
+    results[c][0] = totalTime;
+    results[c][1] = totalNodes;
+    results[c][2] = 1000 * totalNodes / max(totalTime, 1.0);
+    results[c][3] = sumDepth / max(numPos, 1);
+    results[c][4] = numEbf ? exp(sumLogEbf / numEbf) : 0;
   }
-  free(pos.stackAllocation);
-  free(pos.moveList);
+
+  bench_pos_free(&pos);
+
+  fprintf(stderr, "\n==========================="
+                  "\n%7s %10s %12s %12s %8s %8s %6s %6s\n",
+                  "Threads", "Time (ms)", "Nodes", "Nodes/sec", "NPS x",
+                  "TTD x", "Depth", "EBF");
+  for (int c = 0; c < numCounts; c++)
+    fprintf(stderr, "%7d %10.0f %12.0f %12.0f %8.2f %8.2f %6.2f %6.2f\n",
+        counts[c], results[c][0], results[c][1], results[c][2],
+        results[c][2] / max(results[0][2], 1.0),
+        results[0][0] / max(results[c][0], 1.0), results[c][3],
+        results[c][4]);
+
+  free(nodes);
+  free(times);
+  free(depths);
+  free_fens(fens, numFens);
 }
+
+#ifdef USE_MPI
+
+// benchmark_cluster() implements the "benchcluster" command, which all
+// nodes of a cluster run. It searches the positions with the first 1, 2,
+// 4, ... nodes up to all nodes and reports for each node count the time,
+// the nodes searched by all nodes and their nps, the nps speedup and the
+// time-to-depth speedup relative to one node and the average completed
+// depth on rank 0. The parameters are those of benchmark().
+
+void benchmark_cluster(Position *current, char *str)
+{
+  char *token;
+  char **fens;
+  int numFens;
+
+  Limits = (struct LimitsType){ 0 };
+
+  int ttSize      = (token = strtok(str , " ")) ? atoi(token)  : 16;
+  int threads     = (token = strtok(NULL, " ")) ? atoi(token)  : 1;
+  int64_t limit   = (token = strtok(NULL, " ")) ? atoll(token) : 13;
+  char *fenFile   = (token = strtok(NULL, " ")) ? token        : "default";
+  char *limitType = (token = strtok(NULL, " ")) ? token        : "depth";
+#if defined(NNUE) && !defined(NNUE_PURE)
+  char *evalType  = (token = strtok(NULL, " ")) ? token        : "mixed";
+#else
+  char *evalType  = "pure";
+#endif
+
+  set_limits(limit, limitType);
+
+  if (!(fens = read_fens(current, fenFile, &numFens)))
+    return;
+
+  int numPos = 0;
+  for (int i = 0; i < numFens; i++)
+    if (strncmp(fens[i], "setoption ", 9) != 0)
+      numPos++;
+
+  int numCounts = 0, counts[32];
+  for (int n = 1; n < clusterSize; n *= 2)
+    counts[numCounts++] = n;
+  counts[numCounts++] = clusterSize;
+
+  double *nodes = malloc(numPos * sizeof(double));
+  double *times = malloc(numPos * sizeof(double));
+  int *depths = malloc(numPos * sizeof(int));
+  double results[32][4];
+
+  Position pos;
+  bench_pos_init(&pos);
+  delayedSettings.ttSize = ttSize;
+  delayedSettings.numThreads = clamp(threads, 1, MAX_THREADS);
+  process_delayed_settings();
+
+  for (int c = 0; c < numCounts; c++) {
+    char label[32];
+    sprintf(label, "Nodes: %d ", counts[c]);
+    cluster_set_active(counts[c]);
+    bench_run(&pos, fens, numFens, limitType, evalType, label, nodes, times,
+        depths);
+
+    double totalNodes = 0, totalTime = 0, sumDepth = 0;
+    for (int j = 0; j < numPos; j++) {
+      totalNodes += nodes[j];
+      totalTime += times[j];
+      sumDepth += depths[j];
+    }
+    results[c][0] = totalTime;
+    results[c][1] = totalNodes;
+    results[c][2] = 1000 * totalNodes / max(totalTime, 1.0);
+    results[c][3] = sumDepth / max(numPos, 1);
+  }
+
+  cluster_set_active(clusterSize);
+  bench_pos_free(&pos);
+
+  fprintf(stderr, "\n==========================="
+                  "\n%7s %10s %12s %12s %8s %8s %6s\n",
+                  "Nodes", "Time (ms)", "Searched", "Nodes/sec", "NPS x",
+                  "TTD x", "Depth");
+  for (int c = 0; c < numCounts; c++)
+    fprintf(stderr, "%7d %10.0f %12.0f %12.0f %8.2f %8.2f %6.2f\n",
+        counts[c], results[c][0], results[c][1], results[c][2],
+        results[c][2] / max(results[0][2], 1.0),
+        results[0][0] / max(results[c][0], 1.0), results[c][3]);
+
+  free(nodes);
+  free(times);
+  free(depths);
+  free_fens(fens, numFens);
+}
+
+#endif
@@ -27,7 +27,7 @@
 enum { MAX_INDEX = 2*24*64*64 };
 
 // Each uint32_t stores results of 32 positions, one per bit
-static uint32_t KPKBitbase[MAX_INDEX / 32];
+uint32_t KPKBitbase[MAX_INDEX / 32];
 
 // A KPK bitbase index is an integer in [0, IndexMax] range
 //
@@ -127,6 +127,10 @@ static uint8_t classify(uint8_t *db, unsigned idx)
 
 void bitbases_init()
 {
+  // The bitbase may have been embedded at build time.
+  if (TablesLoaded)
+    return;
+
   uint8_t *db = malloc(MAX_INDEX);
   unsigned idx, repeat = 1;
 
@@ -18,6 +18,9 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
+#include <string.h>
+
 #include "bitboard.h"
 #include "misc.h"
 
@@ -86,6 +89,95 @@ Square CastlingRookFrom[16];
 Square CastlingRookTo[16];
 #endif
 
+bool TablesLoaded;
+
+// With tables=yes, a first build writes the tables computed by
+// bitboards_init() and bitbases_init() to tables.bin with the "tables"
+// command, and the final build embeds that file. Attack table pointers are
+// stored as offsets into the tables they point into.
+
+#ifndef USE_POPCNT
+#define POPCNT_TABLES(X) X(PopCnt16)
+#else
+#define POPCNT_TABLES(X)
+#endif
+#ifndef PEDANTIC
+#define EP_TABLES(X) X(EPMask)
+#else
+#define EP_TABLES(X)
+#endif
+
+#define BITBOARD_TABLES(X) \
+  POPCNT_TABLES(X) EP_TABLES(X) X(SquareDistance) X(SquareBB) X(FileBB) \
+  X(RankBB) X(ForwardRanksBB) X(BetweenBB) X(LineBB) X(DistanceRingBB) \
+  X(ForwardFileBB) X(PassedPawnSpan) X(PawnAttackSpan) X(PseudoAttacks) \
+  X(PawnAttacks) X(KPKBitbase) SLIDER_TABLES(X)
+
+#define TABLE_SIZE(t) + sizeof(t)
+#define POINTERS_SIZE(p, t) + 64 * sizeof(uint32_t)
+
+static const uint32_t TablesMagic = 0x42544643; // "CFTB"
+static const size_t TablesSize =
+  2 * sizeof(uint32_t) BITBOARD_TABLES(TABLE_SIZE) SLIDER_POINTERS(POINTERS_SIZE);
+
+void tables_save(const char *fileName)
+{
+  FILE *f = fopen(fileName, "wb");
+  if (!f) {
+    printf("info string Could not write %s\n", fileName);
+    fflush(stdout);
+    return;
+  }
+
+  uint32_t header[2] = { TablesMagic, (uint32_t)TablesSize };
+  fwrite(header, sizeof(header), 1, f);
+
+#define SAVE_TABLE(t) fwrite(t, sizeof(t), 1, f);
+#define SAVE_POINTERS(p, t) \
+  for (int s = 0; s < 64; s++) { \
+    uint32_t offset = p[s] - t; \
+    fwrite(&offset, sizeof(offset), 1, f); \
+  }
+  BITBOARD_TABLES(SAVE_TABLE)
+  SLIDER_POINTERS(SAVE_POINTERS)
+
+  fclose(f);
+}
+
+#ifdef EMBED_TABLES
+#include "incbin.h"
+INCBIN(Tables, "tables.bin");
+
+// tables_load() copies the embedded tables into place. It fails if they
+// were generated by a build with a different table layout.
+
+static bool tables_load(void)
+{
+  const uint8_t *d = gTablesData;
+  uint32_t header[2];
+
+  if (gTablesSize != TablesSize)
+    return false;
+  memcpy(header, d, sizeof(header));
+  if (header[0] != TablesMagic || header[1] != TablesSize)
+    return false;
+  d += sizeof(header);
+
+#define LOAD_TABLE(t) memcpy(t, d, sizeof(t)); d += sizeof(t);
+#define LOAD_POINTERS(p, t) \
+  for (int s = 0; s < 64; s++) { \
+    uint32_t offset; \
+    memcpy(&offset, d, sizeof(offset)); \
+    p[s] = t + offset; \
+    d += sizeof(offset); \
+  }
+  BITBOARD_TABLES(LOAD_TABLE)
+  SLIDER_POINTERS(LOAD_POINTERS)
+
+  return true;
+}
+#endif
+
 #ifndef USE_POPCNT
 // popcount16() counts the non-zero bits using SWAR-Popcount algorithm.
 
@@ -121,6 +213,11 @@ void print_pretty(Bitboard b)
 
 void bitboards_init(void)
 {
+#ifdef EMBED_TABLES
+  if ((TablesLoaded = tables_load()))
+    return;
+#endif
+
 #ifndef USE_POPCNT
   for (unsigned i = 0; i < (1 << 16); ++i)
     PopCnt16[i] = popcount16(i);
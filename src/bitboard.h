@@ -25,10 +25,14 @@
 
 #include "types.h"
 
+extern uint32_t KPKBitbase[2 * 24 * 64 * 64 / 32];
+extern bool TablesLoaded;
+
 void bitbases_init(void);
 bool bitbases_probe(Square wksq, Square wpsq, Square bksq, Color us);
 
 void bitboards_init(void);
+void tables_save(const char *fileName);
 void print_pretty(Bitboard b);
 
 #define AllSquares (~0ULL)
@@ -404,4 +408,36 @@ INLINE Square  backmost_sq(Color c, Bitboard b)
   return c == WHITE ? lsb(b) : msb(b);
 }
 
+
+// slider_attacks_bb() stores the squares of the sliders of type Pt in
+// 'pieces' in sq[] and their attacks on 'occupied' in att[], in pop_lsb()
+// order, and returns their number. The AVX2 bitboards compute up to four
+// pieces per vector pass, so both arrays need room for 16 entries.
+
+INLINE int slider_attacks_bb(const int Pt, Bitboard pieces, Bitboard occupied,
+    Square *sq, Bitboard *att)
+{
+  assert(Pt == BISHOP || Pt == ROOK || Pt == QUEEN);
+
+  int n = 0;
+  while (pieces)
+    sq[n++] = pop_lsb(&pieces);
+
+  int i = 0;
+
+#ifdef AVX2_BITBOARD
+  // A lone piece is faster with the per-direction lanes of attacks_bb()
+  for (int j = n; j & 3; j++)
+    sq[j] = sq[0];
+  for ( ; i + 1 < n; i += 4)
+    _mm256_storeu_si256((__m256i *)&att[i],
+                        slider_attacks_v4(Pt, &sq[i], occupied));
+#endif
+
+  for ( ; i < n; i++)
+    att[i] = attacks_bb(Pt, sq[i], occupied);
+
+  return n;
+}
+
 #endif
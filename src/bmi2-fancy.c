@@ -7,6 +7,12 @@ uint16_t *BishopAttacks[64];
 static uint16_t BishopTable[5248];
 static uint16_t RookTable[102400];
 
+// Tables filled by init_sliding_attacks(), embedded with tables=yes
+#define SLIDER_TABLES(X) \
+  X(RookMasks) X(RookMasks2) X(RookTable) \
+  X(BishopMasks) X(BishopMasks2) X(BishopTable)
+#define SLIDER_POINTERS(X) X(RookAttacks, RookTable) X(BishopAttacks, BishopTable)
+
 typedef unsigned (Fn)(Square, Bitboard);
 
 static void init_bmi2(uint16_t table[], uint16_t *attacks[], Bitboard masks[],
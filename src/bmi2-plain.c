@@ -7,6 +7,10 @@ Bitboard *BishopAttacks[64];
 Bitboard BishopTable[5248];
 Bitboard RookTable[102400];
 
+// Tables filled by init_sliding_attacks(), embedded with tables=yes
+#define SLIDER_TABLES(X) X(RookMasks) X(RookTable) X(BishopMasks) X(BishopTable)
+#define SLIDER_POINTERS(X) X(RookAttacks, RookTable) X(BishopAttacks, BishopTable)
+
 typedef unsigned (Fn)(Square, Bitboard);
 
 static void init_bmi2(Bitboard table[], Bitboard *attacks[], Bitboard masks[],
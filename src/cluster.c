@@ -0,0 +1,424 @@
+#include <inttypes.h>
+#include <mpi.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "cluster.h"
+#include "misc.h"
+#include "search.h"
+#include "thread.h"
+#include "tt.h"
+#include "uci.h"
+
+// Every node runs the UCI loop. Rank 0 reads the commands and broadcasts
+// them, so all nodes set the same options and search the same positions.
+// The other nodes leave all decisions to stop a search to rank 0. When
+// its search ends, rank 0 sends each of them a stop message, after which
+// they send back their best move, score, depth and node count. Rank 0
+// then picks the move by the same vote as between the threads of a node.
+//
+// During the search, entries stored by the main search with at least
+// "Cluster Share Depth" plies are collected in batches and sent to all
+// other nodes, which store them in their TTs. The commands, the stop and
+// result messages and the TT entries each use their own communicator, so
+// that the UCI thread and the search threads can use MPI at the same time.
+
+int clusterRank = 0, clusterSize = 1, clusterActive = 1;
+int clusterShareDepth = 256;
+
+static MPI_Comm cmdComm, signalComm, ttComm;
+
+enum { TAG_STOP = 1, TAG_RESULT, TAG_TT };
+
+typedef struct {
+  Key key;
+  uint16_t move;
+  int16_t value;
+  int16_t eval;
+  uint8_t depth8;
+  uint8_t pvBound;
+} ClusterEntry;
+
+typedef struct {
+  Move move, ponder;
+  Value score;
+  Depth depth;
+  uint64_t nodes;
+} ClusterResult;
+
+// Each search thread collects entries in its own batch, which it moves to
+// the send queue when the batch is full. The main search thread of the
+// node sends the queue whenever the previous sends have completed and the
+// bandwidth limit allows it. Batches that do not fit in the queue are
+// dropped.
+
+enum { BatchSize = 64, QueueSize = 4096 };
+
+static struct {
+  ClusterEntry entry[BatchSize];
+  int count;
+} batches[MAX_THREADS];
+
+static ClusterEntry queue[QueueSize], sendBuf[QueueSize], recvBuf[QueueSize];
+static int queueCount, sendCount;
+static LOCK_T queueLock;
+static MPI_Request *sendRequests;
+static atomic_flag polling = ATOMIC_FLAG_INIT;
+static atomic_bool stopReceived;
+static double bytesPerMs, sendBudget;
+static TimePoint lastSend;
+static uint64_t lastNodes;
+
+// cluster_init() starts MPI. The output of all nodes but rank 0 is
+// discarded.
+
+void cluster_init(int *argc, char ***argv)
+{
+  int provided;
+  MPI_Init_thread(argc, argv, MPI_THREAD_MULTIPLE, &provided);
+  MPI_Comm_rank(MPI_COMM_WORLD, &clusterRank);
+  MPI_Comm_size(MPI_COMM_WORLD, &clusterSize);
+
+  if (provided < MPI_THREAD_MULTIPLE) {
+    if (clusterRank == 0)
+      fprintf(stderr, "The MPI library does not support MPI_THREAD_MULTIPLE.\n");
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  MPI_Comm_dup(MPI_COMM_WORLD, &cmdComm);
+  MPI_Comm_dup(MPI_COMM_WORLD, &signalComm);
+  MPI_Comm_dup(MPI_COMM_WORLD, &ttComm);
+  clusterActive = clusterSize;
+  sendRequests = malloc(clusterSize * sizeof(MPI_Request));
+  LOCK_INIT(queueLock);
+
+  if (clusterRank != 0) {
+#ifndef _WIN32
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+#else
+    freopen("NUL", "w", stdout);
+    freopen("NUL", "w", stderr);
+#endif
+  }
+}
+
+static void receive_entries(bool store);
+
+// cluster_finalize() waits until the TT entries sent by this node have
+// been received, so that no node quits with messages in flight, and then
+// shuts down MPI. The TT has already been freed, so entries received in
+// the meantime are discarded.
+
+void cluster_finalize(void)
+{
+  int done = 0;
+  while (sendCount && !done) {
+    MPI_Testall(sendCount, sendRequests, &done, MPI_STATUSES_IGNORE);
+    receive_entries(false);
+  }
+  sendCount = 0;
+
+  MPI_Request barrier;
+  MPI_Ibarrier(ttComm, &barrier);
+  for (done = 0; !done; MPI_Test(&barrier, &done, MPI_STATUS_IGNORE))
+    receive_entries(false);
+  receive_entries(false);
+
+  free(sendRequests);
+  LOCK_DESTROY(queueLock);
+  MPI_Comm_free(&cmdComm);
+  MPI_Comm_free(&signalComm);
+  MPI_Comm_free(&ttComm);
+  MPI_Finalize();
+}
+
+// cluster_getline() reads a command on rank 0 and broadcasts it to the
+// other nodes. It returns the same as getline().
+
+ssize_t cluster_getline(char **line, size_t *size)
+{
+  long len = 0;
+  if (clusterRank == 0)
+    len = getline(line, size, stdin);
+
+  MPI_Bcast(&len, 1, MPI_LONG, 0, cmdComm);
+  if (len <= 0)
+    return len;
+
+  if (*size < (size_t)len + 1) {
+    *size = len + 1;
+    *line = realloc(*line, *size);
+  }
+  MPI_Bcast(*line, len + 1, MPI_CHAR, 0, cmdComm);
+
+  return len;
+}
+
+// cluster_set_active() lets only the first n nodes take part in the
+// following searches. It must be called by all nodes at the same point,
+// e.g. from a command that they all run.
+
+void cluster_set_active(int n)
+{
+  MPI_Barrier(cmdComm);
+  clusterActive = clamp(n, 1, clusterSize);
+}
+
+// cluster_search_init() is called by the main search thread at the start
+// of a search. It returns false if this node does not take part.
+
+bool cluster_search_init(void)
+{
+  lastNodes = 0;
+  atomic_store(&stopReceived, false);
+
+  if (clusterRank >= clusterActive)
+    return false;
+
+  clusterShareDepth =  clusterActive > 1
+                     ? option_value(OPT_CLUSTER_SHARE_DEPTH) : 256;
+  bytesPerMs = option_value(OPT_CLUSTER_BANDWIDTH) * 1048576.0 / 1000;
+  sendBudget = 0;
+  lastSend = now();
+  for (int i = 0; i < Threads.numThreads; i++)
+    batches[i].count = 0;
+
+  return true;
+}
+
+void cluster_save_entry(Position *pos, Key k, Value v, bool pv, int b,
+    Depth d, Move m, Value ev)
+{
+  int idx = pos->threadIdx;
+  ClusterEntry *e = &batches[idx].entry[batches[idx].count++];
+  e->key = k;
+  e->move = (uint16_t)m;
+  e->value = (int16_t)v;
+  e->eval = (int16_t)ev;
+  e->depth8 = (uint8_t)(d - DEPTH_OFFSET);
+  e->pvBound = (uint8_t)((uint8_t)pv << 2 | b);
+
+  if (batches[idx].count < BatchSize)
+    return;
+
+  LOCK(queueLock);
+  if (queueCount + BatchSize <= QueueSize) {
+    memcpy(&queue[queueCount], batches[idx].entry, sizeof(batches[idx].entry));
+    queueCount += BatchSize;
+  }
+  UNLOCK(queueLock);
+  batches[idx].count = 0;
+}
+
+// receive_entries() stores the TT entries received from other nodes, or
+// only discards them if store is not set.
+
+static void receive_entries(bool store)
+{
+  int flag, count;
+  MPI_Status status;
+
+  while (MPI_Iprobe(MPI_ANY_SOURCE, TAG_TT, ttComm, &flag, &status), flag) {
+    MPI_Get_count(&status, MPI_BYTE, &count);
+    MPI_Recv(recvBuf, count, MPI_BYTE, status.MPI_SOURCE, TAG_TT, ttComm,
+             MPI_STATUS_IGNORE);
+
+    for (int i = 0; store && i < count / (int)sizeof(ClusterEntry); i++) {
+      ClusterEntry *e = &recvBuf[i];
+      bool found;
+      TTEntry ttData;
+      TTEntry *tte = tt_probe(e->key, &found, &ttData);
+      tte_save(tte, e->key, e->value, e->pvBound >> 2, e->pvBound & 3,
+               e->depth8 + DEPTH_OFFSET, e->move, e->eval);
+    }
+  }
+}
+
+// send_entries() sends the queued TT entries to the other active nodes.
+// With a bandwidth limit, only as many entries as the budget allows are
+// sent and the remaining ones stay queued for the next call.
+
+static void send_entries(void)
+{
+  int done;
+  if (sendCount) {
+    MPI_Testall(sendCount, sendRequests, &done, MPI_STATUSES_IGNORE);
+    if (!done)
+      return;
+    sendCount = 0;
+  }
+
+  TimePoint t = now();
+  sendBudget = min(sendBudget + (t - lastSend) * bytesPerMs, 1000 * bytesPerMs);
+  lastSend = t;
+
+  LOCK(queueLock);
+  int n = queueCount;
+  if (bytesPerMs)
+    n = min(n, (int)(sendBudget / (sizeof(ClusterEntry) * (clusterActive - 1))));
+  memcpy(sendBuf, queue, n * sizeof(ClusterEntry));
+  queueCount -= n;
+  memmove(queue, &queue[n], queueCount * sizeof(ClusterEntry));
+  UNLOCK(queueLock);
+
+  if (!n)
+    return;
+
+  size_t bytes = n * sizeof(ClusterEntry);
+
+  if (bytesPerMs)
+    sendBudget -= bytes * (clusterActive - 1);
+  for (int r = 0; r < clusterActive; r++)
+    if (r != clusterRank)
+      MPI_Isend(sendBuf, bytes, MPI_BYTE, r, TAG_TT, ttComm,
+                &sendRequests[sendCount++]);
+}
+
+// cluster_poll() is called regularly during the search. It exchanges TT
+// entries and, except on rank 0, checks for the stop message.
+
+void cluster_poll(void)
+{
+  if (clusterActive == 1 || atomic_flag_test_and_set(&polling))
+    return;
+
+  receive_entries(true);
+  send_entries();
+
+  int flag;
+  if (   clusterRank != 0
+      && !atomic_load(&stopReceived)
+      && (MPI_Iprobe(0, TAG_STOP, signalComm, &flag, MPI_STATUS_IGNORE), flag))
+  {
+    MPI_Recv(NULL, 0, MPI_BYTE, 0, TAG_STOP, signalComm, MPI_STATUS_IGNORE);
+    atomic_store(&stopReceived, true);
+    Threads.stop = true;
+  }
+
+  atomic_flag_clear(&polling);
+}
+
+// cluster_wait_stop() is called by the main search thread of a node other
+// than rank 0 when it has finished its search. It keeps exchanging TT
+// entries until rank 0 stops the search.
+
+void cluster_wait_stop(void)
+{
+  while (!atomic_load(&stopReceived)) {
+    cluster_poll();
+#ifndef _WIN32
+    usleep(1000);
+#else
+    Sleep(1);
+#endif
+  }
+}
+
+// cluster_stop() is called by rank 0 at the end of its search and stops
+// the search of the other active nodes.
+
+void cluster_stop(void)
+{
+  if (clusterRank != 0)
+    return;
+
+  for (int r = 1; r < clusterActive; r++)
+    MPI_Send(NULL, 0, MPI_BYTE, r, TAG_STOP, signalComm);
+}
+
+// cluster_pick_move() is called at the end of the search with the best
+// thread of this node. The other nodes send their result to rank 0, which
+// returns the thread whose move it plays. If vote is set and the move of
+// another node wins the vote, the move is stored in the root moves of the
+// main thread.
+
+Position *cluster_pick_move(Position *pos, Position *bestThread, bool vote)
+{
+  RootMove *rm = &bestThread->rootMoves->move[0];
+  ClusterResult own = {
+    rm->pv[0], rm->pvSize > 1 ? rm->pv[1] : 0, rm->score,
+    bestThread->completedDepth, threads_nodes_searched()
+  };
+
+  if (clusterRank >= clusterActive)
+    return bestThread;
+
+  if (clusterRank != 0) {
+    MPI_Send(&own, sizeof(own), MPI_BYTE, 0, TAG_RESULT, signalComm);
+    return bestThread;
+  }
+
+  ClusterResult res[clusterActive];
+  res[0] = own;
+  lastNodes = own.nodes;
+  for (int r = 1; r < clusterActive; r++) {
+    MPI_Recv(&res[r], sizeof(res[r]), MPI_BYTE, r, TAG_RESULT, signalComm,
+             MPI_STATUS_IGNORE);
+    lastNodes += res[r].nodes;
+  }
+
+  if (!vote || clusterActive == 1)
+    return bestThread;
+
+  Value minScore = res[0].score;
+  for (int r = 1; r < clusterActive; r++)
+    if (res[r].move)
+      minScore = min(minScore, res[r].score);
+
+  int64_t votes[clusterActive];
+  for (int r = 0; r < clusterActive; r++) {
+    votes[r] = 0;
+    for (int s = 0; s < clusterActive; s++)
+      if (res[s].move == res[r].move)
+        votes[r] += (res[s].score - minScore + 14) * res[s].depth;
+  }
+
+  int best = 0;
+  for (int r = 1; r < clusterActive; r++) {
+    if (!res[r].move)
+      continue;
+    if (abs(res[best].score) >= VALUE_TB_WIN_IN_MAX_PLY) {
+      // Make sure we pick the shortest mate
+      if (res[r].score > res[best].score)
+        best = r;
+    } else if (   res[r].score >= VALUE_TB_WIN_IN_MAX_PLY
+               || (   res[r].score > VALUE_TB_LOSS_IN_MAX_PLY
+                   && votes[r] > votes[best]))
+      best = r;
+  }
+
+  if (res[best].move == own.move)
+    return bestThread;
+
+  rm = &pos->rootMoves->move[0];
+  rm->pv[0] = res[best].move;
+  rm->pv[1] = res[best].ponder;
+  rm->pvSize = res[best].ponder ? 2 : 1;
+  rm->score = res[best].score;
+
+  char buf[16];
+  flockfile(stdout);
+  printf("info depth %d score %s nodes %" PRIu64 " pv", res[best].depth,
+         uci_value(buf, res[best].score), lastNodes);
+  for (int i = 0; i < rm->pvSize; i++)
+    printf(" %s", uci_move(buf, rm->pv[i], is_chess960()));
+  printf("\ninfo string Move of cluster node %d\n", best);
+  fflush(stdout);
+  funlockfile(stdout);
+
+  return pos;
+}
+
+// cluster_nodes_searched() returns the number of nodes searched by this
+// node or, on rank 0 after a search, by all active nodes.
+
+uint64_t cluster_nodes_searched(void)
+{
+  return lastNodes ? lastNodes : threads_nodes_searched();
+}
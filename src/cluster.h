@@ -0,0 +1,55 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "types.h"
+
+// With -DUSE_MPI, Cfish can run one search on several machines (nodes).
+// Each node is an MPI process searching the same position with its own
+// threads and hash table. Rank 0 reads the UCI commands and forwards them
+// to the other nodes, which share deep TT entries with each other during
+// the search and report their results to rank 0 at the end.
+
+#ifdef USE_MPI
+
+#include <sys/types.h>
+
+#include "position.h"
+
+extern int clusterRank, clusterSize, clusterActive;
+extern int clusterShareDepth;
+
+void cluster_init(int *argc, char ***argv);
+void cluster_finalize(void);
+ssize_t cluster_getline(char **line, size_t *size);
+void cluster_set_active(int n);
+bool cluster_search_init(void);
+void cluster_poll(void);
+void cluster_wait_stop(void);
+void cluster_stop(void);
+Position *cluster_pick_move(Position *pos, Position *bestThread, bool vote);
+uint64_t cluster_nodes_searched(void);
+void cluster_save_entry(Position *pos, Key k, Value v, bool pv, int b,
+    Depth d, Move m, Value ev);
+
+#define cluster_is_root() (clusterRank == 0)
+
+// cluster_save() queues an entry just stored in the TT for the other
+// nodes if it is deep enough.
+
+INLINE void cluster_save(Position *pos, Key k, Value v, bool pv, int b,
+    Depth d, Move m, Value ev)
+{
+  if (d >= clusterShareDepth)
+    cluster_save_entry(pos, k, v, pv, b, d, m, ev);
+}
+
+#else
+
+#define cluster_is_root() true
+#define cluster_poll() do {} while (0)
+#define cluster_save(pos, k, v, pv, b, d, m, ev) do {} while (0)
+#define cluster_nodes_searched() threads_nodes_searched()
+
+#endif
+
+#endif
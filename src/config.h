@@ -2,7 +2,10 @@
 #define CONFIG_H
 
 //#define LONG_MATES
+// Low memory builds share the counter move history tables of a NUMA node.
+#ifndef LOW_MEMORY
 #define PER_THREAD_CMH
+#endif
 
 #ifdef USE_PEXT
 //#define BMI2_PLAIN
@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "datagen.h"
+#include "misc.h"
+#include "movegen.h"
+#include "position.h"
+#include "search.h"
+#include "thread.h"
+#include "uci.h"
+
+// Games that have not ended after this many plies are adjudicated as draws.
+enum { DatagenMaxPlies = 400 };
+
+// A DatagenRecord stores a position together with its search score and the
+// result of the game in 32 bytes. The layout is that of the "marlinformat"
+// used by some NNUE trainers. All fields are little endian.
+// - occupancy: the occupied squares.
+// - pieces: a nibble for each occupied square in order of increasing square,
+//   two per byte with the first in the low nibble. Bits 0-2 hold the piece
+//   type minus one, or 6 for a rook that may still castle. Bit 3 is set
+//   for black pieces.
+// - stmEp: the en passant square, or 64 if there is none. Bit 7 is set if
+//   black is to move.
+// - halfmove, fullmove: the halfmove clock and the fullmove number.
+// - eval: the score in centipawns from white's point of view.
+// - wdl: the result of the game, 0 for a black win, 1 for a draw and 2 for
+//   a white win.
+
+typedef struct {
+  uint64_t occupancy;
+  uint8_t pieces[16];
+  uint8_t stmEp;
+  uint8_t halfmove;
+  uint16_t fullmove;
+  int16_t eval;
+  uint8_t wdl;
+  uint8_t extra;
+} DatagenRecord;
+
+static_assert(sizeof(DatagenRecord) == 32, "DatagenRecord should be 32 bytes");
+
+static struct {
+  FILE *file;
+  LOCK_T lock;
+  int numGames;
+  int randomPlies;
+  uint64_t seed;
+  uint64_t positions;
+  int results[3];
+  atomic_int next;
+} datagenJob;
+
+static const char StartFEN[] =
+  "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+static void pack_position(const Position *pos, Value v, DatagenRecord *r)
+{
+  memset(r, 0, sizeof(*r));
+  r->occupancy = pieces();
+
+  Bitboard rooks = 0;
+  for (int cr = WHITE_OO; cr <= BLACK_OOO; cr <<= 1)
+    if (can_castle_cr(cr))
+      rooks |= sq_bb(castling_rook_square(cr));
+
+  int n = 0;
+  for (Bitboard b = pieces(); b; n++) {
+    Square s = pop_lsb(&b);
+    Piece pc = piece_on(s);
+    int code = (rooks & sq_bb(s)) ? 6 : type_of_p(pc) - 1;
+    r->pieces[n / 2] |= (code | (color_of(pc) << 3)) << (4 * (n & 1));
+  }
+
+  r->stmEp = (ep_square() ? ep_square() : 64) | (stm() << 7);
+  r->halfmove = rule50_count();
+  r->fullmove = game_ply() / 2 + 1;
+  v = stm() == WHITE ? v : -v;
+  r->eval = clamp(v * 100 / PawnValueEg, -32000, 32000);
+}
+
+// datagen_do_move() makes a move of the game. When the game history
+// reaches the end of the space that the search leaves for it, the part
+// relevant for repetition detection is moved to the start of the stack.
+
+static void datagen_do_move(Position *pos, Move m)
+{
+  do_move(pos, m, gives_check(pos, pos->st, m));
+  pos->gamePly++;
+
+  if (pos->st - pos->stack >= 100) {
+    int n = max(7, min(pos->st->pliesFromNull, 99));
+    Stack *st = pos->st - n;
+    for (int i = 0; i <= n; i++)
+      memcpy(&pos->stack[i], &st[i], StateSize);
+    pos->st = pos->stack + n;
+    pos_set_check_info(pos);
+  }
+}
+
+// datagen_worker() is called by the search threads. Each thread plays the
+// next unplayed game against itself, records its positions and writes them
+// to the output file with the result once the game is over.
+
+void datagen_worker(Position *pos)
+{
+  DatagenRecord *records = malloc(DatagenMaxPlies * sizeof(*records));
+  int g;
+
+  while ((g = atomic_fetch_add(&datagenJob.next, 1)) < datagenJob.numGames) {
+    PRNG rng;
+    prng_init(&rng, datagenJob.seed + 0x9e3779b97f4a7c15ULL * (g + 1));
+
+    char fen[sizeof(StartFEN)];
+    strcpy(fen, StartFEN);
+    pos->st = pos->stack + 7;
+    pos_set(pos, fen, 0);
+
+    // Start from a random opening to diversify the games.
+    for (int i = 0; i < datagenJob.randomPlies; i++) {
+      ExtMove *end = generate_legal(pos, pos->moveList);
+      if (end == pos->moveList)
+        break;
+      datagen_do_move(pos, pos->moveList[prng_rand(&rng) % (end - pos->moveList)].move);
+    }
+
+    int n = 0, wdl = 1;
+
+    for (int ply = 0; ply < DatagenMaxPlies; ply++) {
+      if (is_draw(pos) || popcount(pieces()) == 2)
+        break;
+
+      if (!batch_search(pos)) {
+        if (checkers())
+          wdl = stm() == WHITE ? 0 : 2;
+        break;
+      }
+
+      RootMove *best = &pos->rootMoves->move[0];
+
+      // Adjudicate the game once a mate has been found.
+      if (abs(best->score) >= VALUE_MATE_IN_MAX_PLY) {
+        wdl = (best->score > 0) == (stm() == WHITE) ? 2 : 0;
+        break;
+      }
+
+      // Quiet positions are easier to learn from.
+      if (!checkers() && !is_capture_or_promotion(pos, best->pv[0]))
+        pack_position(pos, best->score, &records[n++]);
+
+      datagen_do_move(pos, best->pv[0]);
+    }
+
+    for (int i = 0; i < n; i++)
+      records[i].wdl = wdl;
+
+    LOCK(datagenJob.lock);
+    fwrite(records, sizeof(*records), n, datagenJob.file);
+    datagenJob.positions += n;
+    datagenJob.results[wdl]++;
+    UNLOCK(datagenJob.lock);
+  }
+
+  free(records);
+}
+
+// datagen() implements the "datagen" command. The search threads play
+// games against themselves, one game per thread at a time, with searches
+// limited by depth and/or nodes, and write the positions in the binary
+// format of DatagenRecord to a file. The parameters are:
+// - Output file name.
+// - games <n>: Number of games. Default is 100.
+// - depth <n>: Depth limit of each search. Default is 8 if no node limit
+//   is given.
+// - nodes <n>: Node limit of each search, checked after each iteration.
+// - random <n>: Number of random moves at the start of a game. Default is 8.
+// - seed <n>: Seed of the random moves. Default is 0.
+
+void datagen(char *str)
+{
+  char *fileName = strtok(str, " \t\n");
+  char *token;
+  int depth = 0;
+  uint64_t nodes = 0;
+
+  datagenJob.numGames = 100;
+  datagenJob.randomPlies = 8;
+  datagenJob.seed = 0;
+
+  while ((token = strtok(NULL, " \t\n"))) {
+    char *value = strtok(NULL, " \t\n");
+    if (!value)
+      break;
+    if (strcmp(token, "games") == 0)
+      datagenJob.numGames = atoi(value);
+    else if (strcmp(token, "depth") == 0)
+      depth = atoi(value);
+    else if (strcmp(token, "nodes") == 0)
+      nodes = strtoull(value, NULL, 10);
+    else if (strcmp(token, "random") == 0)
+      datagenJob.randomPlies = atoi(value);
+    else if (strcmp(token, "seed") == 0)
+      datagenJob.seed = strtoull(value, NULL, 10);
+  }
+
+  if (!fileName) {
+    printf("info string Usage: datagen <outfile> [games <n>] [depth <n>] "
+           "[nodes <n>] [random <n>] [seed <n>]\n");
+    fflush(stdout);
+    return;
+  }
+
+  if (!(datagenJob.file = fopen(fileName, "ab"))) {
+    printf("info string Unable to open file %s\n", fileName);
+    fflush(stdout);
+    return;
+  }
+
+  if (!depth && !nodes)
+    depth = 8;
+
+  LOCK_INIT(datagenJob.lock);
+  datagenJob.positions = 0;
+  memset(datagenJob.results, 0, sizeof(datagenJob.results));
+  atomic_store(&datagenJob.next, 0);
+
+  TimePoint start = now();
+  batch_run(THREAD_DATAGEN, depth, nodes);
+  TimePoint elapsed = now() - start + 1;
+
+  LOCK_DESTROY(datagenJob.lock);
+  fclose(datagenJob.file);
+
+  printf("info string Played %d games (+%d =%d -%d) in %"PRIi64" ms and "
+         "wrote %"PRIu64" positions to %s.\n", datagenJob.numGames,
+         datagenJob.results[2], datagenJob.results[1], datagenJob.results[0],
+         elapsed, datagenJob.positions, fileName);
+  fflush(stdout);
+}
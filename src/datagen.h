@@ -0,0 +1,9 @@
+#ifndef DATAGEN_H
+#define DATAGEN_H
+
+#include "types.h"
+
+void datagen(char *str);
+void datagen_worker(Position *pos);
+
+#endif
@@ -241,12 +241,26 @@ INLINE Score evaluate_pieces(const Position *pos, EvalInfo *ei, Score *mobility,
 
   ei->attackedBy[Us][Pt] = 0;
 
-  loop_through_pieces(Us, Pt, s) {
-    // Find attacked squares, including x-ray attacks for bishops and rooks
-    b = Pt == BISHOP ? attacks_bb_bishop(s, pieces() ^ pieces_p(QUEEN))
-      : Pt == ROOK ? attacks_bb_rook(s,
-                              pieces() ^ pieces_p(QUEEN) ^ pieces_cp(Us, ROOK))
-                   : attacks_from(Pt, s);
+  // Find attacked squares, including x-ray attacks for bishops and rooks.
+  // The attacks of all sliders of this type are computed in one batch.
+  Square sqs[16];
+  Bitboard atts[16];
+  int n = 0;
+
+  if (Pt == KNIGHT)
+    for (Bitboard pcs = pieces_cp(Us, KNIGHT); pcs; n++) {
+      sqs[n] = pop_lsb(&pcs);
+      atts[n] = attacks_from_knight(sqs[n]);
+    }
+  else
+    n = slider_attacks_bb(Pt, pieces_cp(Us, Pt),
+                            Pt == BISHOP ? pieces() ^ pieces_p(QUEEN)
+                          : Pt == ROOK ? pieces() ^ pieces_p(QUEEN) ^ pieces_cp(Us, ROOK)
+                                       : pieces(), sqs, atts);
+
+  for (int i = 0; i < n; i++) {
+    s = sqs[i];
+    b = atts[i];
 
     if (blockers_for_king(pos, Us) & sq_bb(s))
       b &= LineBB[square_of(Us, KING)][s];
@@ -761,7 +775,7 @@ INLINE Value evaluate_winnable(const Position *pos, EvalInfo *ei, Score score)
 // a static evaluation of the position from the point of view of the side
 // to move.
 
-static Value evaluate_classical(const Position *pos)
+Value evaluate_classical(const Position *pos)
 {
   assert(!checkers());
 
@@ -843,9 +857,16 @@ make_v:
 
 #ifdef NNUE
 int useNNUE;
+#ifndef NNUE_PURE
+bool useSmallNet;
+#endif
 #endif
 
+#ifdef EVAL_CACHE
+static Value do_evaluate(const Position *pos)
+#else
 Value evaluate(const Position *pos)
+#endif
 {
   Value v;
 
@@ -859,24 +880,38 @@ Value evaluate(const Position *pos)
     bool classical = largePsq || (psq > PawnValueMg / 4 && !(pos->nodes & 0x0B));
 
     bool strongClassical = non_pawn_material() < 2 * RookValueMg && popcount(pieces_p(PAWN)) < 2;
-    v =  classical || strongClassical
-       ? evaluate_classical(pos)
-       : nnue_evaluate(pos) * (679 + mat / 32) / 1024 + Tempo;
+    if (classical && !strongClassical && useSmallNet) {
+      stat_inc(STAT_SMALL_NET_EVALS);
+      v = nnue_evaluate_small(pos) * (679 + mat / 32) / 1024 + Tempo;
+    } else if (classical || strongClassical) {
+      stat_inc(STAT_CLASSICAL_EVALS);
+      v = evaluate_classical(pos);
+    } else {
+      stat_inc(STAT_NNUE_EVALS);
+      v = nnue_evaluate(pos) * (679 + mat / 32) / 1024 + Tempo;
+    }
 
     if (   classical && largePsq && !strongClassical
         && (   abs(v) * 16 < NNUEThreshold2 * r50
             || (   opposite_bishops(pos)
                 && abs(v) * 16 < (NNUEThreshold1 + non_pawn_material() / 64) * r50
                 && !(pos->nodes & 0xB))))
+    {
+      stat_inc(STAT_NNUE_EVALS);
       v = nnue_evaluate(pos) * (679 + mat / 32) / 1024 + Tempo;
+    }
 
-  } else if (useNNUE == EVAL_PURE)
+  } else if (useNNUE == EVAL_PURE) {
+    stat_inc(STAT_NNUE_EVALS);
     v = nnue_evaluate(pos) * (679 + mat / 32) / 1024 + Tempo;
-  else
+  } else {
+    stat_inc(STAT_CLASSICAL_EVALS);
     v = evaluate_classical(pos);
+  }
 
 #else
 
+  stat_inc(STAT_CLASSICAL_EVALS);
   v = evaluate_classical(pos);
 
 #endif
@@ -889,14 +924,54 @@ Value evaluate(const Position *pos)
 
 #else /* NNUE_PURE */
 
+#ifdef EVAL_CACHE
+static Value do_evaluate(const Position *pos)
+#else
 Value evaluate(const Position *pos)
+#endif
 {
   Value v;
   int mat = non_pawn_material() + PieceValue[MG][PAWN] * popcount(pieces_p(PAWN));
 
+  stat_inc(STAT_NNUE_EVALS);
   v = nnue_evaluate(pos) * (679 + mat / 32) / 1024 + Tempo;
   v = v * (100 - rule50_count()) / 100;
   return clamp(v, VALUE_TB_LOSS_IN_MAX_PLY + 1, VALUE_TB_WIN_IN_MAX_PLY - 1);
 }
 
 #endif
+
+#ifdef EVAL_CACHE
+
+// evaluate() returns the static evaluation of the position from the point
+// of view of the side to move. Besides the position, the evaluation
+// depends on the contempt and the 50-move counter, which are therefore
+// stored in the cache entry as well.
+
+Value evaluate(const Position *pos)
+{
+  if (!pos->evalCache)
+    return do_evaluate(pos);
+
+  Key key = key();
+  EvalCacheEntry *e = &pos->evalCache[key & (EVAL_CACHE_SIZE - 1)];
+
+  stat_inc(STAT_EVAL_CACHE_PROBES);
+  if (   e->key == key
+      && e->contempt == pos->contempt
+      && e->rule50 == rule50_count())
+  {
+    stat_inc(STAT_EVAL_CACHE_HITS);
+    return e->value;
+  }
+
+  Value v = do_evaluate(pos);
+  e->key = key;
+  e->contempt = pos->contempt;
+  e->value = v;
+  e->rule50 = rule50_count();
+
+  return v;
+}
+
+#endif
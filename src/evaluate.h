@@ -11,11 +11,28 @@ enum { Tempo = 28 };
 enum { EVAL_HYBRID, EVAL_PURE, EVAL_CLASSICAL };
 #ifndef NNUE_PURE
 extern int useNNUE;
+extern bool useSmallNet;
 #else
 #define useNNUE EVAL_PURE
 #endif
 #endif
 
+#ifdef EVAL_CACHE
+// Each search thread caches the static evaluations of the positions it
+// evaluated last, indexed by position key.
+enum { EVAL_CACHE_SIZE = 16384 };
+
+struct EvalCacheEntry {
+  Key key;
+  Score contempt;
+  int16_t value;
+  uint8_t rule50;
+};
+#endif
+
 Value evaluate(const Position *pos);
+#ifndef NNUE_PURE
+Value evaluate_classical(const Position *pos);
+#endif
 
 #endif
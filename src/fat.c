@@ -0,0 +1,83 @@
+// fat.c is the entry point of the fat binary built by "make fat". The whole
+// engine is compiled once for each architecture in FATARCHS and the global
+// symbols of each build are prefixed with the name of its architecture, so
+// that all builds can be linked into one executable. main() reads the CPU
+// features and runs the best build the CPU and operating system support.
+
+#include <cpuid.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+int avx512_vnni_main(int argc, char **argv);
+int avx512_main(int argc, char **argv);
+int avxvnni_main(int argc, char **argv);
+int bmi2_main(int argc, char **argv);
+int avx2_main(int argc, char **argv);
+int modern_main(int argc, char **argv);
+int x86_64_main(int argc, char **argv);
+
+static uint64_t xgetbv(void)
+{
+  uint32_t eax, edx;
+  __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  return ((uint64_t)edx << 32) | eax;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t eax, ebx, ecx, edx;
+  uint32_t ecx1 = 0, ebx7 = 0, ecx7 = 0, eax71 = 0;
+  char vendor[13] = { 0 };
+  int family = 0;
+
+  __cpuid(0, eax, ebx, ecx, edx);
+  uint32_t maxLeaf = eax;
+  memcpy(vendor, &ebx, 4);
+  memcpy(vendor + 4, &edx, 4);
+  memcpy(vendor + 8, &ecx, 4);
+
+  __cpuid(1, eax, ebx, ecx1, edx);
+  family = (eax >> 8) & 0x0f;
+  if (family == 0x0f)
+    family += (eax >> 20) & 0xff;
+
+  if (maxLeaf >= 7) {
+    __cpuid_count(7, 0, eax, ebx7, ecx7, edx);
+    if (eax >= 1)
+      __cpuid_count(7, 1, eax71, ebx, ecx, edx);
+  }
+
+  // The OS must save the YMM (and for AVX512 the ZMM) registers.
+  uint64_t xcr0 = (ecx1 & bit_OSXSAVE) ? xgetbv() : 0;
+  bool ymm = (xcr0 & 0x06) == 0x06 && (ecx1 & bit_AVX);
+  bool zmm = ymm && (xcr0 & 0xe0) == 0xe0;
+
+  bool popcnt = ecx1 & bit_POPCNT;
+  bool sse41 = (ecx1 & bit_SSE4_1) && (ecx1 & bit_SSSE3);
+  bool avx2 = ymm && (ebx7 & bit_AVX2);
+  bool avx512 = zmm && (ebx7 & bit_AVX512F) && (ebx7 & bit_AVX512BW);
+  bool vnni512 =  avx512 && (ebx7 & bit_AVX512DQ) && (ebx7 & bit_AVX512VL)
+               && (ecx7 & (1 << 11));
+  bool avxvnni = avx2 && (eax71 & (1 << 4));
+
+  // Let's not use pext on AMD CPUs before Zen 3, where it is microcoded.
+  bool pext =   (ebx7 & bit_BMI2)
+             && !(strcmp(vendor, "AuthenticAMD") == 0 && family < 0x19);
+
+  if (vnni512 && pext)
+    return avx512_vnni_main(argc, argv);
+  if (avx512 && pext)
+    return avx512_main(argc, argv);
+  if (avxvnni && pext)
+    return avxvnni_main(argc, argv);
+  if (avx2 && pext)
+    return bmi2_main(argc, argv);
+  if (avx2 && popcnt && sse41)
+    return avx2_main(argc, argv);
+  if (popcnt && sse41)
+    return modern_main(argc, argv);
+
+  return x86_64_main(argc, argv);
+}
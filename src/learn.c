@@ -0,0 +1,348 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "learn.h"
+#include "misc.h"
+#include "movegen.h"
+#include "thread.h"
+#include "tt.h"
+#include "uci.h"
+
+// The learning file (LearningFile) keeps the results of completed searches
+// across runs. It holds a hash table of records, each with the key of a
+// position and its best move, score, depth and bound. After each search
+// the root position and the positions along the principal variation are
+// stored. Before a search the root position and the positions after each
+// root move are looked up, and the records found are stored in the TT, so
+// that a position searched before starts where the last search ended.
+//
+// The file is mapped as shared memory, so that all engine processes that
+// use it learn from each other. As in the lockless TT, each record is
+// stored as the key XORed with the data and the data, so that a record
+// torn by concurrent writes is ignored. Records are kept in buckets of 4.
+// The file size is fixed when the file is created, so a full table
+// replaces the shallowest record of a bucket. The "learncompact" command
+// rewrites the file with the current LearningSize.
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t bucketSize;
+  uint64_t numBuckets;
+  char padding[40];
+} LearnHeader;
+
+static_assert(sizeof(LearnHeader) == 64, "LearnHeader should be 64 bytes");
+
+typedef struct {
+  uint64_t keyXor;
+  uint64_t data;
+} LearnRecord;
+
+typedef struct {
+  Move move;
+  Value value;
+  Depth depth;
+  int bound;
+} LearnEntry;
+
+enum { LearnBucketSize = 4 };
+
+static const char LearnMagic[8] = "CfishLF";
+static const uint32_t LearnVersion = 1;
+
+static struct {
+  LearnHeader *header;
+  LearnRecord *records;
+  uint64_t mask;
+  size_t size;
+  map_t map;
+} learn;
+
+// learn_buckets() returns the largest power of 2 number of buckets whose
+// records fit in the given size. The header comes on top of that.
+
+static uint64_t learn_buckets(size_t mbSize)
+{
+  uint64_t numBuckets = 1;
+  while (2 * numBuckets * LearnBucketSize * sizeof(LearnRecord) <= (mbSize << 20))
+    numBuckets *= 2;
+  return numBuckets;
+}
+
+void learn_free(void)
+{
+  if (learn.header)
+    unmap_file(learn.header, learn.map);
+  learn.header = NULL;
+  learn.records = NULL;
+}
+
+void learn_report_memory(void)
+{
+  if (learn.header)
+    memory_add("learning file", -1, learn.size, false);
+}
+
+// learn_init() opens the given learning file, creating it if it does not
+// exist, or closes the learning file if the name is "<empty>".
+
+void learn_init(const char *fileName)
+{
+  learn_free();
+
+  if (!*fileName || strcmp(fileName, "<empty>") == 0)
+    return;
+
+  uint64_t numBuckets = learn_buckets(option_value(OPT_LEARNING_SIZE));
+  learn.size =  sizeof(LearnHeader)
+              + numBuckets * LearnBucketSize * sizeof(LearnRecord);
+  learn.header = map_file_shared(fileName, &learn.size, &learn.map);
+  if (!learn.header) {
+    printf("info string Unable to open learning file %s\n", fileName);
+    fflush(stdout);
+    return;
+  }
+
+  LearnHeader *h = learn.header;
+  if (h->magic[0] == 0) {
+    memcpy(h->magic, LearnMagic, sizeof(h->magic));
+    h->version = LearnVersion;
+    h->bucketSize = LearnBucketSize;
+    h->numBuckets = numBuckets;
+  }
+
+  if (   memcmp(h->magic, LearnMagic, sizeof(h->magic)) != 0
+      || h->version != LearnVersion
+      || h->bucketSize != LearnBucketSize
+      || (h->numBuckets & (h->numBuckets - 1))
+      ||   learn.size != sizeof(LearnHeader)
+                       + h->numBuckets * LearnBucketSize * sizeof(LearnRecord))
+  {
+    printf("info string %s is not a valid learning file\n", fileName);
+    fflush(stdout);
+    learn_free();
+    return;
+  }
+
+  learn.records = (LearnRecord *)(h + 1);
+  learn.mask = h->numBuckets - 1;
+}
+
+INLINE uint64_t learn_pack(Move m, Value v, Depth d, int b)
+{
+  return   (uint16_t)m
+         | (uint64_t)(uint16_t)v << 16
+         | (uint64_t)(uint8_t)d << 32
+         | (uint64_t)b << 40;
+}
+
+static bool learn_probe(Key key, LearnEntry *e)
+{
+  LearnRecord *r = &learn.records[(key & learn.mask) * LearnBucketSize];
+
+  for (int i = 0; i < LearnBucketSize; i++) {
+    uint64_t data = r[i].data;
+    if (data && (r[i].keyXor ^ data) == key) {
+      e->move = (uint16_t)data;
+      e->value = (int16_t)(data >> 16);
+      e->depth = (uint8_t)(data >> 32);
+      e->bound = (data >> 40) & 3;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// learn_store() stores a record unless the file has a deeper one for the
+// same position. Otherwise it takes an empty slot of the bucket or that
+// with the shallowest record.
+
+static void learn_store(LearnRecord *records, uint64_t mask, Key key,
+    uint64_t data)
+{
+  LearnRecord *r = &records[(key & mask) * LearnBucketSize], *replace = r;
+  Depth d = (uint8_t)(data >> 32);
+
+  for (int i = 0; i < LearnBucketSize; i++) {
+    uint64_t old = r[i].data;
+    if (!old || (r[i].keyXor ^ old) == key) {
+      if (old && (uint8_t)(old >> 32) > d)
+        return;
+      replace = &r[i];
+      break;
+    }
+    if ((uint8_t)(old >> 32) < (uint8_t)(replace->data >> 32))
+      replace = &r[i];
+  }
+
+  if (replace->data && (uint8_t)(replace->data >> 32) > d)
+    return;
+
+  replace->data = data;
+  replace->keyXor = key ^ data;
+}
+
+static void seed_tt(Key key, LearnEntry *e)
+{
+  bool found;
+  TTEntry ttData;
+  TTEntry *tte = tt_probe(key, &found, &ttData);
+  if (!found || tte_depth(&ttData) < e->depth)
+    tte_save(tte, key, e->value, e->bound == BOUND_EXACT, e->bound, e->depth,
+        e->move, VALUE_NONE);
+}
+
+// learn_seed() is called by the main thread before a search. It stores
+// the records of the root position and of the positions after each root
+// move in the TT, and puts the best move learned for the root first.
+
+void learn_seed(Position *pos)
+{
+  if (!learn.records)
+    return;
+
+  RootMoves *rm = pos->rootMoves;
+  LearnEntry e;
+
+  for (int i = 0; i < rm->size; i++) {
+    Move m = rm->move[i].pv[0];
+    do_move(pos, m, gives_check(pos, pos->st, m));
+    if (learn_probe(key(), &e))
+      seed_tt(key(), &e);
+    undo_move(pos, m);
+  }
+
+  if (!learn_probe(key(), &e))
+    return;
+
+  seed_tt(key(), &e);
+  for (int i = 0; i < rm->size; i++)
+    if (rm->move[i].pv[0] == e.move) {
+      RootMove tmp = rm->move[i];
+      memmove(&rm->move[1], &rm->move[0], i * sizeof(RootMove));
+      rm->move[0] = tmp;
+      break;
+    }
+}
+
+// learn_update() is called by the main thread after a search with the
+// best root move and the completed depth. It stores the root position and
+// the positions along the PV, each with the remaining depth. A search
+// stopped during a fail high or low leaves only a bound for the root move,
+// which is stored as such and as the opposite bound for the opponent.
+
+void learn_update(Position *pos, RootMove *rm, Depth depth)
+{
+  if (!learn.records || depth <= 0 || !rm->pv[0] || rm->bound == BOUND_NONE)
+    return;
+
+  int ply = 0;
+  for (; ply < rm->pvSize && depth - ply > 0; ply++) {
+    Value v = ply & 1 ? -rm->score : rm->score;
+    if (v >= VALUE_MATE_IN_MAX_PLY)
+      v += ply;
+    else if (v <= VALUE_MATED_IN_MAX_PLY)
+      v -= ply;
+    int bound =  !(ply & 1) || rm->bound == BOUND_EXACT ? rm->bound
+               : rm->bound ^ (BOUND_UPPER | BOUND_LOWER);
+    learn_store(learn.records, learn.mask, key(),
+        learn_pack(rm->pv[ply], v, min(depth - ply, 255), bound));
+    do_move(pos, rm->pv[ply], gives_check(pos, pos->st, rm->pv[ply]));
+  }
+
+  while (ply--)
+    undo_move(pos, rm->pv[ply]);
+}
+
+// learn_compact() implements the "learncompact" command. It rewrites the
+// learning file with the size given by LearningSize, keeping the deepest
+// records that fit and dropping those with less than the given depth.
+
+static int record_cmp(const void *a, const void *b)
+{
+  return (int)(uint8_t)(((const LearnRecord *)b)->data >> 32)
+       - (int)(uint8_t)(((const LearnRecord *)a)->data >> 32);
+}
+
+void learn_compact(char *str)
+{
+  const char *fileName = option_string_value(OPT_LEARNING_FILE);
+  if (!learn.records) {
+    printf("info string No learning file open\n");
+    fflush(stdout);
+    return;
+  }
+
+  if (Threads.searching) {
+    if (threads_main()->action != THREAD_SLEEP) {
+      printf("info string Cannot compact the learning file during a search\n");
+      fflush(stdout);
+      return;
+    }
+    thread_wait_until_sleeping(threads_main());
+  }
+
+  Depth minDepth = str ? atoi(str) : 0;
+
+  // Collect the valid records deep enough, the deepest first.
+  size_t total = (learn.mask + 1) * LearnBucketSize, count = 0;
+  LearnRecord *list = malloc(total * sizeof(LearnRecord));
+  for (size_t i = 0; i < total; i++) {
+    LearnRecord r = learn.records[i];
+    if (   r.data
+        && ((r.keyXor ^ r.data) & learn.mask) == i / LearnBucketSize
+        && (uint8_t)(r.data >> 32) >= minDepth)
+      list[count++] = r;
+  }
+  qsort(list, count, sizeof(LearnRecord), record_cmp);
+
+  uint64_t numBuckets = learn_buckets(option_value(OPT_LEARNING_SIZE));
+  size_t size =  sizeof(LearnHeader)
+               + numBuckets * LearnBucketSize * sizeof(LearnRecord);
+  LearnHeader *h = calloc(size, 1);
+  memcpy(h->magic, LearnMagic, sizeof(h->magic));
+  h->version = LearnVersion;
+  h->bucketSize = LearnBucketSize;
+  h->numBuckets = numBuckets;
+  LearnRecord *records = (LearnRecord *)(h + 1);
+
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    Key key = list[i].keyXor ^ list[i].data;
+    LearnRecord *r = &records[(key & (numBuckets - 1)) * LearnBucketSize];
+    for (int j = 0; j < LearnBucketSize; j++)
+      if (!r[j].data) {
+        r[j] = list[i];
+        kept++;
+        break;
+      }
+  }
+  free(list);
+
+  char tmpName[strlen(fileName) + 5];
+  sprintf(tmpName, "%s.tmp", fileName);
+  FILE *F = fopen(tmpName, "wb");
+  bool success = F && fwrite(h, size, 1, F) == 1;
+  success = F && fclose(F) == 0 && success;
+  free(h);
+
+  learn_free();
+#ifdef _WIN32
+  if (success)
+    remove(fileName);
+#endif
+  if (success && rename(tmpName, fileName) == 0)
+    printf("info string Learning file compacted, %zu of %zu records kept\n",
+           kept, count);
+  else {
+    remove(tmpName);
+    printf("info string Unable to compact learning file %s\n", fileName);
+  }
+  fflush(stdout);
+
+  learn_init(fileName);
+}
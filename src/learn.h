@@ -0,0 +1,15 @@
+#ifndef LEARN_H
+#define LEARN_H
+
+#include "position.h"
+#include "search.h"
+#include "types.h"
+
+void learn_init(const char *fileName);
+void learn_free(void);
+void learn_report_memory(void);
+void learn_seed(Position *pos);
+void learn_update(Position *pos, RootMove *rm, Depth depth);
+void learn_compact(char *str);
+
+#endif
@@ -13,6 +13,12 @@ uint8_t   BishopShifts [64];
 static Bitboard RookTable[0x19000];  // To store rook attacks
 static Bitboard BishopTable[0x1480]; // To store bishop attacks
 
+// Tables filled by init_sliding_attacks(), embedded with tables=yes
+#define SLIDER_TABLES(X) \
+  X(RookMasks) X(RookMagics) X(RookShifts) X(RookTable) \
+  X(BishopMasks) X(BishopMagics) X(BishopShifts) X(BishopTable)
+#define SLIDER_POINTERS(X) X(RookAttacks, RookTable) X(BishopAttacks, BishopTable)
+
 typedef unsigned (Fn)(Square, Bitboard);
 
 static void init_magics(Bitboard table[], Bitboard *attacks[],
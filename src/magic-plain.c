@@ -8,6 +8,12 @@ Bitboard *BishopAttacks[64];
 
 static Bitboard AttacksTable[88772];
 
+// Tables filled by init_sliding_attacks(), embedded with tables=yes
+#define SLIDER_TABLES(X) \
+  X(RookMasks) X(RookMagics) X(BishopMasks) X(BishopMagics) X(AttacksTable)
+#define SLIDER_POINTERS(X) \
+  X(RookAttacks, AttacksTable) X(BishopAttacks, AttacksTable)
+
 // Fixed shift magics found by Volker Annuss.
 // From: http://talkchess.com/forum/viewtopic.php?p=727500#727500
 
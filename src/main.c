@@ -21,7 +21,10 @@
 #include <stdio.h>
 
 #include "bitboard.h"
+#include "cluster.h"
 #include "endgame.h"
+#include "learn.h"
+#include "material.h"
 #include "pawns.h"
 #include "polybook.h"
 #include "position.h"
@@ -33,18 +36,32 @@
 
 int main(int argc, char **argv)
 {
+#ifdef USE_MPI
+  cluster_init(&argc, &argv);
+#endif
+  startup_time(NULL);
   print_engine_info(false);
 
   psqt_init();
+  startup_time("psqt");
   bitboards_init();
+  startup_time("bitboards");
   zob_init();
+  startup_time("zobrist");
   bitbases_init();
+  startup_time("bitbases");
 #ifndef NNUE_PURE
   endgames_init();
+  startup_time("endgames");
+  material_init();
+  startup_time("material");
 #endif
   threads_init();
+  startup_time("threads");
   options_init();
+  startup_time("options");
   search_clear();
+  startup_time("clear");
 
   uci_loop(argc, argv);
 
@@ -53,7 +70,15 @@ int main(int argc, char **argv)
   options_free();
   tt_free();
   pb_free();
+  learn_free();
   nnue_free();
+#ifndef NNUE_PURE
+  material_free();
+  pawn_shared_free();
+#endif
+#ifdef USE_MPI
+  cluster_finalize();
+#endif
 
   return 0;
 }
@@ -24,6 +24,7 @@
 #include <string.h>   // For memset
 
 #include "material.h"
+#include "numa.h"
 #include "position.h"
 
 // Polynomial material imbalance parameters.
@@ -49,24 +50,30 @@ static const Score QuadraticTheirs[][8] = {
 
 #undef S
 
+// The piece counts of a material configuration are read from its key.
+#define count(c,p) ((int)piece_count_key(key, c, p))
+#define npm(c) (  KnightValueMg * count(c, KNIGHT) \
+                + BishopValueMg * count(c, BISHOP) \
+                + RookValueMg * count(c, ROOK) + QueenValueMg * count(c, QUEEN))
+
 // Helper used to detect a given material distribution.
-INLINE bool is_KXK(const Position *pos, int us)
+INLINE bool is_KXK(Key key, int us)
 {
-  return  !more_than_one(pieces_c(!us))
-        && non_pawn_material_c(us) >= RookValueMg;
+  return   !count(!us, PAWN) && !npm(!us)
+        &&  npm(us) >= RookValueMg;
 }
 
-INLINE bool is_KBPsK(const Position *pos, int us)
+INLINE bool is_KBPsK(Key key, int us)
 {
-  return   non_pawn_material_c(us) == BishopValueMg
-        && pieces_cp(us, PAWN);
+  return   npm(us) == BishopValueMg
+        && count(us, PAWN);
 }
 
-INLINE bool is_KQKRPs(const Position *pos, int us) {
-  return  !piece_count(us, PAWN)
-        && non_pawn_material_c(us) == QueenValueMg
-        && piece_count(!us, ROOK) == 1
-        && pieces_cp(!us, PAWN);
+INLINE bool is_KQKRPs(Key key, int us) {
+  return  !count(us, PAWN)
+        && npm(us) == QueenValueMg
+        && count(!us, ROOK) == 1
+        && count(!us, PAWN);
 }
 
 // imbalance() calculates the imbalance by comparing the piece count of each
@@ -94,22 +101,21 @@ static Score imbalance(int us, int pieceCount[][8])
   return bonus;
 }
 
-typedef int PieceCountType[2][8];
-
-// material_probe() looks up the current position's material configuration
-// in the material hash table. It returns a pointer to the MaterialEntry
-// if the position is found. Otherwise a new Entry is computed and stored
-// there, so we don't have to recompute all when the same material
+// material_entry_fill() computes the MaterialEntry of the material
+// configuration with the given key. It is called by material_init() for
+// all configurations of the shared table and by material_probe() for the
+// other configurations, which are stored in the material hash table of
+// the thread so we don't have to recompute all when the same material
 // configuration occurs again.
 
-void material_entry_fill(const Position *pos, MaterialEntry *e, Key key)
+void material_entry_fill(MaterialEntry *e, Key key)
 {
   memset(e, 0, sizeof(MaterialEntry));
   e->key = key;
   e->factor[WHITE] = e->factor[BLACK] = (uint8_t)SCALE_FACTOR_NORMAL;
 
-  Value npm_w = non_pawn_material_c(WHITE);
-  Value npm_b = non_pawn_material_c(BLACK);
+  Value npm_w = npm(WHITE);
+  Value npm_b = npm(BLACK);
   Value npm = clamp(npm_w + npm_b, EndgameLimit, MidgameLimit);
   e->gamePhase = ((npm - EndgameLimit) * PHASE_MIDGAME) / (MidgameLimit - EndgameLimit);
 
@@ -123,7 +129,7 @@ void material_entry_fill(const Position *pos, MaterialEntry *e, Key key)
       }
 
   for (int c = 0; c < 2; c++)
-    if (is_KXK(pos, c)) {
+    if (is_KXK(key, c)) {
       e->eval_func = 10; // EvaluateKXK
       e->eval_func_side = c;
       return;
@@ -141,25 +147,26 @@ void material_entry_fill(const Position *pos, MaterialEntry *e, Key key)
   // generic ones that refer to more than one material distribution. Note
   // that in this case we do not return after setting the function.
   for (int c = 0; c < 2; c++) {
-    if (is_KBPsK(pos, c))
+    if (is_KBPsK(key, c))
       e->scal_func[c] = 17; // ScaleKBPsK
 
-    else if (is_KQKRPs(pos, c))
+    else if (is_KQKRPs(key, c))
       e->scal_func[c] = 18; // ScaleKQKRPs
   }
 
-  if (npm_w + npm_b == 0 && pieces_p(PAWN)) { // Only pawns on the board.
-    if (!pieces_cp(BLACK, PAWN)) {
-      assert(piece_count(WHITE, PAWN) >= 2);
+  int pawns = count(WHITE, PAWN) + count(BLACK, PAWN);
+  if (npm_w + npm_b == 0 && pawns) { // Only pawns on the board.
+    if (!count(BLACK, PAWN)) {
+      assert(count(WHITE, PAWN) >= 2);
 
       e->scal_func[WHITE] = 19; // ScaleKPsK
     }
-    else if (!pieces_cp(WHITE, PAWN)) {
-      assert(piece_count(BLACK, PAWN) >= 2);
+    else if (!count(WHITE, PAWN)) {
+      assert(count(BLACK, PAWN) >= 2);
 
       e->scal_func[BLACK] = 19; // ScaleKPsK
     }
-    else if (popcount(pieces_p(PAWN)) == 2) { // Each side has one pawn.
+    else if (pawns == 2) { // Each side has one pawn.
       // This is a special case because we set scaling functions
       // for both colors instead of only one.
       e->scal_func[WHITE] = 20; // ScaleKPKP
@@ -171,29 +178,113 @@ void material_entry_fill(const Position *pos, MaterialEntry *e, Key key)
   // material advantage. This catches some trivial draws like KK, KBK and
   // KNK and gives a drawish scale factor for cases such as KRKBP and
   // KmmKm (except for KBBKN).
-  if (!piece_count(WHITE, PAWN) && npm_w - npm_b <= BishopValueMg)
+  if (!count(WHITE, PAWN) && npm_w - npm_b <= BishopValueMg)
     e->factor[WHITE] = (uint8_t)(npm_w <  RookValueMg   ? SCALE_FACTOR_DRAW :
                                  npm_b <= BishopValueMg ? 4 : 14);
 
-  if (!piece_count(BLACK, PAWN) && npm_b - npm_w <= BishopValueMg)
+  if (!count(BLACK, PAWN) && npm_b - npm_w <= BishopValueMg)
     e->factor[BLACK] = (uint8_t)(npm_b <  RookValueMg   ? SCALE_FACTOR_DRAW :
                                  npm_w <= BishopValueMg ? 4 : 14);
 
   // Evaluate the material imbalance. We use PIECE_TYPE_NONE as a place
   // holder for the bishop pair "extended piece", which allows us to be
   // more flexible in defining bishop pair bonuses.
-#define pc(c,p) piece_count_mk(c,p)
   int PieceCount[2][8] = {
-    { pc(0, BISHOP) > 1, pc(0, PAWN), pc(0, KNIGHT),
-      pc(0, BISHOP)    , pc(0, ROOK), pc(0, QUEEN) },
-    { pc(1, BISHOP) > 1, pc(1, PAWN), pc(1, KNIGHT),
-      pc(1, BISHOP)    , pc(1, ROOK), pc(1, QUEEN) }
+    { count(0, BISHOP) > 1, count(0, PAWN), count(0, KNIGHT),
+      count(0, BISHOP)    , count(0, ROOK), count(0, QUEEN) },
+    { count(1, BISHOP) > 1, count(1, PAWN), count(1, KNIGHT),
+      count(1, BISHOP)    , count(1, ROOK), count(1, QUEEN) }
   };
-#undef pc
   Score tmp = imbalance(WHITE, PieceCount) - imbalance(BLACK, PieceCount);
   e->score = make_score(mg_value(tmp) / 16, eg_value(tmp) / 16);
 }
 
+#undef npm
+#undef count
+
+// SharedMaterial is the table of the material configurations without
+// promoted pieces, indexed by material_index(). It is computed once at
+// startup and is only read afterwards. Each NUMA node other than node 0
+// uses a copy of its own. Low memory builds do without it.
+
+MaterialEntry *SharedMaterial;
+static MaterialEntry *materialCopies[MaterialCopies];
+static alloc_t materialAllocs[MaterialCopies];
+
+void material_init(void)
+{
+#ifndef LOW_MEMORY
+  SharedMaterial = allocate_memory(MaterialNB * sizeof(MaterialEntry), false,
+                                   &materialAllocs[0]);
+  materialCopies[0] = SharedMaterial;
+
+  // Enumerate the counts in the order of material_index()
+  for (unsigned i = 0; i < MaterialNB; i++) {
+    Key key = matKey[W_KING] + matKey[B_KING];
+    for (int c = 0; c < 2; c++) {
+      unsigned side = c == WHITE ? i / MaterialSide : i % MaterialSide;
+      key += (side % 2) * matKey[make_piece(c, QUEEN)];
+      key += (side / 2 % 3) * matKey[make_piece(c, ROOK)];
+      key += (side / 6 % 3) * matKey[make_piece(c, BISHOP)];
+      key += (side / 18 % 3) * matKey[make_piece(c, KNIGHT)];
+      key += (side / 54) * matKey[make_piece(c, PAWN)];
+    }
+    assert(material_index(key) == i);
+    material_entry_fill(&SharedMaterial[i], key);
+  }
+#endif
+}
+
+// material_table() returns the shared material table to be used by the
+// threads of the given NUMA node.
+
+const MaterialEntry *material_table(int node)
+{
+#ifdef LOW_MEMORY
+  (void)node;
+  return NULL;
+#else
+  if (node <= 0 || node >= MaterialCopies)
+    return SharedMaterial;
+
+  if (!materialCopies[node]) {
+    MaterialEntry *t = allocate_memory(MaterialNB * sizeof(MaterialEntry),
+                                       false, &materialAllocs[node]);
+    if (!t)
+      return SharedMaterial;
+#ifdef NUMA
+    numa_bind_memory(t, MaterialNB * sizeof(MaterialEntry), node);
+#endif
+    memcpy(t, SharedMaterial, MaterialNB * sizeof(MaterialEntry));
+    materialCopies[node] = t;
+  }
+
+  return materialCopies[node];
+#endif
+}
+
+void material_free(void)
+{
+  for (int i = 0; i < MaterialCopies; i++)
+    if (materialCopies[i]) {
+      free_memory(&materialAllocs[i]);
+      materialCopies[i] = NULL;
+    }
+  SharedMaterial = NULL;
+}
+
+// material_report_memory() reports the shared material table and its
+// copies for the "memory" command. The table itself is not bound to a
+// node.
+
+void material_report_memory(void)
+{
+  for (int i = 0; i < MaterialCopies; i++)
+    if (materialCopies[i])
+      memory_add("material table", i ? i : -1,
+                 MaterialNB * sizeof(MaterialEntry), materialAllocs[i].lp);
+}
+
 #else
 
 typedef int make_iso_compilers_happy;
@@ -49,17 +49,89 @@ struct MaterialEntry {
 
 typedef struct MaterialEntry MaterialEntry;
 
-typedef MaterialEntry MaterialTable[8192];
+// The material key holds the piece counts in 4-bit fields, see matKey[].
+// The shared material table has an entry for every configuration of at
+// most 8 pawns, 2 knights, 2 bishops, 2 rooks and 1 queen per side, which
+// is every configuration without promoted pieces. material_index() returns
+// the index of a configuration in that table, or MaterialNone if it has
+// more pieces of some type.
+
+#define piece_count_key(key, c, p) (((key) >> (20 * (c) + 4 * (p) + 4)) & 15)
+
+enum {
+  MaterialSide = 9 * 3 * 3 * 3 * 2, MaterialNB = MaterialSide * MaterialSide,
+  MaterialNone = MaterialNB, MaterialCopies = 64
+};
 
-void material_entry_fill(const Position *pos, MaterialEntry *e, Key key);
+#ifdef LOW_MEMORY
+// Low memory builds have no shared material table. All configurations are
+// computed when needed and kept in the material hash table of the thread.
+INLINE unsigned material_index(Key key)
+{
+  (void)key;
+  return MaterialNone;
+}
+#else
+INLINE unsigned material_index(Key key)
+{
+  // Adding 5 to a count of knights, bishops or rooks or 6 to a count of
+  // queens sets bit 3 of its field if the count is too large.
+  const uint64_t add = 0x65550ULL | (0x65550ULL << 20);
+  const uint64_t mask = 0x88880ULL | (0x88880ULL << 20);
+  if (((key >> 8) + add) & mask)
+    return MaterialNone;
+
+  unsigned idx = 0, pieces = 2;
+  for (int c = 0; c < 2; c++) {
+    unsigned pawns = piece_count_key(key, c, PAWN);
+    if (pawns > 8)
+      return MaterialNone;
+    idx =  idx * MaterialSide
+         + pawns * 54
+         + piece_count_key(key, c, KNIGHT) * 18
+         + piece_count_key(key, c, BISHOP) * 6
+         + piece_count_key(key, c, ROOK) * 2
+         + piece_count_key(key, c, QUEEN);
+    pieces +=  pawns + piece_count_key(key, c, KNIGHT)
+             + piece_count_key(key, c, BISHOP) + piece_count_key(key, c, ROOK)
+             + piece_count_key(key, c, QUEEN);
+  }
+
+  // The low byte of the key counts all pieces. It differs from the sum of
+  // the fields if a field overflowed into the next, e.g. with 16 pawns.
+  if ((key & 0xff) != pieces)
+    return MaterialNone;
+
+  return idx;
+}
+#endif
+
+void material_init(void);
+void material_free(void);
+void material_report_memory(void);
+const MaterialEntry *material_table(int node);
+void material_entry_fill(MaterialEntry *e, Key key);
+
+// material_probe() looks up the current position's material configuration
+// in the shared material table or, if it has promoted pieces, in the
+// material hash table of the thread, where a missing entry is computed.
 
 INLINE MaterialEntry *material_probe(const Position *pos)
 {
   Key key = material_key();
-  MaterialEntry *e = &pos->materialTable[key >> (64-13)];
+  unsigned idx = material_index(key);
+
+  stat_inc(STAT_MATERIAL_PROBES);
+  if (likely(idx != MaterialNone)) {
+    stat_inc(STAT_MATERIAL_HITS);
+    return (MaterialEntry *)&pos->materialShared[idx];
+  }
 
+  MaterialEntry *e = &pos->materialTable[key >> pos->materialShift];
   if (unlikely(e->key != key))
-    material_entry_fill(pos, e, key);
+    material_entry_fill(e, key);
+  else
+    stat_inc(STAT_MATERIAL_HITS);
 
   return e;
 }
@@ -27,6 +27,7 @@
 #include <windows.h>
 #else
 #include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 #include "misc.h"
@@ -96,6 +97,145 @@ void print_engine_info(bool to_uci)
   fflush(stdout);
 }
 
+// startup_time() records the time spent in the named startup phase since
+// the previous call. The first call, with a NULL phase, starts the clock.
+// print_startup_times() prints the recorded times for the "startup" command.
+
+static struct {
+  const char *phase;
+  uint64_t usec;
+} startupTimes[16];
+static int numStartupTimes;
+static uint64_t startupLast;
+
+void startup_time(const char *phase)
+{
+  uint64_t t = now_usec();
+  if (phase && numStartupTimes < 16) {
+    startupTimes[numStartupTimes].phase = phase;
+    startupTimes[numStartupTimes++].usec = t - startupLast;
+  }
+  startupLast = t;
+}
+
+void print_startup_times(void)
+{
+  uint64_t total = 0;
+  for (int i = 0; i < numStartupTimes; i++) {
+    printf("info string startup %s %"PRIu64" us\n", startupTimes[i].phase,
+        startupTimes[i].usec);
+    total += startupTimes[i].usec;
+  }
+  printf("info string startup total %"PRIu64" us\n", total);
+  fflush(stdout);
+}
+
+// memory_add() records memory used for the given purpose on the given NUMA
+// node, or on no particular node if node is -1, for the "memory" command.
+// Memory of the same purpose, node and page size is added up.
+// print_memory_usage() prints and then forgets the recorded memory use,
+// followed by the totals per node and the resident set size of the
+// process where available.
+
+enum { MaxMemoryUsage = 128 };
+
+static struct {
+  const char *name;
+  int node;
+  bool lp;
+  size_t size;
+} memoryUsage[MaxMemoryUsage];
+static int numMemoryUsage;
+
+void memory_add(const char *name, int node, size_t size, bool lp)
+{
+  if (!size)
+    return;
+
+  int i = 0;
+  while (   i < numMemoryUsage
+         && (   strcmp(memoryUsage[i].name, name) != 0
+             || memoryUsage[i].node != node || memoryUsage[i].lp != lp))
+    i++;
+  if (i == MaxMemoryUsage)
+    return;
+  if (i == numMemoryUsage) {
+    memoryUsage[numMemoryUsage].name = name;
+    memoryUsage[numMemoryUsage].node = node;
+    memoryUsage[numMemoryUsage].lp = lp;
+    memoryUsage[numMemoryUsage++].size = 0;
+  }
+  memoryUsage[i].size += size;
+}
+
+static void print_node(int node)
+{
+  if (node < 0)
+    printf("any  ");
+  else
+    printf("%-4d ", node);
+}
+
+void print_memory_usage(void)
+{
+  size_t total = 0, totalLp = 0;
+  for (int i = 0; i < numMemoryUsage; i++) {
+    printf("info string memory %-20s node ", memoryUsage[i].name);
+    print_node(memoryUsage[i].node);
+    printf("%10zu kB%s\n", (memoryUsage[i].size + 1023) >> 10,
+           memoryUsage[i].lp ? " large pages" : "");
+    total += memoryUsage[i].size;
+    if (memoryUsage[i].lp)
+      totalLp += memoryUsage[i].size;
+  }
+
+  // Totals per node, as far as memory is bound to nodes
+  for (int i = 0; i < numMemoryUsage; i++) {
+    int node = memoryUsage[i].node;
+    bool first = node >= 0;
+    for (int j = 0; j < i; j++)
+      first = first && memoryUsage[j].node != node;
+    if (!first)
+      continue;
+    size_t size = 0;
+    for (int j = i; j < numMemoryUsage; j++)
+      if (memoryUsage[j].node == node)
+        size += memoryUsage[j].size;
+    printf("info string memory %-20s node ", "total");
+    print_node(node);
+    printf("%10zu kB\n", (size + 1023) >> 10);
+  }
+
+  printf("info string memory total %zu kB, %zu kB with large pages\n",
+         (total + 1023) >> 10, (totalLp + 1023) >> 10);
+
+#ifdef __linux__
+  // Compare with what the kernel reports, which also includes the static
+  // tables, the code and file mappings as far as they are resident.
+  static const char *Files[] = {
+    "/proc/self/status", "/proc/self/smaps_rollup"
+  };
+  static const char *Fields[] = {
+    "VmRSS", "VmHWM", "RssAnon", "RssFile", "AnonHugePages"
+  };
+  for (int f = 0; f < 2; f++) {
+    FILE *F = fopen(Files[f], "r");
+    char line[128], name[32];
+    size_t kb;
+    while (F && fgets(line, sizeof(line), F))
+      if (sscanf(line, "%31[^:]: %zu", name, &kb) == 2)
+        for (int i = 0; i < 5; i++)
+          if (strcmp(name, Fields[i]) == 0)
+            printf("info string memory %-20s %15zu kB\n", name, kb);
+    if (F)
+      fclose(F);
+  }
+#endif
+
+  numMemoryUsage = 0;
+  fflush(stdout);
+}
+
 // print compiler_info() prints a string trying to describe the compiler
 
 void print_compiler_info(void)
@@ -252,6 +392,22 @@ ssize_t getline(char **lineptr, size_t *n, FILE *stream)
   return i;
 }
 
+// cpu_count() returns the number of logical processors that are online.
+
+int cpu_count(void)
+{
+#ifndef _WIN32
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+
+#else
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+
+#endif
+}
+
 #ifdef _WIN32
 typedef SIZE_T (WINAPI *GLPM)(void);
 size_t largePageMinimum;
@@ -374,6 +530,97 @@ const void *map_file(FD fd, map_t *map)
 #endif
 }
 
+// map_file_private() maps a file as private, writable memory. Pages are
+// read in from the page cache on first access and writes are never
+// propagated back to the file. The mapping is released with free_memory().
+
+void *map_file_private(FD fd, alloc_t *alloc)
+{
+  size_t size = file_size(fd);
+
+#ifndef _WIN32
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+#ifdef MADV_WILLNEED
+  // Start reading the file in the background.
+  madvise(data, size, MADV_WILLNEED);
+#endif
+  alloc->ptr = data;
+  alloc->size = size;
+  alloc->lp = false;
+  return data;
+
+#else
+  // Windows has no copy-on-write view that can be released with
+  // VirtualFree(), so read the file into anonymous memory instead.
+  uint8_t *data = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE,
+      PAGE_READWRITE);
+  if (!data)
+    return NULL;
+  for (size_t done = 0; done < size; ) {
+    DWORD chunk = min(size - done, (size_t)1 << 30), read;
+    if (!ReadFile(fd, data + done, chunk, &read, NULL) || read == 0) {
+      VirtualFree(data, 0, MEM_RELEASE);
+      return NULL;
+    }
+    done += read;
+  }
+  alloc->ptr = data;
+  alloc->lp = false;
+  return data;
+
+#endif
+}
+
+// map_file_shared() maps a file as shared, writable memory, so that writes
+// go to the file and are seen by all processes that map it. A file that
+// does not exist or is empty is created with the given size. Otherwise
+// size is set to the size of the file. The mapping is released with
+// unmap_file().
+
+void *map_file_shared(const char *name, size_t *size, map_t *map)
+{
+#ifndef _WIN32
+  int fd = open(name, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return NULL;
+  if (file_size(fd) == 0 && ftruncate(fd, *size) != 0) {
+    close(fd);
+    return NULL;
+  }
+  *size = *map = file_size(fd);
+  void *data = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return data == MAP_FAILED ? NULL : data;
+
+#else
+  HANDLE fd = CreateFile(name, GENERIC_READ | GENERIC_WRITE,
+      FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS,
+      FILE_FLAG_RANDOM_ACCESS, NULL);
+  if (fd == INVALID_HANDLE_VALUE)
+    return NULL;
+  if (file_size(fd) == 0) {
+    LARGE_INTEGER li;
+    li.QuadPart = *size;
+    if (!SetFilePointerEx(fd, li, NULL, FILE_BEGIN) || !SetEndOfFile(fd)) {
+      CloseHandle(fd);
+      return NULL;
+    }
+  }
+  *size = file_size(fd);
+  *map = CreateFileMapping(fd, NULL, PAGE_READWRITE, 0, 0, NULL);
+  CloseHandle(fd);
+  if (*map == NULL)
+    return NULL;
+  void *data = MapViewOfFile(*map, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+  if (!data)
+    CloseHandle(*map);
+  return data;
+
+#endif
+}
+
 void unmap_file(const void *data, map_t map)
 {
   if (!data) return;
@@ -401,6 +648,7 @@ void *allocate_memory(size_t size, bool lp, alloc_t *alloc)
   } else
     ptr = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
   alloc->ptr = ptr;
+  alloc->lp = lp;
   return ptr;
 
 #else /* Unix */
@@ -426,8 +674,12 @@ void *allocate_memory(size_t size, bool lp, alloc_t *alloc)
 
 #endif
 
+  if (ptr == MAP_FAILED)
+    return NULL;
+
   alloc->ptr = ptr;
   alloc->size = allocSize;
+  alloc->lp = lp;
   return (void *)(((uintptr_t)ptr + alignment - 1) & ~(alignment - 1));
 
 #endif
@@ -28,12 +28,18 @@
 #endif
 #include <stdatomic.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "types.h"
 
 void print_engine_info(bool to_uci);
 void print_compiler_info(void);
+void startup_time(const char *phase);
+void print_startup_times(void);
+void memory_add(const char *name, int node, size_t size, bool lp);
+void print_memory_usage(void);
+int cpu_count(void);
 
 // prefetch() preloads the given address in L1/L2 cache. This is
 // a non-blocking function that doesn't stall the CPU waiting for data
@@ -68,9 +74,27 @@ INLINE void prefetch2(void *addr)
 typedef int64_t TimePoint; // A value in milliseconds
 
 INLINE TimePoint now(void) {
+#ifndef _WIN32
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1000 * (uint64_t)ts.tv_sec + (uint64_t)ts.tv_nsec / 1000000;
+#else
   struct timeval tv;
   gettimeofday(&tv, NULL);
   return 1000 * (uint64_t)tv.tv_sec + (uint64_t)tv.tv_usec / 1000;
+#endif
+}
+
+INLINE uint64_t now_usec(void) {
+#ifndef _WIN32
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1000000 * (uint64_t)ts.tv_sec + (uint64_t)ts.tv_nsec / 1000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return 1000000 * (uint64_t)tv.tv_sec + (uint64_t)tv.tv_usec;
+#endif
 }
 
 #ifdef _WIN32
@@ -82,6 +106,7 @@ typedef HANDLE FD;
 typedef HANDLE map_t;
 typedef struct {
   void *ptr;
+  bool lp;
 } alloc_t;
 
 void flockfile(FILE *F);
@@ -95,6 +120,7 @@ typedef size_t map_t;
 typedef struct {
   void *ptr;
   size_t size;
+  bool lp; // Allocated with large pages (only advised on Linux)
 } alloc_t;
 
 #endif
@@ -105,6 +131,8 @@ FD open_file(const char *name);
 void close_file(FD fd);
 size_t file_size(FD fd);
 const void *map_file(FD fd, map_t *map);
+void *map_file_private(FD fd, alloc_t *alloc);
+void *map_file_shared(const char *name, size_t *size, map_t *map);
 void unmap_file(const void *data, map_t map);
 void *allocate_memory(size_t size, bool lp, alloc_t *alloc);
 void free_memory(alloc_t *alloc);
@@ -81,7 +81,7 @@ INLINE ExtMove *generate_pawn_moves(const Position *pos, ExtMove *list,
     }
 
     if (Type == QUIET_CHECKS) {
-      Stack *st = pos->st;
+      Stack *st = check_info(pos);
       b1 &= attacks_from_pawn(st->ksq, Them);
       b2 &= attacks_from_pawn(st->ksq, Them);
 
@@ -123,13 +123,13 @@ INLINE ExtMove *generate_pawn_moves(const Position *pos, ExtMove *list,
     Bitboard b3 = shift_bb(Up   , pawnsOn7) & emptySquares;
 
     while (b1)
-      list = make_promotions(list, pop_lsb(&b1), pos->st->ksq, Type, Right);
+      list = make_promotions(list, pop_lsb(&b1), square_of(Them, KING), Type, Right);
 
     while (b2)
-      list = make_promotions(list, pop_lsb(&b2), pos->st->ksq, Type, Left);
+      list = make_promotions(list, pop_lsb(&b2), square_of(Them, KING), Type, Left);
 
     while (b3)
-      list = make_promotions(list, pop_lsb(&b3), pos->st->ksq, Type, Up);
+      list = make_promotions(list, pop_lsb(&b3), square_of(Them, KING), Type, Up);
   }
 
   // Standard and en-passant captures
@@ -176,23 +176,45 @@ INLINE ExtMove *generate_moves(const Position *pos, ExtMove *list,
 
   Square from;
 
-  loop_through_pieces(Us, Pt, from) {
-    if (Checks) {
-      if (    (Pt == BISHOP || Pt == ROOK || Pt == QUEEN)
-          && !(PseudoAttacks[Pt][from] & target & pos->st->checkSquares[Pt]))
+  if (Pt == KNIGHT) {
+    loop_through_pieces(Us, Pt, from) {
+      if (Checks && (blockers_for_king(pos, !Us) & sq_bb(from)))
         continue;
 
-      if (blockers_for_king(pos, !Us) & sq_bb(from))
-        continue;
+      Bitboard b = attacks_from_knight(from) & target;
+
+      if (Checks)
+        b &= pos->st->checkSquares[Pt];
+
+      while (b)
+        (list++)->move = make_move(from, pop_lsb(&b));
     }
+    return list;
+  }
 
-    Bitboard b = attacks_from(Pt, from) & target;
+  // Compute the attacks of all our sliders of this type in one batch
+  Bitboard pcs = pieces_cp(Us, Pt);
+  if (Checks) {
+    pcs &= ~blockers_for_king(pos, !Us);
+    for (Bitboard b = pcs; b; ) {
+      from = pop_lsb(&b);
+      if (!(PseudoAttacks[Pt][from] & target & pos->st->checkSquares[Pt]))
+        pcs ^= sq_bb(from);
+    }
+  }
+
+  Square sq[16];
+  Bitboard att[16];
+  int n = slider_attacks_bb(Pt, pcs, pieces(), sq, att);
+
+  for (int i = 0; i < n; i++) {
+    Bitboard b = att[i] & target;
 
     if (Checks)
       b &= pos->st->checkSquares[Pt];
 
     while (b)
-      (list++)->move = make_move(from, pop_lsb(&b));
+      (list++)->move = make_move(sq[i], pop_lsb(&b));
   }
 
   return list;
@@ -78,26 +78,26 @@ SMALL
 static void score_quiets(const Position *pos)
 {
   Stack *st = pos->st;
-  ButterflyHistory *history = pos->mainHistory;
-  LowPlyHistory *lph = pos->lowPlyHistory;
+  const int16_t *history = (*pos->mainHistory)[stm()];
 
-  PieceToHistory *cmh = (st-1)->history;
-  PieceToHistory *fmh = (st-2)->history;
-  PieceToHistory *fmh2 = (st-4)->history;
-  PieceToHistory *fmh3 = (st-6)->history;
+  const int16_t *cmh = &(*(st-1)->history)[0][0];
+  const int16_t *fmh = &(*(st-2)->history)[0][0];
+  const int16_t *fmh2 = &(*(st-4)->history)[0][0];
+  const int16_t *fmh3 = &(*(st-6)->history)[0][0];
 
-  Color c = stm();
+  // The low-ply history only counts near the root. Elsewhere the main
+  // history is used in its place with a zero weight.
+  int lphWeight = st->mp_ply < MAX_LPH ? min(4, st->depth / 3) : 0;
+  const int16_t *lph = st->mp_ply < MAX_LPH ? (*pos->lowPlyHistory)[st->mp_ply]
+                                            : history;
 
   for (ExtMove *m = st->cur; m < st->endMoves; m++) {
     uint32_t move = m->move & 4095;
-    Square to = move & 63;
-    Square from = move >> 6;
-    m->value =      (*history)[c][move]
-              + 2 * (*cmh)[piece_on(from)][to]
-              + 2 * (*fmh)[piece_on(from)][to]
-              + 2 * (*fmh2)[piece_on(from)][to]
-              +     (*fmh3)[piece_on(from)][to]
-              + (st->mp_ply < MAX_LPH ? min(4, st->depth / 3) * (*lph)[st->mp_ply][move] : 0);
+    uint32_t pcTo = (hist_piece(piece_on(move >> 6)) << 6) | (move & 63);
+    m->value =      history[move]
+              + 2 * (cmh[pcTo] + fmh[pcTo] + fmh2[pcTo])
+              +     fmh3[pcTo]
+              + lphWeight * lph[move];
   }
 }
 
@@ -117,7 +117,7 @@ static void score_evasions(const Position *pos)
                 - type_of_p(moved_piece(m->move));
     else
       m->value =  (*history)[c][from_to(m->move)]
-                + (*cmh)[moved_piece(m->move)][to_sq(m->move)]
+                + (*cmh)[hist_piece(moved_piece(m->move))][to_sq(m->move)]
                 - (1 << 28);
 }
 
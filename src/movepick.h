@@ -34,7 +34,8 @@ static const int CounterMovePruneThreshold = 0;
 
 INLINE void cms_update(PieceToHistory cms, Piece pc, Square to, int v)
 {
-  cms[pc][to] += v - cms[pc][to] * abs(v) / 29952;
+  int h = hist_piece(pc);
+  cms[h][to] += v - cms[h][to] * abs(v) / 29952;
 }
 
 INLINE void history_update(ButterflyHistory history, Color c, Move m, int v)
@@ -20,6 +20,17 @@ static alignas(64) int32_t hidden1_biases[32];
 static alignas(64) int32_t hidden2_biases[32];
 static int32_t output_biases[1];
 
+#ifndef NNUE_PURE
+// The small net has 128 x 2 inputs.
+static alignas(64) weight_t small_hidden1_weights[32 * 256];
+static alignas(64) weight_t small_hidden2_weights[32 * 32];
+static alignas(64) weight_t small_output_weights [1 * 32];
+
+static alignas(64) int32_t small_hidden1_biases[32];
+static alignas(64) int32_t small_hidden2_biases[32];
+static int32_t small_output_biases[1];
+#endif
+
 INLINE void affine_propagate(clipped_t *input, int32_t *output,
     unsigned inDims, unsigned outDims, int32_t *biases, weight_t *weights)
 {
@@ -170,10 +181,10 @@ INLINE void affine_propagate(clipped_t *input, int32_t *output,
       s0 = s1 = s2 = s3 = _mm256_setzero_si256();
 #if defined(USE_VNNI)
       for (unsigned j = 0; j < inDims / 32; j++) {
-        s0 = _mm256_dpbusd_epi32(s0, inVec[j], w[0 * inDims / 32 + j]);
-        s1 = _mm256_dpbusd_epi32(s1, inVec[j], w[1 * inDims / 32 + j]);
-        s2 = _mm256_dpbusd_epi32(s2, inVec[j], w[2 * inDims / 32 + j]);
-        s3 = _mm256_dpbusd_epi32(s3, inVec[j], w[3 * inDims / 32 + j]);
+        s0 = mm256_dpbusd_epi32(s0, inVec[j], w[0 * inDims / 32 + j]);
+        s1 = mm256_dpbusd_epi32(s1, inVec[j], w[1 * inDims / 32 + j]);
+        s2 = mm256_dpbusd_epi32(s2, inVec[j], w[2 * inDims / 32 + j]);
+        s3 = mm256_dpbusd_epi32(s3, inVec[j], w[3 * inDims / 32 + j]);
       }
 #else
       const __m256i kOnes = _mm256_set1_epi16(1);
@@ -211,14 +222,14 @@ INLINE void affine_propagate(clipped_t *input, int32_t *output,
     __m256i s0, s1, s2, s3;
     for (unsigned i = 0; i < outDims / 8; i++) {
       __m256i *w = (__m256i *)&weights[8 * i * 32];
-      s0 = _mm256_dpbusd_epi32(kZero, in0, w[0]);
-      s0 = _mm256_dpbusd_epi32(s0, in1, w[1]);
-      s1 = _mm256_dpbusd_epi32(kZero, in0, w[2]);
-      s1 = _mm256_dpbusd_epi32(s1, in1, w[3]);
-      s2 = _mm256_dpbusd_epi32(kZero, in0, w[4]);
-      s2 = _mm256_dpbusd_epi32(s2, in1, w[5]);
-      s3 = _mm256_dpbusd_epi32(kZero, in0, w[6]);
-      s3 = _mm256_dpbusd_epi32(s3, in1, w[7]);
+      s0 = mm256_dpbusd_epi32(kZero, in0, w[0]);
+      s0 = mm256_dpbusd_epi32(s0, in1, w[1]);
+      s1 = mm256_dpbusd_epi32(kZero, in0, w[2]);
+      s1 = mm256_dpbusd_epi32(s1, in1, w[3]);
+      s2 = mm256_dpbusd_epi32(kZero, in0, w[4]);
+      s2 = mm256_dpbusd_epi32(s2, in1, w[5]);
+      s3 = mm256_dpbusd_epi32(kZero, in0, w[6]);
+      s3 = mm256_dpbusd_epi32(s3, in1, w[7]);
       s0 = _mm256_hadd_epi32(s0, s1);
       s2 = _mm256_hadd_epi32(s2, s3);
       s0 = _mm256_hadd_epi32(s0, s2);
@@ -273,14 +284,14 @@ INLINE void affine_propagate(clipped_t *input, int32_t *output,
       __m256i sum7 = _mm256_setzero_si256();
 #if defined(USE_VNNI)
       for (unsigned j = 0; j < inDims / 32; j++) {
-        sum0 = _mm256_dpbusd_epi32(sum0, inVec[j], w[0 * inDims / 32 + j]);
-        sum1 = _mm256_dpbusd_epi32(sum1, inVec[j], w[1 * inDims / 32 + j]);
-        sum2 = _mm256_dpbusd_epi32(sum2, inVec[j], w[2 * inDims / 32 + j]);
-        sum3 = _mm256_dpbusd_epi32(sum3, inVec[j], w[3 * inDims / 32 + j]);
-        sum4 = _mm256_dpbusd_epi32(sum4, inVec[j], w[4 * inDims / 32 + j]);
-        sum5 = _mm256_dpbusd_epi32(sum5, inVec[j], w[5 * inDims / 32 + j]);
-        sum6 = _mm256_dpbusd_epi32(sum6, inVec[j], w[6 * inDims / 32 + j]);
-        sum7 = _mm256_dpbusd_epi32(sum7, inVec[j], w[7 * inDims / 32 + j]);
+        sum0 = mm256_dpbusd_epi32(sum0, inVec[j], w[0 * inDims / 32 + j]);
+        sum1 = mm256_dpbusd_epi32(sum1, inVec[j], w[1 * inDims / 32 + j]);
+        sum2 = mm256_dpbusd_epi32(sum2, inVec[j], w[2 * inDims / 32 + j]);
+        sum3 = mm256_dpbusd_epi32(sum3, inVec[j], w[3 * inDims / 32 + j]);
+        sum4 = mm256_dpbusd_epi32(sum4, inVec[j], w[4 * inDims / 32 + j]);
+        sum5 = mm256_dpbusd_epi32(sum5, inVec[j], w[5 * inDims / 32 + j]);
+        sum6 = mm256_dpbusd_epi32(sum6, inVec[j], w[6 * inDims / 32 + j]);
+        sum7 = mm256_dpbusd_epi32(sum7, inVec[j], w[7 * inDims / 32 + j]);
       }
 #else
       const __m256i kOnes = _mm256_set1_epi16(1);
@@ -394,6 +405,23 @@ INLINE void affine_propagate(clipped_t *input, int32_t *output,
 #elif defined(USE_NEON)
   int32x4_t *outVec = (int32x4_t *)output;
   int32x4_t *biasVec = (int32x4_t *)biases;
+#if defined(USE_NEON_DOTPROD)
+  int8x16_t *inVec = (int8x16_t *)input;
+  for (unsigned i = 0; i < outDims / 4; i++) {
+    int8x16_t *w = (int8x16_t *)&weights[4 * i * inDims];
+    int32x4_t s0 = { 0 }, s1 = { 0 }, s2 = { 0 }, s3 = { 0 };
+    for (unsigned j = 0; j < inDims / 16; j++) {
+      s0 = vdotq_s32(s0, inVec[j], w[0 * inDims / 16 + j]);
+      s1 = vdotq_s32(s1, inVec[j], w[1 * inDims / 16 + j]);
+      s2 = vdotq_s32(s2, inVec[j], w[2 * inDims / 16 + j]);
+      s3 = vdotq_s32(s3, inVec[j], w[3 * inDims / 16 + j]);
+    }
+    s0 = vpaddq_s32(s0, s1);
+    s2 = vpaddq_s32(s2, s3);
+    s0 = vpaddq_s32(s0, s2);
+    outVec[i] = vaddq_s32(s0, biasVec[i]);
+  }
+#else
   int8x8_t *inVec = (int8x8_t *)input;
   int16x8_t p;
   for (unsigned i = 0; i < outDims / 4; i++) {
@@ -418,6 +446,7 @@ INLINE void affine_propagate(clipped_t *input, int32_t *output,
     s0 = vpaddq_s32(s0, s2);
     outVec[i] = vaddq_s32(s0, biasVec[i]);
   }
+#endif
 
 #else
   for (unsigned i = 0; i < outDims; i++) {
@@ -541,8 +570,9 @@ struct NetData {
 };
 
 // Evaluation function
-Value nnue_evaluate(const Position *pos)
+INLINE Value evaluate_net(const Position *pos, const bool small)
 {
+  const unsigned inDims = 2 * FT_DIMS(small);
   int32_t out_value;
 #ifdef ALIGNMENT_HACK // work around a bug in old gcc on Windows
   uint8_t buf[sizeof(struct NetData) + 63];
@@ -553,17 +583,18 @@ Value nnue_evaluate(const Position *pos)
 #define B(x) (buf.x)
 #endif
 
-  transform(pos, B(input), NULL);
+  transform(pos, B(input), NULL, small);
 
-  affine_propagate(B(input), B(hidden1_values), 512, 32,
-      hidden1_biases, hidden1_weights);
+  affine_propagate(B(input), B(hidden1_values), inDims, 32,
+      NET(small, hidden1_biases), NET(small, hidden1_weights));
   clip_propagate(B(hidden1_values), B(hidden1_clipped), 32);
 
   affine_propagate(B(hidden1_clipped), B(hidden2_values), 32, 32,
-      hidden2_biases, hidden2_weights);
+      NET(small, hidden2_biases), NET(small, hidden2_weights));
   clip_propagate(B(hidden2_values), B(hidden2_clipped), 32);
 
-  out_value = output_layer(B(hidden2_clipped), output_biases, output_weights);
+  out_value = output_layer(B(hidden2_clipped), NET(small, output_biases),
+      NET(small, output_weights));
 
 #if defined(USE_MMX)
   _mm_empty();
@@ -572,6 +603,55 @@ Value nnue_evaluate(const Position *pos)
   return out_value / FV_SCALE;
 }
 
+Value nnue_evaluate(const Position *pos)
+{
+  return evaluate_net(pos, false);
+}
+
+#ifndef NNUE_PURE
+Value nnue_evaluate_small(const Position *pos)
+{
+  return evaluate_net(pos, true);
+}
+#endif
+
+// nnue_evaluate_batch() evaluates n positions. Each layer is applied to a
+// batch of positions before moving on to the next layer, so that the
+// weights of a layer stay in cache while they are being used. It uses a
+// static buffer and may only be called by one thread at a time.
+
+void nnue_evaluate_batch(const Position **pos, Value *values, unsigned n)
+{
+  static struct NetData batch[NnueBatchSize];
+
+  for (unsigned k = 0; k < n; k += NnueBatchSize) {
+    unsigned m = min(n - k, NnueBatchSize);
+
+    for (unsigned i = 0; i < m; i++)
+      transform(pos[k + i], batch[i].input, NULL, false);
+
+    for (unsigned i = 0; i < m; i++) {
+      affine_propagate(batch[i].input, batch[i].hidden1_values, 512, 32,
+          hidden1_biases, hidden1_weights);
+      clip_propagate(batch[i].hidden1_values, batch[i].hidden1_clipped, 32);
+    }
+
+    for (unsigned i = 0; i < m; i++) {
+      affine_propagate(batch[i].hidden1_clipped, batch[i].hidden2_values,
+          32, 32, hidden2_biases, hidden2_weights);
+      clip_propagate(batch[i].hidden2_values, batch[i].hidden2_clipped, 32);
+    }
+
+    for (unsigned i = 0; i < m; i++)
+      values[k + i] = output_layer(batch[i].hidden2_clipped, output_biases,
+          output_weights) / FV_SCALE;
+  }
+
+#if defined(USE_MMX)
+  _mm_empty();
+#endif
+}
+
 static void read_output_weights(weight_t *w, const char *d)
 {
   for (unsigned i = 0; i < 32; i++) {
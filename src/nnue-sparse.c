@@ -7,12 +7,6 @@ INLINE int16x8_t vmovl_high_s16(int8x16_t v)
 }
 #endif
 
-#ifdef IS_64BIT
-typedef uint64_t mask2_t;
-#else
-typedef uint32_t mask2_t;
-#endif
-
 // InputLayer = InputSlice<256 * 2>
 // out: 512 x int8_t
 
@@ -38,44 +32,141 @@ static alignas(64) int32_t hidden1_biases[32];
 static alignas(64) int32_t hidden2_biases[32];
 static int32_t output_biases[1];
 
+#ifndef NNUE_PURE
+// The small net has 128 x 2 inputs.
+#if !defined(USE_AVX512)
+static alignas(64) weight_t small_hidden1_weights[32 * 256];
+static alignas(64) weight_t small_hidden2_weights[32 * 32];
+#else
+static alignas(64) weight_t small_hidden1_weights[64 * 256];
+static alignas(64) weight_t small_hidden2_weights[64 * 32];
+#endif
+static alignas(64) out_t small_output_weights[1 * 32];
+
+static alignas(64) int32_t small_hidden1_biases[32];
+static alignas(64) int32_t small_hidden2_biases[32];
+static int32_t small_output_biases[1];
+#endif
+
 #ifdef VECTOR
-INLINE bool next_idx(unsigned *idx, unsigned *offset, mask2_t *v,
-    mask_t *mask, unsigned dims)
+// NnzTable[b] holds the positions of the set bits of byte b in increasing
+// order and NnzCount[b] their number.
+static alignas(16) uint16_t NnzTable[256][8];
+static uint8_t NnzCount[256];
+
+static void init_nnz_table(void)
 {
-  while (*v == 0) {
-    *offset += 8 * sizeof(mask2_t);
-    if (*offset >= dims) return false;
-    memcpy(v, (char *)mask + (*offset / 8), sizeof(mask2_t));
+  for (unsigned b = 0; b < 256; b++) {
+    unsigned k = 0;
+    for (unsigned j = 0; j < 8; j++)
+      if (b & (1 << j))
+        NnzTable[b][k++] = j;
+    NnzCount[b] = k;
+  }
+}
+
+// find_nnz() compresses the mask of the positive inputs of a layer into
+// the list of their indices, in increasing order, and returns its length.
+// The indices of each byte of the mask are looked up and stored with one
+// vector store, so the list must have room for 8 more entries than the
+// layer has inputs.
+
+INLINE unsigned find_nnz(const mask_t *mask, unsigned dims, uint16_t *nnz)
+{
+  const uint8_t *m = (const uint8_t *)mask;
+  unsigned count = 0;
+
+#if defined(USE_SSE2)
+  const __m128i kEight = _mm_set1_epi16(8);
+  __m128i base = _mm_setzero_si128();
+  for (unsigned i = 0; i < dims / 8; i++) {
+    __m128i offsets = _mm_load_si128((const __m128i *)NnzTable[m[i]]);
+    _mm_storeu_si128((__m128i *)&nnz[count], _mm_add_epi16(base, offsets));
+    count += NnzCount[m[i]];
+    base = _mm_add_epi16(base, kEight);
+  }
+
+#elif defined(USE_NEON)
+  const uint16x8_t kEight = vdupq_n_u16(8);
+  uint16x8_t base = vdupq_n_u16(0);
+  for (unsigned i = 0; i < dims / 8; i++) {
+    vst1q_u16(&nnz[count], vaddq_u16(base, vld1q_u16(NnzTable[m[i]])));
+    count += NnzCount[m[i]];
+    base = vaddq_u16(base, kEight);
   }
-#ifdef IS_64BIT
-  *idx = *offset + __builtin_ctzll(*v);
+
 #else
-  *idx = *offset + __builtin_ctzl(*v);
+  for (unsigned i = 0; i < dims / 8; i++)
+    for (unsigned j = 0; j < NnzCount[m[i]]; j++)
+      nnz[count++] = 8 * i + NnzTable[m[i]][j];
+
 #endif
-  *v &= *v - 1;
+
+  return count;
+}
+
+INLINE bool next_idx(unsigned *idx, unsigned *n, const uint16_t *nnz,
+    unsigned count)
+{
+  if (*n >= count)
+    return false;
+  *idx = nnz[(*n)++];
   return true;
 }
+
+#else
+INLINE unsigned find_nnz(const mask_t *mask, unsigned dims, uint16_t *nnz)
+{
+  (void)mask; (void)dims; (void)nnz;
+  return 0;
+}
+
 #endif
 
 INLINE void hidden_layer(const int8_t *input, void *output, unsigned dims,
-    const int32_t *biases, const weight_t *weights, mask_t *inMask,
-    mask_t *outMask, const bool pack8_and_calc_mask)
+    const int32_t *biases, const weight_t *weights, const uint16_t *nnz,
+    unsigned count, mask_t *outMask, const bool pack8_and_calc_mask)
 {
+#ifdef VECTOR
+  (void)dims;
+#endif
+
 #if defined(USE_AVX512)
   const __m512i kZero = _mm512_setzero_si512();
   __m512i out_0 = ((__m512i *)biases)[0];
   __m512i out_1 = ((__m512i *)biases)[1];
   __m512i first, second;
-  mask2_t v;
   unsigned idx;
 
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < dims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, dims))
+#if defined(USE_VNNI)
+  // With VNNI, four columns are multiplied and added in one instruction,
+  // without the 16-bit intermediate results.
+  (void)first, (void)second;
+  for (unsigned n = 0; n < count;) {
+    __m512i w[4];
+    uint32_t factor = 0;
+    unsigned k;
+    for (k = 0; k < 4 && next_idx(&idx, &n, nnz, count); k++) {
+      w[k] = ((__m512i *)weights)[idx];
+      factor |= (uint32_t)(uint8_t)input[idx] << (8 * k);
+    }
+    if (k == 0)
+      break;
+    for (; k < 4; k++)
+      w[k] = kZero;
+    __m512i mul = _mm512_set1_epi32(factor);
+    __m512i w01 = _mm512_unpacklo_epi8(w[0], w[1]);
+    __m512i w23 = _mm512_unpacklo_epi8(w[2], w[3]);
+    out_0 = _mm512_dpbusd_epi32(out_0, mul, _mm512_unpacklo_epi16(w01, w23));
+    out_1 = _mm512_dpbusd_epi32(out_1, mul, _mm512_unpackhi_epi16(w01, w23));
+  }
+#else
+  for (unsigned n = 0; n < count;) {
+    if (!next_idx(&idx, &n, nnz, count))
       break;
     first = ((__m512i *)weights)[idx];
     uint16_t factor = input[idx];
-    if (next_idx(&idx, &offset, &v, inMask, dims)) {
+    if (next_idx(&idx, &n, nnz, count)) {
       second = ((__m512i *)weights)[idx];
       factor |= input[idx] << 8;
     } else {
@@ -87,6 +178,7 @@ INLINE void hidden_layer(const int8_t *input, void *output, unsigned dims,
     out_0 = _mm512_add_epi32(out_0, _mm512_unpacklo_epi16(prod, signs));
     out_1 = _mm512_add_epi32(out_1, _mm512_unpackhi_epi16(prod, signs));
   }
+#endif
 
   __m512i out16 = _mm512_srai_epi16(_mm512_packs_epi32(out_0, out_1), SHIFT);
 
@@ -106,16 +198,39 @@ INLINE void hidden_layer(const int8_t *input, void *output, unsigned dims,
   __m256i out_2 = ((__m256i *)biases)[2];
   __m256i out_3 = ((__m256i *)biases)[3];
   __m256i first, second;
-  mask2_t v;
   unsigned idx;
 
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < dims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, dims))
+#if defined(USE_VNNI)
+  (void)first, (void)second;
+  for (unsigned n = 0; n < count;) {
+    __m256i w[4];
+    uint32_t factor = 0;
+    unsigned k;
+    for (k = 0; k < 4 && next_idx(&idx, &n, nnz, count); k++) {
+      w[k] = ((__m256i *)weights)[idx];
+      factor |= (uint32_t)(uint8_t)input[idx] << (8 * k);
+    }
+    if (k == 0)
+      break;
+    for (; k < 4; k++)
+      w[k] = kZero;
+    __m256i mul = _mm256_set1_epi32(factor);
+    __m256i lo01 = _mm256_unpacklo_epi8(w[0], w[1]);
+    __m256i lo23 = _mm256_unpacklo_epi8(w[2], w[3]);
+    __m256i hi01 = _mm256_unpackhi_epi8(w[0], w[1]);
+    __m256i hi23 = _mm256_unpackhi_epi8(w[2], w[3]);
+    out_0 = mm256_dpbusd_epi32(out_0, mul, _mm256_unpacklo_epi16(lo01, lo23));
+    out_1 = mm256_dpbusd_epi32(out_1, mul, _mm256_unpackhi_epi16(lo01, lo23));
+    out_2 = mm256_dpbusd_epi32(out_2, mul, _mm256_unpacklo_epi16(hi01, hi23));
+    out_3 = mm256_dpbusd_epi32(out_3, mul, _mm256_unpackhi_epi16(hi01, hi23));
+  }
+#else
+  for (unsigned n = 0; n < count;) {
+    if (!next_idx(&idx, &n, nnz, count))
       break;
     first = ((__m256i *)weights)[idx];
     uint16_t factor = input[idx];
-    if (next_idx(&idx, &offset, &v, inMask, dims)) {
+    if (next_idx(&idx, &n, nnz, count)) {
       second = ((__m256i *)weights)[idx];
       factor |= input[idx] << 8;
     } else {
@@ -131,6 +246,7 @@ INLINE void hidden_layer(const int8_t *input, void *output, unsigned dims,
     out_2 = _mm256_add_epi32(out_2, _mm256_unpacklo_epi16(prod, signs));
     out_3 = _mm256_add_epi32(out_3, _mm256_unpackhi_epi16(prod, signs));
   }
+#endif
 
   __m256i out16_0 = _mm256_srai_epi16(_mm256_packs_epi32(out_0, out_1), SHIFT);
   __m256i out16_1 = _mm256_srai_epi16(_mm256_packs_epi32(out_2, out_3), SHIFT);
@@ -153,16 +269,14 @@ INLINE void hidden_layer(const int8_t *input, void *output, unsigned dims,
   __m128i out_6 = ((__m128i *)biases)[6];
   __m128i out_7 = ((__m128i *)biases)[7];
   const __m128i *first, *second;
-  mask2_t v;
   unsigned idx;
 
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < dims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, dims))
+  for (unsigned n = 0; n < count;) {
+    if (!next_idx(&idx, &n, nnz, count))
       break;
     first = (__m128i *)&weights[32 * idx];
     uint16_t factor = input[idx];
-    if (next_idx(&idx, &offset, &v, inMask, dims)) {
+    if (next_idx(&idx, &n, nnz, count)) {
       second = (__m128i *)&weights[32 * idx];
       factor |= input[idx] << 8;
     } else {
@@ -221,16 +335,14 @@ INLINE void hidden_layer(const int8_t *input, void *output, unsigned dims,
   __m128i out_6 = ((__m128i *)biases)[6];
   __m128i out_7 = ((__m128i *)biases)[7];
   const __m128i *first, *second;
-  mask2_t v;
   unsigned idx;
 
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < dims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, dims))
+  for (unsigned n = 0; n < count;) {
+    if (!next_idx(&idx, &n, nnz, count))
       break;
     first = (__m128i *)&weights[32 * idx];
     uint32_t factor = input[idx];
-    if (next_idx(&idx, &offset, &v, inMask, dims)) {
+    if (next_idx(&idx, &n, nnz, count)) {
       second = (__m128i *)&weights[32 * idx];
       factor |= input[idx] << 16;
     } else {
@@ -276,16 +388,14 @@ INLINE void hidden_layer(const int8_t *input, void *output, unsigned dims,
     __m64 out_2 = ((__m64 *)biases)[4 * t + 2];
     __m64 out_3 = ((__m64 *)biases)[4 * t + 3];
     const __m64 *first, *second;
-    mask2_t v;
     unsigned idx;
 
-    memcpy(&v, inMask, sizeof(mask2_t));
-    for (unsigned offset = 0; offset < dims;) {
-      if (!next_idx(&idx, &offset, &v, inMask, dims))
+    for (unsigned n = 0; n < count;) {
+      if (!next_idx(&idx, &n, nnz, count))
         break;
       first = &((__m64 *)&weights[32 * idx])[2  * t];
       uint32_t factor = input[idx];
-      if (next_idx(&idx, &offset, &v, inMask, dims)) {
+      if (next_idx(&idx, &n, nnz, count)) {
         second = &((__m64 *)&weights[32 * idx])[2 * t];
         factor |= input[idx] << 16;
       } else {
@@ -338,16 +448,14 @@ INLINE void hidden_layer(const int8_t *input, void *output, unsigned dims,
   __m64 out_14 = ((__m64 *)biases)[14];
   __m64 out_15 = ((__m64 *)biases)[15];
   const __m64 *first, *second;
-  mask2_t v;
   unsigned idx;
 
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < dims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, dims))
+  for (unsigned n = 0; n < count;) {
+    if (!next_idx(&idx, &n, nnz, count))
       break;
     first = (__m64 *)&weights[32 * idx];
     uint32_t factor = input[idx];
-    if (next_idx(&idx, &offset, &v, inMask, dims)) {
+    if (next_idx(&idx, &n, nnz, count)) {
       second = (__m64 *)&weights[32 * idx];
       factor |= input[idx] << 16;
     } else {
@@ -428,12 +536,10 @@ INLINE void hidden_layer(const int8_t *input, void *output, unsigned dims,
   int32x4_t out_6 = ((int32x4_t *)biases)[6];
   int32x4_t out_7 = ((int32x4_t *)biases)[7];
   const int8x8_t *first;
-  mask2_t v;
   unsigned idx;
 
-  memcpy(&v, inMask, sizeof(mask2_t));
-  for (unsigned offset = 0; offset < dims;) {
-    if (!next_idx(&idx, &offset, &v, inMask, dims))
+  for (unsigned n = 0; n < count;) {
+    if (!next_idx(&idx, &n, nnz, count))
       break;
     first = (int8x8_t *)&weights[32 * idx];
     int16_t factor = input[idx];
@@ -476,7 +582,7 @@ INLINE void hidden_layer(const int8_t *input, void *output, unsigned dims,
   }
 
 #else /* generic fallback */
-  (void)inMask; (void)outMask; (void)pack8_and_calc_mask;
+  (void)nnz; (void)count; (void)outMask; (void)pack8_and_calc_mask;
 
   int32_t tmp[32];
 
@@ -502,11 +608,13 @@ struct NetData {
 };
 
 // Evaluation function
-Value nnue_evaluate(const Position *pos)
+INLINE Value evaluate_net(const Position *pos, const bool small)
 {
+  const unsigned inDims = 2 * FT_DIMS(small);
   int32_t out_value;
   alignas(8) mask_t hidden1_mask[512 / (8 * sizeof(mask_t))];
   alignas(8) mask_t hidden2_mask[8 / sizeof(mask_t)] = { 0 };
+  uint16_t nnz[512 + 8];
 #ifdef ALIGNMENT_HACK // work around a bug in old gcc on Windows
   uint8_t buf[sizeof(struct NetData) + 63];
   struct NetData *b = (struct NetData *)(buf + ((((uintptr_t)buf-1) ^ 0x3f) & 0x3f));
@@ -516,15 +624,20 @@ Value nnue_evaluate(const Position *pos)
 #define B(x) (buf.x)
 #endif
 
-  transform(pos, B(input), hidden1_mask);
+  transform(pos, B(input), hidden1_mask, small);
 
-  hidden_layer(B(input), B(hidden1_out), 512, hidden1_biases,
-      hidden1_weights, hidden1_mask, hidden2_mask, true);
+  unsigned count = find_nnz(hidden1_mask, inDims, nnz);
+  stat_add(STAT_NNUE_INPUTS, inDims);
+  stat_add(STAT_NNUE_ACTIVE, count);
+  hidden_layer(B(input), B(hidden1_out), inDims, NET(small, hidden1_biases),
+      NET(small, hidden1_weights), nnz, count, hidden2_mask, true);
 
-  hidden_layer(B(hidden1_out), B(hidden2_out), 32, hidden2_biases,
-      hidden2_weights, hidden2_mask, NULL, false);
+  count = find_nnz(hidden2_mask, 32, nnz);
+  hidden_layer(B(hidden1_out), B(hidden2_out), 32, NET(small, hidden2_biases),
+      NET(small, hidden2_weights), nnz, count, NULL, false);
 
-  out_value = output_layer(B(hidden2_out), output_biases, output_weights);
+  out_value = output_layer(B(hidden2_out), NET(small, output_biases),
+      NET(small, output_weights));
 
 #if defined(USE_MMX)
   _mm_empty();
@@ -533,6 +646,63 @@ Value nnue_evaluate(const Position *pos)
   return out_value / FV_SCALE;
 }
 
+Value nnue_evaluate(const Position *pos)
+{
+  return evaluate_net(pos, false);
+}
+
+#ifndef NNUE_PURE
+Value nnue_evaluate_small(const Position *pos)
+{
+  return evaluate_net(pos, true);
+}
+#endif
+
+// nnue_evaluate_batch() evaluates n positions. Each layer is applied to a
+// batch of positions before moving on to the next layer, so that the
+// weights of a layer stay in cache while they are being used. It uses a
+// static buffer and may only be called by one thread at a time.
+
+struct BatchData {
+  struct NetData net;
+  alignas(8) mask_t hidden1_mask[512 / (8 * sizeof(mask_t))];
+  alignas(8) mask_t hidden2_mask[8 / sizeof(mask_t)];
+};
+
+void nnue_evaluate_batch(const Position **pos, Value *values, unsigned n)
+{
+  static struct BatchData batch[NnueBatchSize];
+  uint16_t nnz[512 + 8];
+
+  for (unsigned k = 0; k < n; k += NnueBatchSize) {
+    unsigned m = min(n - k, NnueBatchSize);
+
+    for (unsigned i = 0; i < m; i++) {
+      transform(pos[k + i], batch[i].net.input, batch[i].hidden1_mask, false);
+      memset(batch[i].hidden2_mask, 0, sizeof(batch[i].hidden2_mask));
+    }
+
+    for (unsigned i = 0; i < m; i++)
+      hidden_layer(batch[i].net.input, batch[i].net.hidden1_out, 512,
+          hidden1_biases, hidden1_weights, nnz,
+          find_nnz(batch[i].hidden1_mask, 512, nnz),
+          batch[i].hidden2_mask, true);
+
+    for (unsigned i = 0; i < m; i++)
+      hidden_layer(batch[i].net.hidden1_out, batch[i].net.hidden2_out, 32,
+          hidden2_biases, hidden2_weights, nnz,
+          find_nnz(batch[i].hidden2_mask, 32, nnz), NULL, false);
+
+    for (unsigned i = 0; i < m; i++)
+      values[k + i] = output_layer(batch[i].net.hidden2_out, output_biases,
+          output_weights) / FV_SCALE;
+  }
+
+#if defined(USE_MMX)
+  _mm_empty();
+#endif
+}
+
 static void read_output_weights(out_t *w, const char *d)
 {
   for (unsigned i = 0; i < 32; i++) {
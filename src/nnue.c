@@ -32,6 +32,7 @@
 #include "nnue.h"
 #include "position.h"
 #include "settings.h"
+#include "thread.h"
 #include "uci.h"
 
 #ifndef NNUE_SPARSE
@@ -40,7 +41,11 @@
 
 #ifdef NNUE_EMBEDDED
 #include "incbin.h"
-INCBIN(Network, EvalFileDefaultName);
+// The embedded file may be a compressed copy of the default net.
+#ifndef NNUE_EMBED_FILE
+#define NNUE_EMBED_FILE EvalFileDefaultName
+#endif
+INCBIN(Network, NNUE_EMBED_FILE);
 #endif
 
 // Old gcc on Windows is unable to provide a 32-byte aligned stack.
@@ -83,6 +88,7 @@ enum {
 
 enum {
   kHalfDimensions = 256,
+  kSmallDimensions = 128,
   FtInDims = 64 * PS_END, // 64 * 641
 };
 
@@ -95,6 +101,14 @@ static_assert(kHalfDimensions % 256 == 0, "kHalfDimensions should be a multiple
 
 #define VECTOR
 
+// AVX-VNNI provides the VEX-encoded 256-bit VNNI instructions of Alder
+// Lake and later CPUs that lack AVX512.
+#if defined(USE_AVXVNNI)
+#define mm256_dpbusd_epi32(a,b,c) _mm256_dpbusd_avx_epi32(a,b,c)
+#elif defined(USE_VNNI)
+#define mm256_dpbusd_epi32(a,b,c) _mm256_dpbusd_epi32(a,b,c)
+#endif
+
 #ifdef USE_AVX512
 #define SIMD_WIDTH 512
 typedef __m512i vec8_t, vec16_t;
@@ -258,6 +272,20 @@ static void append_changed_indices(const Position *pos, const Color c,
   }
 }
 
+// Drop features that are both removed and added in a list of changes that
+// spans several plies, e.g. a piece that moves twice or a piece that is
+// captured on the square it moved to, so that they are not applied twice.
+static void cancel_changed_indices(IndexList *removed, IndexList *added)
+{
+  for (unsigned i = 0; i < removed->size; i++)
+    for (unsigned j = 0; j < added->size; j++)
+      if (removed->values[i] == added->values[j]) {
+        removed->values[i--] = removed->values[--removed->size];
+        added->values[j] = added->values[--added->size];
+        break;
+      }
+}
+
 INLINE int32_t output_layer(const out_t *input, const int32_t *biases,
     const out_t *weights)
 {
@@ -265,7 +293,7 @@ INLINE int32_t output_layer(const out_t *input, const int32_t *biases,
   __m256i *iv = (__m256i *)input;
   __m256i *row = (__m256i *)weights;
 #if defined(USE_VNNI)
-  __m256i prod = _mm256_dpbusd_epi32(_mm256_setzero_si256(), iv[0], row[0]);
+  __m256i prod = mm256_dpbusd_epi32(_mm256_setzero_si256(), iv[0], row[0]);
 #else
   __m256i prod = _mm256_maddubs_epi16(iv[0], row[0]);
   prod = _mm256_madd_epi16(prod, _mm256_set1_epi16(1));
@@ -310,6 +338,13 @@ INLINE int32_t output_layer(const out_t *input, const int32_t *biases,
   sum = _mm_add_pi32(sum, _mm_unpackhi_pi32(sum, sum));
   return _mm_cvtsi64_si32(sum) + biases[0];
 
+#elif defined(USE_NEON_DOTPROD)
+  int8x16_t *iv = (int8x16_t *)input;
+  int8x16_t *row = (int8x16_t *)weights;
+  int32x4_t sum = vdotq_s32(vdupq_n_s32(0), iv[0], row[0]);
+  sum = vdotq_s32(sum, iv[1], row[1]);
+  return vaddvq_s32(sum) + biases[0];
+
 #elif defined(USE_NEON)
   int8x8_t *iv = (int8x8_t *)input;
   int8x8_t *row = (int8x8_t *)weights;
@@ -334,21 +369,148 @@ INLINE int32_t output_layer(const out_t *input, const int32_t *biases,
 static int16_t *ft_biases; // [kHalfDimensions]
 static int16_t *ft_weights; // [kHalfDimenions * FtInDims]
 static alloc_t ft_alloc;
+static const void *ft_mapped; // set if the weights are mapped from a file
+static map_t ft_mapping;
+
+#ifndef NNUE_PURE
+// Feature transformer of the small net (EvalFileSmall). Hybrid mode uses
+// the small net instead of the classical evaluation for the lopsided
+// positions. It has its own accumulator but no refresh cache.
+static int16_t *small_ft_biases; // [kSmallDimensions]
+static int16_t *small_ft_weights; // [kSmallDimensions * FtInDims]
+static alloc_t small_ft_alloc;
+
+// NET(small, x) selects the parameters x of the big or the small net.
+#define NET(small, x) ((small) ? small_##x : x)
+#define FT_DIMS(small) ((small) ? kSmallDimensions : kHalfDimensions)
+#else
+#define NET(small, x) x
+#define FT_DIMS(small) kHalfDimensions
+#endif
+
+INLINE int16_t *acc_values(Stack *st, Color c, const bool small)
+{
+#ifndef NNUE_PURE
+  if (small)
+    return st->accumulator.smallAccumulation[c];
+#endif
+  (void)small;
+  return st->accumulator.accumulation[c];
+}
+
+INLINE uint8_t *acc_state(Stack *st, Color c, const bool small)
+{
+#ifndef NNUE_PURE
+  if (small)
+    return &st->accumulator.smallState[c];
+#endif
+  (void)small;
+  return &st->accumulator.state[c];
+}
 
 #ifdef VECTOR
 #define TILE_HEIGHT (NUM_REGS * SIMD_WIDTH / 16)
+// The accumulator of the small net may be smaller than a tile.
+#define TILE_REGS(dims) \
+  ((dims) * 16 / SIMD_WIDTH < NUM_REGS ? (dims) * 16 / SIMD_WIDTH : NUM_REGS)
 #endif
 
+// Refresh the accumulator from the cache entry for the current king square
+// by applying only the difference between the pieces recorded in the entry
+// and the pieces on the board. The entry is then updated to the current
+// position.
+INLINE void refresh_accumulator(const Position *pos, const Color c,
+    Accumulator *accumulator)
+{
+  Square ksq = square_of(c, KING);
+  AccCacheEntry *entry = &(*pos->accCache)[c][ksq];
+  ksq = orient(c, ksq);
+
+  IndexList removed, added;
+  removed.size = added.size = 0;
+  for (int cc = 0; cc < 2; cc++)
+    for (PieceType pt = PAWN; pt <= QUEEN; pt++) {
+      Piece pc = make_piece(cc, pt);
+      Bitboard cached = entry->byColorBB[cc] & entry->byTypeBB[pt];
+      Bitboard bb = cached & ~pieces_cp(cc, pt);
+      while (bb) {
+        Square s = pop_lsb(&bb);
+        removed.values[removed.size++] = make_index(c, s, pc, ksq);
+      }
+      bb = pieces_cp(cc, pt) & ~cached;
+      while (bb) {
+        Square s = pop_lsb(&bb);
+        added.values[added.size++] = make_index(c, s, pc, ksq);
+      }
+    }
+  memcpy(entry->byColorBB, pos->byColorBB, sizeof(entry->byColorBB));
+  memcpy(entry->byTypeBB, pos->byTypeBB, sizeof(entry->byTypeBB));
+
+#ifdef VECTOR
+  vec16_t acc[NUM_REGS];
+
+  for (unsigned i = 0; i < kHalfDimensions / TILE_HEIGHT; i++) {
+    vec16_t *cacheTile = (vec16_t *)&entry->accumulation[i * TILE_HEIGHT];
+    for (unsigned j = 0; j < NUM_REGS; j++)
+      acc[j] = cacheTile[j];
+
+    for (unsigned k = 0; k < removed.size; k++) {
+      unsigned index = removed.values[k];
+      unsigned offset = kHalfDimensions * index + i * TILE_HEIGHT;
+      vec16_t *column = (vec16_t *)&ft_weights[offset];
+      for (unsigned j = 0; j < NUM_REGS; j++)
+        acc[j] = vec_sub_16(acc[j], column[j]);
+    }
+
+    for (unsigned k = 0; k < added.size; k++) {
+      unsigned index = added.values[k];
+      unsigned offset = kHalfDimensions * index + i * TILE_HEIGHT;
+      vec16_t *column = (vec16_t *)&ft_weights[offset];
+      for (unsigned j = 0; j < NUM_REGS; j++)
+        acc[j] = vec_add_16(acc[j], column[j]);
+    }
+
+    vec16_t *ft_biases_tile = (vec16_t *)&ft_biases[i * TILE_HEIGHT];
+    vec16_t *accTile = (vec16_t *)&accumulator->accumulation[c][i * TILE_HEIGHT];
+    for (unsigned j = 0; j < NUM_REGS; j++) {
+      cacheTile[j] = acc[j];
+      accTile[j] = vec_add_16(acc[j], ft_biases_tile[j]);
+    }
+  }
+#else
+  for (unsigned k = 0; k < removed.size; k++) {
+    unsigned offset = kHalfDimensions * removed.values[k];
+    for (unsigned j = 0; j < kHalfDimensions; j++)
+      entry->accumulation[j] -= ft_weights[offset + j];
+  }
+
+  for (unsigned k = 0; k < added.size; k++) {
+    unsigned offset = kHalfDimensions * added.values[k];
+    for (unsigned j = 0; j < kHalfDimensions; j++)
+      entry->accumulation[j] += ft_weights[offset + j];
+  }
+
+  for (unsigned j = 0; j < kHalfDimensions; j++)
+    accumulator->accumulation[c][j] = entry->accumulation[j] + ft_biases[j];
+#endif
+}
+
 // Calculate cumulative value using difference calculation if possible
-INLINE void update_accumulator(const Position *pos, const Color c)
+INLINE void update_accumulator(const Position *pos, const Color c,
+    const bool small)
 {
+  const unsigned dims = FT_DIMS(small);
+  const int16_t *weights = NET(small, ft_weights);
+  const int16_t *biases = NET(small, ft_biases);
 #ifdef VECTOR
+  const unsigned numRegs = TILE_REGS(dims);
+  const unsigned tileHeight = numRegs * SIMD_WIDTH / 16;
   vec16_t acc[NUM_REGS];
 #endif
 
   Stack *st = pos->st;
   int gain = popcount(pieces()) - 2;
-  while (st->accumulator.state[c] == ACC_EMPTY) {
+  while (*acc_state(st, c, small) == ACC_EMPTY) {
     DirtyPiece *dp = &st->dirtyPiece;
     if (   dp->pc[0] == make_piece(c, KING)
         || (gain -= dp->dirtyNum + 1) < 0)
@@ -356,7 +518,7 @@ INLINE void update_accumulator(const Position *pos, const Color c)
     st--;
   }
 
-  if (st->accumulator.state[c] == ACC_COMPUTED) {
+  if (*acc_state(st, c, small) == ACC_COMPUTED) {
     if (st == pos->st)
       return;
 
@@ -365,125 +527,132 @@ INLINE void update_accumulator(const Position *pos, const Color c)
     append_changed_indices(pos, c, &(st+1)->dirtyPiece, &removed[0], &added[0]);
     for (Stack *st2 = st + 2; st2 <= pos->st; st2++)
       append_changed_indices(pos, c, &st2->dirtyPiece, &removed[1], &added[1]);
+    if (st + 2 < pos->st)
+      cancel_changed_indices(&removed[1], &added[1]);
 
-    (st+1)->accumulator.state[c] = ACC_COMPUTED;
-    pos->st->accumulator.state[c] = ACC_COMPUTED;
+    *acc_state(st + 1, c, small) = ACC_COMPUTED;
+    *acc_state(pos->st, c, small) = ACC_COMPUTED;
 
     Stack *stack[3] = { st + 1, st + 1 == pos->st ? NULL : pos->st, NULL };
 #ifdef VECTOR
-    for (unsigned i = 0; i < kHalfDimensions / TILE_HEIGHT; i++) {
-      vec16_t *accTile = (vec16_t *)&st->accumulator.accumulation[c][i * TILE_HEIGHT];
-      for (unsigned j = 0; j < NUM_REGS; j++)
+    for (unsigned i = 0; i < dims / tileHeight; i++) {
+      vec16_t *accTile = (vec16_t *)&acc_values(st, c, small)[i * tileHeight];
+      for (unsigned j = 0; j < numRegs; j++)
         acc[j] = accTile[j];
       for (unsigned l = 0; stack[l]; l++) {
         // Difference calculation for the deactivated features
         for (unsigned k = 0; k < removed[l].size; k++) {
           unsigned index = removed[l].values[k];
-          const unsigned offset = kHalfDimensions * index + i * TILE_HEIGHT;
-          vec16_t *column = (vec16_t *)&ft_weights[offset];
-          for (unsigned j = 0; j < NUM_REGS; j++)
+          const unsigned offset = dims * index + i * tileHeight;
+          vec16_t *column = (vec16_t *)&weights[offset];
+          for (unsigned j = 0; j < numRegs; j++)
             acc[j] = vec_sub_16(acc[j], column[j]);
         }
 
         // Difference calculation for the activated features
         for (unsigned k = 0; k < added[l].size; k++) {
           unsigned index = added[l].values[k];
-          const unsigned offset = kHalfDimensions * index + i * TILE_HEIGHT;
-          vec16_t *column = (vec16_t *)&ft_weights[offset];
-          for (unsigned j = 0; j < NUM_REGS; j++)
+          const unsigned offset = dims * index + i * tileHeight;
+          vec16_t *column = (vec16_t *)&weights[offset];
+          for (unsigned j = 0; j < numRegs; j++)
             acc[j] = vec_add_16(acc[j], column[j]);
         }
 
-        accTile = (vec16_t *)&stack[l]->accumulator.accumulation[c][i * TILE_HEIGHT];
-        for (unsigned j = 0; j < NUM_REGS; j++)
+        accTile = (vec16_t *)&acc_values(stack[l], c, small)[i * tileHeight];
+        for (unsigned j = 0; j < numRegs; j++)
           accTile[j] = acc[j];
       }
     }
 #else
     for (unsigned l = 0; stack[l]; l++) {
-      memcpy(&stack[l]->accumulator.accumulation[c],
-          &st->accumulator.accumulation[c], kHalfDimensions * sizeof(int16_t));
+      int16_t *accValues = acc_values(stack[l], c, small);
+      memcpy(accValues, acc_values(st, c, small), dims * sizeof(int16_t));
       st = stack[l];
 
       // Difference calculation for the deactivated features
       for (unsigned k = 0; k < removed[l].size; k++) {
         unsigned index = removed[l].values[k];
-        const unsigned offset = kHalfDimensions * index;
+        const unsigned offset = dims * index;
 
-        for (unsigned j = 0; j < kHalfDimensions; j++)
-          st->accumulator.accumulation[c][j] -= ft_weights[offset + j];
+        for (unsigned j = 0; j < dims; j++)
+          accValues[j] -= weights[offset + j];
       }
 
       // Difference calculation for the activated features
       for (unsigned k = 0; k < added[l].size; k++) {
         unsigned index = added[l].values[k];
-        const unsigned offset = kHalfDimensions * index;
+        const unsigned offset = dims * index;
 
-        for (unsigned j = 0; j < kHalfDimensions; j++)
-          st->accumulator.accumulation[c][j] += ft_weights[offset + j];
+        for (unsigned j = 0; j < dims; j++)
+          accValues[j] += weights[offset + j];
       }
     }
 #endif
   } else {
-    Accumulator *accumulator = &pos->st->accumulator;
-    accumulator->state[c] = ACC_COMPUTED;
+    *acc_state(pos->st, c, small) = ACC_COMPUTED;
+    if (!small && pos->accCache) {
+      refresh_accumulator(pos, c, &pos->st->accumulator);
+      return;
+    }
+
+    int16_t *accValues = acc_values(pos->st, c, small);
     IndexList active;
     active.size = 0;
     append_active_indices(pos, c, &active);
 #ifdef VECTOR
-    for (unsigned i = 0; i < kHalfDimensions / TILE_HEIGHT; i++) {
-      vec16_t *ft_biases_tile = (vec16_t *)&ft_biases[i * TILE_HEIGHT];
-      for (unsigned j = 0; j < NUM_REGS; j++)
+    for (unsigned i = 0; i < dims / tileHeight; i++) {
+      vec16_t *ft_biases_tile = (vec16_t *)&biases[i * tileHeight];
+      for (unsigned j = 0; j < numRegs; j++)
         acc[j] = ft_biases_tile[j];
 
       for (unsigned k = 0; k < active.size; k++) {
         unsigned index = active.values[k];
-        unsigned offset = kHalfDimensions * index + i * TILE_HEIGHT;
-        vec16_t *column = (vec16_t *)&ft_weights[offset];
-        for (unsigned j = 0; j < NUM_REGS; j++)
+        unsigned offset = dims * index + i * tileHeight;
+        vec16_t *column = (vec16_t *)&weights[offset];
+        for (unsigned j = 0; j < numRegs; j++)
           acc[j] = vec_add_16(acc[j], column[j]);
       }
 
-      vec16_t *accTile = (vec16_t *)&accumulator->accumulation[c][i * TILE_HEIGHT];
-      for (unsigned j = 0; j < NUM_REGS; j++)
+      vec16_t *accTile = (vec16_t *)&accValues[i * tileHeight];
+      for (unsigned j = 0; j < numRegs; j++)
         accTile[j] = acc[j];
     }
 #else
-    memcpy(accumulator->accumulation[c], ft_biases,
-        kHalfDimensions * sizeof(int16_t));
+    memcpy(accValues, biases, dims * sizeof(int16_t));
 
     for (unsigned k = 0; k < active.size; k++) {
       unsigned index = active.values[k];
-      unsigned offset = kHalfDimensions * index;
+      unsigned offset = dims * index;
 
-      for (unsigned j = 0; j < kHalfDimensions; j++)
-        accumulator->accumulation[c][j] += ft_weights[offset + j];
+      for (unsigned j = 0; j < dims; j++)
+        accValues[j] += weights[offset + j];
     }
 #endif
   }
 }
 
 // Convert input features
-INLINE void transform(const Position *pos, clipped_t *output, mask_t *outMask)
+INLINE void transform(const Position *pos, clipped_t *output, mask_t *outMask,
+    const bool small)
 {
   (void)outMask;
-  update_accumulator(pos, WHITE);
-  update_accumulator(pos, BLACK);
-
-  int16_t (*accumulation)[2][256] = &pos->st->accumulator.accumulation;
+  update_accumulator(pos, WHITE, small);
+  update_accumulator(pos, BLACK, small);
 
+  const unsigned dims = FT_DIMS(small);
   const Color perspectives[2] = { stm(), !stm() };
   for (unsigned p = 0; p < 2; p++) {
-    const unsigned offset = kHalfDimensions * p;
+    const unsigned offset = dims * p;
+    const int16_t *accumulation = acc_values(pos->st, perspectives[p], small);
 
 #ifdef VECTOR
-    const unsigned numChunks = (16 * kHalfDimensions) / SIMD_WIDTH;
+    const unsigned numChunks = (16 * dims) / SIMD_WIDTH;
 
 #if defined(NNUE_SPARSE) || defined(USE_SSSE3) || defined(USE_NEON)
     vec8_t *out = (vec8_t *)&output[offset];
     for (unsigned i = 0; i < numChunks / 2; i++) {
-      vec16_t s0 = ((vec16_t *)(*accumulation)[perspectives[p]])[i * 2];
-      vec16_t s1 = ((vec16_t *)(*accumulation)[perspectives[p]])[i * 2 + 1];
+      vec16_t s0 = ((vec16_t *)accumulation)[i * 2];
+      vec16_t s1 = ((vec16_t *)accumulation)[i * 2 + 1];
 #ifdef NNUE_SPARSE
       out[i] = vec_packs(s0, s1);
       *outMask++ = vec_mask_pos(out[i]);
@@ -495,15 +664,15 @@ INLINE void transform(const Position *pos, clipped_t *output, mask_t *outMask)
 #else
     vec16_t *out = (vec16_t *)&output[offset];
     for (unsigned i = 0; i < numChunks; i++) {
-      vec16_t sum = ((vec16_t *)(*accumulation)[perspectives[p]])[i];
+      vec16_t sum = ((vec16_t *)accumulation)[i];
       out[i] = vec_clip_16(sum);
     }
 
 #endif
 
 #else
-    for (unsigned i = 0; i < kHalfDimensions; i++) {
-      int16_t sum = (*accumulation)[perspectives[p]][i];
+    for (unsigned i = 0; i < dims; i++) {
+      int16_t sum = accumulation[i];
       output[offset + i] = clamp(sum, 0, 127);
     }
 
@@ -521,6 +690,9 @@ INLINE unsigned bit_shuffle(unsigned v, int left, int right, unsigned mask)
 }
 #endif
 
+// Number of positions evaluated together by nnue_evaluate_batch()
+enum { NnueBatchSize = 32 };
+
 enum {
   TransformerStart = 3 * 4 + 177,
   NetworkStart = TransformerStart + 4 + 2 * 256 + 2 * 256 * 64 * 641
@@ -539,109 +711,714 @@ static const char *read_hidden_weights(weight_t *w, unsigned dims,
   return d;
 }
 
-static void init_weights(const void *evalData)
+static void free_ft_weights(void)
 {
-  if (!ft_biases) {
-    if (settings.largePages)
-      ft_biases = allocate_memory(2 * kHalfDimensions * (FtInDims + 1), true,
-          &ft_alloc);
-    if (!ft_biases)
-      ft_biases = allocate_memory(2 * kHalfDimensions * (FtInDims + 1), false,
-          &ft_alloc);
-    if (!ft_biases) {
-      fprintf(stdout, "Could not allocate enough memory.\n");
-      exit(EXIT_FAILURE);
+  if (ft_mapped)
+    unmap_file(ft_mapped, ft_mapping);
+  else if (ft_biases)
+    free_memory(&ft_alloc);
+  ft_mapped = NULL;
+  ft_biases = ft_weights = NULL;
+}
+
+// A net file may store the feature transformer biases and weights as
+// blocks of signed LEB128 numbers, as the nets of newer Stockfish versions
+// do. A compressed block consists of the magic string below, its size in
+// bytes as a 32-bit little-endian number and the numbers themselves.
+// Since most weights are small, this nearly halves the size of the file.
+
+static const char Leb128Magic[] = "COMPRESSED_LEB128";
+enum { Leb128MagicSize = sizeof(Leb128Magic) - 1 };
+
+// ft_block_end() returns the end of a block of count 16-bit numbers that
+// starts at d, or NULL if the block does not fit before end.
+
+static const char *ft_block_end(const char *d, const char *end, size_t count)
+{
+  if (   end - d >= Leb128MagicSize + 4
+      && memcmp(d, Leb128Magic, Leb128MagicSize) == 0)
+  {
+    size_t bytes = readu_le_u32(d + Leb128MagicSize);
+    d += Leb128MagicSize + 4;
+    return (size_t)(end - d) >= bytes ? d + bytes : NULL;
+  }
+
+  return (size_t)(end - d) >= 2 * count ? d + 2 * count : NULL;
+}
+
+// read_ft_block() decodes a block of count 16-bit numbers straight into
+// the given array and returns the end of the block, or NULL if a
+// compressed block does not decode to exactly count numbers.
+
+static const char *read_ft_block(int16_t *w, size_t count, const char *d)
+{
+  if (memcmp(d, Leb128Magic, Leb128MagicSize) != 0) {
+    for (size_t i = 0; i < count; i++, d += 2)
+      w[i] = readu_le_u16(d);
+    return d;
+  }
+
+  const uint8_t *p = (const uint8_t *)d + Leb128MagicSize + 4;
+  const uint8_t *end = p + readu_le_u32(d + Leb128MagicSize);
+  for (size_t i = 0; i < count; i++) {
+    // Most weights take a single byte.
+    if (p < end && !(*p & 0x80)) {
+      w[i] = (int8_t)(*p++ << 1) >> 1;
+      continue;
     }
-    ft_weights = ft_biases + kHalfDimensions;
+    uint32_t v = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+      if (p == end || shift > 14)
+        return NULL;
+      byte = *p++;
+      v |= (uint32_t)(byte & 0x7f) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    if (shift < 16 && (byte & 0x40))
+      v |= ~0U << shift;
+    w[i] = (int16_t)v;
   }
 
+  return p == end ? (const char *)p : NULL;
+}
+
+// write_ft_block() writes count 16-bit numbers as a compressed block.
+
+static bool write_ft_block(FILE *F, const int16_t *w, size_t count)
+{
+  uint8_t *buf = malloc(3 * count), *p = buf;
+  if (!buf)
+    return false;
+
+  for (size_t i = 0; i < count; i++) {
+    int32_t v = w[i];
+    uint8_t byte;
+    do {
+      byte = v & 0x7f;
+      v >>= 7;
+      if (!((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40))))
+        byte |= 0x80;
+      *p++ = byte;
+    } while (byte & 0x80);
+  }
+
+  uint8_t size[4];
+  for (int i = 0; i < 4; i++)
+    size[i] = (uint8_t)((p - buf) >> (8 * i));
+  bool success =   fwrite(Leb128Magic, Leb128MagicSize, 1, F) == 1
+                && fwrite(size, 4, 1, F) == 1
+                && fwrite(buf, p - buf, 1, F) == 1;
+  free(buf);
+  return success;
+}
+
+// allocate_ft_weights() allocates a buffer for the feature transformer
+// biases and weights of the given width, in large pages if enabled.
+
+static int16_t *allocate_ft_weights(unsigned dims, alloc_t *alloc)
+{
+  int16_t *biases = NULL;
+  if (settings.largePages)
+    biases = allocate_memory(2 * dims * (FtInDims + 1), true, alloc);
+  if (!biases)
+    biases = allocate_memory(2 * dims * (FtInDims + 1), false, alloc);
+  return biases;
+}
+
+// read_ft_weights() reads the feature transformer of a net file into the
+// given buffer and returns a pointer to the network part after it.
+
+static const char *read_ft_weights(int16_t *biases, const void *evalData)
+{
   const char *d = (const char *)evalData + TransformerStart + 4;
 
-  // Read transformer
-  for (unsigned i = 0; i < kHalfDimensions; i++, d += 2)
-    ft_biases[i] = readu_le_u16(d);
-  for (unsigned i = 0; i < kHalfDimensions * FtInDims; i++, d += 2)
-    ft_weights[i] = readu_le_u16(d);
+  if (   !(d = read_ft_block(biases, kHalfDimensions, d))
+      || !(d = read_ft_block(biases + kHalfDimensions,
+                             kHalfDimensions * FtInDims, d)))
+    return NULL;
+
+  return d;
+}
+
+// init_network() reads the network part of a net file into the big or
+// the small net.
+
+static void init_network(const char *d, const bool small)
+{
+  (void)small;
 
-  // Read network
   d += 4;
   for (unsigned i = 0; i < 32; i++, d += 4)
-    hidden1_biases[i] = readu_le_u32(d);
-  d = read_hidden_weights(hidden1_weights, 512, d);
+    NET(small, hidden1_biases)[i] = readu_le_u32(d);
+  d = read_hidden_weights(NET(small, hidden1_weights), 2 * FT_DIMS(small), d);
   for (unsigned i = 0; i < 32; i++, d += 4)
-    hidden2_biases[i] = readu_le_u32(d);
-  d = read_hidden_weights(hidden2_weights, 32, d);
+    NET(small, hidden2_biases)[i] = readu_le_u32(d);
+  d = read_hidden_weights(NET(small, hidden2_weights), 32, d);
   for (unsigned i = 0; i < 1; i++, d += 4)
-    output_biases[i] = readu_le_u32(d);
-  read_output_weights(output_weights, d);
+    NET(small, output_biases)[i] = readu_le_u32(d);
+  read_output_weights(NET(small, output_weights), d);
 
 #if defined(NNUE_SPARSE) && defined(USE_AVX2)
-  permute_biases(hidden1_biases);
-  permute_biases(hidden2_biases);
+  permute_biases(NET(small, hidden1_biases));
+  permute_biases(NET(small, hidden2_biases));
 #endif
 }
 
-static bool verify_net(const void *evalData, size_t size)
+static bool init_weights(const void *evalData)
 {
-  if (size != 21022697) return false;
+  if (ft_mapped)
+    free_ft_weights();
 
-  const char *d = evalData;
-  if (readu_le_u32(d) != NnueVersion) return false;
-  if (readu_le_u32(d + 4) != 0x3e5aa6eeU) return false;
-  if (readu_le_u32(d + 8) != 177) return false;
-  if (readu_le_u32(d + TransformerStart) != 0x5d69d7b8) return false;
-  if (readu_le_u32(d + NetworkStart) != 0x63337156) return false;
+  if (!ft_biases) {
+    if (!(ft_biases = allocate_ft_weights(kHalfDimensions, &ft_alloc))) {
+      fprintf(stdout, "Could not allocate enough memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    ft_weights = ft_biases + kHalfDimensions;
+  }
+
+  const char *d = read_ft_weights(ft_biases, evalData);
+  if (!d)
+    return false;
+
+  init_network(d, false);
 
   return true;
 }
 
-static bool load_eval_file(const char *evalFile)
+// net_network_start() returns the start of the network part of a net
+// file after the feature transformer, or NULL if the file is not valid.
+
+static const char *net_network_start(const void *evalData, size_t size)
 {
-  const void *evalData;
-  map_t mapping;
+  enum { NetworkSize = 21022697 - NetworkStart };
+
+  const char *d = evalData, *end = d + size;
+  if (size < TransformerStart + 4 + NetworkSize) return NULL;
+  if (readu_le_u32(d) != NnueVersion) return NULL;
+  if (readu_le_u32(d + 4) != 0x3e5aa6eeU) return NULL;
+  if (readu_le_u32(d + 8) != 177) return NULL;
+  if (readu_le_u32(d + TransformerStart) != 0x5d69d7b8) return NULL;
+
+  d += TransformerStart + 4;
+  if (   !(d = ft_block_end(d, end, kHalfDimensions))
+      || !(d = ft_block_end(d, end, kHalfDimensions * FtInDims))
+      || end - d != NetworkSize
+      || readu_le_u32(d) != 0x63337156)
+    return NULL;
+
+  return d;
+}
+
+static bool verify_net(const void *evalData, size_t size)
+{
+  return net_network_start(evalData, size) != NULL;
+}
+
+// An EvalWeightsFile holds the network in the layout used by this build.
+// It is mapped read-only, so all engine processes on a host that use the
+// same file share a single physical copy of the feature transformer, and
+// loading it skips reading and permuting the network.
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t layout;
+  uint64_t netSize;
+  uint64_t netHash;
+  char netName[32];
+} WeightsFileHeader;
+
+static_assert(sizeof(WeightsFileHeader) == 64, "WeightsFileHeader should be 64 bytes");
+
+static const char WeightsFileMagic[8] = "CfishNW";
+static const uint32_t WeightsFileVersion = 2;
+
+// Identifies the compile-time options that determine the weight layout.
+static const uint32_t WeightsLayout = 0
+#ifdef NNUE_SPARSE
+  | 1 << 0
+#endif
+#ifdef USE_AVX512
+  | 1 << 1
+#endif
+#ifdef USE_AVX2
+  | 1 << 2
+#endif
+#ifdef USE_SSSE3
+  | 1 << 3
+#endif
+#ifdef USE_SSE2
+  | 1 << 4
+#endif
+#ifdef USE_MMX
+  | 1 << 5
+#endif
+#ifdef USE_NEON
+  | 1 << 6
+#endif
+  | (uint32_t)sizeof(weight_t) << 8
+  | (uint32_t)sizeof(out_t) << 12
+  | (uint32_t)sizeof(clipped_t) << 16;
+
+static const struct {
+  void *data;
   size_t size;
+} NetworkParams[] = {
+  { hidden1_biases, sizeof(hidden1_biases) },
+  { hidden1_weights, sizeof(hidden1_weights) },
+  { hidden2_biases, sizeof(hidden2_biases) },
+  { hidden2_weights, sizeof(hidden2_weights) },
+  { output_biases, sizeof(output_biases) },
+  { output_weights, sizeof(output_weights) },
+  { NULL, 0 }
+};
+
+static size_t weights_file_size(void)
+{
+  size_t size = sizeof(WeightsFileHeader)
+               + 2 * kHalfDimensions * (FtInDims + 1);
+  for (unsigned i = 0; NetworkParams[i].data; i++)
+    size += NetworkParams[i].size;
+  return size;
+}
 
+static bool load_weights_file(const char *fileName,
+    const WeightsFileHeader *header)
+{
+  FD fd = open_file(fileName);
+  if (fd == FD_ERR) return false;
+
+  map_t mapping;
+  const char *data = NULL;
+  if (file_size(fd) == weights_file_size())
+    data = map_file(fd, &mapping);
+  close_file(fd);
+  if (!data) return false;
+
+  if (memcmp(data, header, sizeof(*header)) != 0) {
+    unmap_file(data, mapping);
+    return false;
+  }
+
+  free_ft_weights();
+  ft_mapped = data;
+  ft_mapping = mapping;
+  ft_biases = (int16_t *)(data + sizeof(*header));
+  ft_weights = ft_biases + kHalfDimensions;
+
+  const char *d = (const char *)(ft_weights + kHalfDimensions * FtInDims);
+  for (unsigned i = 0; NetworkParams[i].data; i++) {
+    memcpy(NetworkParams[i].data, d, NetworkParams[i].size);
+    d += NetworkParams[i].size;
+  }
+
+  return true;
+}
+
+// save_weights_file() writes the loaded network to a weights file. Since
+// several processes may do this at the same time, each one writes its own
+// temporary file and renames it.
+
+static bool save_weights_file(const char *fileName,
+    const WeightsFileHeader *header)
+{
+  char tmpName[strlen(fileName) + 24];
+  sprintf(tmpName, "%s.%d.tmp", fileName, (int)getpid());
+  FILE *F = fopen(tmpName, "wb");
+  if (!F)
+    return false;
+
+  size_t ftSize = 2 * kHalfDimensions * (FtInDims + 1);
+  bool success =   fwrite(header, sizeof(*header), 1, F) == 1
+                && fwrite(ft_biases, ftSize, 1, F) == 1;
+  for (unsigned i = 0; success && NetworkParams[i].data; i++)
+    success = fwrite(NetworkParams[i].data, NetworkParams[i].size, 1, F) == 1;
+
+  success = fclose(F) == 0 && success;
+#ifdef _WIN32
+  if (success)
+    remove(fileName);
+#endif
+  if (success && rename(tmpName, fileName) == 0)
+    return true;
+
+  remove(tmpName);
+  return false;
+}
+
+// map_eval_file() maps the given net file, or returns the embedded net if
+// the name is that of the default net.
+
+static const void *map_eval_file(const char *evalFile, map_t *mapping,
+    size_t *size)
+{
 #ifdef NNUE_EMBEDDED
   if (strcmp(evalFile, EvalFileDefaultName) == 0) {
-    evalData = gNetworkData;
-    mapping = 0;
-    size = gNetworkSize;
-  } else
+    *mapping = 0;
+    *size = gNetworkSize;
+    return gNetworkData;
+  }
 #endif
-  {
-    FD fd = open_file(evalFile);
-    if (fd == FD_ERR) return false;
-    evalData = map_file(fd, &mapping);
-    size = file_size(fd);
-    close_file(fd);
+
+  FD fd = open_file(evalFile);
+  if (fd == FD_ERR) return NULL;
+  const void *evalData = map_file(fd, mapping);
+  *size = file_size(fd);
+  close_file(fd);
+  return evalData;
+}
+
+// net_hash() returns a 64-bit FNV-1a hash of the net file, taken over
+// 8-byte words.
+
+static uint64_t net_hash(const void *data, size_t size)
+{
+  const unsigned char *d = data;
+  uint64_t h = 0xcbf29ce484222325ULL, w;
+  for (; size >= 8; d += 8, size -= 8) {
+    memcpy(&w, d, 8);
+    h = (h ^ w) * 0x100000001b3ULL;
   }
+  for (; size; d++, size--)
+    h = (h ^ *d) * 0x100000001b3ULL;
+  return h;
+}
 
-  bool success = verify_net(evalData, size);
-  if (success)
-    init_weights(evalData);
+// weights_file_header() fills in the header identifying a weights file
+// for the given network, which is recognized by its name, size and the
+// hash of its contents, so that a retrained net saved under the same name
+// does not reuse the weights of the old one.
+
+static bool weights_file_header(const char *evalFile, WeightsFileHeader *header)
+{
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, WeightsFileMagic, sizeof(header->magic));
+  header->version = WeightsFileVersion;
+  header->layout = WeightsLayout;
+
+  const char *name = evalFile;
+  for (const char *p = evalFile; *p; p++)
+    if (*p == '/' || *p == '\\')
+      name = p + 1;
+  strncpy(header->netName, name, sizeof(header->netName) - 1);
+
+  map_t mapping;
+  size_t size;
+  const void *evalData = map_eval_file(evalFile, &mapping, &size);
+  if (!evalData) return false;
+  header->netSize = size;
+  header->netHash = net_hash(evalData, size);
   if (mapping) unmap_file(evalData, mapping);
+  return true;
+}
+
+static bool load_eval_file(const char *evalFile, const char *weightsFile)
+{
+  const void *evalData;
+  map_t mapping;
+  size_t size;
+
+#if defined(NNUE_SPARSE) && defined(VECTOR)
+  init_nnz_table();
+#endif
+
+  WeightsFileHeader header;
+  bool useWeightsFile =   strcmp(weightsFile, "<empty>") != 0
+                       && *weightsFile
+                       && weights_file_header(evalFile, &header);
+  if (useWeightsFile && load_weights_file(weightsFile, &header))
+    return true;
+
+  if (!(evalData = map_eval_file(evalFile, &mapping, &size)))
+    return false;
+
+  bool success = verify_net(evalData, size) && init_weights(evalData);
+  if (mapping) unmap_file(evalData, mapping);
+
+  // Switch to the shared copy once it has been written.
+  if (   success && useWeightsFile
+      && save_weights_file(weightsFile, &header))
+    load_weights_file(weightsFile, &header);
+
   return success;
 }
 
 static char *loadedFile = NULL;
+static char *loadedWeightsFile = NULL;
+
+#ifndef NNUE_PURE
+static char *loadedSmallFile = NULL;
+
+// small_net_network_start() returns the start of the network part of a
+// small net file, or NULL if the file is not valid. A small net has the
+// HalfKP features of the big net, but a feature transformer of 128 per
+// perspective and hidden layers of 2 x 128 -> 32 -> 32 -> 1.
+
+static const char *small_net_network_start(const void *evalData, size_t size)
+{
+  enum { SmallNetworkSize = 4 + 32 * 4 + 32 * 256 + 32 * 4 + 32 * 32 + 4 + 32 };
+
+  const char *d = evalData, *end = d + size;
+  if (size < 12) return NULL;
+  if (readu_le_u32(d) != NnueVersion) return NULL;
+  if (readu_le_u32(d + 4) != 0x3e5aa58eU) return NULL;
+  uint64_t len = readu_le_u32(d + 8);
+  if (size < 12 + len + 4 + SmallNetworkSize) return NULL;
+  if (readu_le_u32(d + 12 + len) != 0x5d69d4b8) return NULL;
+
+  d += 12 + len + 4;
+  if (   !(d = ft_block_end(d, end, kSmallDimensions))
+      || !(d = ft_block_end(d, end, kSmallDimensions * FtInDims))
+      || end - d != SmallNetworkSize
+      || readu_le_u32(d) != 0x63337136)
+    return NULL;
+
+  return d;
+}
+
+static void free_small_net(void)
+{
+  if (small_ft_biases)
+    free_memory(&small_ft_alloc);
+  small_ft_biases = small_ft_weights = NULL;
+  useSmallNet = false;
+}
+
+// load_small_net() loads the small net given by EvalFileSmall, or unloads
+// it if there is none. A net that cannot be loaded is reported and the
+// classical evaluation is used instead.
+
+static void load_small_net(const char *evalFile)
+{
+  free_small_net();
+  free(loadedSmallFile);
+  loadedSmallFile = strdup(evalFile);
+  if (strcmp(evalFile, "<empty>") == 0 || !*evalFile)
+    return;
+
+  const void *evalData;
+  map_t mapping;
+  size_t size;
+  if ((evalData = map_eval_file(evalFile, &mapping, &size))) {
+    const char *network = small_net_network_start(evalData, size);
+    const char *d = evalData;
+    d += 12 + readu_le_u32(d + 8) + 4;
+    if (   network
+        && (small_ft_biases = allocate_ft_weights(kSmallDimensions,
+                                                  &small_ft_alloc)))
+    {
+      small_ft_weights = small_ft_biases + kSmallDimensions;
+      if (   (d = read_ft_block(small_ft_biases, kSmallDimensions, d))
+          && read_ft_block(small_ft_weights, kSmallDimensions * FtInDims, d))
+      {
+        init_network(network, true);
+        useSmallNet = true;
+      }
+    }
+    if (mapping) unmap_file(evalData, mapping);
+  }
+
+  if (!useSmallNet) {
+    free_small_net();
+    printf("info string ERROR: The small network file %s was not loaded "
+           "successfully.\n", evalFile);
+    fflush(stdout);
+  }
+}
+#endif
+
+// nnue_load_background() loads the net given by EvalFile in a separate
+// thread into a second buffer, so that searches continue with the current
+// net in the meantime. nnue_init() switches to the new net once it has
+// been loaded. Nets used with an EvalWeightsFile are loaded as before.
+
+static struct {
+  char *evalFile;
+  int16_t *ftBiases;
+  alloc_t ftAlloc;
+  char *network;
+  atomic_bool done;
+  bool success;
+} bgLoad;
+
+#ifndef _WIN32
+static pthread_t loadThread;
+#else
+static HANDLE loadThread;
+#endif
+static bool bgLoading = false;
+
+static THREAD_FUNC load_background_worker(void *arg)
+{
+  (void)arg;
+
+  map_t mapping;
+  size_t size;
+  const char *evalData = map_eval_file(bgLoad.evalFile, &mapping, &size);
+  const char *network = evalData ? net_network_start(evalData, size) : NULL;
+
+  if (network && (bgLoad.ftBiases = allocate_ft_weights(kHalfDimensions, &bgLoad.ftAlloc))) {
+    size_t networkSize = evalData + size - network;
+    bgLoad.network = malloc(networkSize);
+    bgLoad.success =   bgLoad.network
+                    && read_ft_weights(bgLoad.ftBiases, evalData);
+    if (bgLoad.success)
+      memcpy(bgLoad.network, network, networkSize);
+  }
+  if (evalData && mapping) unmap_file(evalData, mapping);
+
+  atomic_store(&bgLoad.done, true);
+
+  return 0;
+}
+
+// wait_background_load() waits until a background load has finished.
+
+static void wait_background_load(void)
+{
+  if (!bgLoading)
+    return;
+
+#ifndef _WIN32
+  pthread_join(loadThread, NULL);
+#else
+  WaitForSingleObject(loadThread, INFINITE);
+  CloseHandle(loadThread);
+#endif
+  bgLoading = false;
+}
+
+// discard_background_load() frees a net loaded in the background that is
+// not or no longer needed.
+
+static void discard_background_load(void)
+{
+  wait_background_load();
+  if (bgLoad.ftBiases)
+    free_memory(&bgLoad.ftAlloc);
+  free(bgLoad.network);
+  free(bgLoad.evalFile);
+  bgLoad.ftBiases = NULL;
+  bgLoad.network = NULL;
+  bgLoad.evalFile = NULL;
+}
+
+void nnue_load_background(void)
+{
+  discard_background_load();
+
+  const char *evalFile = option_string_value(OPT_EVAL_FILE);
+  const char *weightsFile = option_string_value(OPT_EVAL_WEIGHTS_FILE);
+  if (   (strcmp(weightsFile, "<empty>") != 0 && *weightsFile)
+      || (loadedFile && strcmp(evalFile, loadedFile) == 0))
+    return;
+
+  bgLoad.evalFile = strdup(evalFile);
+  bgLoad.success = false;
+  atomic_store(&bgLoad.done, false);
+
+#ifndef _WIN32
+  bgLoading = pthread_create(&loadThread, NULL, load_background_worker,
+                             NULL) == 0;
+#else
+  loadThread = CreateThread(NULL, 0, load_background_worker, NULL, 0, NULL);
+  bgLoading = loadThread != NULL;
+#endif
+
+  // Without a thread, nnue_init() loads the net itself.
+  if (!bgLoading)
+    discard_background_load();
+}
+
+// switch_background_load() replaces the current net by the net loaded in
+// the background, waiting for the load to finish if necessary. It returns
+// false if the net could not be loaded.
+
+static bool switch_background_load(void)
+{
+  wait_background_load();
+  if (!bgLoad.success) {
+    discard_background_load();
+    return false;
+  }
+
+#if defined(NNUE_SPARSE) && defined(VECTOR)
+  init_nnz_table();
+#endif
+
+  free_ft_weights();
+  ft_biases = bgLoad.ftBiases;
+  ft_weights = ft_biases + kHalfDimensions;
+  ft_alloc = bgLoad.ftAlloc;
+  bgLoad.ftBiases = NULL;
+  init_network(bgLoad.network, false);
+  discard_background_load();
+
+  return true;
+}
+
+static void clear_caches(void)
+{
+  for (int i = 0; i < MAX_SEARCHES; i++)
+    for (int idx = 0; idx < threadPools[i].numCreated; idx++)
+      nnue_clear_cache(threadPools[i].pos[idx]);
+}
 
 void nnue_init(void)
 {
 #ifndef NNUE_PURE
   const char *s = option_string_value(OPT_USE_NNUE);
-  useNNUE =  strcmp(s, "classical") == 0 ? EVAL_CLASSICAL
-           : strcmp(s, "pure"     ) == 0 ? EVAL_PURE : EVAL_HYBRID;
+  int evalType =  strcmp(s, "classical") == 0 ? EVAL_CLASSICAL
+                : strcmp(s, "pure"     ) == 0 ? EVAL_PURE : EVAL_HYBRID;
+  if (evalType != useNNUE) {
+    useNNUE = evalType;
+    clear_caches();
+  }
+#endif
+
+#ifndef NNUE_PURE
+  const char *smallFile = option_string_value(OPT_EVAL_FILE_SMALL);
+  if (!loadedSmallFile || strcmp(smallFile, loadedSmallFile) != 0) {
+    load_small_net(smallFile);
+    clear_caches();
+  }
 #endif
 
   const char *evalFile = option_string_value(OPT_EVAL_FILE);
-  if (loadedFile && strcmp(evalFile, loadedFile) == 0)
+  const char *weightsFile = option_string_value(OPT_EVAL_WEIGHTS_FILE);
+  if (   loadedFile && strcmp(evalFile, loadedFile) == 0
+      && strcmp(weightsFile, loadedWeightsFile) == 0)
     return;
 
-  if (loadedFile)
+  // Keep using the current net until the new one has been loaded in the
+  // background. Searches set up their accumulators from scratch, so only
+  // the caches need to be cleared when switching.
+  bool background =   bgLoad.evalFile && strcmp(evalFile, bgLoad.evalFile) == 0
+                   && (strcmp(weightsFile, "<empty>") == 0 || !*weightsFile);
+  if (background && loadedFile && !atomic_load(&bgLoad.done))
+    return;
+
+  if (loadedFile) {
     free(loadedFile);
+    free(loadedWeightsFile);
+    loadedFile = NULL;
+  }
 
-  if (load_eval_file(evalFile)) {
+  if (background && switch_background_load()) {
     loadedFile = strdup(evalFile);
+    loadedWeightsFile = strdup(weightsFile);
+    clear_caches();
+    return;
+  }
+  discard_background_load();
+
+  if (load_eval_file(evalFile, weightsFile)) {
+    loadedFile = strdup(evalFile);
+    loadedWeightsFile = strdup(weightsFile);
+    clear_caches();
     return;
   }
 
@@ -657,8 +1434,164 @@ void nnue_init(void)
   exit(EXIT_FAILURE);
 }
 
+// nnue_clear_cache() empties the accumulator refresh cache and the
+// evaluation cache of a thread. This is needed whenever a different net
+// is loaded or the evaluation type changes.
+
+void nnue_clear_cache(Position *pos)
+{
+  memset(pos->accCache, 0, sizeof(AccCache));
+#ifdef EVAL_CACHE
+  memset(pos->evalCache, 0, EVAL_CACHE_SIZE * sizeof(EvalCacheEntry));
+#endif
+}
+
+// nnue_eval_file() implements the "evalbatch" command. It reads FENs from
+// a file, one per line, and prints each FEN followed by its NNUE score
+// from the point of view of the side to move. Positions are evaluated in
+// batches with nnue_evaluate_batch().
+
+void nnue_eval_file(char *str)
+{
+  char *fileName = strtok(str, " \n");
+  if (!fileName) {
+    printf("info string Usage: evalbatch <fenfile>\n");
+    fflush(stdout);
+    return;
+  }
+
+  FILE *F = fopen(fileName, "r");
+  if (!F) {
+    printf("info string Unable to open file %s\n", fileName);
+    fflush(stdout);
+    return;
+  }
+
+  process_delayed_settings(); // Make sure the net is loaded
+
+  Position *positions = calloc(NnueBatchSize, sizeof(Position));
+  void *stackAllocation = malloc(63 + 2 * NnueBatchSize * sizeof(Stack));
+  Stack *stacks = (Stack *)(((uintptr_t)stackAllocation + 0x3f) & ~0x3f);
+  const Position *batch[NnueBatchSize];
+  Value values[NnueBatchSize];
+  char fens[NnueBatchSize][128];
+  char *line = NULL;
+  size_t len = 0;
+  unsigned n = 0;
+  bool eof = false;
+
+  while (!eof) {
+    eof = getline(&line, &len, F) <= 0;
+
+    if (!eof) {
+      line[strcspn(line, "\r\n")] = 0;
+
+      // Reject anything that does not have exactly one king of each color,
+      // since pos_set() does not validate its input.
+      size_t placement = strcspn(line, " ");
+      int kings[2] = { 0, 0 };
+      for (size_t i = 0; i < placement; i++)
+        kings[0] += line[i] == 'K', kings[1] += line[i] == 'k';
+      if (kings[0] != 1 || kings[1] != 1) {
+        if (*line)
+          printf("%s | invalid\n", line);
+        continue;
+      }
+
+      Position *pos = &positions[n];
+      pos->st = &stacks[2 * n + 1];
+      (pos->st - 1)->accumulator.state[WHITE] = ACC_INIT;
+      (pos->st - 1)->accumulator.state[BLACK] = ACC_INIT;
+      strncpy(fens[n], line, 127);
+      fens[n][127] = 0;
+      pos_set(pos, fens[n], option_value(OPT_CHESS960));
+      pos->st->accumulator.state[WHITE] = ACC_EMPTY;
+      pos->st->accumulator.state[BLACK] = ACC_EMPTY;
+      batch[n++] = pos;
+    }
+
+    if (n == NnueBatchSize || (eof && n > 0)) {
+      nnue_evaluate_batch(batch, values, n);
+      for (unsigned i = 0; i < n; i++)
+        printf("%s | %d\n", fens[i], values[i]);
+      n = 0;
+    }
+  }
+  fflush(stdout);
+
+  free(line);
+  fclose(F);
+  free(stackAllocation);
+  free(positions);
+}
+
+// nnue_export() implements the "export_net" command. It writes the loaded
+// net to the given file, by default the net's name with .nnue replaced by
+// -leb128.nnue, with the feature transformer compressed. Both compressed
+// and uncompressed nets can be loaded with EvalFile or embedded.
+
+void nnue_export(char *str)
+{
+  process_delayed_settings(); // Make sure the net is loaded
+
+  char *fileName = strtok(str, " \t\n");
+  char defaultName[strlen(loadedFile) + 16];
+  if (!fileName) {
+    strcpy(defaultName, loadedFile);
+    char *ext = strstr(defaultName, ".nnue");
+    strcpy(ext ? ext : defaultName + strlen(defaultName), "-leb128.nnue");
+    fileName = defaultName;
+  }
+
+  map_t mapping;
+  size_t size;
+  const char *evalData = map_eval_file(loadedFile, &mapping, &size);
+  const char *network = evalData ? net_network_start(evalData, size) : NULL;
+  FILE *F = network ? fopen(fileName, "wb") : NULL;
+  bool success = F != NULL;
+  if (F) {
+    success =   fwrite(evalData, TransformerStart + 4, 1, F) == 1
+             && write_ft_block(F, ft_biases, kHalfDimensions)
+             && write_ft_block(F, ft_weights, kHalfDimensions * FtInDims)
+             && fwrite(network, evalData + size - network, 1, F) == 1;
+    success = fclose(F) == 0 && success;
+  }
+  if (evalData && mapping) unmap_file(evalData, mapping);
+
+  if (success)
+    printf("info string Network saved to %s\n", fileName);
+  else
+    printf("info string Unable to save network to %s\n", fileName);
+  fflush(stdout);
+}
+
+// nnue_report_memory() reports the feature transformer weights, which
+// take almost all memory of a net, for the "memory" command. Weights
+// mapped from an EvalWeightsFile are shared with the other processes.
+
+void nnue_report_memory(void)
+{
+  size_t size = 2 * kHalfDimensions * (FtInDims + 1);
+  if (ft_mapped)
+    memory_add("NNUE (weights file)", -1, size, false);
+  else if (ft_biases)
+    memory_add("NNUE", -1, size, ft_alloc.lp);
+  if (bgLoad.ftBiases && atomic_load(&bgLoad.done))
+    memory_add("NNUE (loaded next)", -1, size, bgLoad.ftAlloc.lp);
+#ifndef NNUE_PURE
+  if (small_ft_biases)
+    memory_add("NNUE small net", -1, 2 * kSmallDimensions * (FtInDims + 1),
+               small_ft_alloc.lp);
+#endif
+}
+
 void nnue_free(void)
 {
-  if (ft_biases)
-    free_memory(&ft_alloc);
+  discard_background_load();
+  free_ft_weights();
+#ifndef NNUE_PURE
+  free_small_net();
+  free(loadedSmallFile);
+  loadedSmallFile = NULL;
+#endif
 }
@@ -8,13 +8,38 @@
 
 enum { ACC_EMPTY, ACC_COMPUTED, ACC_INIT };
 
+// Hybrid builds keep a second accumulator for the small net (EvalFileSmall).
 typedef struct {
   alignas(64) int16_t accumulation[2][256];
+#ifndef NNUE_PURE
+  alignas(64) int16_t smallAccumulation[2][128];
+  uint8_t smallState[2];
+#endif
   uint8_t state[2];
 } Accumulator;
 
+// The accumulator refresh cache stores, per thread, perspective and king
+// square, the accumulation (without biases) for the pieces recorded in
+// the entry. A zeroed entry is valid and represents an empty board.
+typedef struct {
+  alignas(64) int16_t accumulation[256];
+  Bitboard byColorBB[2];
+  Bitboard byTypeBB[7];
+} AccCacheEntry;
+
+typedef AccCacheEntry AccCache[2][64];
+
 void nnue_init(void);
 void nnue_free(void);
+void nnue_report_memory(void);
+void nnue_load_background(void);
 Value nnue_evaluate(const Position *pos);
+#ifndef NNUE_PURE
+Value nnue_evaluate_small(const Position *pos);
+#endif
+void nnue_evaluate_batch(const Position **pos, Value *values, unsigned n);
+void nnue_eval_file(char *str);
+void nnue_export(char *str);
+void nnue_clear_cache(Position *pos);
 
 #endif
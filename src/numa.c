@@ -153,6 +153,42 @@ int bind_thread_to_numa_node(int threadIdx)
   return node;
 }
 
+// bind_thread_to_cpu_node() binds a thread that is bound to the given cpu
+// by the "Thread Binding" option to the node of that cpu.
+
+int bind_thread_to_cpu_node(int threadIdx, int cpu)
+{
+  int node = numa_node_of_cpu(cpu);
+  if (node < 0 || node >= numNodes)
+    return bind_thread_to_numa_node(threadIdx);
+
+  printf("info string Binding thread %d to node %d.\n", threadIdx, node);
+  fflush(stdout);
+  numa_bind(nodeMask[node]);
+
+  return node;
+}
+
+// numa_shard_nodes() stores the nodes in use in the array nodes and
+// returns their number.
+
+int numa_shard_nodes(int *nodes, int max)
+{
+  int num = 0;
+  for (int node = 0; node < numNodes && num < max; node++)
+    if (numa_bitmask_isbitset(settings.mask, node))
+      nodes[num++] = node;
+  return num;
+}
+
+// numa_bind_memory() lets the pages of a memory range that has not been
+// touched yet be allocated on the given node.
+
+void numa_bind_memory(void *ptr, size_t size, int node)
+{
+  numa_tonode_memory(ptr, size, node);
+}
+
 #else /* NUMA on Windows */
 
 typedef BOOL (WINAPI *GLPIEX)(LOGICAL_PROCESSOR_RELATIONSHIP,
@@ -391,6 +427,21 @@ int bind_thread_to_numa_node(int threadIdx)
   return node;
 }
 
+int bind_thread_to_cpu_node(int threadIdx, int cpu)
+{
+  UCHAR number;
+  if (GetNumaProcessorNode((UCHAR)cpu, &number))
+    for (int node = 0; node < numNodes; node++)
+      if (nodeNumber[node] == number) {
+        printf("info string Binding thread %d to node %d.\n", threadIdx,
+               nodeNumber[node]);
+        fflush(stdout);
+        return node;
+      }
+
+  return bind_thread_to_numa_node(threadIdx);
+}
+
 void *numa_alloc(size_t size)
 {
   if (impVirtualAllocExNuma) {
@@ -417,6 +468,24 @@ void numa_interleave_memory(void *ptr, size_t size, ULONGLONG mask)
   (void)mask;
 }
 
+int numa_shard_nodes(int *nodes, int max)
+{
+  int num = 0;
+  for (int node = 0; node < numNodes && num < max; node++)
+    nodes[num++] = node;
+  return num;
+}
+
+// Windows offers no way to change the placement of already allocated
+// memory, so shards are placed by the threads that first touch them.
+
+void numa_bind_memory(void *ptr, size_t size, int node)
+{
+  (void)ptr;
+  (void)size;
+  (void)node;
+}
+
 #endif
 
 #else
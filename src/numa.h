@@ -15,6 +15,9 @@ void numa_exit(void);
 void read_numa_nodes(char *str);
 struct bitmask *numa_thread_to_node(int idx);
 int bind_thread_to_numa_node(int idx);
+int bind_thread_to_cpu_node(int idx, int cpu);
+int numa_shard_nodes(int *nodes, int max);
+void numa_bind_memory(void *ptr, size_t size, int node);
 
 #ifndef _WIN32
 typedef struct bitmask *NodeMask;
@@ -35,6 +38,7 @@ typedef int NodeMask;
 #define numa_interleave_memory(a, b, c) do {} while (0)
 #define numa_free(ptr, size) free(ptr)
 #define bind_thread_to_numa_node(a) 0
+#define bind_thread_to_cpu_node(a, b) 0
 
 #endif
 
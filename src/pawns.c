@@ -21,10 +21,13 @@
 #ifndef NNUE_PURE
 
 #include <assert.h>
+#include <string.h>
 
 #include "bitboard.h"
+#include "numa.h"
 #include "pawns.h"
 #include "position.h"
+#include "settings.h"
 #include "thread.h"
 
 #define V(v) ((Value)(v))
@@ -181,16 +184,120 @@ INLINE Score pawn_evaluate(const Position *pos, PawnEntry *e, const Color Us)
 }
 
 
-// pawns_probe() looks up the current position's pawns configuration in
-// the pawns hash table.
+// The shared pawn tables, one per NUMA node, are written by all threads
+// of the node without locking. An entry stores its key xored with the
+// other words of the entry, so that a reader detects entries that were
+// torn by a concurrent write.
+
+static PawnEntry *pawnShared[PawnCopies];
+static alloc_t pawnSharedAllocs[PawnCopies];
+
+INLINE Key pawn_checksum(const PawnEntry *e)
+{
+  Key words[sizeof(PawnEntry) / sizeof(Key)];
+  memcpy(words, e, sizeof(words));
+  Key x = 0;
+  for (size_t i = 1; i < sizeof(words) / sizeof(Key); i++)
+    x ^= words[i];
+  return x;
+}
+
+// pawn_entry_fill() is called on a miss in the thread's own pawn table.
+// It copies the entry from the shared pawn table if that holds it, and
+// otherwise evaluates the pawn structure and stores it in both tables.
 
 void pawn_entry_fill(const Position *pos, PawnEntry *e, Key key)
 {
+  PawnEntry *se = NULL;
+  if (pos->pawnShared) {
+    se = &pos->pawnShared[key & pos->pawnSharedMask];
+    stat_inc(STAT_PAWN_SHARED_PROBES);
+    memcpy(e, se, sizeof(PawnEntry));
+    if ((e->key ^ pawn_checksum(e)) == key) {
+      stat_inc(STAT_PAWN_SHARED_HITS);
+      e->key = key;
+      return;
+    }
+  }
+
+  stat_inc(STAT_PAWN_FILLS);
   e->key = key;
   e->blockedCount = 0;
   e->score = pawn_evaluate(pos, e, WHITE) - pawn_evaluate(pos, e, BLACK);
   e->openFiles = popcount(e->semiopenFiles[WHITE] & e->semiopenFiles[BLACK]);
   e->passedCount = popcount(e->passedPawns[WHITE] | e->passedPawns[BLACK]);
+
+  if (se) {
+    memcpy((char *)se + sizeof(Key), (char *)e + sizeof(Key),
+           sizeof(PawnEntry) - sizeof(Key));
+    se->key = key ^ pawn_checksum(e);
+  }
+}
+
+
+static size_t pawn_shared_entries(void)
+{
+  size_t entries = 1;
+  while (2 * entries * sizeof(PawnEntry) <= settings.sharedPawnHash << 20)
+    entries *= 2;
+  return entries;
+}
+
+// pawn_shared_table() returns the shared pawn table of the given NUMA
+// node, allocating it on first use, and stores its index mask in *mask.
+// It returns NULL if the Shared Pawn Hash option is 0. The tables are
+// freed by pawn_shared_free() when the option changes, after the threads
+// using them have been destroyed.
+
+PawnEntry *pawn_shared_table(int node, Key *mask)
+{
+  if (!settings.sharedPawnHash)
+    return NULL;
+
+  if (node < 0 || node >= PawnCopies)
+    node = 0;
+
+  size_t entries = pawn_shared_entries();
+
+  if (!pawnShared[node]) {
+    size_t size = entries * sizeof(PawnEntry);
+    PawnEntry *t = allocate_memory(size, settings.largePages,
+                                   &pawnSharedAllocs[node]);
+    if (!t)
+      t = allocate_memory(size, false, &pawnSharedAllocs[node]);
+    if (!t)
+      return NULL;
+#ifdef NUMA
+    if (settings.numaEnabled)
+      numa_bind_memory(t, size, node);
+#endif
+    memset(t, 0, size);
+    pawnShared[node] = t;
+  }
+
+  *mask = entries - 1;
+  return pawnShared[node];
+}
+
+void pawn_shared_free(void)
+{
+  for (int i = 0; i < PawnCopies; i++)
+    if (pawnShared[i]) {
+      free_memory(&pawnSharedAllocs[i]);
+      pawnShared[i] = NULL;
+    }
+}
+
+// pawn_report_memory() reports the shared pawn tables for the "memory"
+// command.
+
+void pawn_report_memory(void)
+{
+  for (int i = 0; i < PawnCopies; i++)
+    if (pawnShared[i])
+      memory_add("shared pawn hash", settings.numaEnabled ? i : -1,
+                 pawn_shared_entries() * sizeof(PawnEntry),
+                 pawnSharedAllocs[i].lp);
 }
 
 
@@ -27,9 +27,6 @@
 #include "position.h"
 #include "types.h"
 
-// Number of entries in the pawn hash table. Must be a power of 2.
-#define PAWN_ENTRIES 16384
-
 // PawnEntry contains various information about a pawn structure. A lookup
 // to the pawn hash table (performed by calling the probe function) returns
 // a pointer to an Entry object.
@@ -51,7 +48,6 @@ struct PawnEntry {
 };
 
 typedef struct PawnEntry PawnEntry;
-typedef PawnEntry PawnTable[PAWN_ENTRIES];
 
 Score do_king_safety_white(PawnEntry *pe, const Position *pos, Square ksq);
 Score do_king_safety_black(PawnEntry *pe, const Position *pos, Square ksq);
@@ -59,15 +55,23 @@ Score do_king_safety_black(PawnEntry *pe, const Position *pos, Square ksq);
 Value shelter_storm_white(const Position *pos, Square ksq);
 Value shelter_storm_black(const Position *pos, Square ksq);
 
+enum { PawnCopies = 64 };
+
 void pawn_entry_fill(const Position *pos, PawnEntry *e, Key k);
+PawnEntry *pawn_shared_table(int node, Key *mask);
+void pawn_shared_free(void);
+void pawn_report_memory(void);
 
 INLINE PawnEntry *pawn_probe(const Position *pos)
 {
   Key key = pawn_key();
-  PawnEntry *e = &pos->pawnTable[key & (PAWN_ENTRIES - 1)];
+  PawnEntry *e = &pos->pawnTable[key & pos->pawnMask];
 
+  stat_inc(STAT_PAWN_PROBES);
   if (unlikely(e->key != key))
     pawn_entry_fill(pos, e, key);
+  else
+    stat_inc(STAT_PAWN_HITS);
 
   return e;
 }
@@ -1,11 +1,14 @@
 /* polybook.c from BrainFish, Copyright (C) 2016-2017 Thomas Zipproth */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "misc.h"
 #include "movegen.h"
 #include "polybook.h"
 #include "thread.h"
+#include "tt.h"
 #include "types.h"
 #include "uci.h"
 
@@ -306,12 +309,128 @@ PRNG sr;
 
 static bool initialised = false;
 
+// Books are probed in place from a read-only shared mapping of the file, so
+// that the page cache holds a single copy of the book for all processes.
+// If both book slots use the same file, they also share the mapping.
+// If "BookIndex" is set, the key of every PB_INDEX_STRIDE-th entry is copied
+// into a sparse index, so that the binary search touches only a single page
+// of the book itself. The keys are also added to a Bloom filter with
+// PB_FILTER_BITS bits per position, so that about 99% of the positions that
+// are not in the book are rejected without touching the book at all.
+// Each key sets PB_FILTER_HASHES bits of a single 512-bit block, so that a
+// test reads one cache line.
+
+enum { PB_INDEX_STRIDE = 256, PB_FILTER_BITS = 10, PB_FILTER_HASHES = 6 };
+
+struct BookMap {
+  char *name;
+  const struct PolyHash *polyhash;
+  map_t mapping;
+  ssize_t keycount;
+  uint64_t *index;
+  ssize_t indexCount;
+  uint64_t *filter;
+  size_t filterBlocks;
+  int refs;
+};
+
+static struct BookMap bookMaps[2];
+
+// filter_bits() returns the bits of a key in its block of the filter. The
+// block is selected by the high bits of the key itself, the bits within
+// the block by those of the key multiplied by a large odd constant.
+
+static uint64_t *filter_bits(const struct BookMap *bm, uint64_t key,
+    uint64_t bits[8])
+{
+  uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+  memset(bits, 0, 8 * sizeof(uint64_t));
+  for (int i = 1; i <= PB_FILTER_HASHES; i++) {
+    unsigned bit = (h >> (64 - 9 * i)) & 511;
+    bits[bit >> 6] |= 1ULL << (bit & 63);
+  }
+  return &bm->filter[8 * mul_hi64(key, bm->filterBlocks)];
+}
+
+static void filter_add(struct BookMap *bm, uint64_t key)
+{
+  uint64_t bits[8];
+  uint64_t *block = filter_bits(bm, key, bits);
+  for (int i = 0; i < 8; i++)
+    block[i] |= bits[i];
+}
+
+static bool filter_test(const struct BookMap *bm, uint64_t key)
+{
+  uint64_t bits[8];
+  const uint64_t *block = filter_bits(bm, key, bits);
+  for (int i = 0; i < 8; i++)
+    if ((block[i] & bits[i]) != bits[i])
+      return false;
+  return true;
+}
+
+static struct BookMap *book_map(const char *bookfile)
+{
+  struct BookMap *bm = NULL;
+
+  for (int i = 0; i < 2; i++)
+    if (bookMaps[i].refs && strcmp(bookMaps[i].name, bookfile) == 0) {
+      bookMaps[i].refs++;
+      return &bookMaps[i];
+    } else if (!bookMaps[i].refs)
+      bm = &bookMaps[i];
+
+  FD fd = open_file(bookfile);
+  if (fd == FD_ERR)
+    return NULL;
+  bm->keycount = file_size(fd) / 16;
+  bm->polyhash = map_file(fd, &bm->mapping);
+  close_file(fd);
+  if (!bm->polyhash)
+    return NULL;
+
+  bm->index = NULL;
+  bm->indexCount = 0;
+  bm->filter = NULL;
+  bm->filterBlocks = 0;
+  if (option_value(OPT_BOOK_INDEX)) {
+    bm->indexCount = (bm->keycount + PB_INDEX_STRIDE - 1) / PB_INDEX_STRIDE;
+    bm->index = malloc(bm->indexCount * sizeof(*bm->index));
+    if (!bm->index)
+      bm->indexCount = 0;
+    for (ssize_t i = 0; i < bm->indexCount; i++)
+      bm->index[i] = from_be_u64(bm->polyhash[i * PB_INDEX_STRIDE].key);
+
+    // The entries of a position are adjacent, so its key is added once.
+    size_t positions = 0;
+    for (ssize_t i = 0; i < bm->keycount; i++)
+      positions += !i || bm->polyhash[i].key != bm->polyhash[i - 1].key;
+    bm->filterBlocks = max((positions * PB_FILTER_BITS + 511) / 512, 1);
+    bm->filter = calloc(8 * bm->filterBlocks, sizeof(uint64_t));
+    if (!bm->filter)
+      bm->filterBlocks = 0;
+    for (ssize_t i = 0; bm->filter && i < bm->keycount; i++)
+      if (!i || bm->polyhash[i].key != bm->polyhash[i - 1].key)
+        filter_add(bm, from_be_u64(bm->polyhash[i].key));
+  }
+
+  bm->name = strdup(bookfile);
+  bm->refs = 1;
+  return bm;
+}
+
 static void pb_release(PolyBook *pb)
 {
-  if (pb->polyhash) {
-    unmap_file(pb->polyhash, pb->mapping);
-    pb->polyhash = NULL;
+  struct BookMap *bm = pb->map;
+  if (bm && --bm->refs == 0) {
+    unmap_file(bm->polyhash, bm->mapping);
+    free(bm->index);
+    free(bm->filter);
+    free(bm->name);
   }
+  pb->map = NULL;
+  pb->polyhash = NULL;
 }
 
 void pb_free(void)
@@ -320,6 +439,21 @@ void pb_free(void)
   pb_release(&polybook2);
 }
 
+// pb_report_memory() reports the mapped books and their indexes for the
+// "memory" command.
+
+void pb_report_memory(void)
+{
+  for (int i = 0; i < 2; i++)
+    if (bookMaps[i].refs) {
+      memory_add("books (mapped)", -1, bookMaps[i].keycount * 16, false);
+      memory_add("book index", -1,
+                 bookMaps[i].indexCount * sizeof(*bookMaps[i].index), false);
+      memory_add("book filter", -1,
+                 bookMaps[i].filterBlocks * 8 * sizeof(uint64_t), false);
+    }
+}
+
 void pb_init(PolyBook *pb, const char *bookfile)
 {
   if (!initialised) {
@@ -336,25 +470,99 @@ void pb_init(PolyBook *pb, const char *bookfile)
 
   pb_release(pb);
 
-  FD fd = open_file(bookfile);
-  if (fd != FD_ERR) {
-    pb->keycount = file_size(fd) / 16;
-    pb->polyhash = map_file(fd, &pb->mapping);
-    close_file(fd);
-  }
+  pb->map = book_map(bookfile);
 
-  if (!pb->polyhash) {
+  if (!pb->map) {
     printf("info string Could not open %s\n", bookfile);
     pb->enabled = false;
     return;
   }
 
+  pb->keycount = pb->map->keycount;
+  pb->polyhash = pb->map->polyhash;
+
   printf("info string Book loaded: %s\n", bookfile);
 
   pb->enabled = true;
   pb->do_search = true;
 }
 
+// seed_tt() stores the best book move of the current position in the TT
+// and recurses into the book moves. Positions already holding a move have
+// been seeded before through a transposition or by the other book.
+
+static int seed_tt(PolyBook *pb, Position *pos, int depth)
+{
+  if (find_first_key(pb, polyglot_key(pos)) < 1)
+    return 0;
+
+  bool found;
+  TTEntry ttData;
+  TTEntry *tte = tt_probe(key(), &found, &ttData);
+  if (found && tte_move(&ttData))
+    return 0;
+
+  ssize_t first = pb->index_first, last = first + pb->index_count;
+  Move bestMove = pg_move_to_sf_move(pos, from_be_u16(pb->polyhash[pb->index_best].move));
+  if (!bestMove || !is_pseudo_legal(pos, bestMove) || !is_legal(pos, bestMove))
+    return 0;
+
+  tte_save(tte, key(), VALUE_NONE, false, BOUND_NONE, DEPTH_NONE, bestMove,
+      VALUE_NONE);
+
+  int count = 1;
+  if (depth <= 1)
+    return count;
+
+  for (ssize_t i = first; i < last; i++) {
+    Move m = pg_move_to_sf_move(pos, from_be_u16(pb->polyhash[i].move));
+    if (!m || !is_pseudo_legal(pos, m) || !is_legal(pos, m))
+      continue;
+    pos->st->endMoves = (pos->st-1)->endMoves;
+    do_move(pos, m, gives_check(pos, pos->st, m));
+    count += seed_tt(pb, pos, depth - 1);
+    undo_move(pos, m);
+  }
+
+  return count;
+}
+
+// pb_seed_tt() walks the book trees from the starting position up to the
+// given depth in plies and stores the best book move of each position as
+// its hash move. The entries have no value, bound or depth, so they only
+// help move ordering once the game leaves the book.
+
+void pb_seed_tt(int depth)
+{
+  if (!depth || !TT.table || (!polybook.enabled && !polybook2.enabled))
+    return;
+
+  tt_wait_clear();
+
+  Position pos;
+  memset(&pos, 0, sizeof(pos));
+  pos.stackAllocation = malloc(63 + (depth + 16) * sizeof(*pos.stack));
+  pos.stack = (Stack *)(((uintptr_t)pos.stackAllocation + 0x3f) & ~0x3f);
+  pos.st = pos.stack + 7;
+  pos.moveList = malloc(MAX_MOVES * sizeof(*pos.moveList));
+  (pos.st-1)->endMoves = pos.moveList;
+
+  char fen[] = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+  pos_set(&pos, fen, false);
+
+  int count = 0;
+  if (polybook.enabled)
+    count += seed_tt(&polybook, &pos, depth);
+  if (polybook2.enabled)
+    count += seed_tt(&polybook2, &pos, depth);
+
+  free(pos.stackAllocation);
+  free(pos.moveList);
+
+  printf("info string Seeded %d book positions into the hash table\n", count);
+  fflush(stdout);
+}
+
 void pb_set_best_book_move(bool best_book_move)
 {
   useBestBookMove = best_book_move;
@@ -417,8 +625,16 @@ Move pb_probe(PolyBook *pb, Position *pos)
   return 0;
 }
 
+// polyglot_key() returns the PolyGlot key of the position. Both books are
+// probed in the same position in turn, so the key of the last position is
+// cached together with its Stockfish key.
+
 static Key polyglot_key(const Position *pos)
 {
+  static Key lastKey, lastPolyKey;
+  if (key() == lastKey && lastKey)
+    return lastPolyKey;
+
   Key key = 0;
   Bitboard b = pieces();
 
@@ -441,6 +657,8 @@ static Key polyglot_key(const Position *pos)
   if (stm() == WHITE)
     key ^= PG.Zobrist.turn;
 
+  lastKey = pos->st->key;
+  lastPolyKey = key;
   return key;
 }
 
@@ -486,9 +704,28 @@ static int find_first_key(PolyBook *pb, uint64_t key)
   pb->index_best = -1;
   pb->index_rand = -1;
 
+  if (pb->map->filter && !filter_test(pb->map, key))
+    return -1;
+
   ssize_t start = 0;
   ssize_t end = pb->keycount;
 
+  // Narrow the search down to a single stride of entries using the index.
+  // The first entry with the key follows the last indexed key below it.
+  const uint64_t *index = pb->map->index;
+  if (index) {
+    ssize_t lo = 0, hi = pb->map->indexCount;
+    while (hi - lo > 1) {
+      ssize_t mid = (lo + hi) / 2;
+      if (index[mid] < key)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    start = lo * PB_INDEX_STRIDE;
+    end = min(start + PB_INDEX_STRIDE + 1, pb->keycount);
+  }
+
   do {
     ssize_t mid = (end + start) / 2;
 
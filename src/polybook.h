@@ -10,8 +10,7 @@
 struct PolyBook {
   ssize_t keycount;
   const struct PolyHash *polyhash;
-
-  map_t mapping;
+  struct BookMap *map;
 
 //  int use_best_book_move;
 //  int max_book_depth;
@@ -40,8 +39,10 @@ extern PolyBook polybook, polybook2;
 
 void pb_init(PolyBook *pb, const char *bookfile);
 void pb_free(void);
+void pb_report_memory(void);
 void pb_set_best_book_move(bool best_book_move);
 void pb_set_book_depth(int book_depth);
+void pb_seed_tt(int depth);
 Move pb_probe(PolyBook *pb, Position *pos);
 
 #endif
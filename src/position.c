@@ -79,7 +79,7 @@ INLINE void move_piece(Position *pos, Color c, Piece piece, Square from,
 
 // Calculate CheckInfo data.
 
-INLINE void set_check_info(Position *pos)
+INLINE void set_check_info(const Position *pos)
 {
   Stack *st = pos->st;
 
@@ -318,6 +318,28 @@ static void set_castling_right(Position *pos, Color c, Square rfrom)
 }
 
 
+// pos_compute_key() computes the hash key of the position from scratch,
+// taking the en passant square and castling rights from the given state.
+
+Key pos_compute_key(const Position *pos, const Stack *st)
+{
+  Key key = 0;
+
+  for (Bitboard b = pieces(); b; ) {
+    Square s = pop_lsb(&b);
+    key ^= zob.psq[piece_on(s)][s];
+  }
+
+  if (st->epSquare != 0)
+    key ^= zob.enpassant[file_of(st->epSquare)];
+
+  if (stm() == BLACK)
+    key ^= zob.side;
+
+  return key ^ zob.castling[st->castlingRights];
+}
+
+
 // set_state() computes the hash keys of the position, and other data
 // that once computed is updated incrementally as moves are made. The
 // function is only used when a new position is set up, and to verify
@@ -335,23 +357,16 @@ static void set_state(Position *pos, Stack *st)
   st->checkersBB = attackers_to(square_of(stm(), KING)) & pieces_c(!stm());
 
   set_check_info(pos);
+  st->seeSq = SQ_NONE;
+
+  st->key = pos_compute_key(pos, st);
 
+#ifndef NNUE_PURE
   for (Bitboard b = pieces(); b; ) {
     Square s = pop_lsb(&b);
-    Piece pc = piece_on(s);
-    st->key ^= zob.psq[pc][s];
-#ifndef NNUE_PURE
-    st->psq += psqt.psq[pc][s];
-#endif
+    st->psq += psqt.psq[piece_on(s)][s];
   }
-
-  if (st->epSquare != 0)
-    st->key ^= zob.enpassant[file_of(st->epSquare)];
-
-  if (stm() == BLACK)
-    st->key ^= zob.side;
-
-  st->key ^= zob.castling[st->castlingRights];
+#endif
 
 #ifndef NNUE_PURE
   for (Bitboard b = pieces_p(PAWN); b; ) {
@@ -779,6 +794,10 @@ void do_move(Position *pos, Move m, int givesCheck)
 #ifdef NNUE
   st->accumulator.state[WHITE] = ACC_EMPTY;
   st->accumulator.state[BLACK] = ACC_EMPTY;
+#ifndef NNUE_PURE
+  st->accumulator.smallState[WHITE] = ACC_EMPTY;
+  st->accumulator.smallState[BLACK] = ACC_EMPTY;
+#endif
   DirtyPiece *dp = &(st->dirtyPiece);
   dp->dirtyNum = 1;
 #endif
@@ -867,7 +886,9 @@ void do_move(Position *pos, Move m, int givesCheck)
     key ^= zob.psq[captured][capsq];
     st->materialKey -= matKey[captured];
 #ifndef NNUE_PURE
-    prefetch(&pos->materialTable[st->materialKey >> (64 - 13)]);
+    unsigned idx = material_index(st->materialKey);
+    prefetch(  idx != MaterialNone ? (void *)&pos->materialShared[idx]
+             : &pos->materialTable[st->materialKey >> pos->materialShift]);
 
     // Update incremental scores
     st->psq -= psqt.psq[captured][capsq];
@@ -957,7 +978,7 @@ void do_move(Position *pos, Move m, int givesCheck)
 #ifndef NNUE_PURE
     // Update pawn hash key and prefetch access to pawnsTable
     st->pawnKey ^= zob.psq[piece][from] ^ zob.psq[piece][to];
-    prefetch2(&pos->pawnTable[st->pawnKey & (PAWN_ENTRIES -1)]);
+    prefetch2(&pos->pawnTable[st->pawnKey & pos->pawnMask]);
 #endif
 
     // Reset ply counters.
@@ -989,7 +1010,7 @@ void do_move(Position *pos, Move m, int givesCheck)
   pos->sideToMove = !pos->sideToMove;
   pos->nodes++;
 
-  set_check_info(pos);
+  st->ksq = st->seeSq = SQ_NONE;
 
   assert(pos_is_ok(pos, &failed_step));
 }
@@ -1078,6 +1099,10 @@ void do_null_move(Position *pos)
 #ifdef NNUE
   st->accumulator.state[WHITE] = ACC_EMPTY;
   st->accumulator.state[BLACK] = ACC_EMPTY;
+#ifndef NNUE_PURE
+  st->accumulator.smallState[WHITE] = ACC_EMPTY;
+  st->accumulator.smallState[BLACK] = ACC_EMPTY;
+#endif
   st->dirtyPiece.dirtyNum = 0;
   st->dirtyPiece.pc[0] = 0;
 #endif
@@ -1095,7 +1120,7 @@ void do_null_move(Position *pos)
 
   pos->sideToMove = !pos->sideToMove;
 
-  set_check_info(pos);
+  st->ksq = st->seeSq = SQ_NONE;
 
   assert(pos_is_ok(pos, &failed_step));
 }
@@ -1122,7 +1147,13 @@ Key key_after(const Position *pos, Move m)
 }
 
 
-// Test whether SEE >= value.
+// see_test() tests whether SEE >= value. Move ordering and pruning test
+// many moves to the same square, e.g. the captures of a piece with
+// different thresholds, so the attackers of the last square tested are
+// cached in the Stack. do_move() invalidates the cache by setting seeSq
+// to SQ_NONE. With the cache, the attackers for the exchange are found by
+// adding the slider x-rayed through the moving piece, if any.
+
 bool see_test(const Position *pos, Move m, int value)
 {
   if (unlikely(type_of_m(m) != NORMAL))
@@ -1141,7 +1172,19 @@ bool see_test(const Position *pos, Move m, int value)
 
   occ = pieces() ^ sq_bb(from) ^ sq_bb(to);
   Color stm = color_of(piece_on(from));
-  Bitboard attackers = attackers_to_occ(pos, to, occ), stmAttackers;
+  Stack *st = pos->st;
+  stat_inc(STAT_SEE_PROBES);
+  if (st->seeSq == to)
+    stat_inc(STAT_SEE_CACHE_HITS);
+  else {
+    st->seeAttackers = attackers_to(to);
+    st->seeSq = to;
+  }
+  Bitboard attackers = st->seeAttackers, stmAttackers;
+  if (PseudoAttacks[BISHOP][to] & sq_bb(from))
+    attackers |= attacks_bb_bishop(to, occ) & pieces_pp(BISHOP, QUEEN);
+  else if (PseudoAttacks[ROOK][to] & sq_bb(from))
+    attackers |= attacks_bb_rook(to, occ) & pieces_pp(ROOK, QUEEN);
   bool res = true;
 
   while (true) {
@@ -1149,7 +1192,7 @@ bool see_test(const Position *pos, Move m, int value)
     attackers &= occ;
     if (!(stmAttackers = attackers & pieces_c(stm))) break;
     if (    (stmAttackers & blockers_for_king(pos, stm))
-        && (pos->st->pinnersForKing[stm] & occ))
+        && (check_info(pos)->pinnersForKing[stm] & occ))
       stmAttackers &= ~blockers_for_king(pos, stm);
     if (!stmAttackers) break;
     res = !res;
@@ -1248,7 +1291,7 @@ bool has_game_cycle(const Position *pos, int ply)
 }
 
 
-void pos_set_check_info(Position *pos)
+void pos_set_check_info(const Position *pos)
 {
   set_check_info(pos);
 }
@@ -30,6 +30,7 @@
 #include <string.h>
 
 #include "bitboard.h"
+#include "misc.h"
 #include "types.h"
 
 #ifdef NNUE
@@ -79,8 +80,11 @@ struct Stack {
   // Not copied when making a move
   uint8_t capturedPiece;
   uint8_t epSquare;
+  uint8_t ksq;
+  uint8_t seeSq;
   Key key;
   Bitboard checkersBB;
+  Bitboard seeAttackers;
 
   // Original search stack data
   Move* pv;
@@ -117,7 +121,6 @@ struct Stack {
       Bitboard checkSquares[7]; // element 0 is pinnersForKing[BLACK]
     };
   };
-  Square ksq;
 
 #ifdef NNUE
   // NNUE data
@@ -133,6 +136,22 @@ typedef struct Stack Stack;
 #define SStackBegin(st) (&st.pv)
 #define SStackSize (offsetof(Stack, countermove) - offsetof(Stack, pv))
 
+#ifdef SEARCH_STATS
+// Search and evaluation event counters, compiled in with stats=yes.
+enum {
+  STAT_TT_PROBES, STAT_TT_HITS, STAT_TT_REPLACED, STAT_TT_LOCAL,
+  STAT_TT_CUTOFFS, STAT_QSEARCH_NODES, STAT_NNUE_EVALS, STAT_CLASSICAL_EVALS,
+  STAT_NULL_MOVES, STAT_NULL_CUTOFFS, STAT_LMR_SEARCHES, STAT_LMR_RESEARCHES,
+  STAT_CRUMB_PROBES, STAT_CRUMB_SHARED, STAT_SKIPPED_DEPTHS,
+  STAT_TB_CACHE_PROBES, STAT_TB_CACHE_HITS, STAT_TB_PREFETCHES,
+  STAT_TB_PROBES, STAT_TB_PROBE_USEC, STAT_PAWN_PROBES, STAT_PAWN_HITS,
+  STAT_PAWN_SHARED_PROBES, STAT_PAWN_SHARED_HITS, STAT_PAWN_FILLS,
+  STAT_MATERIAL_PROBES, STAT_MATERIAL_HITS, STAT_EVAL_CACHE_PROBES,
+  STAT_EVAL_CACHE_HITS, STAT_NNUE_INPUTS, STAT_NNUE_ACTIVE,
+  STAT_SMALL_NET_EVALS, STAT_SEE_PROBES, STAT_SEE_CACHE_HITS, STAT_NB
+};
+#endif
+
 
 // Position struct stores information regarding the board representation as
 // pieces, side to move, hash keys, castling info, etc. The search uses
@@ -154,6 +173,7 @@ struct Position {
   Key rootKeyFlip;
   uint16_t gamePly;
   bool hasRepeated;
+  Move lastMove; // Last move of the game, 0 if none
 
   ExtMove *moveList;
 
@@ -162,6 +182,9 @@ struct Position {
   Stack *stack;
   uint64_t nodes;
   uint64_t tbHits;
+#ifdef SEARCH_STATS
+  uint64_t stats[STAT_NB];
+#endif
   uint64_t ttHitAverage;
   int pvIdx, pvLast;
   int selDepth, nmpMinPly;
@@ -170,6 +193,7 @@ struct Position {
   Depth completedDepth;
   Score contempt;
   int failedHighCnt;
+  int ponderGroup; // Multi-ponder group, 0 for the expected reply
 
   // Pointers to thread-specific tables.
   CounterMoveStat *counterMoves;
@@ -178,14 +202,33 @@ struct Position {
   CapturePieceToHistory *captureHistory;
   PawnEntry *pawnTable;
   MaterialEntry *materialTable;
+  const MaterialEntry *materialShared;
+  PawnEntry *pawnShared; // Shared pawn table of the NUMA node, or NULL
+  Key pawnMask;      // Number of pawn table entries minus one
+  Key pawnSharedMask;
+  int materialShift; // 64 minus log2 of the number of material table entries
   CounterMoveHistoryStat *counterMoveHistory;
+  TBCacheEntry *tbCache;
+#ifdef EVAL_CACHE
+  EvalCacheEntry *evalCache;
+#endif
+#ifdef SEARCH_TRACE
+  TraceBuffer *trace;
+#endif
+  alloc_t arena; // The allocation holding this struct and the tables above
+#ifdef NNUE
+  AccCache *accCache;
+  void *accCacheAllocation;
+#endif
 
   // Thread-control data.
   uint64_t bestMoveChanges;
   atomic_bool resetCalls;
+  atomic_bool ponderStop; // Raised on ponderhit for ponderGroup > 0
   int callsCnt;
-  int action;
+  atomic_int action;
   int threadIdx;
+  int numaNode;
 #ifndef _WIN32
   pthread_t nativeThread;
   pthread_mutex_t mutex;
@@ -211,6 +254,7 @@ PURE bool is_pseudo_legal(const Position *pos, Move m);
 PURE bool gives_check_special(const Position *pos, Stack *st, Move m);
 
 // Doing and undoing moves
+PURE Key pos_compute_key(const Position *pos, const Stack *st);
 void do_move(Position *pos, Move m, int givesCheck);
 void undo_move(Position *pos, Move m);
 void do_null_move(Position *pos);
@@ -274,20 +318,42 @@ PURE bool has_game_cycle(const Position *pos, int ply);
 #define game_ply() (pos->gamePly)
 #define is_chess960() (pos->chess960)
 #define nodes_searched() (pos->nodes)
+#ifdef SEARCH_STATS
+#define stat_inc(s) (((Position *)pos)->stats[s]++)
+#define stat_add(s, n) (((Position *)pos)->stats[s] += (n))
+#else
+#define stat_inc(s) ((void)0)
+#define stat_add(s, n) ((void)0)
+#endif
 #define rule50_count() (pos->st->rule50)
 #define psq_score() (pos->st->psq)
 #define non_pawn_material_c(c) (pos->st->nonPawnMaterial[c])
 #define non_pawn_material() (non_pawn_material_c(WHITE) + non_pawn_material_c(BLACK))
 #define pawns_only() (!pos->st->nonPawn)
 
+void pos_set_check_info(const Position *pos);
+
+// check_info() returns the Stack of the position with its CheckInfo data
+// (blockers and pinners for both kings and the check squares of the enemy
+// king). Many nodes are left before a move is generated or tested, so
+// do_move() only marks the CheckInfo data as missing by setting ksq to
+// SQ_NONE, and the data is computed on first use.
+
+INLINE Stack *check_info(const Position *pos)
+{
+  if (pos->st->ksq == SQ_NONE)
+    pos_set_check_info(pos);
+  return pos->st;
+}
+
 INLINE Bitboard blockers_for_king(const Position *pos, Color c)
 {
-  return pos->st->blockersForKing[c];
+  return check_info(pos)->blockersForKing[c];
 }
 
 INLINE bool is_discovery_check_on_king(const Position *pos, Color c, Move m)
 {
-  return pos->st->blockersForKing[c] & sq_bb(from_sq(m));
+  return check_info(pos)->blockersForKing[c] & sq_bb(from_sq(m));
 }
 
 INLINE bool pawn_passed(const Position *pos, Color c, Square s)
@@ -324,12 +390,12 @@ INLINE bool is_capture(const Position *pos, Move m)
 
 INLINE bool gives_check(const Position *pos, Stack *st, Move m)
 {
+  check_info(pos);
   return  type_of_m(m) == NORMAL && !(blockers_for_king(pos, !stm()) & pieces_c(stm()))
         ? (bool)(st->checkSquares[type_of_p(moved_piece(m))] & sq_bb(to_sq(m)))
         : gives_check_special(pos, st, m);
 }
 
-void pos_set_check_info(Position *pos);
 
 // undo_null_move is used to undo a null move.
 
@@ -24,9 +24,12 @@
 #include <inttypes.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "cluster.h"
 #include "evaluate.h"
+#include "learn.h"
 #include "misc.h"
 #include "movegen.h"
 #include "movepick.h"
@@ -36,19 +39,36 @@
 #include "tbprobe.h"
 #include "timeman.h"
 #include "thread.h"
+#include "trace.h"
 #include "tt.h"
 #include "uci.h"
 
 #define load_rlx(x) atomic_load_explicit(&(x), memory_order_relaxed)
 #define store_rlx(x,y) atomic_store_explicit(&(x), y, memory_order_relaxed)
 
-LimitsType Limits;
-
-int TB_Cardinality, TB_CardinalityDTM;
-static bool TB_RootInTB, TB_UseRule50;
-static Depth TB_ProbeDepth;
-
-static int base_ct;
+// A thread stops searching when Threads.stop is raised or, if it ponders
+// another reply than the expected one, on ponderhit. Only the threads of
+// a ponder group other than 0 test the atomic ponderStop.
+#define search_stopped(pos) \
+  (   load_rlx(Threads.stop) \
+   || (unlikely((pos)->ponderGroup) && load_rlx((pos)->ponderStop)))
+
+LimitsType searchLimits[MAX_SEARCHES];
+
+// Search parameters set up for each search by start_thinking()
+int TB_Cardinalities[MAX_SEARCHES], TB_CardinalitiesDTM[MAX_SEARCHES];
+static bool TB_RootInTBs[MAX_SEARCHES], TB_UseRule50s[MAX_SEARCHES];
+static bool TB_Prefetches[MAX_SEARCHES];
+static Depth TB_ProbeDepths[MAX_SEARCHES];
+static int base_cts[MAX_SEARCHES];
+
+#define TB_Cardinality    PER_SEARCH(TB_Cardinalities)
+#define TB_CardinalityDTM PER_SEARCH(TB_CardinalitiesDTM)
+#define TB_RootInTB       PER_SEARCH(TB_RootInTBs)
+#define TB_UseRule50      PER_SEARCH(TB_UseRule50s)
+#define TB_Prefetch       PER_SEARCH(TB_Prefetches)
+#define TB_ProbeDepth     PER_SEARCH(TB_ProbeDepths)
+#define base_ct           PER_SEARCH(base_cts)
 
 // Different node types, used as template parameter
 enum { NonPV, PV };
@@ -60,8 +80,10 @@ INLINE int futility_margin(Depth d, bool improving) {
   return 234 * (d - improving);
 }
 
-// Reductions lookup tables, initialized at startup
-static int Reductions[MAX_MOVES]; // [depth or moveNumber]
+// Reductions lookup tables, initialized at startup and whenever the
+// number of threads of the search changes
+static int ReductionTables[MAX_SEARCHES][MAX_MOVES]; // [depth or moveNumber]
+#define Reductions PER_SEARCH(ReductionTables)
 
 INLINE Depth reduction(int i, Depth d, int mn)
 {
@@ -104,8 +126,23 @@ struct Skill {
 //  Move best = 0;
 };
 
+#ifndef _WIN32
+static pthread_t timerThreads[MAX_SEARCHES];
+#else
+static HANDLE timerThreads[MAX_SEARCHES];
+#endif
+static bool timerActives[MAX_SEARCHES];
+#define timerThread PER_SEARCH(timerThreads)
+#define timerActive PER_SEARCH(timerActives)
+
+// Sizes and phases of the skip blocks used to distribute helper threads
+// over the iterations when "Helper Skip Depths" is enabled
+static const int SkipSize[]  = { 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+static const int SkipPhase[] = { 0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7 };
+
 // Breadcrumbs are used to mark nodes as being search by a given thread
-static _Atomic uint64_t breadcrumbs[1024];
+static _Atomic uint64_t breadcrumbTables[MAX_SEARCHES][1024];
+#define breadcrumbs PER_SEARCH(breadcrumbTables)
 
 static Value search_PV(Position *pos, Stack *ss, Value alpha, Value beta,
     Depth depth);
@@ -130,9 +167,60 @@ static void update_quiet_stats(const Position *pos, Stack *ss, Move move,
 static void update_capture_stats(const Position *pos, Move move, Move *captures,
     int captureCnt, int bonus);
 static void check_time(void);
+static void timer_start(void);
+static void timer_stop(void);
 static void stable_sort(RootMove *rm, int num);
-static void uci_print_pv(Position *pos, Depth depth, Value alpha, Value beta);
+static void uci_print_pv(Position *pos, Depth depth, Value alpha, Value beta,
+    bool final);
 static int extract_ponder_from_tt(RootMove *rm, Position *pos);
+static void ponder_rejoin(Position *pos);
+static void resume_save(Position *pos, Position *best, bool valid);
+
+// With the "Multi Ponder" option above 1, a ponder search splits the
+// threads into groups. Group 0 ponders the position after the expected
+// reply as usual. The other groups ponder the positions after the next
+// likeliest replies, which are those the TT rates best for the opponent.
+// On ponderhit the other groups rejoin group 0. If the opponent plays one
+// of the other replies instead, its search is still in the TT.
+
+#define MAX_PONDER_GROUPS 4
+
+static struct {
+  Position *root;               // Root position of group 0
+  int groups;
+  int numMoves;
+  Move moves[MAX_MOVES];        // Root moves of group 0
+  Key keys[MAX_PONDER_GROUPS];  // Keys of the positions pondered
+  TimePoint startTime, endTime;
+  bool pending;                 // The last ponder search was not a hit
+  uint64_t searches, hits, otherHits;
+  TimePoint savedTime;
+} ponderInfo;
+
+// With the "Resume Analysis" option, an infinite search of the root of the
+// last search, or of a position along its PV, resumes iterative deepening
+// close to the depth the last search completed instead of from depth 1.
+// The TT still holds the results of the last search, so the first resumed
+// iteration is cheap and only re-establishes the PV and the root move
+// scores that the aspiration window is centred on.
+
+#define RESUME_MIN_DEPTH 5
+
+typedef struct {
+  Depth depth;                  // Completed depth, 0 if nothing to resume
+  int multiPV;
+  int pvSize;
+  Move pv[MAX_PLY];             // PV of the best move
+  Key keys[MAX_PLY];            // Keys of the positions along the PV
+  Value score;
+  int numMoves;
+  Move moves[MAX_MOVES];        // Root moves in the final order
+  Value scores[MAX_MOVES];
+} ResumeInfo;
+
+static ResumeInfo resumeInfos[MAX_SEARCHES];
+
+#define resumeInfo PER_SEARCH(resumeInfos)
 
 // search_init() is called during startup to initialize various lookup tables
 
@@ -143,82 +231,281 @@ void search_init(void)
 }
 
 
-// search_clear() resets search state to zero, to obtain reproducible results
+static void cmh_clear(CounterMoveHistoryStat *cmh)
+{
+  stats_clear(cmh);
+  for (int chk = 0; chk < 2; chk++)
+    for (int c = 0; c < 2; c++)
+      for (int j = 0; j < HIST_PIECE_NB; j++)
+        for (int k = 0; k < 64; k++)
+          (*cmh)[chk][c][0][0][j][k] = CounterMovePruneThreshold - 1;
+}
+
+// search_clear_thread() resets the history tables of a thread. It is
+// called by the thread itself, also right after allocating its tables.
+// A counter move history table shared by several threads is cleared by
+// the first of them.
+
+void search_clear_thread(Position *pos)
+{
+  int idx = 0;
+  while (idx < pos->threadIdx && Threads.pos[idx]->counterMoveHistory != pos->counterMoveHistory)
+    idx++;
+  if (idx == pos->threadIdx)
+    cmh_clear(pos->counterMoveHistory);
+
+  stats_clear(pos->counterMoves);
+  stats_clear(pos->mainHistory);
+  stats_clear(pos->captureHistory);
+  stats_clear(pos->lowPlyHistory);
+  memset(pos->tbCache, 0, TB_CACHE_SIZE * sizeof(TBCacheEntry));
+#ifdef EVAL_CACHE
+  memset(pos->evalCache, 0, EVAL_CACHE_SIZE * sizeof(EvalCacheEntry));
+#endif
+}
+
+// search_clear() resets search state to zero, to obtain reproducible results.
+// The TT and the tablebases are shared by all searches, so in server mode
+// they are only cleared while no tagged search is running.
 
 void search_clear(void)
 {
-  if (!settings.ttSize) {
+  if (!settings.ttSize || threads_slots_busy()) {
     delayedSettings.clear = true;
     return;
   }
 
-  Time.availableNodes = 0;
-
-  tt_clear();
-  for (int i = 0; i < numCmhTables; i++)
-    if (cmhTables[i]) {
-      stats_clear(cmhTables[i]);
-      for (int chk = 0; chk < 2; chk++)
-        for (int c = 0; c < 2; c++)
-          for (int j = 0; j < 16; j++)
-            for (int k = 0; k < 64; k++)
-              (*cmhTables[i])[chk][c][0][0][j][k] = CounterMovePruneThreshold - 1;
-    }
-
-  for (int idx = 0; idx < Threads.numThreads; idx++) {
-    Position *pos = Threads.pos[idx];
-    stats_clear(pos->counterMoves);
-    stats_clear(pos->mainHistory);
-    stats_clear(pos->captureHistory);
-    stats_clear(pos->lowPlyHistory);
+  if (option_value(OPT_BG_CLEAR_HASH))
+    tt_clear_background();
+  else
+    tt_clear();
+
+  search_clear_threads();
+  resumeInfo.depth = 0;
+
+  // Clear counter move history tables of threads that no longer exist
+  int end = min(numCmhTables, (searchIdx + 1) * MAX_THREADS);
+  for (int i = searchIdx * MAX_THREADS; i < end; i++) {
+    int idx = 0;
+    while (idx < Threads.numCreated && Threads.pos[idx]->counterMoveHistory != cmhTables[i])
+      idx++;
+    if (cmhTables[i] && idx == Threads.numCreated)
+      cmh_clear(cmhTables[i]);
   }
 
   TB_release();
+}
+
+// search_clear_threads() resets the history tables of the threads of the
+// current search and its time management state. Parked threads are
+// cleared as well, so that they do not bring stale tables back into use
+// when they are unparked.
+
+void search_clear_threads(void)
+{
+  Time.availableNodes = 0;
+
+  // Let each thread clear its own tables, so that in NUMA mode the pages
+  // stay on the node of the thread using them.
+  for (int idx = 0; idx < Threads.numCreated; idx++)
+    thread_wake_up(Threads.pos[idx], THREAD_SEARCH_CLEAR);
+  for (int idx = 0; idx < Threads.numCreated; idx++)
+    thread_wait_until_sleeping(Threads.pos[idx]);
 
   mainThread.previousScore = VALUE_INFINITE;
   mainThread.previousTimeReduction = 1;
 }
 
 
-// perft() is our utility to verify move generation. All the leaf nodes
-// up to the given depth are generated and counted, and the sum is returned.
+#ifdef SEARCH_STATS
+
+// Name of each counter and the counter relative to which its rate is
+// printed, or -1 if none.
+static const struct {
+  const char *name;
+  int base;
+} StatInfo[STAT_NB] = {
+  [STAT_TT_PROBES]          = { "TT probes", -1 },
+  [STAT_TT_HITS]            = { "TT hits", STAT_TT_PROBES },
+  [STAT_TT_REPLACED]        = { "TT replaced", STAT_TT_PROBES },
+  [STAT_TT_LOCAL]           = { "TT local probes", STAT_TT_PROBES },
+  [STAT_TT_CUTOFFS]         = { "TT cutoffs", -1 },
+  [STAT_QSEARCH_NODES]      = { "QSearch nodes", -1 },
+  [STAT_NNUE_EVALS]         = { "NNUE evals", -1 },
+  [STAT_CLASSICAL_EVALS]    = { "Classical evals", -1 },
+  [STAT_NULL_MOVES]         = { "Null moves", -1 },
+  [STAT_NULL_CUTOFFS]       = { "Null cutoffs", STAT_NULL_MOVES },
+  [STAT_LMR_SEARCHES]       = { "LMR searches", -1 },
+  [STAT_LMR_RESEARCHES]     = { "LMR re-searches", STAT_LMR_SEARCHES },
+  [STAT_CRUMB_PROBES]       = { "Crumb probes", -1 },
+  [STAT_CRUMB_SHARED]       = { "Shared nodes", STAT_CRUMB_PROBES },
+  [STAT_SKIPPED_DEPTHS]     = { "Skipped depths", -1 },
+  [STAT_TB_CACHE_PROBES]    = { "TB cache probes", -1 },
+  [STAT_TB_CACHE_HITS]      = { "TB cache hits", STAT_TB_CACHE_PROBES },
+  [STAT_TB_PREFETCHES]      = { "TB prefetches", -1 },
+  [STAT_TB_PROBES]          = { "TB probes", -1 },
+  [STAT_TB_PROBE_USEC]      = { "TB probe usec", -1 },
+  [STAT_PAWN_PROBES]        = { "Pawn probes", -1 },
+  [STAT_PAWN_HITS]          = { "Pawn hits", STAT_PAWN_PROBES },
+  [STAT_PAWN_SHARED_PROBES] = { "Pawn shared", -1 },
+  [STAT_PAWN_SHARED_HITS]   = { "Pawn shared hits", STAT_PAWN_SHARED_PROBES },
+  [STAT_PAWN_FILLS]         = { "Pawn fills", STAT_PAWN_PROBES },
+  [STAT_MATERIAL_PROBES]    = { "Material probes", -1 },
+  [STAT_MATERIAL_HITS]      = { "Material hits", STAT_MATERIAL_PROBES },
+  [STAT_EVAL_CACHE_PROBES]  = { "EvalCache probes", -1 },
+  [STAT_EVAL_CACHE_HITS]    = { "EvalCache hits", STAT_EVAL_CACHE_PROBES },
+  [STAT_NNUE_INPUTS]        = { "NNUE inputs", -1 },
+  [STAT_NNUE_ACTIVE]        = { "Active inputs", STAT_NNUE_INPUTS },
+  [STAT_SMALL_NET_EVALS]    = { "Small net evals", -1 },
+  [STAT_SEE_PROBES]         = { "SEE probes", -1 },
+  [STAT_SEE_CACHE_HITS]     = { "SEE cache hits", STAT_SEE_PROBES },
+};
 
-static uint64_t perft_helper(Position *pos, Depth depth);
+// search_print_stats() prints search statistics as collected by
+// threads_search_stats(), one counter per line, each line starting with
+// the given prefix.
 
-INLINE uint64_t perft_node(Position *pos, Depth depth, const bool Root)
+void search_print_stats(FILE *F, const char *prefix, const uint64_t *stats)
 {
-  uint64_t cnt, nodes = 0;
-  const bool leaf = (depth == 2);
+  for (int i = 0; i < STAT_NB; i++) {
+    int base = StatInfo[i].base;
+    assert(StatInfo[i].name);
+    fprintf(F, "%s%-16s: %" PRIu64, prefix, StatInfo[i].name, stats[i]);
+    if (base >= 0 && stats[base])
+      fprintf(F, " (%.2f%%)", 100.0 * stats[i] / stats[base]);
+    fprintf(F, "\n");
+  }
+}
+
+#endif
+
+
+// copy_root_position() sets up a thread's position as a copy of the root
+// position, including enough of the root State buffer for repetition
+// detection.
+
+void copy_root_position(Position *pos, Position *root)
+{
+  memcpy(pos, root, offsetof(Position, moveList));
+  int n = max(7, root->st->pliesFromNull);
+  for (int i = 0; i <= n; i++)
+    memcpy(&pos->stack[i], &root->st[i - n], StateSize);
+  pos->st = pos->stack + n;
+  (pos->st-1)->endMoves = pos->moveList;
+  pos_set_check_info(pos);
+}
 
-  ExtMove *m = Root ? pos->moveList : (pos->st-1)->endMoves;
+
+// perft() is our utility to verify move generation. All the leaf nodes
+// up to the given depth are generated and counted, and the sum is returned.
+// The moves of the root position are distributed over the search threads.
+// Leaves are counted in bulk by generating the legal moves at depth 1 and,
+// if the "Perft Hash" option is set, subtree counts are cached in a hash
+// table.
+
+typedef struct {
+  Key keyXor; // key ^ data, so that torn entries are detected
+  uint64_t data; // count << 8 | depth, so counts below 2^56 only
+} PerftEntry;
+
+static struct {
+  PerftEntry *table;
+  size_t count;
+  Depth depth;
+  int numMoves;
+  atomic_int next;
+  Move moves[MAX_MOVES];
+  uint64_t counts[MAX_MOVES];
+} perftJob;
+
+static uint64_t perft_helper(Position *pos, Depth depth)
+{
+  PerftEntry *pe = NULL;
+  if (perftJob.table) {
+    pe = &perftJob.table[mul_hi64(key(), perftJob.count)];
+    uint64_t data = pe->data;
+    if ((pe->keyXor ^ data) == key() && (Depth)(data & 0xff) == depth)
+      return data >> 8;
+  }
+
+  uint64_t nodes = 0;
+  ExtMove *m = (pos->st-1)->endMoves;
   ExtMove *last = pos->st->endMoves = generate_legal(pos, m);
   for (; m < last; m++) {
-    if (Root && depth <= 1) {
-      cnt = 1;
-      nodes++;
-    } else {
-      do_move(pos, m->move, gives_check(pos, pos->st, m->move));
-      cnt = leaf ? (uint64_t)(generate_legal(pos, last) - last)
-                 : perft_helper(pos, depth - 1);
-      nodes += cnt;
-      undo_move(pos, m->move);
-    }
-    if (Root) {
-      char buf[16];
-      printf("%s: %"PRIu64"\n", uci_move(buf, m->move, is_chess960()), cnt);
-    }
+    do_move(pos, m->move, gives_check(pos, pos->st, m->move));
+    nodes += depth == 2 ? (uint64_t)(generate_legal(pos, last) - last)
+                        : perft_helper(pos, depth - 1);
+    undo_move(pos, m->move);
+  }
+
+  // Counts that do not fit next to the depth are not cached
+  if (pe && nodes < 1ULL << 56) {
+    uint64_t data = nodes << 8 | (uint64_t)depth;
+    pe->data = data;
+    pe->keyXor = key() ^ data;
   }
+
   return nodes;
 }
 
-static NOINLINE uint64_t perft_helper(Position *pos, Depth depth)
+// perft_worker() is called by the search threads. Each thread repeatedly
+// takes the next unsearched root move and counts its leaves.
+
+void perft_worker(Position *pos)
 {
-  return perft_node(pos, depth, false);
+  ExtMove *last = pos->st->endMoves = generate_legal(pos, pos->moveList);
+
+  int i;
+  while ((i = atomic_fetch_add(&perftJob.next, 1)) < perftJob.numMoves) {
+    Move m = perftJob.moves[i];
+    do_move(pos, m, gives_check(pos, pos->st, m));
+    perftJob.counts[i] =  perftJob.depth == 2
+                        ? (uint64_t)(generate_legal(pos, last) - last)
+                        : perft_helper(pos, perftJob.depth - 1);
+    undo_move(pos, m);
+  }
 }
 
-NOINLINE uint64_t perft(Position *pos, Depth depth)
+uint64_t perft(Position *pos, Depth depth)
 {
-  return perft_node(pos, depth, true);
+  ExtMove list[MAX_MOVES];
+  ExtMove *end = generate_legal(pos, list);
+  uint64_t nodes = 0;
+  char buf[16];
+
+  if (depth <= 1) {
+    for (ExtMove *m = list; m < end; m++)
+      printf("%s: 1\n", uci_move(buf, m->move, is_chess960()));
+    return end - list;
+  }
+
+  perftJob.depth = depth;
+  perftJob.numMoves = end - list;
+  atomic_store(&perftJob.next, 0);
+  for (int i = 0; i < perftJob.numMoves; i++)
+    perftJob.moves[i] = list[i].move;
+
+  size_t mb = option_value(OPT_PERFT_HASH);
+  perftJob.count = (mb << 20) / sizeof(PerftEntry);
+  perftJob.table = mb ? calloc(perftJob.count, sizeof(PerftEntry)) : NULL;
+
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    copy_root_position(Threads.pos[idx], pos);
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    thread_wake_up(Threads.pos[idx], THREAD_PERFT);
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    thread_wait_until_sleeping(Threads.pos[idx]);
+
+  free(perftJob.table);
+  perftJob.table = NULL;
+
+  for (int i = 0; i < perftJob.numMoves; i++) {
+    printf("%s: %"PRIu64"\n", uci_move(buf, perftJob.moves[i], is_chess960()),
+        perftJob.counts[i]);
+    nodes += perftJob.counts[i];
+  }
+
+  return nodes;
 }
 
 // mainthread_search() is called by the main thread when the program
@@ -228,13 +515,22 @@ NOINLINE uint64_t perft(Position *pos, Depth depth)
 void mainthread_search(void)
 {
   Position *pos = Threads.pos[0];
+#ifdef USE_MPI
+  if (!cluster_search_init())
+    return;
+#endif
   Color us = stm();
   time_init(us, game_ply());
   tt_new_search();
+  mainThread.pvTime = 0;
+  mainThread.pvPending = false;
+  memset(mainThread.pvHash, 0, sizeof(mainThread.pvHash));
   char buf[16];
   bool playBookMove = false;
 
 #ifdef NNUE
+  flockfile(stdout);
+  uci_print_tag();
   switch (useNNUE) {
   case EVAL_HYBRID:
     printf("info string Hybrid NNUE evaluation using %s enabled.\n", option_string_value(OPT_EVAL_FILE));
@@ -246,6 +542,7 @@ void mainthread_search(void)
     printf("info string Classical evaluation enabled.\n");
     break;
   }
+  funlockfile(stdout);
 #endif
 
   base_ct = option_value(OPT_CONTEMPT) * PawnValueEg / 100;
@@ -281,6 +578,10 @@ void mainthread_search(void)
       }
 
     if (!playBookMove) {
+      // A resumed search already has its root moves ordered.
+      if (!pos->rootDepth)
+        learn_seed(pos);
+      timer_start();
       Threads.pos[0]->bestMoveChanges = 0;
       for (int idx = 1; idx < Threads.numThreads; idx++) {
         Threads.pos[idx]->bestMoveChanges = 0;
@@ -296,7 +597,12 @@ void mainthread_search(void)
   // search, the UCI protocol states that we shouldn't print the best
   // move before the GUI sends a "stop" or "ponderhit" command. We
   // therefore simply wait here until the GUI sends one of those commands
-  // (which also raises Threads.stop).
+  // (which also raises Threads.stop). The other nodes of a cluster wait
+  // for rank 0 to stop them instead.
+#ifdef USE_MPI
+  if (!cluster_is_root())
+    cluster_wait_stop();
+#endif
   LOCK(Threads.lock);
   if (!Threads.stop && (Threads.ponder || Limits.infinite)) {
     Threads.sleeping = true;
@@ -307,6 +613,10 @@ void mainthread_search(void)
 
   // Stop the other threads if they have not stopped already
   Threads.stop = true;
+  timer_stop();
+#ifdef USE_MPI
+  cluster_stop();
+#endif
 
   // Wait until all threads have finished
   if (pos->rootMoves->size > 0) {
@@ -318,9 +628,19 @@ void mainthread_search(void)
     pos->rootMoves->move[0].pv[0] = 0;
     pos->rootMoves->move[0].pvSize = 1;
     pos->rootMoves->size++;
+    flockfile(stdout);
+    uci_print_tag();
     printf("info depth 0 score %s\n",
            uci_value(buf, checkers() ? -VALUE_MATE : VALUE_DRAW));
     fflush(stdout);
+    funlockfile(stdout);
+  }
+
+  // A ponder search that ends without ponderhit was a miss, unless the
+  // opponent played one of the other replies pondered.
+  if (Threads.ponder) {
+    ponderInfo.pending = true;
+    ponderInfo.endTime = now();
   }
 
   // When playing in 'nodes as time' mode, subtract the searched nodes from
@@ -341,9 +661,12 @@ void mainthread_search(void)
     int64_t votes[maxNum];
     Value minScore = pos->rootMoves->move[0].score;
     for (int idx = 1; idx < Threads.numThreads; idx++)
-      minScore = min(minScore, Threads.pos[idx]->rootMoves->move[0].score);
+      if (!Threads.pos[idx]->ponderGroup)
+        minScore = min(minScore, Threads.pos[idx]->rootMoves->move[0].score);
     for (int idx = 0; idx < Threads.numThreads; idx++) {
       Position *p = Threads.pos[idx];
+      if (p->ponderGroup)
+        continue;
       Move m = p->rootMoves->move[0].pv[0];
       for (i = 0; i < num; i++)
         if (mvs[i] == m) break;
@@ -357,6 +680,8 @@ void mainthread_search(void)
     int64_t bestVote = votes[0];
     for (int idx = 1; idx < Threads.numThreads; idx++) {
       Position *p = Threads.pos[idx];
+      if (p->ponderGroup)
+        continue;
       for (i = 0; mvs[i] != p->rootMoves->move[0].pv[0]; i++);
       if (abs(bestThread->rootMoves->move[0].score) >= VALUE_TB_WIN_IN_MAX_PLY) {
         // Make sure we pick the shortest mate
@@ -372,14 +697,23 @@ void mainthread_search(void)
     }
   }
 
+#ifdef USE_MPI
+  bestThread = cluster_pick_move(pos, bestThread,
+                                    option_value(OPT_MULTI_PV) == 1
+                                 && !playBookMove
+                                 && !Limits.depth
+                                 && pos->rootMoves->move[0].pv[0] != 0);
+#endif
+
   mainThread.previousScore = bestThread->rootMoves->move[0].score;
 
   // Send new PV when needed
-  if (bestThread != pos)
+  if (bestThread != pos || mainThread.pvPending)
     uci_print_pv(bestThread, bestThread->completedDepth,
-                 -VALUE_INFINITE, VALUE_INFINITE);
+                 -VALUE_INFINITE, VALUE_INFINITE, true);
 
   flockfile(stdout);
+  uci_print_tag();
   printf("bestmove %s", uci_move(buf, bestThread->rootMoves->move[0].pv[0], is_chess960()));
 
   if (bestThread->rootMoves->move[0].pvSize > 1 || extract_ponder_from_tt(&bestThread->rootMoves->move[0], pos))
@@ -388,9 +722,184 @@ void mainthread_search(void)
   printf("\n");
   fflush(stdout);
   funlockfile(stdout);
+
+  // Remember the result of the search, unless it was restricted to some
+  // of the root moves.
+  if (!playBookMove && !Limits.numSearchmoves && cluster_is_root())
+    learn_update(pos, &bestThread->rootMoves->move[0],
+                 bestThread->completedDepth);
+
+  resume_save(pos, bestThread,
+                 !playBookMove && !Limits.numSearchmoves && !TB_RootInTB
+              && bestThread->rootMoves->move[0].pv[0]);
+
+#ifdef SEARCH_TRACE
+  trace(pos, TRACE_BESTMOVE, TRACE_INSTANT, bestThread->threadIdx);
+  const char *traceFile = option_string_value(OPT_TRACE_FILE);
+  if (strcmp(traceFile, "<empty>") != 0)
+    trace_write(traceFile);
+#endif
 }
 
 
+// With the "MultiPV Split" option the threads do not each search all
+// PV lines in turn. Instead every root move is searched on its own with
+// a full aspiration window and the threads take the next unsearched move
+// of their current iteration from a shared queue. Results are collected
+// in a shared table from which the main thread builds the PV lines once
+// all moves of an iteration have been searched.
+
+typedef struct {
+  RootMove rm;
+  Depth depth;
+} SplitResult;
+
+static struct {
+  bool active;
+  int numMoves;
+  atomic_int next[MAX_PLY];
+  atomic_int done[MAX_PLY];
+  Move moves[MAX_MOVES];
+  SplitResult result[MAX_MOVES]; // protected by Threads.lock
+} rootSplits[MAX_SEARCHES];
+#define rootSplit PER_SEARCH(rootSplits)
+
+static void split_init(RootMoves *rm)
+{
+  int multiPV = min(option_value(OPT_MULTI_PV), rm->size);
+  rootSplit.active = option_value(OPT_MULTI_PV_SPLIT) && multiPV > 1;
+  if (!rootSplit.active)
+    return;
+
+  rootSplit.numMoves = rm->size;
+  for (int d = 0; d < MAX_PLY; d++) {
+    atomic_store(&rootSplit.next[d], 0);
+    atomic_store(&rootSplit.done[d], 0);
+  }
+  for (int i = 0; i < rm->size; i++) {
+    rootSplit.moves[i] = rm->move[i].pv[0];
+    rootSplit.result[i].rm = rm->move[i];
+    rootSplit.result[i].depth = 0;
+  }
+}
+
+// split_iteration() replaces the MultiPV loop of thread_search() when
+// root moves are split between threads. The main thread waits for the
+// other threads to finish the iteration, then sorts and prints the lines.
+
+static Value split_iteration(Position *pos, Stack *ss, int searchAgainCounter)
+{
+  RootMoves *rm = pos->rootMoves;
+  Depth depth = pos->rootDepth;
+  int i;
+
+  while (   !Threads.stop
+         && (i = atomic_fetch_add(&rootSplit.next[depth], 1)) < rootSplit.numMoves)
+  {
+    int idx = 0;
+    while (rm->move[idx].pv[0] != rootSplit.moves[i])
+      idx++;
+    RootMove *m = &rm->move[idx];
+    pos->pvIdx = idx;
+    pos->pvLast = idx + 1;
+    pos->selDepth = 0;
+
+    LOCK(Threads.lock);
+    Depth prevDepth = rootSplit.result[i].depth;
+    Value previousScore = rootSplit.result[i].rm.score;
+    UNLOCK(Threads.lock);
+
+    // Mate values from DTM tables need no search
+    if (abs(m->tbRank) > 1000) {
+      m->score = m->tbScore;
+      m->bound = BOUND_EXACT;
+    } else {
+      Value alpha = -VALUE_INFINITE, beta = VALUE_INFINITE, delta = 17;
+      int ct = base_ct;
+
+      if (depth >= 4 && prevDepth > 0) {
+        alpha = max(previousScore - delta, -VALUE_INFINITE);
+        beta  = min(previousScore + delta,  VALUE_INFINITE);
+        ct = base_ct + (113 - base_ct / 2) * previousScore / (abs(previousScore) + 147);
+      }
+      pos->contempt = stm() == WHITE ?  make_score(ct, ct / 2)
+                                     : -make_score(ct, ct / 2);
+
+      pos->failedHighCnt = 0;
+      while (true) {
+        Depth adjustedDepth = max(1, depth - pos->failedHighCnt - searchAgainCounter);
+        Value value = search_PV(pos, ss, alpha, beta, adjustedDepth);
+
+        if (Threads.stop)
+          break;
+
+        if (value <= alpha) {
+          beta = (alpha + beta) / 2;
+          alpha = max(value - delta, -VALUE_INFINITE);
+
+          pos->failedHighCnt = 0;
+          if (pos->threadIdx == 0)
+            Threads.stopOnPonderhit = false;
+        } else if (value >= beta) {
+          beta = min(value + delta, VALUE_INFINITE);
+          pos->failedHighCnt++;
+        } else
+          break;
+
+        delta += delta / 4 + 5;
+      }
+
+      if (Threads.stop)
+        break;
+    }
+
+    LOCK(Threads.lock);
+    if (depth > rootSplit.result[i].depth) {
+      rootSplit.result[i].rm = *m;
+      rootSplit.result[i].depth = depth;
+    }
+    UNLOCK(Threads.lock);
+    atomic_fetch_add(&rootSplit.done[depth], 1);
+  }
+
+  if (pos->threadIdx != 0)
+    return -VALUE_INFINITE;
+
+  while (   !Threads.stop
+         && atomic_load(&rootSplit.done[depth]) < rootSplit.numMoves)
+  {
+    check_time();
+#ifdef _WIN32
+    Sleep(1);
+#else
+    usleep(1000);
+#endif
+  }
+
+  // Lines that were not searched to the current depth are reported with
+  // their score from an earlier iteration.
+  LOCK(Threads.lock);
+  for (i = 0; i < rootSplit.numMoves; i++) {
+    SplitResult *r = &rootSplit.result[i];
+    int idx = 0;
+    while (rm->move[idx].pv[0] != r->rm.pv[0])
+      idx++;
+    rm->move[idx] = r->rm;
+    if (r->depth < depth) {
+      rm->move[idx].previousScore = r->depth ? r->rm.score : -VALUE_INFINITE;
+      rm->move[idx].score = -VALUE_INFINITE;
+    }
+  }
+  UNLOCK(Threads.lock);
+
+  stable_sort(rm->move, rm->size);
+  pos->pvIdx = 0;
+  uci_print_pv(pos, depth, -VALUE_INFINITE, VALUE_INFINITE, false);
+
+  return  rm->move[0].score != -VALUE_INFINITE ? rm->move[0].score
+        : rm->move[0].previousScore;
+}
+
 // thread_search() is the main iterative deepening loop. It calls search()
 // repeatedly with increasing depth until the allocated thinking time has
 // been consumed, the user stops the search, or the maximum search depth is
@@ -404,6 +913,7 @@ void thread_search(Position *pos)
   Depth lastBestMoveDepth = 0;
   double timeReduction = 1.0, totBestMoveChanges = 0;
   int iterIdx = 0;
+  uint64_t startNodes = pos->nodes;
 
   Stack *ss = pos->st; // At least the seventh element of the allocated array.
   for (int i = -7; i < 3; i++) {
@@ -411,6 +921,10 @@ void thread_search(Position *pos)
 #ifdef NNUE
     ss[i].accumulator.state[WHITE] = ACC_INIT;
     ss[i].accumulator.state[BLACK] = ACC_INIT;
+#ifndef NNUE_PURE
+    ss[i].accumulator.smallState[WHITE] = ACC_INIT;
+    ss[i].accumulator.smallState[BLACK] = ACC_INIT;
+#endif
 #endif
   }
   (ss-1)->endMoves = pos->moveList;
@@ -422,9 +936,11 @@ void thread_search(Position *pos)
     ss[i].ply = i;
   ss->pv = pv;
 
+  trace(pos, TRACE_SEARCH, TRACE_BEGIN, pos->threadIdx);
+
   bestValue = delta = alpha = -VALUE_INFINITE;
   beta = VALUE_INFINITE;
-  pos->completedDepth = 0;
+  pos->completedDepth = pos->rootDepth; // Nonzero if the search resumes
 
   if (pos->threadIdx == 0) {
     if (mainThread.previousScore == VALUE_INFINITE)
@@ -453,15 +969,30 @@ void thread_search(Position *pos)
   multiPV = min(multiPV, rm->size);
   pos->ttHitAverage = ttHitAverageWindow * ttHitAverageResolution / 2;
   int searchAgainCounter = 0;
+  bool skipDepths =   option_value(OPT_SKIP_DEPTHS)
+                    && pos->threadIdx > 0
+                    && !Limits.batch;
 
   // Iterative deepening loop until requested to stop or the target depth
   // is reached.
   while (   ++pos->rootDepth < MAX_PLY
-         && !Threads.stop
+         && !search_stopped(pos)
          && !(   Limits.depth
-              && pos->threadIdx == 0
+              && (pos->threadIdx == 0 || Limits.batch)
               && pos->rootDepth > Limits.depth))
   {
+    // Distribute helper threads over the depths so that they do not all
+    // search the same iteration at the same time.
+    if (skipDepths) {
+      int i = (pos->threadIdx - 1) % 20;
+      if (((pos->rootDepth + game_ply() + SkipPhase[i]) / SkipSize[i]) % 2) {
+        stat_inc(STAT_SKIPPED_DEPTHS);
+        continue;
+      }
+    }
+
+    trace(pos, TRACE_ITERATION, TRACE_BEGIN, pos->rootDepth);
+
     // Age out PV variability metric
     if (pos->threadIdx == 0)
       totBestMoveChanges /= 2;
@@ -479,8 +1010,11 @@ void thread_search(Position *pos)
     if (!Threads.increaseDepth)
       searchAgainCounter++;
 
+    if (rootSplit.active)
+      bestValue = split_iteration(pos, ss, searchAgainCounter);
+
     // MultiPV loop. We perform a full root search for each PV line
-    for (int pvIdx = 0; pvIdx < multiPV && !Threads.stop; pvIdx++) {
+    for (int pvIdx = 0; pvIdx < multiPV && !search_stopped(pos) && !rootSplit.active; pvIdx++) {
       pos->pvIdx = pvIdx;
       if (pvIdx == pvLast) {
         pvFirst = pvLast;
@@ -495,6 +1029,7 @@ void thread_search(Position *pos)
       // Skip the search if we have a mate value from DTM tables.
       if (abs(rm->move[pvIdx].tbRank) > 1000) {
         bestValue = rm->move[pvIdx].score = rm->move[pvIdx].tbScore;
+        rm->move[pvIdx].bound = BOUND_EXACT;
         alpha = -VALUE_INFINITE;
         beta = VALUE_INFINITE;
         goto skip_search;
@@ -519,7 +1054,9 @@ void thread_search(Position *pos)
       pos->failedHighCnt = 0;
       while (true) {
         Depth adjustedDepth = max(1, pos->rootDepth - pos->failedHighCnt - searchAgainCounter);
+        trace(pos, TRACE_ASPIRATION, TRACE_BEGIN, adjustedDepth);
         bestValue = search_PV(pos, ss, alpha, beta, adjustedDepth);
+        trace(pos, TRACE_ASPIRATION, TRACE_END, adjustedDepth);
 
         // Bring the best move to the front. It is critical that sorting
         // is done with a stable algorithm because all the values but the
@@ -532,20 +1069,22 @@ void thread_search(Position *pos)
         // If search has been stopped, we break immediately. Sorting and
         // writing PV back to TT is safe because RootMoves is still
         // valid, although it refers to the previous iteration.
-        if (Threads.stop)
+        if (search_stopped(pos))
           break;
 
         // When failing high/low give some update (without cluttering
         // the UI) before a re-search.
         if (   pos->threadIdx == 0
+            && !Limits.batch
             && multiPV == 1
             && (bestValue <= alpha || bestValue >= beta)
             && time_elapsed() > 3000)
-          uci_print_pv(pos, pos->rootDepth, alpha, beta);
+          uci_print_pv(pos, pos->rootDepth, alpha, beta, false);
 
         // In case of failing low/high increase aspiration window and
         // re-search, otherwise exit the loop.
         if (bestValue <= alpha) {
+          trace(pos, TRACE_FAIL_LOW, TRACE_INSTANT, bestValue);
           beta = (alpha + beta) / 2;
           alpha = max(bestValue - delta, -VALUE_INFINITE);
 
@@ -553,6 +1092,7 @@ void thread_search(Position *pos)
           if (pos->threadIdx == 0)
             Threads.stopOnPonderhit = false;
         } else if (bestValue >= beta) {
+          trace(pos, TRACE_FAIL_HIGH, TRACE_INSTANT, bestValue);
           beta = min(bestValue + delta, VALUE_INFINITE);
           pos->failedHighCnt++;
         } else
@@ -568,13 +1108,23 @@ void thread_search(Position *pos)
 
 skip_search:
       if (    pos->threadIdx == 0
+          && !Limits.batch
           && (Threads.stop || pvIdx + 1 == multiPV || time_elapsed() > 3000))
-        uci_print_pv(pos, pos->rootDepth, alpha, beta);
+        uci_print_pv(pos, pos->rootDepth, alpha, beta, Threads.stop);
     }
 
-    if (!Threads.stop)
+    trace(pos, TRACE_ITERATION, TRACE_END, pos->rootDepth);
+
+    if (!search_stopped(pos))
       pos->completedDepth = pos->rootDepth;
 
+    // Batch searches have a node limit per thread that is only checked
+    // between iterations.
+    if (   Limits.batch
+        && Limits.nodes
+        && pos->nodes - startNodes >= Limits.nodes)
+      break;
+
     if (rm->move[0].pv[0] != lastBestMove) {
       lastBestMove = rm->move[0].pv[0];
       lastBestMoveDepth = pos->rootDepth;
@@ -582,6 +1132,7 @@ skip_search:
 
     // Have we found a "mate in x"?
     if (   Limits.mate
+        && !pos->ponderGroup
         && bestValue >= VALUE_MATE_IN_MAX_PLY
         && VALUE_MATE - bestValue <= 2 * Limits.mate)
       Threads.stop = true;
@@ -597,6 +1148,7 @@ skip_search:
 
     // Do we have time for the next iteration? Can we stop searching now?
     if (    use_time_management()
+        &&  cluster_is_root()
         && !Threads.stop
         && !Threads.stopOnPonderhit)
     {
@@ -644,6 +1196,16 @@ skip_search:
     iterIdx = (iterIdx + 1) & 3;
   }
 
+  trace(pos, TRACE_SEARCH, TRACE_END, pos->threadIdx);
+
+  // After ponderhit, a thread that pondered another reply continues with
+  // the position after the expected reply.
+  if (pos->ponderGroup && !Threads.stop) {
+    ponder_rejoin(pos);
+    thread_search(pos);
+    return;
+  }
+
   if (pos->threadIdx != 0)
     return;
 
@@ -694,7 +1256,7 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
   assert(!(PvNode && cutNode));
 
   Move pv[MAX_PLY+1], capturesSearched[32], quietsSearched[64];
-  TTEntry *tte;
+  TTEntry *tte, ttData;
   Key posKey;
   Move ttMove, move, excludedMove, bestMove;
   Depth extension, newDepth;
@@ -714,13 +1276,15 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
   // Check for the available remaining time
   if (load_rlx(pos->resetCalls)) {
     store_rlx(pos->resetCalls, false);
-    pos->callsCnt = Limits.nodes ? min(1024, Limits.nodes / 1024) : 1024;
+    pos->callsCnt =  Limits.nodes && !Limits.batch
+                   ? min(1024, Limits.nodes / 1024) : 1024;
   }
   if (--pos->callsCnt <= 0) {
     for (int idx = 0; idx < Threads.numThreads; idx++)
       store_rlx(Threads.pos[idx]->resetCalls, true);
 
     check_time();
+    trace(pos, TRACE_CHECK_TIME, TRACE_INSTANT, Threads.stop);
   }
 
   // Used to send selDepth info to GUI
@@ -729,7 +1293,7 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
 
   if (!rootNode) {
     // Step 2. Check for aborted search and immediate draw
-    if (load_rlx(Threads.stop) || is_draw(pos) || ss->ply >= MAX_PLY)
+    if (search_stopped(pos) || is_draw(pos) || ss->ply >= MAX_PLY)
       return  ss->ply >= MAX_PLY && !inCheck ? evaluate(pos)
                                              : value_draw(pos);
 
@@ -774,12 +1338,18 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
   // use a different position key in case of an excluded move.
   excludedMove = ss->excludedMove;
   posKey = !excludedMove ? key() : key() ^ make_key(excludedMove);
-  tte = tt_probe(posKey, &ss->ttHit);
-  ttValue = ss->ttHit ? value_from_tt(tte_value(tte), ss->ply, rule50_count()) : VALUE_NONE;
+  tte = tt_probe(posKey, &ss->ttHit, &ttData);
+  stat_inc(STAT_TT_PROBES);
+  stat_add(STAT_TT_HITS, ss->ttHit);
+  stat_add(STAT_TT_REPLACED, !ss->ttHit && !tte_is_empty(&ttData));
+#ifdef NUMA
+  stat_add(STAT_TT_LOCAL, tt_shard_node(posKey) == pos->numaNode);
+#endif
+  ttValue = ss->ttHit ? value_from_tt(tte_value(&ttData), ss->ply, rule50_count()) : VALUE_NONE;
   ttMove =  rootNode ? pos->rootMoves->move[pos->pvIdx].pv[0]
-          : ss->ttHit    ? tte_move(tte) : 0;
+          : ss->ttHit    ? tte_move(&ttData) : 0;
   if (!excludedMove)
-    ss->ttPv = PvNode || (ss->ttHit && tte_is_pv(tte));
+    ss->ttPv = PvNode || (ss->ttHit && tte_is_pv(&ttData));
   formerPv = ss->ttPv && !PvNode;
 
   if (   ss->ttPv
@@ -795,10 +1365,10 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
   // At non-PV nodes we check for an early TT cutoff.
   if (  !PvNode
       && ss->ttHit
-      && tte_depth(tte) >= depth
+      && tte_depth(&ttData) >= depth
       && ttValue != VALUE_NONE // Possible in case of TT access race.
-      && (ttValue >= beta ? (tte_bound(tte) & BOUND_LOWER)
-                          : (tte_bound(tte) & BOUND_UPPER)))
+      && (ttValue >= beta ? (tte_bound(&ttData) & BOUND_LOWER)
+                          : (tte_bound(&ttData) & BOUND_UPPER)))
   {
     // If ttMove is quiet, update move sorting heuristics on TT hit.
     if (ttMove) {
@@ -817,8 +1387,10 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
         update_cm_stats(ss, moved_piece(ttMove), to_sq(ttMove), penalty);
       }
     }
-    if (rule50_count() < 90)
+    if (rule50_count() < 90) {
+      stat_inc(STAT_TT_CUTOFFS);
       return ttValue;
+    }
   }
 
   // Step 5. Tablebase probe
@@ -830,7 +1402,9 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
         &&  rule50_count() == 0
         && !can_castle_any())
     {
+      trace(pos, TRACE_TB_PROBE, TRACE_BEGIN, piecesCnt);
       int found, wdl = TB_probe_wdl(pos, &found);
+      trace(pos, TRACE_TB_PROBE, TRACE_END, piecesCnt);
 
       if (found) {
         pos->tbHits++;
@@ -872,6 +1446,14 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
         }
       }
     }
+
+    // Let the OS read ahead the tablebase blocks that the children
+    // entering the tablebase range will probe.
+    else if (   TB_Prefetch
+             && piecesCnt == TB_Cardinality + 1
+             && depth > TB_ProbeDepth
+             && !can_castle_any())
+      TB_prefetch_captures(pos);
   }
 
   // Step 6. Static evaluation of the position
@@ -882,7 +1464,7 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
     goto moves_loop;
   } else if (ss->ttHit) {
     // Never assume anything about values stored in TT
-    if ((eval = tte_eval(tte)) == VALUE_NONE)
+    if ((eval = tte_eval(&ttData)) == VALUE_NONE)
       eval = evaluate(pos);
     ss->staticEval = eval;
 
@@ -891,7 +1473,7 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
 
     // Can ttValue be used as a better position evaluation?
     if (   ttValue != VALUE_NONE
-        && (tte_bound(tte) & (ttValue > eval ? BOUND_LOWER : BOUND_UPPER)))
+        && (tte_bound(&ttData) & (ttValue > eval ? BOUND_LOWER : BOUND_UPPER)))
       eval = ttValue;
   } else {
     if ((ss-1)->currentMove != MOVE_NULL)
@@ -945,8 +1527,11 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
     ss->endMoves = (ss-1)->endMoves;
     Value nullValue = -search_NonPV(pos, ss+1, -beta, depth-R, !cutNode);
     undo_null_move(pos);
+    stat_inc(STAT_NULL_MOVES);
 
     if (nullValue >= beta) {
+      stat_inc(STAT_NULL_CUTOFFS);
+
       // Do not return unproven mate or TB scores
       if (nullValue >= VALUE_TB_WIN_IN_MAX_PLY)
         nullValue = beta;
@@ -979,12 +1564,12 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
       &&  depth > 4
       &&  abs(beta) < VALUE_TB_WIN_IN_MAX_PLY
       && !(   ss->ttHit
-           && tte_depth(tte) >= depth - 3
+           && tte_depth(&ttData) >= depth - 3
            && ttValue != VALUE_NONE
            && ttValue < probCutBeta))
   {
     if (   ss->ttHit
-        && tte_depth(tte) >= depth - 3
+        && tte_depth(&ttData) >= depth - 3
         && ttValue != VALUE_NONE
         && ttValue >= probCutBeta
         && ttMove
@@ -1006,7 +1591,7 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
         probCutCount--;
 
         ss->currentMove = move;
-        ss->history = &(*pos->counterMoveHistory)[inCheck][captureOrPromotion][moved_piece(move)][to_sq(move)];
+        ss->history = &(*pos->counterMoveHistory)[inCheck][captureOrPromotion][hist_piece(moved_piece(move))][to_sq(move)];
         givesCheck = gives_check(pos, ss, move);
         do_move(pos, move, givesCheck);
 
@@ -1022,7 +1607,7 @@ INLINE Value search_node(Position *pos, Stack *ss, Value alpha, Value beta,
         undo_move(pos, move);
         if (value >= probCutBeta) {
           if (!(   ss->ttHit
-                && tte_depth(tte) >= depth - 3
+                && tte_depth(&ttData) >= depth - 3
                 && ttValue != VALUE_NONE))
             tte_save(tte, posKey, value_to_tt(value, ss->ply), ttPv,
                 BOUND_LOWER, depth - 3, move, ss->staticEval);
@@ -1053,6 +1638,7 @@ moves_loop: // When in check search starts from here.
   _Atomic uint64_t *crumb = NULL;
   bool marked = false;
   if (ss->ply < 8) {
+    stat_inc(STAT_CRUMB_PROBES);
     crumb = &breadcrumbs[posKey & 1023];
     // The next line assumes there are at most 65535 search threads
     uint64_t v = (posKey & ~0xffffULL) | (pos->threadIdx + 1), expected = 0ULL;
@@ -1064,8 +1650,10 @@ moves_loop: // When in check search starts from here.
       crumb = NULL;
       // Was the crumb is for the same position and was left by another thread?
       v ^= expected;
-      if (v != 0 && (v & ~0xffffULL) == 0)
+      if (v != 0 && (v & ~0xffffULL) == 0) {
         marked = true;
+        stat_inc(STAT_CRUMB_SHARED);
+      }
     }
   }
 
@@ -1097,13 +1685,20 @@ moves_loop: // When in check search starts from here.
 
     ss->moveCount = ++moveCount;
 
-    if (rootNode && pos->threadIdx == 0 && time_elapsed() > 3000) {
+    if (   rootNode
+        && pos->threadIdx == 0
+        && !Limits.batch
+        && time_elapsed() > 3000)
+    {
       char buf[16];
+      flockfile(stdout);
+      uci_print_tag();
       printf("info depth %d currmove %s currmovenumber %d\n",
              depth,
              uci_move(buf, move, is_chess960()),
              moveCount + pos->pvIdx);
       fflush(stdout);
+      funlockfile(stdout);
     }
 
     if (PvNode)
@@ -1134,18 +1729,18 @@ moves_loop: // When in check search starts from here.
       {
         // Countermoves based pruning
         if (   lmrDepth < 4 + ((ss-1)->statScore > 0 || (ss-1)->moveCount == 1)
-            && (*cmh )[movedPiece][to_sq(move)] < CounterMovePruneThreshold
-            && (*fmh )[movedPiece][to_sq(move)] < CounterMovePruneThreshold)
+            && (*cmh )[hist_piece(movedPiece)][to_sq(move)] < CounterMovePruneThreshold
+            && (*fmh )[hist_piece(movedPiece)][to_sq(move)] < CounterMovePruneThreshold)
           continue;
 
         // Futility pruning: parent node
         if (   lmrDepth < 7
             && !inCheck
             && ss->staticEval + 254 + 159 * lmrDepth <= alpha
-            &&  (*cmh )[movedPiece][to_sq(move)]
-              + (*fmh )[movedPiece][to_sq(move)]
-              + (*fmh2)[movedPiece][to_sq(move)]
-              + (*fmh3)[movedPiece][to_sq(move)] / 2 < 26394)
+            &&  (*cmh )[hist_piece(movedPiece)][to_sq(move)]
+              + (*fmh )[hist_piece(movedPiece)][to_sq(move)]
+              + (*fmh2)[hist_piece(movedPiece)][to_sq(move)]
+              + (*fmh3)[hist_piece(movedPiece)][to_sq(move)] / 2 < 26394)
           continue;
 
         // Prune moves with negative SEE at low depths and below a decreasing
@@ -1179,8 +1774,8 @@ moves_loop: // When in check search starts from here.
         && !excludedMove // No recursive singular search
      /* &&  ttValue != VALUE_NONE implicit in the next condition */
         &&  abs(ttValue) < VALUE_KNOWN_WIN
-        && (tte_bound(tte) & BOUND_LOWER)
-        &&  tte_depth(tte) >= depth - 3)
+        && (tte_bound(&ttData) & BOUND_LOWER)
+        &&  tte_depth(&ttData) >= depth - 3)
     {
       Value singularBeta = ttValue - ((formerPv + 4) * depth) / 2;
       Depth singularDepth = (depth - 1 + 3 * formerPv) / 2;
@@ -1252,7 +1847,7 @@ moves_loop: // When in check search starts from here.
     // Update the current move (this must be done after singular extension
     // search)
     ss->currentMove = move;
-    ss->history = &(*pos->counterMoveHistory)[inCheck][captureOrPromotion][movedPiece][to_sq(move)];
+    ss->history = &(*pos->counterMoveHistory)[inCheck][captureOrPromotion][hist_piece(movedPiece)][to_sq(move)];
 
     // Step 14. Make the move.
     do_move(pos, move, givesCheck);
@@ -1320,9 +1915,9 @@ moves_loop: // When in check search starts from here.
                  && !see_test(pos, reverse_move(move), 0))
           r -= 2 + ss->ttPv - (type_of_p(movedPiece) == PAWN);
 
-        ss->statScore =  (*cmh )[movedPiece][to_sq(move)]
-                       + (*fmh )[movedPiece][to_sq(move)]
-                       + (*fmh2)[movedPiece][to_sq(move)]
+        ss->statScore =  (*cmh )[hist_piece(movedPiece)][to_sq(move)]
+                       + (*fmh )[hist_piece(movedPiece)][to_sq(move)]
+                       + (*fmh2)[hist_piece(movedPiece)][to_sq(move)]
                        + (*pos->mainHistory)[!stm()][from_to(move)]
                        - 5287;
 
@@ -1347,6 +1942,7 @@ moves_loop: // When in check search starts from here.
       Depth d = clamp(newDepth - r, 1, newDepth);
 
       value = -search_NonPV(pos, ss+1, -(alpha+1), d, 1);
+      stat_inc(STAT_LMR_SEARCHES);
 
       doFullDepthSearch = (value > alpha && d != newDepth);
       didLMR = true;
@@ -1359,6 +1955,9 @@ moves_loop: // When in check search starts from here.
     if (doFullDepthSearch) {
       value = -search_NonPV(pos, ss+1, -(alpha+1), newDepth, !cutNode);
 
+      if (didLMR)
+        stat_inc(STAT_LMR_RESEARCHES);
+
       if (didLMR && !captureOrPromotion) {
         int bonus = value > alpha ?  stat_bonus(newDepth)
                                   : -stat_bonus(newDepth);
@@ -1390,7 +1989,7 @@ moves_loop: // When in check search starts from here.
     // Finished searching the move. If a stop occurred, the return value of
     // the search cannot be trusted, and we return immediately without
     // updating best move, PV and TT.
-    if (load_rlx(Threads.stop)) {
+    if (search_stopped(pos)) {
       if (crumb) store_rlx(*crumb, 0);
       return 0;
     }
@@ -1406,6 +2005,8 @@ moves_loop: // When in check search starts from here.
       // PV move or new best move ?
       if (moveCount == 1 || value > alpha) {
         rm->score = value;
+        rm->bound =  value >= beta ? BOUND_LOWER
+                   : value <= alpha ? BOUND_UPPER : BOUND_EXACT;
         rm->selDepth = pos->selDepth;
         rm->pvSize = 1;
 
@@ -1513,11 +2114,14 @@ moves_loop: // When in check search starts from here.
   else if (depth > 3)
     ss->ttPv = ss->ttPv && (ss+1)->ttPv;
 
-  if (!excludedMove && !(rootNode && pos->pvIdx))
-    tte_save(tte, posKey, value_to_tt(bestValue, ss->ply), ss->ttPv,
-        bestValue >= beta ? BOUND_LOWER :
-        PvNode && bestMove ? BOUND_EXACT : BOUND_UPPER,
+  if (!excludedMove && !(rootNode && (pos->pvIdx || rootSplit.active))) {
+    int b =  bestValue >= beta ? BOUND_LOWER
+           : PvNode && bestMove ? BOUND_EXACT : BOUND_UPPER;
+    tte_save(tte, posKey, value_to_tt(bestValue, ss->ply), ss->ttPv, b,
         depth, bestMove, ss->staticEval);
+    cluster_save(pos, posKey, value_to_tt(bestValue, ss->ply), ss->ttPv, b,
+        depth, bestMove, ss->staticEval);
+  }
 
   assert(bestValue > -VALUE_INFINITE && bestValue < VALUE_INFINITE);
 
@@ -1552,7 +2156,7 @@ INLINE Value qsearch_node(Position *pos, Stack *ss, Value alpha, Value beta,
   assert(depth <= 0);
 
   Move pv[MAX_PLY+1];
-  TTEntry *tte;
+  TTEntry *tte, ttData;
   Key posKey;
   Move ttMove, move, bestMove;
   Value bestValue, value, ttValue, futilityValue, futilityBase, oldAlpha;
@@ -1568,6 +2172,7 @@ INLINE Value qsearch_node(Position *pos, Stack *ss, Value alpha, Value beta,
 
   bestMove = 0;
   moveCount = 0;
+  stat_inc(STAT_QSEARCH_NODES);
 
   // Check for an instant draw or if the maximum ply has been reached
   if (is_draw(pos) || ss->ply >= MAX_PLY)
@@ -1583,18 +2188,27 @@ INLINE Value qsearch_node(Position *pos, Stack *ss, Value alpha, Value beta,
 
   // Transposition table lookup
   posKey = key();
-  tte = tt_probe(posKey, &ss->ttHit);
-  ttValue = ss->ttHit ? value_from_tt(tte_value(tte), ss->ply, rule50_count()) : VALUE_NONE;
-  ttMove = ss->ttHit ? tte_move(tte) : 0;
-  pvHit = ss->ttHit && tte_is_pv(tte);
+  tte = tt_probe(posKey, &ss->ttHit, &ttData);
+  stat_inc(STAT_TT_PROBES);
+  stat_add(STAT_TT_HITS, ss->ttHit);
+  stat_add(STAT_TT_REPLACED, !ss->ttHit && !tte_is_empty(&ttData));
+#ifdef NUMA
+  stat_add(STAT_TT_LOCAL, tt_shard_node(posKey) == pos->numaNode);
+#endif
+  ttValue = ss->ttHit ? value_from_tt(tte_value(&ttData), ss->ply, rule50_count()) : VALUE_NONE;
+  ttMove = ss->ttHit ? tte_move(&ttData) : 0;
+  pvHit = ss->ttHit && tte_is_pv(&ttData);
 
   if (  !PvNode
       && ss->ttHit
-      && tte_depth(tte) >= ttDepth
+      && tte_depth(&ttData) >= ttDepth
       && ttValue != VALUE_NONE // Only in case of TT access race
-      && (ttValue >= beta ? (tte_bound(tte) &  BOUND_LOWER)
-                          : (tte_bound(tte) &  BOUND_UPPER)))
+      && (ttValue >= beta ? (tte_bound(&ttData) &  BOUND_LOWER)
+                          : (tte_bound(&ttData) &  BOUND_UPPER)))
+  {
+    stat_inc(STAT_TT_CUTOFFS);
     return ttValue;
+  }
 
   // Evaluate the position statically
   if (InCheck) {
@@ -1603,12 +2217,12 @@ INLINE Value qsearch_node(Position *pos, Stack *ss, Value alpha, Value beta,
   } else {
     if (ss->ttHit) {
       // Never assume anything about values stored in TT
-      if ((ss->staticEval = bestValue = tte_eval(tte)) == VALUE_NONE)
+      if ((ss->staticEval = bestValue = tte_eval(&ttData)) == VALUE_NONE)
          ss->staticEval = bestValue = evaluate(pos);
 
       // Can ttValue be used as a better position evaluation?
       if (    ttValue != VALUE_NONE
-          && (tte_bound(tte) & (ttValue > bestValue ? BOUND_LOWER : BOUND_UPPER)))
+          && (tte_bound(&ttData) & (ttValue > bestValue ? BOUND_LOWER : BOUND_UPPER)))
         bestValue = ttValue;
     } else
       ss->staticEval = bestValue =
@@ -1688,13 +2302,13 @@ INLINE Value qsearch_node(Position *pos, Stack *ss, Value alpha, Value beta,
     bool captureOrPromotion = is_capture_or_promotion(pos, move);
     ss->history = &(*pos->counterMoveHistory)[InCheck]
                                            [captureOrPromotion]
-                                           [moved_piece(move)]
+                                           [hist_piece(moved_piece(move))]
                                            [to_sq(move)];
 
     if (  !captureOrPromotion
         && bestValue > VALUE_TB_LOSS_IN_MAX_PLY
-        && (*(ss-1)->history)[moved_piece(move)][to_sq(move)] < CounterMovePruneThreshold
-        && (*(ss-2)->history)[moved_piece(move)][to_sq(move)] < CounterMovePruneThreshold)
+        && (*(ss-1)->history)[hist_piece(moved_piece(move))][to_sq(move)] < CounterMovePruneThreshold
+        && (*(ss-2)->history)[hist_piece(moved_piece(move))][to_sq(move)] < CounterMovePruneThreshold)
       continue;
 
     // Make and search the move
@@ -1833,9 +2447,15 @@ static void update_pv(Move *pv, Move move, Move *childPv)
 
 
 // update_cm_stats() updates countermove and follow-up move history.
+// After castling, the target square of the castling move (the square of
+// its rook) may be empty. Entries of an empty square are never read, and
+// compact tables have no room for them, so they are not updated.
 
 static void update_cm_stats(Stack *ss, Piece pc, Square s, int bonus)
 {
+  if (!pc)
+    return;
+
   if (move_is_ok((ss-1)->currentMove))
     cms_update(*(ss-1)->history, pc, s, bonus);
 
@@ -1938,35 +2558,141 @@ static void update_quiet_stats(const Position *pos, Stack *ss, Move move,
 // check_time() is used to print debug info and, more importantly, to detect
 // when we are out of available time and thus stop the search.
 
-static void check_time(void)
+static bool time_up(void)
 {
   TimePoint elapsed = time_elapsed();
 
-  // An engine may not stop pondering until told so by the GUI
-  if (Threads.ponder)
+  return   (use_time_management() && elapsed > time_maximum() - 10)
+        || (Limits.movetime && elapsed >= Limits.movetime);
+}
+
+static void check_time(void)
+{
+  cluster_poll();
+
+  // An engine may not stop pondering until told so by the GUI. The other
+  // nodes of a cluster are stopped by rank 0.
+  if (Threads.ponder || !cluster_is_root())
     return;
 
-  if (   (use_time_management() && elapsed > time_maximum() - 10)
-      || (Limits.movetime && elapsed >= Limits.movetime)
-      || (Limits.nodes && threads_nodes_searched() >= Limits.nodes))
+  // The clock is left to the timer thread if there is one
+  if (   (!timerActive && time_up())
+      || (   Limits.nodes
+          && !Limits.batch
+          && threads_nodes_searched() >= Limits.nodes))
         Threads.stop = 1;
 }
 
+// With the "Timer Thread" option, a separate thread watches the clock and
+// raises Threads.stop when the time is up, so that the search threads
+// only have to count nodes.
+
+static THREAD_FUNC timer_loop(void *arg)
+{
+#ifdef SERVER
+  searchIdx = (intptr_t)arg;
+#else
+  (void)arg;
+#endif
+
+  while (!Threads.stop) {
+    if (!Threads.ponder && time_up())
+      Threads.stop = 1;
+    else
+#ifndef _WIN32
+      usleep(1000);
+#else
+      Sleep(1);
+#endif
+  }
+
+  return 0;
+}
+
+static void timer_start(void)
+{
+  timerActive =   option_value(OPT_TIMER_THREAD)
+               && cluster_is_root()
+               && !Limits.npmsec
+               && (use_time_management() || Limits.movetime);
+  if (!timerActive)
+    return;
+
+#ifndef _WIN32
+  timerActive = pthread_create(&timerThread, NULL, timer_loop,
+                               (void *)(intptr_t)searchIdx) == 0;
+#else
+  timerThread = CreateThread(NULL, 0, timer_loop,
+                             (void *)(intptr_t)searchIdx, 0, NULL);
+  timerActive = timerThread != NULL;
+#endif
+}
+
+// timer_stop() waits for the timer thread. Threads.stop must have been
+// raised.
+
+static void timer_stop(void)
+{
+  if (!timerActive)
+    return;
+
+#ifndef _WIN32
+  pthread_join(timerThread, NULL);
+#else
+  WaitForSingleObject(timerThread, INFINITE);
+  CloseHandle(timerThread);
+#endif
+  timerActive = false;
+}
+
 // uci_print_pv() prints PV information according to the UCI protocol.
 // UCI requires that all (if any) unsearched PV lines are sent with a
-// previous search score.
-
-static void uci_print_pv(Position *pos, Depth depth, Value alpha, Value beta)
+// previous search score. All lines are formatted into one buffer that is
+// written at once. With "PV Interval", updates closer than the given time
+// to the previous one are skipped, unless final is set, and the last one
+// skipped is printed at the end of the search. With "PV Changed Only",
+// lines whose depth, score and PV did not change since they were last
+// printed are left out, except from the final output.
+
+static void uci_print_pv(Position *pos, Depth depth, Value alpha, Value beta,
+    bool final)
 {
   TimePoint elapsed = time_elapsed() + 1;
+  int interval = option_value(OPT_PV_INTERVAL);
+
+  if (!final && interval && elapsed - mainThread.pvTime < interval) {
+    mainThread.pvPending = true;
+    return;
+  }
+  mainThread.pvTime = elapsed;
+  mainThread.pvPending = false;
+
   RootMoves *rm = pos->rootMoves;
   int pvIdx = pos->pvIdx;
   int multiPV = min(option_value(OPT_MULTI_PV), rm->size);
+  bool changedOnly = !final && option_value(OPT_PV_CHANGED_ONLY);
   uint64_t nodes_searched = threads_nodes_searched();
   uint64_t tbhits = threads_tb_hits();
-  char buf[16];
+  char buf[16], tag[80], tail[160];
+  static const char *BoundStr[] = { "", " lowerbound", " upperbound" };
+
+  // The tag and the fields after the score are the same for all lines.
+  size_t tagLen = strlen(uci_tag(tag));
+  size_t tailLen = sprintf(tail, " nodes %"PRIu64" nps %"PRIu64,
+                           nodes_searched, nodes_searched * 1000 / elapsed);
+  if (elapsed > 1000)
+    tailLen += sprintf(tail + tailLen, " hashfull %d", tt_hashfull());
+  tailLen += sprintf(tail + tailLen, " tbhits %"PRIu64" time %"PRIi64" pv",
+                     tbhits, elapsed);
+
+  size_t size = multiPV * (tagLen + tailLen + 96 + 6 * MAX_PLY);
+  if (mainThread.pvBufSize < size) {
+    free(mainThread.pvBuf);
+    mainThread.pvBuf = malloc(size);
+    mainThread.pvBufSize = size;
+  }
+  char *out = mainThread.pvBuf;
 
-  flockfile(stdout);
   for (int i = 0; i < multiPV; i++) {
     bool updated = rm->move[i].score != -VALUE_INFINITE;
 
@@ -1991,25 +2717,35 @@ static void uci_print_pv(Position *pos, Depth depth, Value alpha, Value beta)
         && TB_MaxCardinalityDTM > 0)
       TB_expand_mate(pos, &rm->move[i]);
 
-    printf("info depth %d seldepth %d multipv %d score %s",
-           d, rm->move[i].selDepth + 1, i + 1,
-           uci_value(buf, v));
-
-    if (!tb && i == pvIdx)
-      printf("%s", v >= beta ? " lowerbound" : v <= alpha ? " upperbound" : "");
-
-    printf(" nodes %"PRIu64" nps %"PRIu64, nodes_searched,
-                              nodes_searched * 1000 / elapsed);
-
-    if (elapsed > 1000)
-      printf(" hashfull %d", tt_hashfull());
-
-    printf(" tbhits %"PRIu64" time %"PRIi64" pv", tbhits, elapsed);
+    int bound = tb || i != pvIdx ? 0 : v >= beta ? 1 : v <= alpha ? 2 : 0;
 
+    uint64_t h = (uint64_t)bound << 48 ^ (uint64_t)d << 32 ^ (uint32_t)v;
     for (int idx = 0; idx < rm->move[i].pvSize; idx++)
-      printf(" %s", uci_move(buf, rm->move[i].pv[idx], is_chess960()));
-    printf("\n");
+      h = (h ^ rm->move[i].pv[idx]) * 0x100000001b3ULL;
+    if (changedOnly && h == mainThread.pvHash[i])
+      continue;
+    mainThread.pvHash[i] = h;
+
+    memcpy(out, tag, tagLen);
+    out += tagLen;
+    out += sprintf(out, "info depth %d seldepth %d multipv %d score %s%s",
+                   d, rm->move[i].selDepth + 1, i + 1, uci_value(buf, v),
+                   BoundStr[bound]);
+    memcpy(out, tail, tailLen);
+    out += tailLen;
+
+    for (int idx = 0; idx < rm->move[i].pvSize; idx++) {
+      const char *m = uci_move(buf, rm->move[i].pv[idx], is_chess960());
+      size_t len = strlen(m);
+      *out++ = ' ';
+      memcpy(out, m, len);
+      out += len;
+    }
+    *out++ = '\n';
   }
+
+  flockfile(stdout);
+  fwrite(mainThread.pvBuf, 1, out - mainThread.pvBuf, stdout);
   fflush(stdout);
   funlockfile(stdout);
 }
@@ -2031,10 +2767,11 @@ static int extract_ponder_from_tt(RootMove *rm, Position *pos)
     return 0;
 
   do_move(pos, rm->pv[0], gives_check(pos, pos->st, rm->pv[0]));
-  TTEntry *tte = tt_probe(key(), &ttHit);
+  TTEntry ttData;
+  tt_probe(key(), &ttHit, &ttData);
 
   if (ttHit) {
-    Move m = tte_move(tte); // Local copy to be SMP safe
+    Move m = tte_move(&ttData);
     ExtMove list[MAX_MOVES];
     ExtMove *last = generate_legal(pos, list);
     for (ExtMove *p = list; p < last; p++)
@@ -2048,13 +2785,15 @@ static int extract_ponder_from_tt(RootMove *rm, Position *pos)
   return rm->pvSize > 1;
 }
 
-static void TB_rank_root_moves(Position *pos, RootMoves *rm)
+// TB_set_limits() sets up probing during search from the Syzygy options.
+
+static void TB_set_limits(void)
 {
   TB_RootInTB = false;
   TB_UseRule50 = option_value(OPT_SYZ_50_MOVE);
   TB_ProbeDepth = option_value(OPT_SYZ_PROBE_DEPTH);
   TB_Cardinality = option_value(OPT_SYZ_PROBE_LIMIT);
-  bool dtz_available = true, dtm_available = false;
+  TB_Prefetch = option_value(OPT_SYZ_PREFETCH);
 
   if (TB_Cardinality > TB_MaxCardinality) {
     TB_Cardinality = TB_MaxCardinality;
@@ -2064,6 +2803,13 @@ static void TB_rank_root_moves(Position *pos, RootMoves *rm)
   TB_CardinalityDTM =  option_value(OPT_SYZ_USE_DTM)
                      ? min(TB_Cardinality, TB_MaxCardinalityDTM)
                      : 0;
+}
+
+static void TB_rank_root_moves(Position *pos, RootMoves *rm)
+{
+  bool dtz_available = true, dtm_available = false;
+
+  TB_set_limits();
 
   if (TB_Cardinality >= popcount(pieces()) && !can_castle_any()) {
     // Try to rank moves using DTZ tables.
@@ -2097,6 +2843,315 @@ static void TB_rank_root_moves(Position *pos, RootMoves *rm)
 }
 
 
+// ponder_replies() returns the number of replies other than the expected
+// one, up to max, to be pondered in the position before the expected
+// reply. Replies are ranked by the TT value of the position they lead to,
+// and replies not in the TT or without legal moves after them are left out.
+
+static int ponder_replies(Position *pos, Move expected, Move *replies, int max)
+{
+  ExtMove list[MAX_MOVES], childList[MAX_MOVES];
+  ExtMove *end = generate_legal(pos, list);
+  int n = 0;
+
+  for (ExtMove *m = list; m < end; m++) {
+    if (m->move == expected)
+      continue;
+    do_move(pos, m->move, gives_check(pos, pos->st, m->move));
+    bool found;
+    TTEntry ttData;
+    tt_probe(key(), &found, &ttData);
+    if (found && generate_legal(pos, childList) > childList)
+      list[n++] = (ExtMove){ .move = m->move, .value = tte_value(&ttData) };
+    undo_move(pos, m->move);
+  }
+
+  // The lowest values for us are the likeliest replies.
+  for (int i = 1; i < n; i++)
+    for (int j = i; j > 0 && list[j].value < list[j - 1].value; j--) {
+      ExtMove tmp = list[j];
+      list[j] = list[j - 1];
+      list[j - 1] = tmp;
+    }
+
+  n = min(n, max);
+  for (int i = 0; i < n; i++)
+    replies[i] = list[i].move;
+
+  return n;
+}
+
+// ponder_take_back() takes back the expected reply in a thread's copy of
+// the root position and returns the key of the position before it as
+// stored in the game history. Key 0 there marks a position that has not
+// occurred twice, so the key is recomputed for do_move().
+
+static Key ponder_take_back(Position *pos)
+{
+  undo_move(pos, ponderInfo.root->lastMove);
+  pos_set_check_info(pos);
+  Key k = pos->st->key;
+  pos->st->key = pos_compute_key(pos, pos->st);
+  return k;
+}
+
+// ponder_init_thread() sets up the root of a thread of ponder group g > 0,
+// the position after the given reply.
+
+static void ponder_init_thread(Position *pos, Move reply)
+{
+  ExtMove list[MAX_MOVES];
+
+  Key k = ponder_take_back(pos);
+  do_move(pos, reply, gives_check(pos, pos->st, reply));
+  (pos->st - 1)->key = k;
+  pos->rootKeyFlip = pos->st->key;
+  (pos->st - 1)->endMoves = pos->moveList;
+
+  ExtMove *end = generate_legal(pos, list);
+  RootMoves *rm = pos->rootMoves;
+  rm->size = end - list;
+  for (int i = 0; i < rm->size; i++) {
+    rm->move[i].pvSize = 1;
+    rm->move[i].pv[0] = list[i].move;
+    rm->move[i].score = -VALUE_INFINITE;
+    rm->move[i].previousScore = -VALUE_INFINITE;
+    rm->move[i].selDepth = 0;
+    rm->move[i].bound = BOUND_NONE;
+    rm->move[i].tbRank = 0;
+    rm->move[i].tbScore = 0;
+  }
+}
+
+// ponder_split() splits the threads into ponder groups, after the
+// threads have been set up to search the root position.
+
+static void ponder_split(Position *root)
+{
+  ponderInfo.root = root;
+  ponderInfo.groups = 1;
+  ponderInfo.keys[0] = root->st->key;
+  ponderInfo.startTime = Limits.startTime;
+  ponderInfo.searches++;
+
+  int max = min(option_value(OPT_MULTI_PONDER), Threads.numThreads);
+  if (   max < 2
+      || searchIdx
+      || !root->lastMove
+      || Limits.numSearchmoves
+      || TB_RootInTB
+      || rootSplit.active)
+    return;
+
+  // Find the other replies to ponder using a helper thread's position.
+  Move replies[MAX_PONDER_GROUPS];
+  Position *pos = Threads.pos[1];
+  ponder_take_back(pos);
+  int n = ponder_replies(pos, root->lastMove, replies, max - 1);
+  copy_root_position(pos, root);
+  if (!n)
+    return;
+
+  ponderInfo.groups = n + 1;
+  RootMoves *rm = Threads.pos[0]->rootMoves;
+  ponderInfo.numMoves = rm->size;
+  for (int i = 0; i < rm->size; i++)
+    ponderInfo.moves[i] = rm->move[i].pv[0];
+
+  for (int idx = 1; idx < Threads.numThreads; idx++) {
+    int g = idx % ponderInfo.groups;
+    if (!g)
+      continue;
+    Position *p = Threads.pos[idx];
+    p->ponderGroup = g;
+    ponder_init_thread(p, replies[g - 1]);
+    ponderInfo.keys[g] = p->st->key;
+  }
+
+  char buf[16];
+  flockfile(stdout);
+  printf("info string Also pondering");
+  for (int i = 0; i < n; i++)
+    printf(" %s", uci_move(buf, replies[i], is_chess960()));
+  printf("\n");
+  fflush(stdout);
+  funlockfile(stdout);
+}
+
+// ponder_rejoin() lets a thread of a ponder group g > 0 search the root
+// position of group 0 from scratch.
+
+static void ponder_rejoin(Position *pos)
+{
+  copy_root_position(pos, ponderInfo.root);
+  RootMoves *rm = pos->rootMoves;
+  rm->size = ponderInfo.numMoves;
+  for (int i = 0; i < rm->size; i++) {
+    rm->move[i].pvSize = 1;
+    rm->move[i].pv[0] = ponderInfo.moves[i];
+    rm->move[i].score = -VALUE_INFINITE;
+    rm->move[i].previousScore = -VALUE_INFINITE;
+    rm->move[i].selDepth = 0;
+    rm->move[i].bound = BOUND_NONE;
+    rm->move[i].tbRank = 0;
+    rm->move[i].tbScore = 0;
+  }
+  pos->selDepth = 0;
+  pos->nmpMinPly = 0;
+  pos->rootDepth = 0;
+  pos->ponderGroup = 0;
+  store_rlx(pos->ponderStop, false);
+}
+
+// ponder_hit() is called on ponderhit. It lets the threads of the other
+// ponder groups rejoin group 0.
+
+void ponder_hit(void)
+{
+  ponderInfo.hits++;
+  ponderInfo.savedTime += now() - ponderInfo.startTime;
+  for (int idx = 1; idx < Threads.numThreads; idx++)
+    if (Threads.pos[idx]->ponderGroup)
+      store_rlx(Threads.pos[idx]->ponderStop, true);
+}
+
+// ponder_check_miss() is called at the start of a search. If the last
+// ponder search ended without ponderhit and the opponent played one of
+// the other replies pondered, the time spent pondering it is counted as
+// saved.
+
+static void ponder_check_miss(Position *root)
+{
+  if (!ponderInfo.pending)
+    return;
+
+  ponderInfo.pending = false;
+  for (int g = 1; g < ponderInfo.groups; g++)
+    if (ponderInfo.keys[g] == root->st->key) {
+      ponderInfo.otherHits++;
+      ponderInfo.savedTime += ponderInfo.endTime - ponderInfo.startTime;
+    }
+}
+
+// ponder_print_stats() implements the "ponderstats" command.
+
+void ponder_print_stats(void)
+{
+  uint64_t misses = ponderInfo.searches - ponderInfo.hits;
+  printf("info string ponder searches %" PRIu64 " hits %" PRIu64,
+         ponderInfo.searches, ponderInfo.hits);
+  if (ponderInfo.searches)
+    printf(" (%.1f%%)", 100.0 * ponderInfo.hits / ponderInfo.searches);
+  printf(" other replies hit %" PRIu64, ponderInfo.otherHits);
+  if (misses)
+    printf(" (%.1f%% of misses)", 100.0 * ponderInfo.otherHits / misses);
+  printf(" time saved %" PRIi64 " ms\n", ponderInfo.savedTime);
+  fflush(stdout);
+}
+
+
+// resume_save() is called by the main thread after a search. It keeps the
+// root move scores and the PV of the best thread for a later search that
+// resumes from them, or forgets them if the search is not valid for that.
+
+static void resume_save(Position *pos, Position *best, bool valid)
+{
+  ResumeInfo *ri = &resumeInfo;
+  RootMoves *rm = best->rootMoves;
+
+  ri->depth = valid ? best->completedDepth : 0;
+  if (ri->depth <= 0)
+    return;
+
+  ri->multiPV = min(option_value(OPT_MULTI_PV), rm->size);
+  ri->score = rm->move[0].score;
+  ri->numMoves = rm->size;
+  for (int i = 0; i < rm->size; i++) {
+    ri->moves[i] = rm->move[i].pv[0];
+    ri->scores[i] = rm->move[i].score;
+  }
+
+  // Walking the PV does not count as searched nodes.
+  uint64_t nodes = pos->nodes;
+  int ply = 0;
+  ri->pvSize = rm->move[0].pvSize;
+  for (; ply < ri->pvSize; ply++) {
+    ri->pv[ply] = rm->move[0].pv[ply];
+    ri->keys[ply] = key();
+    do_move(pos, ri->pv[ply], gives_check(pos, pos->st, ri->pv[ply]));
+  }
+
+  while (ply--)
+    undo_move(pos, ri->pv[ply]);
+  pos->nodes = nodes;
+}
+
+// resume_seed() is called by start_thinking() with the root moves of a new
+// infinite search. If the root is that of the last search or a position
+// along its PV, it restores the root move scores and the PV and returns
+// the depth from which iterative deepening resumes, otherwise it returns 0.
+
+static Depth resume_seed(Position *root, RootMoves *moves)
+{
+  ResumeInfo *ri = &resumeInfo;
+  int multiPV = min(option_value(OPT_MULTI_PV), moves->size);
+
+  if (   !option_value(OPT_RESUME_ANALYSIS)
+      || !Limits.infinite
+      || Limits.depth
+      || Limits.numSearchmoves
+      || TB_RootInTB
+      || ri->depth <= 0)
+    return 0;
+
+  int ply = 0;
+  while (ply < ri->pvSize && ri->keys[ply] != root->st->key)
+    ply++;
+
+  // Only the score of the PV move is known once the root has moved on,
+  // so further PV lines would have no aspiration window to resume with.
+  Depth depth = ri->depth - ply - 1;
+  if (   ply == ri->pvSize
+      || depth < RESUME_MIN_DEPTH
+      || (ply == 0 && (moves->size != ri->numMoves || multiPV > ri->multiPV))
+      || (ply > 0 && multiPV > 1))
+    return 0;
+
+  int idx = 0;
+  while (idx < moves->size && moves->move[idx].pv[0] != ri->pv[ply])
+    idx++;
+  if (idx == moves->size)
+    return 0;
+
+  // On the same root, put the moves in the order of the last search and
+  // restore their scores. Then put the PV move first with its line.
+  if (ply == 0)
+    for (int i = 0; i < moves->size; i++) {
+      moves->move[i].pv[0] = ri->moves[i];
+      moves->move[i].score = ri->scores[i];
+    }
+
+  for (idx = 0; moves->move[idx].pv[0] != ri->pv[ply]; idx++);
+  RootMove tmp = moves->move[idx];
+  memmove(&moves->move[1], &moves->move[0], idx * sizeof(RootMove));
+  moves->move[0] = tmp;
+
+  Value v = ply & 1 ? -ri->score : ri->score;
+  if (v >= VALUE_MATE_IN_MAX_PLY)
+    v += ply;
+  else if (v <= VALUE_MATED_IN_MAX_PLY)
+    v -= ply;
+
+  moves->move[0].score = v;
+  moves->move[0].pvSize = ri->pvSize - ply;
+  memcpy(moves->move[0].pv, &ri->pv[ply], (ri->pvSize - ply) * sizeof(Move));
+
+  printf("info string Resuming analysis at depth %d\n", depth + 1);
+  fflush(stdout);
+
+  return depth;
+}
+
 // start_thinking() wakes up the main thread to start a new search,
 // then returns immediately.
 
@@ -2113,6 +3168,9 @@ void start_thinking(Position *root, bool ponderMode)
   for (int i = 0; i < 1024; i++)
     store_rlx(breadcrumbs[i], 0);
 
+  if (!searchIdx)
+    ponder_check_miss(root);
+
   // Generate all legal moves.
   ExtMove list[MAX_MOVES];
   ExtMove *end = generate_legal(root, list);
@@ -2131,42 +3189,284 @@ void start_thinking(Position *root, bool ponderMode)
 
   RootMoves *moves = Threads.pos[0]->rootMoves;
   moves->size = end - list;
-  for (int i = 0; i < moves->size; i++)
+  for (int i = 0; i < moves->size; i++) {
+    moves->move[i].pvSize = 1;
     moves->move[i].pv[0] = list[i].move;
+    moves->move[i].score = -VALUE_INFINITE;
+    moves->move[i].bound = BOUND_NONE;
+  }
 
   // Rank root moves if root position is a TB position.
   TB_rank_root_moves(root, moves);
 
+  Depth resumeDepth = ponderMode ? 0 : resume_seed(root, moves);
+
   for (int idx = 0; idx < Threads.numThreads; idx++) {
     Position *pos = Threads.pos[idx];
     pos->selDepth = 0;
     pos->nmpMinPly = 0;
-    pos->rootDepth = 0;
+    pos->rootDepth = resumeDepth;
     pos->nodes = pos->tbHits = 0;
+#ifdef SEARCH_STATS
+    memset(pos->stats, 0, sizeof(pos->stats));
+#endif
+    pos->ponderGroup = 0;
+    store_rlx(pos->ponderStop, false);
     RootMoves *rm = pos->rootMoves;
     rm->size = end - list;
     for (int i = 0; i < rm->size; i++) {
-      rm->move[i].pvSize = 1;
-      rm->move[i].pv[0] = moves->move[i].pv[0];
-      rm->move[i].score = -VALUE_INFINITE;
-      rm->move[i].previousScore = -VALUE_INFINITE;
+      rm->move[i].pvSize = moves->move[i].pvSize;
+      memmove(rm->move[i].pv, moves->move[i].pv,
+              moves->move[i].pvSize * sizeof(Move));
+      rm->move[i].score = moves->move[i].score;
+      rm->move[i].previousScore = moves->move[i].score;
       rm->move[i].selDepth = 0;
+      rm->move[i].bound = moves->move[i].bound;
       rm->move[i].tbRank = moves->move[i].tbRank;
       rm->move[i].tbScore = moves->move[i].tbScore;
     }
-    memcpy(pos, root, offsetof(Position, moveList));
-    // Copy enough of the root State buffer.
-    int n = max(7, root->st->pliesFromNull);
-    for (int i = 0; i <= n; i++)
-      memcpy(&pos->stack[i], &root->st[i - n], StateSize);
-    pos->st = pos->stack + n;
-    (pos->st-1)->endMoves = pos->moveList;
-    pos_set_check_info(pos);
+    copy_root_position(pos, root);
   }
 
+  split_init(moves);
+
   if (TB_RootInTB)
     Threads.pos[0]->tbHits = end - list;
 
+  if (ponderMode)
+    ponder_split(root);
+
+#ifdef SEARCH_TRACE
+  trace_start();
+#endif
+
   Threads.searching = true;
   thread_wake_up(threads_main(), THREAD_SEARCH);
 }
+
+// batch_search() searches the position of a search thread on its own
+// within the limits set by batch_run(). It returns false if the position
+// has no legal moves.
+
+bool batch_search(Position *pos)
+{
+  pos->rootKeyFlip = pos->st->key;
+  (pos->st-1)->endMoves = pos->moveList;
+
+  ExtMove *end = generate_legal(pos, pos->moveList);
+  RootMoves *rm = pos->rootMoves;
+  rm->size = end - pos->moveList;
+  for (int i = 0; i < rm->size; i++) {
+    rm->move[i].pvSize = 1;
+    rm->move[i].pv[0] = pos->moveList[i].move;
+    rm->move[i].score = -VALUE_INFINITE;
+    rm->move[i].previousScore = -VALUE_INFINITE;
+    rm->move[i].selDepth = 0;
+    rm->move[i].bound = BOUND_NONE;
+    rm->move[i].tbRank = 0;
+    rm->move[i].tbScore = 0;
+  }
+  pos->selDepth = 0;
+  pos->nmpMinPly = 0;
+  pos->rootDepth = 0;
+  pos->completedDepth = 0;
+
+  if (rm->size == 0)
+    return false;
+
+  thread_search(pos);
+  return true;
+}
+
+// batch_run() lets all search threads perform the given action and waits
+// until they are done. The action runs independent single-threaded
+// searches with batch_search(), which stop when the depth limit is reached
+// or, at the end of an iteration, when the thread has searched the given
+// number of nodes. Batch searches have no time management, contempt or
+// root tablebase ranking, print nothing and share the hash table.
+
+void batch_run(int action, Depth depth, uint64_t nodes)
+{
+  process_delayed_settings();
+
+  if (Threads.searching)
+    thread_wait_until_sleeping(threads_main());
+
+  Limits = (struct LimitsType){ 0 };
+  Limits.depth = depth;
+  Limits.nodes = nodes;
+  Limits.batch = true;
+  Limits.startTime = now();
+  Time.startTime = Limits.startTime;
+  tt_new_search();
+  TB_set_limits();
+  base_ct = 0;
+  rootSplit.active = false;
+  Threads.stop = false;
+  Threads.ponder = false;
+  Threads.stopOnPonderhit = false;
+  Threads.increaseDepth = true;
+  for (int i = 0; i < 1024; i++)
+    store_rlx(breadcrumbs[i], 0);
+
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    Threads.pos[idx]->nodes = Threads.pos[idx]->tbHits = 0;
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    thread_wake_up(Threads.pos[idx], action);
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    thread_wait_until_sleeping(Threads.pos[idx]);
+
+  Limits.batch = false;
+}
+
+// search_batch() implements the "searchbatch" command. It reads FENs or
+// EPD records from a file, one per line, and searches each position to a
+// fixed depth. Every search thread repeatedly takes the next unsearched
+// position and searches it on its own, so that the positions are searched
+// in parallel. The best move, score and PV of each position are written
+// to the output file in input order.
+
+static struct {
+  char **lines;
+  char **results;
+  int numLines;
+  int chess960;
+  atomic_int next;
+} batchJob;
+
+// batch_fen_is_valid() checks that a FEN fits in 127 characters and has
+// exactly one king and at most 8 pawns of each color and no pawns on the
+// first or last rank, since pos_set() does not validate its input.
+
+static bool batch_fen_is_valid(const char *fen)
+{
+  if (strlen(fen) > 127)
+    return false;
+
+  size_t placement = strcspn(fen, " ");
+  int kings[2] = { 0, 0 }, pawns[2] = { 0, 0 }, rank = 7;
+  for (size_t i = 0; i < placement; i++) {
+    if (fen[i] == '/')
+      rank--;
+    kings[0] += fen[i] == 'K', kings[1] += fen[i] == 'k';
+    if (fen[i] == 'P' || fen[i] == 'p') {
+      pawns[fen[i] == 'p']++;
+      if (rank == 0 || rank == 7)
+        return false;
+    }
+  }
+  return   kings[0] == 1 && kings[1] == 1
+        && pawns[0] <= 8 && pawns[1] <= 8;
+}
+
+// batch_worker() is called by the search threads. Each thread sets up the
+// next unsearched position on its own Position object and searches it.
+
+void batch_worker(Position *pos)
+{
+  int i;
+  while ((i = atomic_fetch_add(&batchJob.next, 1)) < batchJob.numLines) {
+    const char *line = batchJob.lines[i];
+    char *r = batchJob.results[i] = malloc(strlen(line) + 128 + 8 * MAX_PLY);
+    char fen[128], buf[16];
+
+    if (!batch_fen_is_valid(line)) {
+      sprintf(r, "%s | invalid", line);
+      continue;
+    }
+
+    strcpy(fen, line);
+    pos->st = pos->stack + 7;
+    pos_set(pos, fen, batchJob.chess960);
+
+    // The side not to move must not be in check.
+    if (attackers_to(square_of(stm() ^ 1, KING)) & pieces_c(stm())) {
+      sprintf(r, "%s | invalid", line);
+      continue;
+    }
+
+    uint64_t nodes = pos->nodes;
+    if (!batch_search(pos)) {
+      sprintf(r, "%s | bestmove (none) score %s", line,
+              uci_value(buf, checkers() ? -VALUE_MATE : VALUE_DRAW));
+      continue;
+    }
+
+    RootMove *best = &pos->rootMoves->move[0];
+    r += sprintf(r, "%s | bestmove %s", line,
+                 uci_move(buf, best->pv[0], is_chess960()));
+    r += sprintf(r, " score %s depth %d nodes %"PRIu64" pv",
+                 uci_value(buf, best->score), pos->completedDepth,
+                 pos->nodes - nodes);
+    for (int j = 0; j < best->pvSize; j++)
+      r += sprintf(r, " %s", uci_move(buf, best->pv[j], is_chess960()));
+  }
+}
+
+void search_batch(char *str)
+{
+  char *fenFile = strtok(str, " \t\n");
+  char *outFile = fenFile ? strtok(NULL, " \t\n") : NULL;
+  char *token = outFile ? strtok(NULL, " \t\n") : NULL;
+  int depth = token ? atoi(token) : 13;
+
+  if (!outFile || depth <= 0) {
+    printf("info string Usage: searchbatch <fenfile> <outfile> [depth]\n");
+    fflush(stdout);
+    return;
+  }
+
+  FILE *F = fopen(fenFile, "r");
+  if (!F) {
+    printf("info string Unable to open file %s\n", fenFile);
+    fflush(stdout);
+    return;
+  }
+
+  int maxLines = 100;
+  batchJob.lines = malloc(maxLines * sizeof(char *));
+  batchJob.numLines = 0;
+  char *line = NULL;
+  size_t len = 0;
+  while (getline(&line, &len, F) > 0) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (!*line)
+      continue;
+    if (batchJob.numLines == maxLines) {
+      maxLines += 100;
+      batchJob.lines = realloc(batchJob.lines, maxLines * sizeof(char *));
+    }
+    batchJob.lines[batchJob.numLines++] = strcpy(malloc(strlen(line) + 1), line);
+  }
+  free(line);
+  fclose(F);
+
+  batchJob.results = calloc(batchJob.numLines, sizeof(char *));
+  batchJob.chess960 = option_value(OPT_CHESS960);
+  atomic_store(&batchJob.next, 0);
+
+  batch_run(THREAD_BATCH, depth, 0);
+
+  TimePoint elapsed = time_elapsed() + 1;
+  uint64_t nodes = threads_nodes_searched();
+
+  FILE *G = fopen(outFile, "w");
+  if (!G)
+    printf("info string Unable to open file %s\n", outFile);
+  for (int i = 0; i < batchJob.numLines; i++) {
+    if (G)
+      fprintf(G, "%s\n", batchJob.results[i]);
+    free(batchJob.results[i]);
+    free(batchJob.lines[i]);
+  }
+  if (G) {
+    fclose(G);
+    printf("info string Searched %d positions in %"PRIi64" ms, %"PRIu64
+           " nodes, %"PRIu64" nps. Results written to %s.\n",
+           batchJob.numLines, elapsed, nodes, nodes * 1000 / elapsed, outFile);
+  }
+  fflush(stdout);
+
+  free(batchJob.results);
+  free(batchJob.lines);
+}
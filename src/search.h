@@ -36,6 +36,7 @@ struct RootMove {
   Value score;
   Value previousScore;
   int selDepth;
+  int bound;
   int tbRank;
   Value tbScore;
   Move pv[MAX_PLY];
@@ -63,6 +64,7 @@ struct LimitsType {
   int movetime;
   int mate;
   bool infinite;
+  bool batch;
   uint64_t nodes;
   TimePoint startTime;
   int numSearchmoves;
@@ -71,7 +73,8 @@ struct LimitsType {
 
 typedef struct LimitsType LimitsType;
 
-extern LimitsType Limits;
+extern LimitsType searchLimits[MAX_SEARCHES];
+#define Limits PER_SEARCH(searchLimits)
 
 INLINE int use_time_management(void)
 {
@@ -80,7 +83,20 @@ INLINE int use_time_management(void)
 
 void search_init(void);
 void search_clear(void);
+void search_clear_threads(void);
+void search_clear_thread(Position *pos);
+void copy_root_position(Position *pos, Position *root);
 uint64_t perft(Position *pos, Depth depth);
+void perft_worker(Position *pos);
+bool batch_search(Position *pos);
+void batch_run(int action, Depth depth, uint64_t nodes);
+void search_batch(char *str);
+void batch_worker(Position *pos);
 void start_thinking(Position *pos, bool ponderMode);
+void ponder_hit(void);
+void ponder_print_stats(void);
+#ifdef SEARCH_STATS
+void search_print_stats(FILE *F, const char *prefix, const uint64_t *stats);
+#endif
 
 #endif
@@ -1,21 +1,55 @@
+#include <stdio.h>
+
+#include "affinity.h"
 #ifdef NNUE
 #include "nnue.h"
 #endif
+#include "material.h"
 #include "numa.h"
+#include "pawns.h"
 #include "search.h"
 #include "settings.h"
 #include "thread.h"
 #include "tt.h"
 #include "types.h"
+#include "uci.h"
 
 struct settings settings, delayedSettings;
 
-// Process Hash, Threads, NUMA and LargePages settings.
+#ifndef NNUE_PURE
+// table_entries() returns the number of entries of a pawn or material
+// table of each thread. The table takes the given number of KB or, if it
+// is 0, the default number of entries. The result is a power of 2 of at
+// least 1024 entries. The default does not depend on Hash or Threads,
+// since a change of the table size recreates the search threads.
+
+static size_t table_entries(size_t kb, size_t entrySize, size_t defaultEntries)
+{
+  if (!kb)
+    return defaultEntries;
+
+  size_t entries = 1024;
+  while (2 * entries * entrySize <= kb << 10)
+    entries *= 2;
+
+  return entries;
+}
+#endif
+
+// Process Hash, Threads, NUMA, NUMA TT Shards, Thread Binding, LargePages,
+// Pawn Hash, Shared Pawn Hash and Material Hash settings and load a saved
+// hash table if requested.
 
 void process_delayed_settings(void)
 {
+  // Settings are shared by all searches, so in server mode they are only
+  // applied for slot 0 while no tagged search is running.
+  if (searchIdx || threads_slots_busy())
+    return;
+
   bool ttChange = delayedSettings.ttSize != settings.ttSize;
   bool lpChange = delayedSettings.largePages != settings.largePages;
+  bool shardChange = delayedSettings.ttShards != settings.ttShards;
   bool numaChange =   settings.numaEnabled != delayedSettings.numaEnabled
                    || (   settings.numaEnabled
                        && !masks_equal(settings.mask, delayedSettings.mask));
@@ -32,16 +66,61 @@ void process_delayed_settings(void)
   }
 #endif
 
+  // The search threads bind themselves to their processors when they are
+  // created, so the pools of all server slots are created anew.
+  if (thread_binding_changed()) {
+    threads_set_number(0);
+    threads_destroy_slots();
+    settings.numThreads = 0;
+    thread_binding_apply();
+  }
+
+#ifndef NNUE_PURE
+  // By default the pawn tables get 16384 entries. The material tables only
+  // hold configurations with promoted pieces, since all others are in the
+  // shared material table, so by default they get the minimum of 1024
+  // entries.
+  // Low memory builds halve the pawn tables and compute all material
+  // configurations in the material tables, which therefore get 8192
+  // entries.
+#ifndef LOW_MEMORY
+  size_t pawnEntries = table_entries(delayedSettings.pawnHash,
+                                     sizeof(PawnEntry), 16384);
+  size_t materialEntries = table_entries(delayedSettings.materialHash,
+                                         sizeof(MaterialEntry), 1024);
+#else
+  size_t pawnEntries = table_entries(delayedSettings.pawnHash,
+                                     sizeof(PawnEntry), 8192);
+  size_t materialEntries = table_entries(delayedSettings.materialHash,
+                                         sizeof(MaterialEntry), 8192);
+#endif
+  if (   pawnEntries != settings.pawnEntries
+      || materialEntries != settings.materialEntries
+      || delayedSettings.sharedPawnHash != settings.sharedPawnHash
+      || numaChange)
+  {
+    threads_set_number(0);
+    threads_destroy_slots();
+    settings.numThreads = 0;
+    settings.pawnEntries = pawnEntries;
+    settings.materialEntries = materialEntries;
+    settings.sharedPawnHash = delayedSettings.sharedPawnHash;
+    pawn_shared_free();
+  }
+#endif
+
   if (settings.numThreads != delayedSettings.numThreads) {
     settings.numThreads = delayedSettings.numThreads;
     threads_set_number(settings.numThreads);
   }
+  threads_recreate_slots();
 
-  if (numaChange || ttChange || lpChange) {
-    tt_free();
+  // The table is allocated anew, but keeps its contents.
+  if (numaChange || ttChange || lpChange || shardChange) {
     settings.largePages = delayedSettings.largePages;
+    settings.ttShards = delayedSettings.ttShards;
     settings.ttSize = delayedSettings.ttSize;
-    tt_allocate(settings.ttSize);
+    tt_resize(settings.ttSize);
   }
 
   if (delayedSettings.clear) {
@@ -49,6 +128,16 @@ void process_delayed_settings(void)
     search_clear();
   }
 
+  if (delayedSettings.loadHash) {
+    delayedSettings.loadHash = false;
+    const char *fileName = option_string_value(OPT_HASH_FILE);
+    if (tt_load(fileName))
+      printf("info string Hash loaded from %s.\n", fileName);
+    else
+      printf("info string Unable to load hash from %s.\n", fileName);
+    fflush(stdout);
+  }
+
 #ifdef NNUE
   nnue_init();
 #endif
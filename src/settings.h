@@ -7,9 +7,14 @@ struct settings {
   NodeMask mask;
   size_t ttSize;
   size_t numThreads;
+  size_t pawnHash, materialHash;       // Options in KB, 0 for automatic
+  size_t pawnEntries, materialEntries; // Table sizes of new threads
+  size_t sharedPawnHash;               // Option in MB, 0 for none
   bool numaEnabled;
+  bool ttShards;
   bool largePages;
   bool clear;
+  bool loadHash;
 };
 
 extern struct settings settings, delayedSettings;
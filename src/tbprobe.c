@@ -8,11 +8,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/mman.h>
+#include <time.h>
+#endif
 
 #include "bitboard.h"
 #include "movegen.h"
 #include "position.h"
 #include "search.h"
+#include "settings.h"
 #include "tbprobe.h"
 #include "thread.h"
 #include "uci.h"
@@ -31,7 +37,8 @@ typedef size_t map_t;
 #endif
 
 int TB_MaxCardinality = 0, TB_MaxCardinalityDTM = 0;
-extern int TB_CardinalityDTM;
+extern int TB_CardinalitiesDTM[MAX_SEARCHES];
+#define TB_CardinalityDTM PER_SEARCH(TB_CardinalitiesDTM)
 
 static const char *tbSuffix[] = { ".rtbw", ".rtbm", ".rtbz" };
 static uint32_t tbMagic[] = { 0x5d23e871, 0x88ac504b, 0xa50c66d7 };
@@ -64,6 +71,9 @@ struct BaseEntry {
   Key key;
   const uint8_t *data[3];
   map_t mapping[3];
+  size_t fileSize[3];
+  alloc_t wdlAlloc; // WDL table copied into memory, if any
+  size_t wdlSize;
   atomic_bool ready[3];
   uint8_t num;
   bool symmetric, hasPawns, hasDtm, hasDtz;
@@ -162,19 +172,97 @@ static Key calc_key_from_pieces(uint8_t *piece, int num)
   return key;
 }
 
-static FD open_tb(const char *str, const char *suffix)
+// Instead of trying to open every possible tablebase file in each of the
+// directories on the path, TB_init() lists the directories once and keeps
+// the names of the tablebase files found in a sorted index.
+
+#ifdef _WIN32
+#define tb_name_cmp _stricmp
+#else
+#define tb_name_cmp strcmp
+#endif
+
+struct TbFile {
+  char name[24];
+  int path;
+};
+
+static struct TbFile *tbFiles = NULL;
+static int numTbFiles = 0;
+
+static int tb_file_cmp(const void *a, const void *b)
 {
-  char name[256];
+  const struct TbFile *fa = a, *fb = b;
+  int r = tb_name_cmp(fa->name, fb->name);
+  return r ? r : fa->path - fb->path;
+}
+
+static void add_tb_file(const char *name, int path, int *size)
+{
+  size_t len = strlen(name);
+  if (   len < 6 || len >= sizeof(tbFiles->name)
+      || (   tb_name_cmp(name + len - 5, ".rtbw")
+          && tb_name_cmp(name + len - 5, ".rtbm")
+          && tb_name_cmp(name + len - 5, ".rtbz")))
+    return;
+
+  if (numTbFiles == *size) {
+    *size = 2 * *size + 256;
+    tbFiles = realloc(tbFiles, *size * sizeof(*tbFiles));
+  }
+  strcpy(tbFiles[numTbFiles].name, name);
+  tbFiles[numTbFiles++].path = path;
+}
+
+static void index_tb_files(void)
+{
+  int size = 0;
 
   for (int i = 0; i < numPaths; i++) {
-    strcpy(name, paths[i]);
-    strcat(name, "/");
-    strcat(name, str);
-    strcat(name, suffix);
-    FD fd = open_file(name);
-    if (fd != FD_ERR) return fd;
+#ifndef _WIN32
+    DIR *dir = opendir(paths[i]);
+    if (!dir) continue;
+    struct dirent *de;
+    while ((de = readdir(dir)))
+      add_tb_file(de->d_name, i, &size);
+    closedir(dir);
+#else
+    char pattern[256];
+    snprintf(pattern, sizeof(pattern), "%s\\*", paths[i]);
+    WIN32_FIND_DATAA fd;
+    HANDLE h = FindFirstFileA(pattern, &fd);
+    if (h == INVALID_HANDLE_VALUE) continue;
+    do
+      add_tb_file(fd.cFileName, i, &size);
+    while (FindNextFileA(h, &fd));
+    FindClose(h);
+#endif
+  }
+
+  qsort(tbFiles, numTbFiles, sizeof(*tbFiles), tb_file_cmp);
+}
+
+static FD open_tb(const char *str, const char *suffix)
+{
+  struct TbFile key;
+  snprintf(key.name, sizeof(key.name), "%s%s", str, suffix);
+  key.path = -1;
+
+  // Find the first entry with this name, i.e. the one on the first path
+  int lo = 0, hi = numTbFiles;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (tb_file_cmp(&tbFiles[mid], &key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  return FD_ERR;
+  if (lo == numTbFiles || tb_name_cmp(tbFiles[lo].name, key.name))
+    return FD_ERR;
+
+  char name[256];
+  snprintf(name, sizeof(name), "%s/%s", paths[tbFiles[lo].path], key.name);
+  return open_file(name);
 }
 
 static bool test_tb(const char *str, const char *suffix)
@@ -192,12 +280,14 @@ static bool test_tb(const char *str, const char *suffix)
   return fd != FD_ERR;
 }
 
-static const void *map_tb(const char *name, const char *suffix, map_t *mapping)
+static const void *map_tb(const char *name, const char *suffix, map_t *mapping,
+    size_t *size)
 {
   FD fd = open_tb(name, suffix);
   if (fd == FD_ERR)
     return NULL;
 
+  *size = file_size(fd);
   const void *data = map_file(fd, mapping);
   if (data == NULL) {
     fprintf(stderr, "Could not map %s%s into memory.\n", name, suffix);
@@ -206,9 +296,48 @@ static const void *map_tb(const char *name, const char *suffix, map_t *mapping)
 
   close_file(fd);
 
+#ifdef MADV_WILLNEED
+  // Start reading the whole table in the background
+  if (option_value(OPT_SYZ_POPULATE))
+    madvise((void *)data, *size, MADV_WILLNEED);
+#endif
+
   return data;
 }
 
+// copy_wdl_table() copies a mapped WDL table into anonymous memory if it
+// fits in what is left of the "SyzygyMemory" budget. Unlike the page
+// cache, such memory can be backed by large pages and be interleaved
+// over the NUMA nodes in use. The caller holds tbMutex.
+
+static size_t tbMemoryUsed = 0;
+
+static const uint8_t *copy_wdl_table(struct BaseEntry *be, const uint8_t *data,
+    size_t size)
+{
+  size_t budget = (size_t)option_value(OPT_SYZ_MEMORY) << 20;
+  if (tbMemoryUsed + size > budget)
+    return data;
+
+  uint8_t *mem = allocate_memory(size, true, &be->wdlAlloc);
+  if (!mem)
+    mem = allocate_memory(size, false, &be->wdlAlloc);
+  if (!mem)
+    return data;
+
+#if defined(NUMA) && !defined(_WIN32)
+  if (settings.numaEnabled)
+    numa_interleave_memory(mem, size, settings.mask);
+#endif
+
+  memcpy(mem, data, size);
+  unmap_file(data, be->mapping[WDL]);
+  be->wdlSize = size;
+  tbMemoryUsed += size;
+
+  return mem;
+}
+
 static void add_to_hash(void *ptr, Key key)
 {
   int idx;
@@ -267,6 +396,7 @@ static void init_tb(char *str)
 
   for (int type = 0; type < 3; type++)
     atomic_init(&be->ready[type], false);
+  be->wdlSize = 0;
 
   if (!be->hasPawns) {
     int j = 0;
@@ -304,7 +434,12 @@ static void free_tb_entry(struct BaseEntry *be)
 {
   for (int type = 0; type < 3; type++) {
     if (atomic_load_explicit(&be->ready[type], memory_order_relaxed)) {
-      unmap_file(be->data[type], be->mapping[type]);
+      if (type == WDL && be->wdlSize) {
+        free_memory(&be->wdlAlloc);
+        tbMemoryUsed -= be->wdlSize;
+        be->wdlSize = 0;
+      } else
+        unmap_file(be->data[type], be->mapping[type]);
       int num = num_tables(be, type);
       struct EncInfo *ei = first_ei(be, type);
       for (int t = 0; t < num; t++) {
@@ -324,6 +459,34 @@ void TB_free(void)
   free(pawnEntry);
 }
 
+// TB_report_memory() reports the tables in use for the "memory" command.
+// Mapped tables take as much memory as the page cache holds of them,
+// which is shared with other processes.
+
+static void report_tb_entry(struct BaseEntry *be)
+{
+  for (int type = 0; type < 3; type++)
+    if (atomic_load_explicit(&be->ready[type], memory_order_relaxed)) {
+      if (type == WDL && be->wdlSize)
+        memory_add("tablebases (copied)", -1, be->wdlSize, be->wdlAlloc.lp);
+      else
+        memory_add("tablebases (mapped)", -1, be->fileSize[type], false);
+    }
+}
+
+void TB_report_memory(void)
+{
+  if (!pieceEntry)
+    return;
+
+  memory_add("tablebase entries", -1,  TB_MAX_PIECE * sizeof(*pieceEntry)
+                                     + TB_MAX_PAWN * sizeof(*pawnEntry), false);
+  for (int i = 0; i < tbNumPiece; i++)
+    report_tb_entry((struct BaseEntry *)&pieceEntry[i]);
+  for (int i = 0; i < tbNumPawn; i++)
+    report_tb_entry((struct BaseEntry *)&pawnEntry[i]);
+}
+
 void TB_release(void)
 {
   for (int i = 0; i < tbNumPiece; i++)
@@ -349,12 +512,21 @@ void TB_init(char *path)
     LOCK_DESTROY(tbMutex);
 
     pathString = NULL;
+    free(tbFiles);
+    tbFiles = NULL;
+    numTbFiles = 0;
   }
 
   numWdl = numDtm = numDtz = 0;
   tbNumPiece = tbNumPawn = 0;
   TB_MaxCardinality = TB_MaxCardinalityDTM = 0;
 
+  // Cached probe results may refer to the old tables
+  for (int i = 0; i < MAX_SEARCHES; i++)
+    for (int idx = 0; idx < threadPools[i].numCreated; idx++)
+      memset(threadPools[i].pos[idx]->tbCache, 0,
+             TB_CACHE_SIZE * sizeof(TBCacheEntry));
+
   // if path is an empty string or equals "<empty>", we are done.
   const char *p = path;
   if (strlen(p) == 0 || !strcmp(p, "<empty>")) return;
@@ -378,6 +550,8 @@ void TB_init(char *path)
 
   LOCK_INIT(tbMutex);
 
+  index_tb_files();
+
   if (!pieceEntry) {
     pieceEntry = malloc(TB_MAX_PIECE * sizeof(*pieceEntry));
     pawnEntry = malloc(TB_MAX_PAWN * sizeof(*pawnEntry));
@@ -963,8 +1137,10 @@ static struct PairsData *setup_pairs(const uint8_t **ptr, size_t tb_size,
 
 static NOINLINE bool init_table(struct BaseEntry *be, const char *str, int type)
 {
-  const uint8_t *data = map_tb(str, tbSuffix[type], &be->mapping[type]);
+  size_t fileSize;
+  const uint8_t *data = map_tb(str, tbSuffix[type], &be->mapping[type], &fileSize);
   if (!data) return false;
+  be->fileSize[type] = fileSize;
 
   if (read_le_u32(data) != tbMagic[type]) {
     fprintf(stderr, "Corrupted table.\n");
@@ -972,6 +1148,9 @@ static NOINLINE bool init_table(struct BaseEntry *be, const char *str, int type)
     return false;
   }
 
+  if (type == WDL)
+    data = copy_wdl_table(be, data, fileSize);
+
   be->data[type] = data;
 
   bool split = type != DTZ && (data[4] & 0x01);
@@ -1090,6 +1269,41 @@ static NOINLINE bool init_table(struct BaseEntry *be, const char *str, int type)
   return true;
 }
 
+// prefetch_pairs() finds the compressed block that decompress_pairs()
+// would read for the given index and asks the OS to read it ahead.
+
+static void prefetch_pairs(struct PairsData *d, size_t idx)
+{
+  if (!d->idxBits)
+    return;
+
+  uint32_t mainIdx = idx >> d->idxBits;
+  int litIdx = (idx & (((size_t)1 << d->idxBits) - 1)) - ((size_t)1 << (d->idxBits - 1));
+  uint32_t block;
+  memcpy(&block, d->indexTable + 6 * mainIdx, sizeof(block));
+  block = from_le_u32(block);
+
+  uint16_t idxOffset = *(uint16_t *)(d->indexTable + 6 * mainIdx + 4);
+  litIdx += from_le_u16(idxOffset);
+
+  if (litIdx < 0)
+    while (litIdx < 0)
+      litIdx += d->sizeTable[--block] + 1;
+  else
+    while (litIdx > d->sizeTable[block])
+      litIdx -= d->sizeTable[block++] + 1;
+
+#ifndef _WIN32
+  static uintptr_t pageMask = 0;
+  if (!pageMask)
+    pageMask = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+  uintptr_t begin = (uintptr_t)(d->data + ((size_t)block << d->blockSize));
+  uintptr_t end = begin + ((size_t)1 << d->blockSize);
+  begin &= pageMask;
+  madvise((void *)begin, end - begin, MADV_WILLNEED);
+#endif
+}
+
 static const uint8_t *decompress_pairs(struct PairsData *d, size_t idx)
 {
   if (!d->idxBits)
@@ -1168,7 +1382,8 @@ INLINE int fill_squares(Position *pos, uint8_t *pc, bool flip, int mirror, int *
   return i;
 }
 
-INLINE int probe_table(Position *pos, int s, int *success, const int type)
+INLINE int probe_table(Position *pos, int s, int *success, const int type,
+    const bool prefetch)
 {
   // Obtain the position's material-signature key
   Key key = material_key();
@@ -1256,6 +1471,11 @@ INLINE int probe_table(Position *pos, int s, int *success, const int type)
     idx = type != DTM ? encode_pawn_f(p, ei, be) : encode_pawn_r(p, ei, be);
   }
 
+  if (prefetch) {
+    prefetch_pairs(ei->precomp, idx);
+    return 0;
+  }
+
   const uint8_t *w = decompress_pairs(ei->precomp, idx);
 
   if (type == WDL)
@@ -1289,17 +1509,29 @@ INLINE int probe_table(Position *pos, int s, int *success, const int type)
 
 static NOINLINE int probe_wdl_table(Position *pos, int *success)
 {
-  return probe_table(pos, 0, success, WDL);
+  return probe_table(pos, 0, success, WDL, false);
+}
+
+static NOINLINE void prefetch_wdl_table(Position *pos)
+{
+  int success = 1;
+  probe_table(pos, 0, &success, WDL, true);
 }
 
 static NOINLINE int probe_dtm_table(Position *pos, int won, int *success)
 {
-  return probe_table(pos, won, success, DTM);
+  return probe_table(pos, won, success, DTM, false);
+}
+
+static NOINLINE void prefetch_dtm_table(Position *pos)
+{
+  int success = 1;
+  probe_table(pos, 0, &success, DTM, true);
 }
 
 static NOINLINE int probe_dtz_table(Position *pos, int wdl, int *success)
 {
-  return probe_table(pos, wdl, success, DTZ);
+  return probe_table(pos, wdl, success, DTZ, false);
 }
 
 // Add missing underpromotion captures to list of captures.
@@ -1374,7 +1606,7 @@ static int probe_ab(Position *pos, int alpha, int beta, int *success)
 //  0 : draw
 //  1 : win, but draw under 50-move rule
 //  2 : win
-int TB_probe_wdl(Position *pos, int *success)
+static int probe_wdl(Position *pos, int *success)
 {
   *success = 1;
 
@@ -1465,6 +1697,80 @@ int TB_probe_wdl(Position *pos, int *success)
   return v;
 }
 
+#ifdef SEARCH_STATS
+static uint64_t time_usec(void)
+{
+#ifndef _WIN32
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return 1000000 * (uint64_t)ts.tv_sec + (uint64_t)ts.tv_nsec / 1000;
+#else
+  return 1000 * (uint64_t)now();
+#endif
+}
+#endif
+
+// TB_probe_wdl() returns the WDL value of a position as probe_wdl() does.
+// Search threads first look the position up in their TB cache.
+int TB_probe_wdl(Position *pos, int *success)
+{
+  TBCacheEntry *tce = NULL;
+
+  if (pos->tbCache) {
+    stat_inc(STAT_TB_CACHE_PROBES);
+    tce = &pos->tbCache[key() & (TB_CACHE_SIZE - 1)];
+    if (tce->success && tce->key == key()) {
+      stat_inc(STAT_TB_CACHE_HITS);
+      pos->st->endMoves = (pos->st-1)->endMoves;
+      *success = tce->success;
+      return tce->wdl;
+    }
+  }
+
+#ifdef SEARCH_STATS
+  uint64_t start = time_usec();
+#endif
+
+  int v = probe_wdl(pos, success);
+
+#ifdef SEARCH_STATS
+  if (tce) {
+    stat_inc(STAT_TB_PROBES);
+    ((Position *)pos)->stats[STAT_TB_PROBE_USEC] += time_usec() - start;
+  }
+#endif
+
+  if (tce && *success) {
+    tce->key = key();
+    tce->wdl = v;
+    tce->success = *success;
+  }
+
+  return v;
+}
+
+// TB_prefetch_captures() lets the OS read ahead the WDL table blocks of
+// the positions reached by the legal captures of the current position.
+
+void TB_prefetch_captures(Position *pos)
+{
+  ExtMove *m = (pos->st-1)->endMoves;
+  ExtMove *end = !checkers()
+                ? add_underprom_caps(pos, m, generate_captures(pos, m))
+                : generate_evasions(pos, m);
+  pos->st->endMoves = end;
+
+  for (; m < end; m++) {
+    Move move = m->move;
+    if (!is_capture(pos, move) || !is_legal(pos, move))
+      continue;
+    do_move(pos, move, gives_check(pos, pos->st, move));
+    prefetch_wdl_table(pos);
+    undo_move(pos, move);
+    stat_inc(STAT_TB_PREFETCHES);
+  }
+}
+
 #if 0
 // This will not be called for positions with en passant captures
 static Value probe_dtm_dc(Position *pos, int won, int *success)
@@ -1768,77 +2074,119 @@ int TB_probe_dtz(Position *pos, int *success)
   return best;
 }
 
+// The root moves are probed in parallel by the search threads. Each of
+// TB_root_probe_dtz(), TB_root_probe_wdl() and TB_root_probe_dtm() sets up
+// rootJob and wakes up the threads, which call TB_root_probe_worker() to
+// repeatedly take the next unprobed move.
+
+static struct {
+  RootMoves *rm;
+  bool (*probe)(Position *pos, int i);
+  atomic_int next;
+  atomic_bool failed;
+  int cnt50, bound;
+  bool rep, move50;
+  Value tmpScore[MAX_MOVES];
+} rootJob;
+
+void TB_root_probe_worker(Position *pos)
+{
+  int i;
+  pos->st->endMoves = (pos->st-1)->endMoves;
+  while (   (i = atomic_fetch_add(&rootJob.next, 1)) < rootJob.rm->size
+         && !atomic_load_explicit(&rootJob.failed, memory_order_relaxed))
+    if (!rootJob.probe(pos, i))
+      atomic_store(&rootJob.failed, true);
+}
+
+static bool probe_root_moves(Position *pos, RootMoves *rm,
+    bool (*probe)(Position *pos, int i))
+{
+  rootJob.rm = rm;
+  rootJob.probe = probe;
+  atomic_store(&rootJob.next, 0);
+  atomic_store(&rootJob.failed, false);
+
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    copy_root_position(Threads.pos[idx], pos);
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    thread_wake_up(Threads.pos[idx], THREAD_TB_PROBE);
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    thread_wait_until_sleeping(Threads.pos[idx]);
+
+  return !atomic_load(&rootJob.failed);
+}
+
+static bool probe_root_dtz(Position *pos, int i)
+{
+  int v, success;
+  RootMove *m = &rootJob.rm->move[i];
+  do_move(pos, m->pv[0], gives_check(pos, pos->st, m->pv[0]));
+
+  // Calculate dtz for the current move counting from the root position.
+  if (rule50_count() == 0) {
+    // If the move resets the 50-move counter, dtz is -101/-1/0/1/101.
+    v = -TB_probe_wdl(pos, &success);
+    v = WdlToDtz[v + 2];
+  } else {
+    // Otherwise, take dtz for the new position and correct by 1 ply.
+    v = -TB_probe_dtz(pos, &success);
+    if (v > 0) v++;
+    else if (v < 0) v--;
+  }
+  // Make sure that a mating move gets value 1.
+  if (checkers() && v == 2) {
+    if (generate_legal(pos, (pos->st-1)->endMoves) == (pos->st-1)->endMoves)
+      v = 1;
+  }
+
+  undo_move(pos, m->pv[0]);
+  if (!success) return false;
+
+  // Better moves are ranked higher. Guaranteed wins are ranked equally.
+  // Losing moves are ranked equally unless a 50-move draw is in sight.
+  // Note that moves ranked 900 have dtz + cnt50 == 100, which in rare
+  // cases may be insufficient to win as dtz may be one off (see the
+  // comments before TB_probe_dtz()).
+  int cnt50 = rootJob.cnt50, bound = rootJob.bound;
+  int r =  v > 0 ? (v + cnt50 <= 99 && !rootJob.rep ? 1000 : 1000 - (v + cnt50))
+         : v < 0 ? (-v * 2 + cnt50 < 100 ? -1000 : -1000 + (-v + cnt50))
+         : 0;
+  m->tbRank = r;
+
+  // Determine the score to be displayed for this move. Assign at least
+  // 1 cp to cursed wins and let it grow to 49 cp as the position gets
+  // closer to a real win.
+  m->tbScore =  r >= bound ? VALUE_MATE - MAX_MATE_PLY - 1
+              : r >  0     ? max( 3, r - 800) * PawnValueEg / 200
+              : r == 0     ? VALUE_DRAW
+              : r > -bound ? min(-3, r + 800) * PawnValueEg / 200
+              :             -VALUE_MATE + MAX_MATE_PLY + 1;
+
+  return true;
+}
+
 // Use the DTZ tables to rank and score all root moves in the list.
 // A return value of 0 means that not all probes were successful.
 bool TB_root_probe_dtz(Position *pos, RootMoves *rm)
 {
-  int v, success;
-
   // Obtain 50-move counter for the root position.
-  int cnt50 = rule50_count();
+  rootJob.cnt50 = rule50_count();
 
   // Check whether a position was repeated since the last zeroing move.
   // In that case, we need to be careful and play DTZ-optimal moves if
   // winning.
-  bool rep = pos->hasRepeated;
+  rootJob.rep = pos->hasRepeated;
 
   // The border between draw and win lies at rank 1 or rank 900, depending
   // on whether the 50-move rule is used.
-  int bound = option_value(OPT_SYZ_50_MOVE) ? 900 : 1;
+  rootJob.bound = option_value(OPT_SYZ_50_MOVE) ? 900 : 1;
 
   // Probe, rank and score each move.
-  pos->st->endMoves = (pos->st-1)->endMoves;
-  for (int i = 0; i < rm->size; i++) {
-    RootMove *m = &rm->move[i];
-    do_move(pos, m->pv[0], gives_check(pos, pos->st, m->pv[0]));
-
-    // Calculate dtz for the current move counting from the root position.
-    if (rule50_count() == 0) {
-      // If the move resets the 50-move counter, dtz is -101/-1/0/1/101.
-      v = -TB_probe_wdl(pos, &success);
-      v = WdlToDtz[v + 2];
-    } else {
-      // Otherwise, take dtz for the new position and correct by 1 ply.
-      v = -TB_probe_dtz(pos, &success);
-      if (v > 0) v++;
-      else if (v < 0) v--;
-    }
-    // Make sure that a mating move gets value 1.
-    if (checkers() && v == 2) {
-      if (generate_legal(pos, (pos->st-1)->endMoves) == (pos->st-1)->endMoves)
-        v = 1;
-    }
-
-    undo_move(pos, m->pv[0]);
-    if (!success) return false;
-
-    // Better moves are ranked higher. Guaranteed wins are ranked equally.
-    // Losing moves are ranked equally unless a 50-move draw is in sight.
-    // Note that moves ranked 900 have dtz + cnt50 == 100, which in rare
-    // cases may be insufficient to win as dtz may be one off (see the
-    // comments before TB_probe_dtz()).
-    int r =  v > 0 ? (v + cnt50 <= 99 && !rep ? 1000 : 1000 - (v + cnt50))
-           : v < 0 ? (-v * 2 + cnt50 < 100 ? -1000 : -1000 + (-v + cnt50))
-           : 0;
-    m->tbRank = r;
-
-    // Determine the score to be displayed for this move. Assign at least
-    // 1 cp to cursed wins and let it grow to 49 cp as the position gets
-    // closer to a real win.
-    m->tbScore =  r >= bound ? VALUE_MATE - MAX_MATE_PLY - 1
-                : r >  0     ? max( 3, r - 800) * PawnValueEg / 200
-                : r == 0     ? VALUE_DRAW
-                : r > -bound ? min(-3, r + 800) * PawnValueEg / 200
-                :             -VALUE_MATE + MAX_MATE_PLY + 1;
-  }
-
-  return true;
+  return probe_root_moves(pos, rm, probe_root_dtz);
 }
 
-// Use the WDL tables to rank all root moves in the list.
-// This is a fallback for the case that some or all DTZ tables are missing.
-// A return value of 0 means that not all probes were successful.
-bool TB_root_probe_wdl(Position *pos, RootMoves *rm)
+static bool probe_root_wdl(Position *pos, int i)
 {
   static int WdlToRank[] = { -1000, -899, 0, 899, 1000 };
   static Value WdlToValue[] = {
@@ -1850,20 +2198,49 @@ bool TB_root_probe_wdl(Position *pos, RootMoves *rm)
   };
 
   int v, success;
-  int move50 = option_value(OPT_SYZ_50_MOVE);
+  RootMove *m = &rootJob.rm->move[i];
+  do_move(pos, m->pv[0], gives_check(pos, pos->st, m->pv[0]));
+  v = -TB_probe_wdl(pos, &success);
+  undo_move(pos, m->pv[0]);
+  if (!success) return false;
+  if (!rootJob.move50)
+    v = v > 0 ? 2 : v < 0 ? -2 : 0;
+  m->tbRank = WdlToRank[v + 2];
+  m->tbScore = WdlToValue[v + 2];
+
+  return true;
+}
+
+// Use the WDL tables to rank all root moves in the list.
+// This is a fallback for the case that some or all DTZ tables are missing.
+// A return value of 0 means that not all probes were successful.
+bool TB_root_probe_wdl(Position *pos, RootMoves *rm)
+{
+  rootJob.move50 = option_value(OPT_SYZ_50_MOVE);
 
   // Probe, rank and score each move.
-  pos->st->endMoves = (pos->st-1)->endMoves;
-  for (int i = 0; i < rm->size; i++) {
-    RootMove *m = &rm->move[i];
+  return probe_root_moves(pos, rm, probe_root_wdl);
+}
+
+static bool probe_root_dtm(Position *pos, int i)
+{
+  int success;
+  RootMove *m = &rootJob.rm->move[i];
+
+  // Use tbScore to find out if the position is won or lost.
+  int wdl =  m->tbScore >  PawnValueEg ?  2
+           : m->tbScore < -PawnValueEg ? -2 : 0;
+
+  if (wdl == 0)
+    rootJob.tmpScore[i] = 0;
+  else {
+    // Probe and adjust mate score by 1 ply.
     do_move(pos, m->pv[0], gives_check(pos, pos->st, m->pv[0]));
-    v = -TB_probe_wdl(pos, &success);
+    Value v = -TB_probe_dtm(pos, -wdl, &success);
+    rootJob.tmpScore[i] = wdl > 0 ? v - 1 : v + 1;
     undo_move(pos, m->pv[0]);
-    if (!success) return false;
-    if (!move50)
-      v = v > 0 ? 2 : v < 0 ? -2 : 0;
-    m->tbRank = WdlToRank[v + 2];
-    m->tbScore = WdlToValue[v + 2];
+    if (success == 0)
+      return false;
   }
 
   return true;
@@ -1874,36 +2251,15 @@ bool TB_root_probe_wdl(Position *pos, RootMoves *rm)
 // A return value of 0 means that not all probes were successful.
 bool TB_root_probe_dtm(Position *pos, RootMoves *rm)
 {
-  int success;
-  Value tmpScore[rm->size];
-
   // Probe each move.
-  pos->st->endMoves = (pos->st-1)->endMoves;
-  for (int i = 0; i < rm->size; i++) {
-    RootMove *m = &rm->move[i];
-
-    // Use tbScore to find out if the position is won or lost.
-    int wdl =  m->tbScore >  PawnValueEg ?  2
-             : m->tbScore < -PawnValueEg ? -2 : 0;
-
-    if (wdl == 0)
-      tmpScore[i] = 0;
-    else {
-      // Probe and adjust mate score by 1 ply.
-      do_move(pos, m->pv[0], gives_check(pos, pos->st, m->pv[0]));
-      Value v = -TB_probe_dtm(pos, -wdl, &success);
-      tmpScore[i] = wdl > 0 ? v - 1 : v + 1;
-      undo_move(pos, m->pv[0]);
-      if (success == 0)
-        return false;
-    }
-  }
+  if (!probe_root_moves(pos, rm, probe_root_dtm))
+    return false;
 
   // All probes were successful. Now adjust TB scores and ranks.
   for (int i = 0; i < rm->size; i++) {
     RootMove *m = &rm->move[i];
 
-    m->tbScore = tmpScore[i];
+    m->tbScore = rootJob.tmpScore[i];
 
     // Let rank correspond to mate score, except for critical moves
     // ranked 900, which we rank below all other mates for safety.
@@ -1940,6 +2296,16 @@ void TB_expand_mate(Position *pos, RootMove *move)
       v = v > 0 ? -v - 1 : -v + 1;
       wdl = -wdl;
       pos->st->endMoves = generate_legal(pos, (pos->st-1)->endMoves);
+      // The search threads may still be busy, so instead of probing the
+      // moves in parallel we let the OS read ahead the table blocks of all
+      // losing positions before probing them one by one.
+      if (wdl < 0)
+        for (m = (pos->st-1)->endMoves; m < pos->st->endMoves; m++) {
+          do_move(pos, m->move, gives_check(pos, pos->st, m->move));
+          prefetch_wdl_table(pos);
+          prefetch_dtm_table(pos);
+          undo_move(pos, m->move);
+        }
       for (m = (pos->st-1)->endMoves; m < pos->st->endMoves; m++) {
         do_move(pos, m->move, gives_check(pos, pos->st, m->move));
         if (wdl < 0)
@@ -6,15 +6,28 @@
 extern int TB_MaxCardinality;
 extern int TB_MaxCardinalityDTM;
 
+// Each search thread caches the results of its WDL probes, indexed by
+// position key.
+enum { TB_CACHE_SIZE = 4096 };
+
+struct TBCacheEntry {
+  Key key;
+  int16_t wdl;
+  uint8_t success;
+};
+
 void TB_init(char *path);
 void TB_free(void);
 void TB_release(void);
+void TB_report_memory(void);
 int TB_probe_wdl(Position *pos, int *success);
+void TB_prefetch_captures(Position *pos);
 int TB_probe_dtz(Position *pos, int *success);
 Value TB_probe_dtm(Position *pos, int wdl, int *success);
 bool TB_root_probe_wdl(Position *pos, RootMoves *rm);
 bool TB_root_probe_dtz(Position *pos, RootMoves *rm);
 bool TB_root_probe_dtm(Position *pos, RootMoves *rm);
 void TB_expand_mate(Position *pos, RootMove *move);
+void TB_root_probe_worker(Position *pos);
 
 #endif
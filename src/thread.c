@@ -18,8 +18,17 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE // For pthread_setaffinity_np()
+#include <sched.h>
+#endif
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "affinity.h"
+#include "datagen.h"
+#include "evaluate.h"
 #include "material.h"
 #include "movegen.h"
 #include "movepick.h"
@@ -28,94 +37,163 @@
 #include "search.h"
 #include "settings.h"
 #include "thread.h"
+#include "trace.h"
 #include "tt.h"
 #include "uci.h"
 #include "tbprobe.h"
 
 static void thread_idle_loop(Position *pos);
-
-#ifndef _WIN32
-#define THREAD_FUNC void *
-#else
-#define THREAD_FUNC DWORD WINAPI
-#endif
+extern void speedtest_worker(Position *pos);
 
 // Global objects
-ThreadPool Threads;
-MainThread mainThread;
+ThreadPool threadPools[MAX_SEARCHES];
+MainThread mainThreads[MAX_SEARCHES];
+#ifdef SERVER
+_Thread_local int searchIdx;
+#endif
 CounterMoveHistoryStat **cmhTables = NULL;
+static alloc_t *cmhAllocs = NULL;
 int numCmhTables = 0;
 
+// thread_alloc() allocates zeroed memory for a search thread on the NUMA
+// node of the thread, using large pages if the LargePages option is set
+// and large pages are available.
+
+static void *thread_alloc(size_t size, int node, alloc_t *alloc)
+{
+  void *ptr = NULL;
+  if (settings.largePages)
+    ptr = allocate_memory(size, true, alloc);
+  if (!ptr)
+    ptr = allocate_memory(size, false, alloc);
+  if (!ptr) {
+    fprintf(stderr, "Failed to allocate memory for a search thread.\n");
+    exit(EXIT_FAILURE);
+  }
+#ifdef NUMA
+  if (settings.numaEnabled)
+    numa_bind_memory(ptr, size, node);
+#else
+  (void)node;
+#endif
+  return ptr;
+}
+
+// arena_layout() returns the size of the arena that holds the Position
+// struct of a search thread followed by its tables, each starting on a
+// cache line. If pos is not NULL, the table pointers of pos are set to
+// point into the arena starting at pos. Keeping all per-thread state in
+// one allocation lets it be backed by large pages, which reduces the TLB
+// misses of the history, pawn, material and accumulator lookups.
+
+#define ARENA_TAKE(field, bytes) do { \
+  if (pos) pos->field = (void *)((char *)pos + size); \
+  size += ((bytes) + 63) & ~(size_t)63; \
+} while (0)
+
+static size_t arena_layout(Position *pos)
+{
+  size_t size = (sizeof(Position) + 63) & ~(size_t)63;
+
+#ifndef NNUE_PURE
+  ARENA_TAKE(pawnTable, settings.pawnEntries * sizeof(PawnEntry));
+  ARENA_TAKE(materialTable, settings.materialEntries * sizeof(MaterialEntry));
+#endif
+  ARENA_TAKE(counterMoves, sizeof(CounterMoveStat));
+  ARENA_TAKE(mainHistory, sizeof(ButterflyHistory));
+  ARENA_TAKE(captureHistory, sizeof(CapturePieceToHistory));
+  ARENA_TAKE(lowPlyHistory, sizeof(LowPlyHistory));
+  ARENA_TAKE(tbCache, TB_CACHE_SIZE * sizeof(TBCacheEntry));
+#ifdef EVAL_CACHE
+  ARENA_TAKE(evalCache, EVAL_CACHE_SIZE * sizeof(EvalCacheEntry));
+#endif
+#ifdef SEARCH_TRACE
+  ARENA_TAKE(trace, sizeof(TraceBuffer));
+#endif
+  ARENA_TAKE(rootMoves, sizeof(RootMoves));
+  ARENA_TAKE(stackAllocation, (MAX_PLY + 110) * sizeof(Stack));
+  ARENA_TAKE(moveList, 10000 * sizeof(ExtMove));
+#ifdef NNUE
+  ARENA_TAKE(accCacheAllocation, sizeof(AccCache));
+#endif
+
+  return size;
+}
+
+#undef ARENA_TAKE
+
 // thread_init() is where a search thread starts and initialises itself.
 
 static THREAD_FUNC thread_init(void *arg)
 {
-  int idx = (intptr_t)arg;
+  int idx = (intptr_t)arg % MAX_THREADS;
+#ifdef SERVER
+  searchIdx = (intptr_t)arg / MAX_THREADS;
+#endif
 
+  // A thread bound to a processor uses the memory of its node. The
+  // threads of server slot s > 0 take the processors following those of
+  // slot 0 and of the slots before s.
+  int bindIdx = idx;
+#ifdef SERVER
+  if (searchIdx)
+    bindIdx += settings.numThreads
+              + (searchIdx - 1) * option_value(OPT_SERVER_THREADS);
+#endif
+  int cpu = thread_binding_cpu(bindIdx);
   int node;
   if (settings.numaEnabled)
-    node = bind_thread_to_numa_node(idx);
+    node =  cpu >= 0 ? bind_thread_to_cpu_node(idx, cpu)
+          : bind_thread_to_numa_node(idx);
   else
     node = 0;
+  bind_thread_to_cpu(bindIdx);
+  // Each search slot has its own range of counter move history tables
 #ifdef PER_THREAD_CMH
   (void)node;
-  int t = idx;
+  int t = searchIdx * MAX_THREADS + idx;
 #else
-  int t = node;
+  int t = searchIdx * MAX_THREADS + node;
 #endif
   if (t >= numCmhTables) {
     int old = numCmhTables;
     numCmhTables = t + 16;
     cmhTables = realloc(cmhTables,
         numCmhTables * sizeof(CounterMoveHistoryStat *));
+    cmhAllocs = realloc(cmhAllocs, numCmhTables * sizeof(alloc_t));
     while (old < numCmhTables)
       cmhTables[old++] = NULL;
   }
-  if (!cmhTables[t]) {
-    if (settings.numaEnabled)
-      cmhTables[t] = numa_alloc(sizeof(CounterMoveHistoryStat));
-    else
-      cmhTables[t] = calloc(sizeof(CounterMoveHistoryStat), 1);
-    for (int chk = 0; chk < 2; chk++)
-      for (int c = 0; c < 2; c++)
-        for (int j = 0; j < 16; j++)
-          for (int k = 0; k < 64; k++)
-            (*cmhTables[t])[chk][c][0][0][j][k] = CounterMovePruneThreshold - 1;
-  }
-
-  Position *pos;
-
-  if (settings.numaEnabled) {
-    pos = numa_alloc(sizeof(Position));
-#ifndef NNUE_PURE
-    pos->pawnTable = numa_alloc(PAWN_ENTRIES * sizeof(PawnEntry));
-    pos->materialTable = numa_alloc(8192 * sizeof(MaterialEntry));
-#endif
-    pos->counterMoves = numa_alloc(sizeof(CounterMoveStat));
-    pos->mainHistory = numa_alloc(sizeof(ButterflyHistory));
-    pos->captureHistory = numa_alloc(sizeof(CapturePieceToHistory));
-    pos->lowPlyHistory = numa_alloc(sizeof(LowPlyHistory));
-    pos->rootMoves = numa_alloc(sizeof(RootMoves));
-    pos->stackAllocation = numa_alloc(63 + (MAX_PLY + 110) * sizeof(Stack));
-    pos->moveList = numa_alloc(10000 * sizeof(ExtMove));
-  } else {
-    pos = calloc(sizeof(Position), 1);
-#ifndef NNUE_PURE
-    pos->pawnTable = calloc(PAWN_ENTRIES * sizeof(PawnEntry), 1);
-    pos->materialTable = calloc(8192 * sizeof(MaterialEntry), 1);
-#endif
-    pos->counterMoves = calloc(sizeof(CounterMoveStat), 1);
-    pos->mainHistory = calloc(sizeof(ButterflyHistory), 1);
-    pos->captureHistory = calloc(sizeof(CapturePieceToHistory), 1);
-    pos->lowPlyHistory = calloc(sizeof(LowPlyHistory), 1);
-    pos->rootMoves = calloc(sizeof(RootMoves), 1);
-    pos->stackAllocation = calloc(63 + (MAX_PLY + 110) * sizeof(Stack), 1);
-    pos->moveList = calloc(10000 * sizeof(ExtMove), 1);
-  }
+  if (!cmhTables[t])
+    cmhTables[t] = thread_alloc(sizeof(CounterMoveHistoryStat), node,
+                                &cmhAllocs[t]);
+
+  alloc_t arena;
+  Position *pos = thread_alloc(arena_layout(NULL), node, &arena);
+  arena_layout(pos);
+  pos->arena = arena;
   pos->stack = (Stack *)(((uintptr_t)pos->stackAllocation + 0x3f) & ~0x3f);
+#ifdef NNUE
+  pos->accCache = (AccCache *)(((uintptr_t)pos->accCacheAllocation + 0x3f) & ~0x3f);
+#endif
   pos->threadIdx = idx;
+  pos->numaNode = node;
   pos->counterMoveHistory = cmhTables[t];
 
+  // Touch all tables from this thread, so that their pages are placed on
+  // the thread's own NUMA node.
+  search_clear_thread(pos);
+#ifndef NNUE_PURE
+  pos->pawnMask = settings.pawnEntries - 1;
+  // The tables are empty until the settings have been processed
+  if (settings.materialEntries)
+    pos->materialShift = 64 - msb(settings.materialEntries);
+  pos->materialShared = material_table(node);
+  pos->pawnShared = pawn_shared_table(node, &pos->pawnSharedMask);
+  memset(pos->pawnTable, 0, settings.pawnEntries * sizeof(PawnEntry));
+  memset(pos->materialTable, 0, settings.materialEntries * sizeof(MaterialEntry));
+#endif
+
   atomic_store(&pos->resetCalls, false);
   pos->selDepth = pos->callsCnt = 0;
 
@@ -157,15 +235,16 @@ static void thread_create(int idx)
 
   Threads.initializing = true;
   pthread_mutex_lock(&Threads.mutex);
-  pthread_create(&thread, NULL, thread_init, (void *)(intptr_t)idx);
+  pthread_create(&thread, NULL, thread_init,
+      (void *)(intptr_t)(searchIdx * MAX_THREADS + idx));
   while (Threads.initializing)
     pthread_cond_wait(&Threads.sleepCondition, &Threads.mutex);
   pthread_mutex_unlock(&Threads.mutex);
 
 #else
 
-  HANDLE thread = CreateThread(NULL, 0, thread_init, (void *)(intptr_t)idx,
-      0 , NULL);
+  HANDLE thread = CreateThread(NULL, 0, thread_init,
+      (void *)(intptr_t)(searchIdx * MAX_THREADS + idx), 0 , NULL);
   WaitForSingleObject(Threads.event, INFINITE);
 
 #endif
@@ -194,33 +273,8 @@ static void thread_destroy(Position *pos)
   CloseHandle(pos->stopEvent);
 #endif
 
-  if (settings.numaEnabled) {
-#ifndef NNUE_PURE
-    numa_free(pos->pawnTable, PAWN_ENTRIES * sizeof(PawnEntry));
-    numa_free(pos->materialTable, 8192 * sizeof(MaterialEntry));
-#endif
-    numa_free(pos->counterMoves, sizeof(CounterMoveStat));
-    numa_free(pos->mainHistory, sizeof(ButterflyHistory));
-    numa_free(pos->captureHistory, sizeof(CapturePieceToHistory));
-    numa_free(pos->lowPlyHistory, sizeof(LowPlyHistory));
-    numa_free(pos->rootMoves, sizeof(RootMoves));
-    numa_free(pos->stackAllocation, 63 + (MAX_PLY + 110) * sizeof(Stack));
-    numa_free(pos->moveList, 10000 * sizeof(ExtMove));
-    numa_free(pos, sizeof(Position));
-  } else {
-#ifndef NNUE_PURE
-    free(pos->pawnTable);
-    free(pos->materialTable);
-#endif
-    free(pos->counterMoves);
-    free(pos->mainHistory);
-    free(pos->captureHistory);
-    free(pos->lowPlyHistory);
-    free(pos->rootMoves);
-    free(pos->stackAllocation);
-    free(pos->moveList);
-    free(pos);
-  }
+  alloc_t arena = pos->arena;
+  free_memory(&arena);
 }
 
 
@@ -295,11 +349,28 @@ void thread_wake_up(Position *pos, int action)
 }
 
 
+// idle_spin() lets a sleeping thread poll for new work for "Idle Spin"
+// milliseconds before it blocks, so that a new command is picked up
+// without the latency of waking up the thread.
+
+static void idle_spin(Position *pos)
+{
+  int spin = option_value(OPT_IDLE_SPIN);
+  if (!spin)
+    return;
+
+  TimePoint end = now() + spin;
+  while (   atomic_load_explicit(&pos->action, memory_order_relaxed) == THREAD_SLEEP
+         && now() < end) {}
+}
+
 // thread_idle_loop() is where the thread is parked when it has no work to do.
 
 static void thread_idle_loop(Position *pos)
 {
   while (true) {
+    idle_spin(pos);
+
 #ifndef _WIN32
 
     pthread_mutex_lock(&pos->mutex);
@@ -317,6 +388,8 @@ static void thread_idle_loop(Position *pos)
 
 #endif
 
+    trace(pos, TRACE_WAKEUP, TRACE_INSTANT, pos->action);
+
     if (pos->action == THREAD_EXIT) {
 
       break;
@@ -325,6 +398,38 @@ static void thread_idle_loop(Position *pos)
 
       tt_clear_worker(pos->threadIdx);
 
+    } else if (pos->action == THREAD_TT_RESIZE) {
+
+      tt_resize_worker(pos->threadIdx);
+
+    } else if (pos->action == THREAD_TT_STATS) {
+
+      tt_stats_worker(pos->threadIdx);
+
+    } else if (pos->action == THREAD_SEARCH_CLEAR) {
+
+      search_clear_thread(pos);
+
+    } else if (pos->action == THREAD_PERFT) {
+
+      perft_worker(pos);
+
+    } else if (pos->action == THREAD_TB_PROBE) {
+
+      TB_root_probe_worker(pos);
+
+    } else if (pos->action == THREAD_BATCH) {
+
+      batch_worker(pos);
+
+    } else if (pos->action == THREAD_DATAGEN) {
+
+      datagen_worker(pos);
+
+    } else if (pos->action == THREAD_SPEEDTEST) {
+
+      speedtest_worker(pos);
+
     } else {
 
       if (pos->threadIdx == 0)
@@ -334,10 +439,17 @@ static void thread_idle_loop(Position *pos)
 
     }
 
+    // Release the threads waiting for this one before it starts spinning.
+#ifndef _WIN32
+
+    pthread_mutex_lock(&pos->mutex);
     pos->action = THREAD_SLEEP;
+    pthread_cond_signal(&pos->sleepCondition);
+    pthread_mutex_unlock(&pos->mutex);
 
-#ifdef _WIN32
+#else
 
+    pos->action = THREAD_SLEEP;
     SetEvent(pos->stopEvent);
 
 #endif
@@ -348,7 +460,8 @@ static void thread_idle_loop(Position *pos)
 // threads_init() creates and launches requested threads that will go
 // immediately to sleep. We cannot use a constructor because Threads is a
 // static object and we need a fully initialized engine at this point due to
-// allocation of Endgames in the Thread constructor.
+// allocation of Endgames in the Thread constructor. In server mode it sets
+// up the thread pool of the current search slot.
 
 void threads_init(void)
 {
@@ -365,11 +478,12 @@ void threads_init(void)
 
 #ifdef NUMA
 
-  numa_init();
+  if (searchIdx == 0)
+    numa_init();
 
 #endif
 
-  Threads.numThreads = 1;
+  Threads.numThreads = Threads.numCreated = 1;
   thread_create(0);
 }
 
@@ -381,6 +495,9 @@ void threads_init(void)
 void threads_exit(void)
 {
   threads_set_number(0);
+  free(mainThread.pvBuf);
+  mainThread.pvBuf = NULL;
+  mainThread.pvBufSize = 0;
 
 #ifndef _WIN32
 
@@ -395,36 +512,118 @@ void threads_exit(void)
 
 #ifdef NUMA
 
-  numa_exit();
+  if (searchIdx == 0)
+    numa_exit();
+
+#endif
+}
+
+
+// threads_pin() pins search thread i to the i-th logical processor that
+// the process may run on, or restores the previous affinity of the threads
+// if pin is false. It returns false if pinning is not supported. On Windows
+// only the processors of the first processor group are used.
+
+#if defined(__linux__)
+static cpu_set_t *savedAffinity;
+#elif defined(_WIN32)
+static DWORD_PTR *savedAffinity;
+#endif
+
+bool threads_pin(bool pin)
+{
+#if defined(__linux__)
+  if (pin) {
+    cpu_set_t avail;
+    if (savedAffinity || sched_getaffinity(0, sizeof(avail), &avail) != 0)
+      return false;
+    savedAffinity = malloc(Threads.numThreads * sizeof(cpu_set_t));
+    for (int idx = 0, cpu = -1; idx < Threads.numThreads; idx++) {
+      pthread_t thread = Threads.pos[idx]->nativeThread;
+      pthread_getaffinity_np(thread, sizeof(cpu_set_t), &savedAffinity[idx]);
+      do cpu = (cpu + 1) % CPU_SETSIZE; while (!CPU_ISSET(cpu, &avail));
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(thread, sizeof(set), &set);
+    }
+  } else if (savedAffinity) {
+    for (int idx = 0; idx < Threads.numThreads; idx++)
+      pthread_setaffinity_np(Threads.pos[idx]->nativeThread,
+          sizeof(cpu_set_t), &savedAffinity[idx]);
+    free(savedAffinity);
+    savedAffinity = NULL;
+  }
+  return true;
+
+#elif defined(_WIN32)
+  if (pin) {
+    DWORD_PTR avail, systemMask;
+    if (   savedAffinity
+        || !GetProcessAffinityMask(GetCurrentProcess(), &avail, &systemMask)
+        || !avail)
+      return false;
+    savedAffinity = malloc(Threads.numThreads * sizeof(DWORD_PTR));
+    for (int idx = 0, cpu = -1; idx < Threads.numThreads; idx++) {
+      do cpu = (cpu + 1) % (8 * sizeof(DWORD_PTR));
+      while (!(avail & ((DWORD_PTR)1 << cpu)));
+      savedAffinity[idx] = SetThreadAffinityMask(Threads.pos[idx]->nativeThread,
+          (DWORD_PTR)1 << cpu);
+    }
+  } else if (savedAffinity) {
+    for (int idx = 0; idx < Threads.numThreads; idx++)
+      if (savedAffinity[idx])
+        SetThreadAffinityMask(Threads.pos[idx]->nativeThread,
+            savedAffinity[idx]);
+    free(savedAffinity);
+    savedAffinity = NULL;
+  }
+  return true;
+
+#else
+  (void)pin;
+  return false;
 
 #endif
 }
 
 
 // threads_set_number() creates/destroys threads to match the requested
-// number.
+// number. Unless "Park Threads" is disabled, threads that are no longer
+// needed are parked instead of destroyed: they keep sleeping with their
+// tables allocated and are used again when the number of threads grows.
 
 void threads_set_number(int num)
 {
-  while (Threads.numThreads < num)
-    thread_create(Threads.numThreads++);
+  int keep = num && option_value(OPT_PARK_THREADS) ? max(num, Threads.numCreated) : num;
+
+  while (Threads.numCreated > keep)
+    thread_destroy(Threads.pos[--Threads.numCreated]);
 
-  while (Threads.numThreads > num)
-    thread_destroy(Threads.pos[--Threads.numThreads]);
+  while (Threads.numCreated < num)
+    thread_create(Threads.numCreated++);
+
+  Threads.numThreads = num;
 
   search_init();
 
   if (num == 0 && numCmhTables > 0) {
-    for (int i = 0; i < numCmhTables; i++)
+    int end = min(numCmhTables, (searchIdx + 1) * MAX_THREADS);
+    for (int i = searchIdx * MAX_THREADS; i < end; i++)
       if (cmhTables[i]) {
-        if (settings.numaEnabled)
-          numa_free(cmhTables[i], sizeof(CounterMoveHistoryStat));
-        else
-          free(cmhTables[i]);
+        free_memory(&cmhAllocs[i]);
+        cmhTables[i] = NULL;
       }
-    free(cmhTables);
-    cmhTables = NULL;
-    numCmhTables = 0;
+    int i = 0;
+    while (i < numCmhTables && !cmhTables[i])
+      i++;
+    if (i == numCmhTables) {
+      free(cmhTables);
+      free(cmhAllocs);
+      cmhTables = NULL;
+      cmhAllocs = NULL;
+      numCmhTables = 0;
+    }
   }
 
   if (num == 0)
@@ -432,6 +631,85 @@ void threads_set_number(int num)
 }
 
 
+// threads_report_memory() reports the arenas of the search threads of all
+// search slots and the counter move history tables for the "memory"
+// command.
+
+void threads_report_memory(void)
+{
+  size_t arenaSize = arena_layout(NULL);
+  for (int i = 0; i < MAX_SEARCHES; i++)
+    for (int idx = 0; idx < threadPools[i].numCreated; idx++) {
+      Position *pos = threadPools[i].pos[idx];
+      memory_add("search threads", settings.numaEnabled ? pos->numaNode : -1,
+                 arenaSize, pos->arena.lp);
+    }
+
+  for (int t = 0; t < numCmhTables; t++)
+    if (cmhTables[t]) {
+#ifdef PER_THREAD_CMH
+      ThreadPool *pool = &threadPools[t / MAX_THREADS];
+      int node =  t % MAX_THREADS < pool->numCreated
+                ? pool->pos[t % MAX_THREADS]->numaNode : -1;
+#else
+      int node = t % MAX_THREADS;
+#endif
+      memory_add("countermove history", settings.numaEnabled ? node : -1,
+                 sizeof(CounterMoveHistoryStat), cmhAllocs[t].lp);
+    }
+}
+
+
+// threads_destroy_slots() destroys the thread pools of the tagged search
+// slots and threads_recreate_slots() creates them again with the same
+// number of threads. process_delayed_settings() uses them around changes
+// to tables that the threads of all slots refer to.
+
+#ifdef SERVER
+static int slotThreads[MAX_SEARCHES];
+#endif
+
+void threads_destroy_slots(void)
+{
+#ifdef SERVER
+  for (int i = 1; i < MAX_SEARCHES; i++)
+    if (threadPools[i].numCreated) {
+      searchIdx = i;
+      if (!slotThreads[i])
+        slotThreads[i] = Threads.numThreads;
+      threads_set_number(0);
+    }
+  searchIdx = 0;
+#endif
+}
+
+void threads_recreate_slots(void)
+{
+#ifdef SERVER
+  for (int i = 1; i < MAX_SEARCHES; i++)
+    if (slotThreads[i]) {
+      searchIdx = i;
+      threads_set_number(slotThreads[i]);
+      slotThreads[i] = 0;
+    }
+  searchIdx = 0;
+#endif
+}
+
+
+// threads_slots_busy() returns whether a search slot other than slot 0
+// is still running a search. Settings shared by all searches must not be
+// changed while it does.
+
+bool threads_slots_busy(void)
+{
+  for (int i = 1; i < MAX_SEARCHES; i++)
+    if (threadPools[i].numThreads && threadPools[i].pos[0]->action != THREAD_SLEEP)
+      return true;
+  return false;
+}
+
+
 // threads_nodes_searched() returns the number of nodes searched.
 
 uint64_t threads_nodes_searched(void)
@@ -452,3 +730,20 @@ uint64_t threads_tb_hits(void)
     hits += Threads.pos[idx]->tbHits;
   return hits;
 }
+
+
+#ifdef SEARCH_STATS
+
+// threads_search_stats() adds up the search statistics of all threads.
+
+void threads_search_stats(uint64_t *stats)
+{
+  for (int i = 0; i < STAT_NB; i++)
+    stats[i] = 0;
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    for (int i = 0; i < STAT_NB; i++)
+      stats[i] += Threads.pos[idx]->stats[i];
+}
+
+#endif
+
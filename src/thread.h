@@ -32,13 +32,31 @@
 
 #define MAX_THREADS 512
 
+// In server mode (-DSERVER) several searches run at the same time, each
+// in its own search slot with its own thread pool, limits and time
+// management. Slot 0 serves the untagged UCI commands. The slot of the
+// search a thread works for is kept in the thread-local searchIdx, and
+// PER_SEARCH(x) selects that slot's instance of the per-search array x.
+
+#ifdef SERVER
+#define MAX_SEARCHES 32
+extern _Thread_local int searchIdx;
+#else
+#define MAX_SEARCHES 1
+#define searchIdx 0
+#endif
+
+#define PER_SEARCH(x) ((x)[searchIdx])
+
 #ifndef _WIN32
+#define THREAD_FUNC void *
 #define LOCK_T pthread_mutex_t
 #define LOCK_INIT(x) pthread_mutex_init(&(x), NULL)
 #define LOCK_DESTROY(x) pthread_mutex_destroy(&(x))
 #define LOCK(x) pthread_mutex_lock(&(x))
 #define UNLOCK(x) pthread_mutex_unlock(&(x))
 #else
+#define THREAD_FUNC DWORD WINAPI
 #define LOCK_T HANDLE
 #define LOCK_INIT(x) do { x = CreateMutex(NULL, FALSE, NULL); } while (0)
 #define LOCK_DESTROY(x) CloseHandle(x)
@@ -47,7 +65,9 @@
 #endif
 
 enum {
-  THREAD_SLEEP, THREAD_SEARCH, THREAD_TT_CLEAR, THREAD_EXIT, THREAD_RESUME
+  THREAD_SLEEP, THREAD_SEARCH, THREAD_TT_CLEAR, THREAD_TT_RESIZE,
+  THREAD_TT_STATS, THREAD_SEARCH_CLEAR, THREAD_PERFT, THREAD_TB_PROBE,
+  THREAD_BATCH, THREAD_DATAGEN, THREAD_SPEEDTEST, THREAD_EXIT, THREAD_RESUME
 };
 
 void thread_search(Position *pos);
@@ -62,11 +82,17 @@ struct MainThread {
   double previousTimeReduction;
   Value previousScore;
   Value iterValue[4];
+  int64_t pvTime;
+  bool pvPending;
+  uint64_t pvHash[MAX_MOVES];
+  char *pvBuf;
+  size_t pvBufSize;
 };
 
 typedef struct MainThread MainThread;
 
-extern MainThread mainThread;
+extern MainThread mainThreads[MAX_SEARCHES];
+#define mainThread PER_SEARCH(mainThreads)
 
 void mainthread_search(void);
 
@@ -78,6 +104,7 @@ void mainthread_search(void);
 struct ThreadPool {
   Position *pos[MAX_THREADS];
   int numThreads;
+  int numCreated; // including parked threads
 #ifndef _WIN32
   pthread_mutex_t mutex;
   pthread_cond_t sleepCondition;
@@ -96,10 +123,19 @@ void threads_init(void);
 void threads_exit(void);
 void threads_start_thinking(Position *pos, LimitsType *);
 void threads_set_number(int num);
+void threads_report_memory(void);
+bool threads_pin(bool pin);
 uint64_t threads_nodes_searched(void);
 uint64_t threads_tb_hits(void);
+#ifdef SEARCH_STATS
+void threads_search_stats(uint64_t *stats);
+#endif
+bool threads_slots_busy(void);
+void threads_destroy_slots(void);
+void threads_recreate_slots(void);
 
-extern ThreadPool Threads;
+extern ThreadPool threadPools[MAX_SEARCHES];
+#define Threads PER_SEARCH(threadPools)
 
 INLINE Position *threads_main(void)
 {
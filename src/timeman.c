@@ -25,7 +25,7 @@
 #include "timeman.h"
 #include "uci.h"
 
-struct TimeManagement Time; // Our global time management struct
+struct TimeManagement timeManagements[MAX_SEARCHES]; // One per search
 
 // tm_init() is called at the beginning of the search and calculates the
 // time bounds allowed for the current game ply. We currently support:
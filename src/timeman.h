@@ -35,7 +35,8 @@ struct TimeManagement {
   int64_t availableNodes;
 };
 
-extern struct TimeManagement Time;
+extern struct TimeManagement timeManagements[MAX_SEARCHES];
+#define Time PER_SEARCH(timeManagements)
 
 void time_init(Color us, int ply);
 
@@ -0,0 +1,69 @@
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "thread.h"
+#include "trace.h"
+
+static uint64_t traceStart;
+
+static const char *TraceNames[TRACE_NB] = {
+  "search", "iteration", "aspiration", "tb probe", "fail high", "fail low",
+  "check time", "wakeup", "bestmove"
+};
+
+static const char *TracePhases[3] = {
+  "\"B\"", "\"E\"", "\"i\",\"s\":\"t\""
+};
+
+static const char *TraceArgs[TRACE_NB] = {
+  "thread", "depth", "depth", "pieces", "value", "value", "stop", "action",
+  "thread"
+};
+
+// trace_start() empties the trace buffers of all search threads. It is
+// called when a search is started.
+
+void trace_start(void)
+{
+  traceStart = now_usec();
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    Threads.pos[idx]->trace->count = 0;
+}
+
+// trace_write() writes the events recorded since the start of the search
+// to a file in the Chrome trace event format, which can be viewed with
+// chrome://tracing or https://ui.perfetto.dev. Each search thread is shown
+// as a thread of one process, with times in microseconds since the start
+// of the search.
+
+void trace_write(const char *fileName)
+{
+  FILE *F = fopen(fileName, "w");
+  if (!F) {
+    printf("info string Unable to write trace to %s.\n", fileName);
+    fflush(stdout);
+    return;
+  }
+
+  fprintf(F, "{\"traceEvents\":[\n");
+  for (int idx = 0; idx < Threads.numThreads; idx++) {
+    TraceBuffer *tb = Threads.pos[idx]->trace;
+    fprintf(F, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+               "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+            idx ? ",\n" : "", idx, idx);
+
+    // If the buffer has wrapped around, only the last TraceSize events
+    // are left.
+    uint64_t begin = tb->count > TraceSize ? tb->count - TraceSize : 0;
+    for (uint64_t i = begin; i < tb->count; i++) {
+      TraceEvent *e = &tb->event[i & (TraceSize - 1)];
+      fprintf(F, ",\n{\"name\":\"%s\",\"ph\":%s,\"ts\":%" PRIu64 ","
+                 "\"pid\":0,\"tid\":%d,\"args\":{\"%s\":%d}}",
+              TraceNames[e->type], TracePhases[e->phase],
+              e->time >= traceStart ? e->time - traceStart : 0, idx,
+              TraceArgs[e->type], e->arg);
+    }
+  }
+  fprintf(F, "\n]}\n");
+  fclose(F);
+}
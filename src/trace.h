@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+
+#ifdef SEARCH_TRACE
+
+#include "misc.h"
+#include "position.h"
+
+// A TraceBuffer is a ring buffer of the last TraceSize timeline events of
+// a search thread. Begin and end events of a type enclose a time span,
+// the other events mark a point in time. Each event has one argument,
+// such as the depth of an iteration or the value of a fail high.
+
+enum {
+  TRACE_SEARCH, TRACE_ITERATION, TRACE_ASPIRATION, TRACE_TB_PROBE,
+  TRACE_FAIL_HIGH, TRACE_FAIL_LOW, TRACE_CHECK_TIME, TRACE_WAKEUP,
+  TRACE_BESTMOVE, TRACE_NB
+};
+
+enum { TRACE_BEGIN, TRACE_END, TRACE_INSTANT };
+
+enum { TraceSize = 1 << 16 };
+
+typedef struct {
+  uint64_t time;
+  uint8_t type, phase;
+  int32_t arg;
+} TraceEvent;
+
+struct TraceBuffer {
+  TraceEvent event[TraceSize];
+  uint64_t count;
+};
+
+INLINE void trace_event(Position *pos, int type, int phase, int arg)
+{
+  TraceEvent *e = &pos->trace->event[pos->trace->count++ & (TraceSize - 1)];
+  e->time = now_usec();
+  e->type = type;
+  e->phase = phase;
+  e->arg = arg;
+}
+
+void trace_start(void);
+void trace_write(const char *fileName);
+
+#define trace(pos, type, phase, arg) trace_event(pos, type, phase, arg)
+
+#else
+
+#define trace(pos, type, phase, arg) do {} while (0)
+
+#endif
+
+#endif
@@ -19,7 +19,9 @@
 */
 
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>   // For memset
 #ifndef _WIN32
 #include <sys/mman.h>
@@ -39,17 +41,53 @@ TranspositionTable TT; // Our global transposition table
 
 void tt_free(void)
 {
+  tt_wait_clear();
   if (TT.table)
     free_memory(&TT.alloc);
   TT.table = NULL;
 }
 
+// tt_report_memory() reports the memory of the transposition table for the
+// "memory" command. An unsharded table is spread over all nodes.
 
-// tt_allocate() allocates the transposition table, measured in megabytes.
+void tt_report_memory(void)
+{
+  if (!TT.table)
+    return;
 
-void tt_allocate(size_t mbSize)
+  size_t size = TT.clusterCount * sizeof(Cluster);
+#ifdef NUMA
+  if (TT.numShards > 1) {
+    for (int i = 0; i < TT.numShards; i++)
+      memory_add("hash table", TT.shardNode[i], size / TT.numShards,
+                 TT.alloc.lp);
+    return;
+  }
+#endif
+  memory_add("hash table", -1, size, TT.alloc.lp);
+}
+
+
+// tt_allocate_table() allocates an uninitialised transposition table of
+// mbSize megabytes. It returns false if the memory could not be allocated.
+
+static bool tt_allocate_table(size_t mbSize)
 {
   TT.clusterCount = mbSize * 1024 * 1024 / sizeof(Cluster);
+
+#ifdef NUMA
+  TT.numShards = 1;
+  TT.shardNode[0] = 0;
+  if (settings.numaEnabled && settings.ttShards) {
+    TT.numShards = numa_shard_nodes(TT.shardNode, MaxTTShards);
+    // Let each shard consist of a whole number of 2MB pages if possible
+    size_t unit = TT.numShards * (2 * 1024 * 1024 / sizeof(Cluster));
+    if (TT.clusterCount < unit)
+      unit = TT.numShards;
+    TT.clusterCount -= TT.clusterCount % unit;
+  }
+#endif
+
   size_t size = TT.clusterCount * sizeof(Cluster);
 
   TT.table = NULL;
@@ -67,6 +105,30 @@ void tt_allocate(size_t mbSize)
   if (!TT.table)
     TT.table = allocate_memory(size, false, &TT.alloc);
   if (!TT.table)
+    return false;
+
+#ifdef NUMA
+  // Bind each shard to its node before the memory is touched
+  if (TT.numShards > 1) {
+    size_t shardSize = size / TT.numShards;
+    for (int i = 0; i < TT.numShards; i++)
+      numa_bind_memory((char *)TT.table + i * shardSize, shardSize,
+          TT.shardNode[i]);
+    printf("info string Transposition table split into %d NUMA shards.\n",
+           TT.numShards);
+    fflush(stdout);
+  }
+#endif
+
+  return true;
+}
+
+
+// tt_allocate() allocates the transposition table, measured in megabytes.
+
+void tt_allocate(size_t mbSize)
+{
+  if (!tt_allocate_table(mbSize))
     goto failed;
 
   // Clear the TT table to page in the memory immediately. This avoids
@@ -81,6 +143,138 @@ failed:
 }
 
 
+// tt_resize() changes the size of the transposition table to mbSize
+// megabytes while keeping its contents. The search threads rehash the
+// clusters of the old table into the new one in parallel, which also
+// pages in the new table like tt_clear() does. If a new cluster receives
+// more entries than it can hold, the entries with the highest replace
+// value as defined by tt_probe() are kept. If both tables do not fit in
+// memory at the same time, the table is reallocated empty.
+
+static Cluster *oldTable;
+static size_t oldClusterCount;
+
+void tt_resize(size_t mbSize)
+{
+  tt_wait_clear();
+
+  if (!TT.table) {
+    tt_allocate(mbSize);
+    return;
+  }
+
+  oldTable = TT.table;
+  oldClusterCount = TT.clusterCount;
+  alloc_t oldAlloc = TT.alloc;
+
+  if (!tt_allocate_table(mbSize)) {
+    free_memory(&oldAlloc);
+    tt_allocate(mbSize);
+    return;
+  }
+
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    thread_wake_up(Threads.pos[idx], THREAD_TT_RESIZE);
+  for (int idx = 0; idx < Threads.numThreads; idx++)
+    thread_wait_until_sleeping(Threads.pos[idx]);
+
+  free_memory(&oldAlloc);
+  oldTable = NULL;
+}
+
+// scale() computes the quotient and remainder of a * b / c. Without
+// 128-bit integers, a * b fits in 64 bits since cluster counts are then
+// small enough.
+
+static void scale(uint64_t a, uint64_t b, uint64_t c, uint64_t *q,
+    uint64_t *r)
+{
+#if defined(__GNUC__) && defined(IS_64BIT)
+  __extension__ typedef unsigned __int128 uint128;
+  uint128 p = (uint128)a * b;
+#else
+  uint64_t p = a * b;
+#endif
+  *q = p / c;
+  *r = p % c;
+}
+
+// entry_value() returns the replace value of an entry as in tt_probe(),
+// or INT_MIN if the entry is empty.
+
+static int entry_value(const TTEntry *tte)
+{
+#ifndef TT_LOCKLESS
+  uint8_t depth8 = tte->depth8, genBound8 = tte->genBound8;
+#else
+  uint8_t depth8 = tte->data, genBound8 = tte->data >> 8;
+#endif
+  return  depth8 ? depth8 - ((263 + TT.generation8 - genBound8) & 0xF8)
+                 : INT_MIN;
+}
+
+void tt_resize_worker(int idx)
+{
+  // Each thread fills a contiguous range of clusters of the new table.
+  uint64_t oldCount = oldClusterCount, newCount = TT.clusterCount;
+  uint64_t slice = (newCount + Threads.numThreads - 1) / Threads.numThreads;
+  uint64_t begin = min(idx * slice, newCount);
+  uint64_t end = min(begin + slice, newCount);
+
+  // A key k lies in old cluster k * oldCount >> 64 and in new cluster
+  // k * newCount >> 64, so new cluster j can only receive entries of the
+  // old clusters first(j) to first(j + 1) - 1, where first(j) is the
+  // quotient q of j * oldCount / newCount, and of old cluster first(j + 1)
+  // itself if the remainder r is not zero. Since the entries of a
+  // 10-byte TT only store the low 16 bits of their key, an entry is
+  // copied to all new clusters it might belong to.
+  uint64_t q, r, dq = oldCount / newCount, dr = oldCount % newCount;
+  scale(begin, oldCount, newCount, &q, &r);
+
+  for (uint64_t j = begin; j < end; j++) {
+    uint64_t first = q;
+    q += dq, r += dr;
+    if (r >= newCount)
+      q++, r -= newCount;
+    uint64_t last = min(r ? q : q - 1, oldCount - 1);
+
+    TTEntry best[ClusterSize];
+    int value[ClusterSize];
+    int n = 0;
+
+    for (uint64_t i = first; i <= last; i++)
+      for (int k = 0; k < ClusterSize; k++) {
+        TTEntry *tte = &oldTable[i].entry[k];
+        int v = entry_value(tte);
+        if (v == INT_MIN)
+          continue;
+#ifdef TT_LOCKLESS
+        if (mul_hi64(tte->keyXor ^ tte->data, newCount) != j)
+          continue;
+#endif
+        // Insert the entry into the list of best entries sorted by value
+        int m;
+        if (n < ClusterSize)
+          m = n++;
+        else if (value[ClusterSize - 1] >= v)
+          continue;
+        else
+          m = ClusterSize - 1;
+        for (; m > 0 && value[m - 1] < v; m--) {
+          best[m] = best[m - 1];
+          value[m] = value[m - 1];
+        }
+        best[m] = *tte;
+        value[m] = v;
+      }
+
+    Cluster *cl = &TT.table[j];
+    memset(cl, 0, sizeof(Cluster));
+    memcpy(cl->entry, best, n * sizeof(TTEntry));
+  }
+}
+
+
 // tt_clear() initialises the entire transposition table to zero.
 
 void tt_clear(void)
@@ -88,6 +282,12 @@ void tt_clear(void)
   // We let search threads clear the table in parallel. In NUMA mode,
   // this has the beneficial effect of spreading the TT over all nodes.
 
+  tt_wait_clear();
+
+#ifdef TT_LOCKLESS
+  atomic_store(&TT.collisions, 0);
+#endif
+
   if (TT.table) {
     for (int idx = 0; idx < Threads.numThreads; idx++)
       thread_wake_up(Threads.pos[idx], THREAD_TT_CLEAR);
@@ -114,15 +314,184 @@ void tt_clear_worker(int idx)
 }
 
 
+// tt_clear_background() zeroes the table in a separate thread, so that
+// the GUI does not have to wait for a large table to be cleared. Searches
+// may run in the meantime. They will then see a mix of entries of the
+// previous game and of the new search, which is harmless, and some of
+// their new entries may be cleared.
+
+#ifndef _WIN32
+static pthread_t clearThread;
+#else
+static HANDLE clearThread;
+#endif
+static bool clearing = false;
+
+static THREAD_FUNC tt_clear_background_worker(void *arg)
+{
+  (void)arg;
+
+  size_t total = TT.clusterCount * sizeof(Cluster);
+  size_t chunk = 2 * 1024 * 1024;
+
+  for (size_t begin = 0; begin < total; begin += chunk)
+    memset((uint8_t *)TT.table + begin, 0, min(chunk, total - begin));
+
+  return 0;
+}
+
+void tt_clear_background(void)
+{
+  tt_wait_clear();
+
+#ifdef TT_LOCKLESS
+  atomic_store(&TT.collisions, 0);
+#endif
+
+  if (!TT.table)
+    return;
+
+#ifndef _WIN32
+  clearing = pthread_create(&clearThread, NULL, tt_clear_background_worker,
+                            NULL) == 0;
+#else
+  clearThread = CreateThread(NULL, 0, tt_clear_background_worker, NULL, 0,
+                             NULL);
+  clearing = clearThread != NULL;
+#endif
+
+  if (!clearing)
+    tt_clear();
+}
+
+// tt_wait_clear() waits until a background clear has finished.
+
+void tt_wait_clear(void)
+{
+  if (!clearing)
+    return;
+
+#ifndef _WIN32
+  pthread_join(clearThread, NULL);
+#else
+  WaitForSingleObject(clearThread, INFINITE);
+  CloseHandle(clearThread);
+#endif
+  clearing = false;
+}
+
+
+// The hash file starts with a header of one cache line followed by an
+// exact image of TT.table. Keeping the header size a multiple of the
+// cache line size lets tt_load() map the file and use the clusters in
+// place.
+
+struct TTFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t clusterSize;
+  uint64_t clusterCount;
+  uint8_t generation8;
+  char padding[CacheLineSize - 25];
+};
+
+typedef struct TTFileHeader TTFileHeader;
+
+static const char TTFileMagic[8] = "CfishTT";
+static const uint32_t TTFileVersion = 1;
+
+static_assert(sizeof(TTFileHeader) == CacheLineSize, "Bad TTFileHeader size");
+
+// tt_save() writes the transposition table to a file. The table is first
+// written to a temporary file, since it may be mapped from fileName itself.
+
+bool tt_save(const char *fileName)
+{
+  tt_wait_clear();
+  if (!TT.table)
+    return false;
+
+  char tmpName[strlen(fileName) + 5];
+  sprintf(tmpName, "%s.tmp", fileName);
+  FILE *F = fopen(tmpName, "wb");
+  if (!F)
+    return false;
+
+  TTFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TTFileMagic, sizeof(header.magic));
+  header.version = TTFileVersion;
+  header.clusterSize = sizeof(Cluster);
+  header.clusterCount = TT.clusterCount;
+  header.generation8 = TT.generation8;
+
+  bool success =   fwrite(&header, sizeof(header), 1, F) == 1
+                && fwrite(TT.table, sizeof(Cluster), TT.clusterCount, F)
+                        == TT.clusterCount;
+
+  success = fclose(F) == 0 && success;
+#ifdef _WIN32
+  if (success)
+    remove(fileName);
+#endif
+  if (success && rename(tmpName, fileName) == 0)
+    return true;
+
+  remove(tmpName);
+  return false;
+}
+
+// tt_load() replaces the transposition table with the contents of a file
+// written by tt_save(). The file is mapped into memory so that the table
+// can be used immediately, with pages being read in on first access. The
+// file must have been saved with the current Hash size.
+
+bool tt_load(const char *fileName)
+{
+  FD fd = open_file(fileName);
+  if (fd == FD_ERR)
+    return false;
+
+  alloc_t alloc;
+  TTFileHeader *header = NULL;
+  size_t size = file_size(fd);
+  if (size == sizeof(TTFileHeader) + TT.clusterCount * sizeof(Cluster))
+    header = map_file_private(fd, &alloc);
+  close_file(fd);
+  if (!header)
+    return false;
+
+  if (   memcmp(header->magic, TTFileMagic, sizeof(header->magic)) != 0
+      || header->version != TTFileVersion
+      || header->clusterSize != sizeof(Cluster)
+      || header->clusterCount != TT.clusterCount)
+  {
+    free_memory(&alloc);
+    return false;
+  }
+
+  tt_free();
+  TT.alloc = alloc;
+  TT.table = (Cluster *)(header + 1);
+  TT.generation8 = header->generation8;
+
+  return true;
+}
+
+
 // tt_probe() looks up the current position in the transposition table.
 // It returns true and a pointer to the TTEntry if the position is found.
 // Otherwise, it returns false and a pointer to an empty or least valuable
 // TTEntry to be replaced later. The replace value of an entry is
 // calculated as its depth minus 8 times its relative age. TTEntry t1 is
 // considered more valuable than TTEntry t2 if its replace value is greater
-// than that of t2.
+// than that of t2. A copy of the entry as probed is stored in *data. The
+// tte_*() accessors should be applied to this copy, since other threads
+// may overwrite the entry itself at any time.
+
+#ifndef TT_LOCKLESS
 
-TTEntry *tt_probe(Key key, bool *found)
+TTEntry *tt_probe(Key key, bool *found, TTEntry *data)
 {
   TTEntry *tte = tt_first_entry(key);
   uint16_t key16 = key; // Use the low 16 bits as key inside the cluster
@@ -131,7 +500,8 @@ TTEntry *tt_probe(Key key, bool *found)
     if (tte[i].key16 == key16 || !tte[i].depth8) {
 //      if ((tte[i].genBound8 & 0xF8) != TT.generation8 && tte[i].key16)
       tte[i].genBound8 = TT.generation8 | (tte[i].genBound8 & 0x7); // Refresh
-      *found = tte[i].depth8;
+      *data = tte[i];
+      *found = data->depth8;
       return &tte[i];
     }
 
@@ -146,10 +516,63 @@ TTEntry *tt_probe(Key key, bool *found)
         >  tte[i].depth8 - ((263 + TT.generation8 -   tte[i].genBound8) & 0xF8))
       replace = &tte[i];
 
+  *data = *replace;
   *found = false;
   return replace;
 }
 
+#else
+
+// With TT_LOCKLESS, an entry only matches if the full key verifies. An
+// entry whose low 16 bits match but whose full key does not is counted
+// as a collision: it is either a different position or a torn write, and
+// would have been returned as a hit by the 10-byte entry layout. The copy
+// stored in *out holds the data word that was verified, so all fields
+// decoded from it belong to the same position.
+
+TTEntry *tt_probe(Key key, bool *found, TTEntry *out)
+{
+  TTEntry *tte = tt_first_entry(key);
+  TTEntry snap[ClusterSize];
+  int value[ClusterSize];
+
+  for (int i = 0; i < ClusterSize; i++) {
+    uint64_t data = snap[i].data = tte[i].data;
+    Key stored = (snap[i].keyXor = tte[i].keyXor) ^ data;
+    uint8_t depth8 = (uint8_t)data, genBound8 = (uint8_t)(data >> 8);
+
+    if (stored == key || !depth8) {
+      if (depth8) {
+        data = (data & ~(0xF8ULL << 8)) | (uint64_t)TT.generation8 << 8;
+        tte[i].data = data; // Refresh
+        tte[i].keyXor = key ^ data;
+      }
+      out->data = data;
+      out->keyXor = key ^ data;
+      *found = depth8;
+      return &tte[i];
+    }
+
+    if ((uint16_t)stored == (uint16_t)key)
+      atomic_fetch_add_explicit(&TT.collisions, 1, memory_order_relaxed);
+
+    // See the comment in the 10-byte version for the age calculation
+    value[i] = depth8 - ((263 + TT.generation8 - genBound8) & 0xF8);
+  }
+
+  // Find an entry to be replaced according to the replacement strategy
+  int replace = 0;
+  for (int i = 1; i < ClusterSize; i++)
+    if (value[replace] > value[i])
+      replace = i;
+
+  *out = snap[replace];
+  *found = false;
+  return &tte[replace];
+}
+
+#endif
+
 
 // Returns an approximation of the hashtable occupation during a search. The
 // hash is x permill full, as per UCI protocol.
@@ -159,8 +582,140 @@ int tt_hashfull(void)
   int cnt = 0;
   for (int i = 0; i < 1000 / ClusterSize; i++) {
     const TTEntry *tte = &TT.table[i].entry[0];
-    for (int j = 0; j < ClusterSize; j++)
-      cnt += tte[j].depth8 && (tte[j].genBound8 & 0xf8) == TT.generation8;
+    for (int j = 0; j < ClusterSize; j++) {
+#ifndef TT_LOCKLESS
+      uint8_t depth8 = tte[j].depth8, genBound8 = tte[j].genBound8;
+#else
+      uint8_t depth8 = tte[j].data, genBound8 = tte[j].data >> 8;
+#endif
+      cnt += depth8 && (genBound8 & 0xf8) == TT.generation8;
+    }
   }
   return cnt * 1000 / (ClusterSize * (1000 / ClusterSize));
 }
+
+
+enum { TTStatsDepths = 12 };
+
+struct TTStats {
+  uint64_t clusters, entries, pv;
+  uint64_t age[32], depth[TTStatsDepths], bound[4];
+};
+
+typedef struct TTStats TTStats;
+
+static TTStats *ttStats;
+static uint64_t ttStatsStride;
+
+static void tt_stats_scan(TTStats *st, uint64_t begin, uint64_t end)
+{
+  for (uint64_t i = begin; i < end; i += ttStatsStride) {
+    const TTEntry *tte = &TT.table[i].entry[0];
+    st->clusters++;
+    for (int j = 0; j < ClusterSize; j++) {
+#ifndef TT_LOCKLESS
+      uint8_t depth8 = tte[j].depth8, genBound8 = tte[j].genBound8;
+#else
+      uint8_t depth8 = tte[j].data, genBound8 = tte[j].data >> 8;
+#endif
+      if (!depth8)
+        continue;
+      // Depths of at most 0 go to the first bucket, then 4 plies each
+      int d = depth8 + DEPTH_OFFSET;
+      st->entries++;
+      st->age[((263 + TT.generation8 - genBound8) & 0xF8) >> 3]++;
+      st->depth[d <= 0 ? 0 : min((d + 3) / 4, TTStatsDepths - 1)]++;
+      st->bound[genBound8 & 0x3]++;
+      st->pv += (genBound8 >> 2) & 1;
+    }
+  }
+}
+
+void tt_stats_worker(int idx)
+{
+  // Each thread scans a contiguous range of the sampled clusters
+  uint64_t count = (TT.clusterCount + ttStatsStride - 1) / ttStatsStride;
+  uint64_t slice = (count + Threads.numThreads - 1) / Threads.numThreads;
+  uint64_t begin = min(idx * slice, count) * ttStatsStride;
+  uint64_t end = min((idx + 1) * slice * ttStatsStride, TT.clusterCount);
+  tt_stats_scan(&ttStats[idx], begin, end);
+}
+
+static void print_share(const char *name, uint64_t n, uint64_t total)
+{
+  printf("info string %-16s: %" PRIu64 " (%.2f%%)\n", name, n,
+         total ? 100.0 * n / total : 0.0);
+}
+
+// tt_print_stats() scans the transposition table and prints how many of
+// its entries were written by each of the last 32 searches, and the
+// depths, bound types and PV share of the entries. The scan is done in
+// parallel by the search threads, or by the calling thread while a search
+// is running. If sample is not 0, only sample clusters evenly spread over
+// the table are scanned.
+
+void tt_print_stats(uint64_t sample)
+{
+  tt_wait_clear();
+  if (!TT.table)
+    return;
+
+  ttStatsStride = sample && sample < TT.clusterCount
+                 ? TT.clusterCount / sample : 1;
+  bool parallel = !Threads.searching && !threads_slots_busy();
+  int n = parallel ? Threads.numThreads : 1;
+  ttStats = calloc(n, sizeof(TTStats));
+  if (!ttStats)
+    return;
+
+  if (parallel) {
+    for (int idx = 0; idx < n; idx++)
+      thread_wake_up(Threads.pos[idx], THREAD_TT_STATS);
+    for (int idx = 0; idx < n; idx++)
+      thread_wait_until_sleeping(Threads.pos[idx]);
+  } else
+    tt_stats_scan(&ttStats[0], 0, TT.clusterCount);
+
+  TTStats st = { 0 };
+  for (int idx = 0; idx < n; idx++) {
+    st.clusters += ttStats[idx].clusters;
+    st.entries  += ttStats[idx].entries;
+    st.pv       += ttStats[idx].pv;
+    for (int i = 0; i < 32; i++)
+      st.age[i] += ttStats[idx].age[i];
+    for (int i = 0; i < TTStatsDepths; i++)
+      st.depth[i] += ttStats[idx].depth[i];
+    for (int i = 0; i < 4; i++)
+      st.bound[i] += ttStats[idx].bound[i];
+  }
+  free(ttStats);
+  ttStats = NULL;
+
+  // Fill is relative to the scanned capacity, all else to the entries
+  uint64_t slots = st.clusters * ClusterSize;
+  char name[32];
+  printf("info string %-16s: %" PRIu64 " of %" PRIu64 "\n", "TT clusters",
+         st.clusters, (uint64_t)TT.clusterCount);
+  print_share("TT entries", st.entries, slots);
+  for (int i = 0; i < 32; i++)
+    if (st.age[i]) {
+      sprintf(name, "Age %d", i);
+      print_share(name, st.age[i], slots);
+    }
+  for (int i = 0; i < TTStatsDepths; i++) {
+    if (!st.depth[i])
+      continue;
+    if (i == 0)
+      sprintf(name, "Depth <= 0");
+    else if (i < TTStatsDepths - 1)
+      sprintf(name, "Depth %d-%d", 4 * i - 3, 4 * i);
+    else
+      sprintf(name, "Depth >= %d", 4 * i - 3);
+    print_share(name, st.depth[i], st.entries);
+  }
+  print_share("Exact bound", st.bound[BOUND_EXACT], st.entries);
+  print_share("Lower bound", st.bound[BOUND_LOWER], st.entries);
+  print_share("Upper bound", st.bound[BOUND_UPPER], st.entries);
+  print_share("PV entries", st.pv, st.entries);
+  fflush(stdout);
+}
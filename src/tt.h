@@ -24,6 +24,8 @@
 #include "misc.h"
 #include "types.h"
 
+#ifndef TT_LOCKLESS
+
 // TTEntry struct is the 10 bytes transposition table entry, defined as below:
 //
 // key        16 bit
@@ -44,6 +46,31 @@ struct TTEntry {
   int16_t  eval16;
 };
 
+#else
+
+// With TT_LOCKLESS, TTEntry is a 16 bytes entry consisting of a data word
+// and the full 64-bit key XORed with the data word. The data word is laid
+// out as below:
+//
+// depth       8 bit (bits  0- 7)
+// generation  5 bit (bits 11-15)
+// pv node     1 bit (bit     10)
+// bound type  2 bit (bits  8- 9)
+// move       16 bit (bits 16-31)
+// value      16 bit (bits 32-47)
+// eval value 16 bit (bits 48-63)
+//
+// Both words are written without locking. If another thread interleaves
+// its writes with ours, the key no longer verifies and the entry is simply
+// treated as belonging to a different position.
+
+struct TTEntry {
+  uint64_t keyXor;
+  uint64_t data;
+};
+
+#endif
+
 typedef struct TTEntry TTEntry;
 
 // A TranspositionTable consists of a power of 2 number of clusters and
@@ -53,6 +80,8 @@ typedef struct TTEntry TTEntry;
 // clusters never cross cache lines. This ensures best cache performance,
 // as the cacheline is prefetched, as soon as possible.
 
+#if !defined(TT_LOCKLESS) && !defined(TT_CLUSTER64)
+
 enum { CacheLineSize = 64, ClusterSize = 3 };
 
 struct Cluster {
@@ -60,19 +89,54 @@ struct Cluster {
   char padding[2]; // Align to a divisor of the cache line size
 };
 
+#elif !defined(TT_LOCKLESS)
+
+// With TT_CLUSTER64, a cluster fills a whole cache line. This trades a
+// lower number of clusters for more replacement candidates per probe.
+
+enum { CacheLineSize = 64, ClusterSize = 6 };
+
+struct Cluster {
+  TTEntry entry[ClusterSize];
+  char padding[4]; // Align to the cache line size
+};
+
+#else
+
+enum { CacheLineSize = 64, ClusterSize = 4 };
+
+struct Cluster {
+  TTEntry entry[ClusterSize];
+};
+
+#endif
+
 typedef struct Cluster Cluster;
 
+#ifdef NUMA
+enum { MaxTTShards = 64 };
+#endif
+
 struct TranspositionTable {
   size_t clusterCount;
   Cluster *table;
   alloc_t alloc;
   uint8_t generation8; // Size must be not bigger than TTEntry::genBound8
+#ifdef TT_LOCKLESS
+  atomic_uint_fast64_t collisions; // Probes rejected by key verification
+#endif
+#ifdef NUMA
+  int numShards; // Number of NUMA node shards, 1 if not sharded
+  int shardNode[MaxTTShards];
+#endif
 };
 
 typedef struct TranspositionTable TranspositionTable;
 
 extern TranspositionTable TT;
 
+#ifndef TT_LOCKLESS
+
 INLINE void tte_save(TTEntry *tte, Key k, Value v, bool pv, int b, Depth d,
     Move m, Value ev)
 {
@@ -125,7 +189,90 @@ INLINE int tte_bound(TTEntry *tte)
   return tte->genBound8 & 0x3;
 }
 
+#else
+
+INLINE uint64_t tte_pack(uint8_t depth8, uint8_t genBound8, uint16_t move16,
+    int16_t value16, int16_t eval16)
+{
+  return           depth8
+        | (uint64_t)genBound8 << 8
+        | (uint64_t)move16 << 16
+        | (uint64_t)(uint16_t)value16 << 32
+        | (uint64_t)(uint16_t)eval16 << 48;
+}
+
+INLINE void tte_save(TTEntry *tte, Key k, Value v, bool pv, int b, Depth d,
+    Move m, Value ev)
+{
+  uint64_t data = tte->data;
+  bool sameKey = (tte->keyXor ^ data) == k;
+  uint8_t depth8 = (uint8_t)data, genBound8 = (uint8_t)(data >> 8);
+  uint16_t move16 = (uint16_t)(data >> 16);
+  int16_t value16 = (int16_t)(data >> 32), eval16 = (int16_t)(data >> 48);
+
+  // Preserve any existing move for the same position
+  if (m || !sameKey)
+    move16 = (uint16_t)m;
+
+  // Don't overwrite more valuable entries
+  if (   !sameKey
+      || d - DEPTH_OFFSET > depth8 - 4
+      || b == BOUND_EXACT)
+  {
+    assert(d > DEPTH_OFFSET && d < 256 + DEPTH_OFFSET);
+
+    depth8    = (uint8_t)(d - DEPTH_OFFSET);
+    genBound8 = (uint8_t)(TT.generation8 | ((uint8_t)pv << 2) | b);
+    value16   = (int16_t)v;
+    eval16    = (int16_t)ev;
+  }
+
+  data = tte_pack(depth8, genBound8, move16, value16, eval16);
+  tte->data = data;
+  tte->keyXor = k ^ data;
+}
+
+INLINE Move tte_move(TTEntry *tte)
+{
+  return (uint16_t)(tte->data >> 16);
+}
+
+INLINE Value tte_value(TTEntry *tte)
+{
+  return (int16_t)(tte->data >> 32);
+}
+
+INLINE Value tte_eval(TTEntry *tte)
+{
+  return (int16_t)(tte->data >> 48);
+}
+
+INLINE Depth tte_depth(TTEntry *tte)
+{
+  return (uint8_t)tte->data + DEPTH_OFFSET;
+}
+
+INLINE bool tte_is_pv(TTEntry *tte)
+{
+  return (tte->data >> 8) & 0x4;
+}
+
+INLINE int tte_bound(TTEntry *tte)
+{
+  return (tte->data >> 8) & 0x3;
+}
+
+#endif
+
+// tte_is_empty() returns true if the entry does not hold a position.
+
+INLINE bool tte_is_empty(TTEntry *tte)
+{
+  return tte_depth(tte) == DEPTH_OFFSET;
+}
+
 void tt_free(void);
+void tt_report_memory(void);
 
 INLINE void tt_new_search(void)
 {
@@ -137,10 +284,31 @@ INLINE TTEntry *tt_first_entry(Key key)
   return &TT.table[mul_hi64(key, TT.clusterCount)].entry[0];
 }
 
-TTEntry *tt_probe(Key key, bool *found);
+#ifdef NUMA
+
+// With TT sharding, the table is split into numShards equal parts, each
+// allocated on its own node. Since tt_first_entry() maps keys to clusters
+// monotonically, the shard of a key is given by the same multiplication.
+
+INLINE int tt_shard_node(Key key)
+{
+  return TT.shardNode[mul_hi64(key, TT.numShards)];
+}
+
+#endif
+
+TTEntry *tt_probe(Key key, bool *found, TTEntry *data);
 int tt_hashfull(void);
+void tt_print_stats(uint64_t sample);
+void tt_stats_worker(int idx);
 void tt_allocate(size_t mbSize);
+void tt_resize(size_t mbSize);
+void tt_resize_worker(int idx);
 void tt_clear(void);
 void tt_clear_worker(int idx);
+void tt_clear_background(void);
+void tt_wait_clear(void);
+bool tt_save(const char *fileName);
+bool tt_load(const char *fileName);
 
 #endif
@@ -321,13 +321,29 @@ typedef struct LimitsType LimitsType;
 typedef struct RootMove RootMove;
 typedef struct RootMoves RootMoves;
 typedef struct PawnEntry PawnEntry;
+typedef struct TBCacheEntry TBCacheEntry;
+typedef struct EvalCacheEntry EvalCacheEntry;
+typedef struct TraceBuffer TraceBuffer;
 typedef struct MaterialEntry MaterialEntry;
 
 enum { MAX_LPH = 4 };
 
+// With COMPACT_HIST the continuation history tables are indexed by the
+// 12 real pieces instead of by all 16 piece codes, which shrinks a
+// CounterMoveHistoryStat from 8 MB to 4.5 MB. hist_piece() maps a piece
+// to its index. The sentinel table of index 0 then belongs to a white pawn
+// on a1, which never occurs.
+#ifdef COMPACT_HIST
+enum { HIST_PIECE_NB = 12 };
+#define hist_piece(pc) ((pc) - 1 - (((pc) >> 3) << 1))
+#else
+enum { HIST_PIECE_NB = 16 };
+#define hist_piece(pc) (pc)
+#endif
+
 typedef Move CounterMoveStat[16][64];
-typedef int16_t PieceToHistory[16][64];
-typedef PieceToHistory CounterMoveHistoryStat[2][2][16][64];
+typedef int16_t PieceToHistory[HIST_PIECE_NB][64];
+typedef PieceToHistory CounterMoveHistoryStat[2][2][HIST_PIECE_NB][64];
 typedef int16_t ButterflyHistory[2][4096];
 typedef int16_t CapturePieceToHistory[16][64][8];
 typedef int16_t LowPlyHistory[MAX_LPH][4096];
@@ -16,26 +16,60 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 
+#include "cluster.h"
+#include "datagen.h"
 #include "evaluate.h"
+#include "learn.h"
+#include "material.h"
 #include "misc.h"
 #include "movegen.h"
+#include "pawns.h"
+#ifdef NNUE
+#include "nnue.h"
+#endif
+#include "polybook.h"
 #include "position.h"
 #include "search.h"
 #include "settings.h"
+#include "tbprobe.h"
 #include "thread.h"
 #include "timeman.h"
+#include "tt.h"
 #include "uci.h"
 
 extern void benchmark(Position *pos, char *str);
+extern void benchmark_suite(Position *pos, char *str);
+extern void benchmark_scaling(Position *pos, char *str);
+extern void speedtest(Position *pos, char *str);
+#ifdef USE_MPI
+extern void benchmark_cluster(Position *pos, char *str);
+#endif
 
 // FEN string of the initial position, normal chess
 static const char StartFEN[] =
   "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
+static void root_pos_init(Position *pos);
+static void root_pos_free(Position *pos);
+
+// The game set up by the last "position" command is kept in a Position of
+// its own together with its FEN and moves. GUIs send the whole game with
+// every move, so a command that only appends moves to that game only has
+// to make the new moves.
+
+static struct {
+  Position pos;
+  int ply;              // Number of plies into the circular buffer
+  char fen[128];
+  char *moves;          // The moves made, separated by single spaces
+  size_t movesLen, movesSize;
+} game;
+
 // position() is called when the engine receives the "position" UCI
 // command. The function sets up the position described in the given FEN
 // string ("fen") or the starting position ("startpos") and then makes
@@ -60,27 +94,79 @@ void position(Position *pos, char *str)
   else
     return;
 
-  pos->st = pos->stack + 100; // Start of circular buffer of 100 slots.
-  pos_set(pos, fen, option_value(OPT_CHESS960));
+  // Join the moves by single spaces to compare them with the game.
+  char *list = malloc((moves ? strlen(moves) : 0) + 1);
+  size_t len = 0;
+  if (moves)
+    for (char *m = strtok(moves, " \t\n"); m; m = strtok(NULL, " \t\n")) {
+      if (len) list[len++] = ' ';
+      strcpy(list + len, m);
+      len += strlen(m);
+    }
+  list[len] = 0;
+
+  // Continue the game if the command only appends moves to it.
+  Position *gpos = &game.pos;
+  char *newMoves = list;
+  if (   gpos->stackAllocation
+      && gpos->chess960 == option_value(OPT_CHESS960)
+      && strcmp(game.fen, fen) == 0
+      && len >= game.movesLen
+      && strncmp(list, game.moves, game.movesLen) == 0
+      && (!game.movesLen || list[game.movesLen] == ' ' || !list[game.movesLen]))
+    newMoves += game.movesLen;
+  else {
+    if (!gpos->stackAllocation)
+      root_pos_init(gpos);
+    strcpy(game.fen, fen);
+    gpos->st = gpos->stack + 100; // Start of circular buffer of 100 slots.
+    pos_set(gpos, fen, option_value(OPT_CHESS960));
+    game.ply = 0;
+    game.movesLen = 0;
+  }
 
-  // Parse move list (if any).
-  if (moves) {
-    int ply = 0;
-
-    for (moves = strtok(moves, " \t"); moves; moves = strtok(NULL, " \t")) {
-      Move m = uci_to_move(pos, moves);
-      if (!m) break;
-      do_move(pos, m, gives_check(pos, pos->st, m));
-      pos->gamePly++;
-      // Roll over if we reach 100 plies.
-      if (++ply == 100) {
-        memcpy(pos->st - 100, pos->st, StateSize);
-        pos->st -= 100;
-        pos_set_check_info(pos);
-        ply -= 100;
-      }
+  // Parse the new moves (if any).
+  for (char *m = strtok(newMoves, " "); m; m = strtok(NULL, " ")) {
+    Move move = uci_to_move(gpos, m);
+    if (!move) break;
+    do_move(gpos, move, gives_check(gpos, gpos->st, move));
+    gpos->gamePly++;
+    gpos->lastMove = move;
+    // Roll over if we reach 100 plies.
+    if (++game.ply == 100) {
+      memcpy(gpos->st - 100, gpos->st, StateSize);
+      gpos->st -= 100;
+      pos_set_check_info(gpos);
+      game.ply -= 100;
     }
 
+    size_t l = strlen(m);
+    if (game.movesLen + l + 2 > game.movesSize) {
+      game.movesSize = 2 * game.movesSize + l + 256;
+      game.moves = realloc(game.moves, game.movesSize);
+    }
+    if (game.movesLen) game.moves[game.movesLen++] = ' ';
+    strcpy(game.moves + game.movesLen, m);
+    game.movesLen += l;
+  }
+  free(list);
+
+  // Copy the game to the root position.
+  memcpy(pos, gpos, offsetof(Position, moveList));
+  for (int i = 100; i < 200; i++)
+    memcpy(&pos->stack[i], &gpos->stack[i], StateSize);
+  pos->st = pos->stack + (gpos->st - gpos->stack);
+  pos_set_check_info(pos);
+#ifdef NNUE
+  pos->st->accumulator.state[WHITE] = ACC_INIT;
+  pos->st->accumulator.state[BLACK] = ACC_INIT;
+#ifndef NNUE_PURE
+  pos->st->accumulator.smallState[WHITE] = ACC_INIT;
+  pos->st->accumulator.smallState[BLACK] = ACC_INIT;
+#endif
+#endif
+
+  if (game.movesLen) {
     // Make sure that is_draw() never tries to look back more than 99 ply.
     // This is enough, since 100 ply history means draw by 50-move rule.
     if (pos->st->pliesFromNull > 99)
@@ -207,6 +293,288 @@ static void go(Position *pos, char *str)
   start_thinking(pos, ponderMode);
 }
 
+// memory() is called when the engine receives the "memory" command. It
+// prints the memory allocated for each purpose, per NUMA node.
+
+static void memory(void)
+{
+  tt_report_memory();
+  threads_report_memory();
+#ifndef NNUE_PURE
+  pawn_report_memory();
+  material_report_memory();
+#endif
+#ifdef NNUE
+  nnue_report_memory();
+#endif
+  TB_report_memory();
+  pb_report_memory();
+  learn_report_memory();
+  print_memory_usage();
+}
+
+#ifdef SEARCH_STATS
+
+// stats() is called when the engine receives the "stats" command. It
+// prints the counters collected by all threads during the last search.
+
+static void stats(void)
+{
+  uint64_t searchStats[STAT_NB];
+  threads_search_stats(searchStats);
+
+  printf("info string %-16s: %" PRIu64 "\n", "Nodes searched",
+         threads_nodes_searched());
+  search_print_stats(stdout, "info string ", searchStats);
+  fflush(stdout);
+}
+
+#endif
+
+
+// split_word() terminates the first word of str and returns the rest of
+// the string with leading blanks skipped.
+
+static char *split_word(char *str)
+{
+  while (*str && !isblank(*str))
+    str++;
+
+  if (*str) {
+    *str++ = 0;
+    while (isblank(*str))
+      str++;
+  }
+
+  return str;
+}
+
+
+// stop() is called when the engine receives the "stop" or "quit" command.
+
+static void stop(void)
+{
+  if (Threads.searching) {
+    Threads.stop = true;
+    LOCK(Threads.lock);
+    if (Threads.sleeping)
+      thread_wake_up(threads_main(), THREAD_RESUME);
+    Threads.sleeping = false;
+    UNLOCK(Threads.lock);
+  }
+}
+
+
+// The GUI sends 'ponderhit' to tell us the player has played the expected
+// move. In case Threads.stopOnPonderhit is set we are waiting for
+// 'ponderhit' to stop the search (for instance because we have already
+// searched long enough), otherwise we should continue searching but
+// switch from pondering to normal search.
+
+static void ponderhit(void)
+{
+  Threads.ponder = false; // Switch to normal search
+  ponder_hit();
+  if (Threads.stopOnPonderhit)
+    Threads.stop = true;
+  LOCK(Threads.lock);
+  if (Threads.sleeping) {
+    Threads.stop = true;
+    thread_wake_up(threads_main(), THREAD_RESUME);
+    Threads.sleeping = false;
+  }
+  UNLOCK(Threads.lock);
+}
+
+
+// root_pos_init() allocates the stack and move list of a root position
+// used by the UI thread and sets up the start position.
+
+static void root_pos_init(Position *pos)
+{
+  char fen[strlen(StartFEN) + 1];
+
+  // The root position has no thread-specific tables such as the NNUE
+  // accumulator cache or the tablebase cache.
+  memset(pos, 0, sizeof(*pos));
+
+  // Allocate 215 Stack slots.
+  // Slots 100-200 form a circular buffer to be filled with game moves.
+  // Slots 0-99 make room for prepending the part of game history relevant
+  // for repetition detection.
+  // Slots 201-214 may be used by TB root probing.
+  pos->stackAllocation = malloc(63 + 215 * sizeof(Stack));
+  pos->stack = (Stack *)(((uintptr_t)pos->stackAllocation + 0x3f) & ~0x3f);
+  pos->moveList = malloc(1000 * sizeof(ExtMove));
+  pos->st = pos->stack + 100;
+  pos->st[-1].endMoves = pos->moveList;
+
+  strcpy(fen, StartFEN);
+  pos_set(pos, fen, 0);
+  pos->rootKeyFlip = pos->st->key;
+}
+
+static void root_pos_free(Position *pos)
+{
+  free(pos->stackAllocation);
+  free(pos->moveList);
+}
+
+
+#ifdef SERVER
+
+// In server mode the command "id <tag> <command>" runs <command> for the
+// search tagged <tag>. Each tag is bound to a search slot with its own
+// root position and its own "Server Threads" threads, and all output of
+// its search starts with "id <tag> ". Supported commands are position,
+// go, stop and ponderhit. A tag gets a slot that was never used or else
+// the idle slot that was used least recently. The net, the TT and the
+// tablebases are shared by all searches.
+
+static struct {
+  char tag[64];
+  Position pos;
+  TimePoint lastUse;
+} slots[MAX_SEARCHES];
+
+void uci_print_tag(void)
+{
+  if (searchIdx)
+    printf("id %s ", slots[searchIdx].tag);
+}
+
+char *uci_tag(char *str)
+{
+  if (searchIdx)
+    sprintf(str, "id %s ", slots[searchIdx].tag);
+  else
+    str[0] = 0;
+  return str;
+}
+
+static bool slot_busy(int slot)
+{
+  return   threadPools[slot].numThreads
+        && threadPools[slot].pos[0]->action != THREAD_SLEEP;
+}
+
+// slot_for_tag() returns the slot bound to the given tag, binding a slot
+// to it first if needed, or 0 if all slots are busy.
+
+static int slot_for_tag(const char *tag)
+{
+  int slot = 0;
+
+  for (int i = 1; i < MAX_SEARCHES; i++)
+    if (strncmp(slots[i].tag, tag, sizeof(slots[i].tag) - 1) == 0)
+      return i;
+
+  for (int i = 1; i < MAX_SEARCHES; i++) {
+    if (!slots[i].tag[0]) {
+      slot = i;
+      break;
+    }
+    if (!slot_busy(i) && (!slot || slots[i].lastUse < slots[slot].lastUse))
+      slot = i;
+  }
+
+  if (!slot)
+    return 0;
+
+  searchIdx = slot;
+
+  if (!slots[slot].tag[0]) {
+    LOCK_INIT(Threads.lock);
+    Threads.searching = Threads.sleeping = false;
+    threads_init();
+    threads_set_number(option_value(OPT_SERVER_THREADS));
+    root_pos_init(&slots[slot].pos);
+  } else {
+    // A slot taken over from another tag starts with clear histories
+    if (Threads.searching)
+      thread_wait_until_sleeping(threads_main());
+    search_clear_threads();
+  }
+
+  strncpy(slots[slot].tag, tag, sizeof(slots[slot].tag) - 1);
+  searchIdx = 0;
+
+  return slot;
+}
+
+static void server_command(char *str)
+{
+  char *tag = str;
+  char *cmd = split_word(tag);
+  char *args = split_word(cmd);
+
+  if (!*tag)
+    return;
+
+  int slot = slot_for_tag(tag);
+  if (!slot) {
+    printf("id %s info string No free search slot\n", tag);
+    fflush(stdout);
+    return;
+  }
+
+  searchIdx = slot;
+  slots[slot].lastUse = now();
+  Position *pos = &slots[slot].pos;
+
+  if (strcmp(cmd, "stop") == 0)
+    stop();
+  else if (strcmp(cmd, "ponderhit") == 0)
+    ponderhit();
+  else if (   (strcmp(cmd, "position") == 0 || strcmp(cmd, "go") == 0)
+           && slot_busy(slot)) {
+    printf("id %s info string Search still running\n", tag);
+    fflush(stdout);
+  }
+  else if (strcmp(cmd, "position") == 0)
+    position(pos, args);
+  else if (strcmp(cmd, "go") == 0) {
+    // Apply pending settings such as the first TT allocation, unless
+    // another search is running
+    searchIdx = 0;
+    if (threads_main()->action == THREAD_SLEEP)
+      process_delayed_settings();
+    searchIdx = slot;
+
+    if (Threads.searching)
+      thread_wait_until_sleeping(threads_main());
+    if (Threads.numThreads != option_value(OPT_SERVER_THREADS))
+      threads_set_number(option_value(OPT_SERVER_THREADS));
+    go(pos, args);
+  }
+  else {
+    printf("id %s info string Unknown command: %s %s\n", tag, cmd, args);
+    fflush(stdout);
+  }
+
+  searchIdx = 0;
+}
+
+// server_exit() stops the tagged searches and their threads.
+
+static void server_exit(void)
+{
+  for (int i = 1; i < MAX_SEARCHES; i++) {
+    if (!slots[i].tag[0])
+      continue;
+    searchIdx = i;
+    stop();
+    if (Threads.searching)
+      thread_wait_until_sleeping(threads_main());
+    threads_exit();
+    LOCK_DESTROY(Threads.lock);
+    root_pos_free(&slots[i].pos);
+  }
+  searchIdx = 0;
+}
+
+#endif
+
 
 // uci_loop() waits for a command from stdin, parses it and calls the
 // appropriate function. Also intercepts EOF from stdin to ensure
@@ -218,7 +586,6 @@ static void go(Position *pos, char *str)
 void uci_loop(int argc, char **argv)
 {
   Position pos;
-  char fen[strlen(StartFEN) + 1];
   char str_buf[64];
   char *token;
 
@@ -237,16 +604,7 @@ void uci_loop(int argc, char **argv)
   // This variable must be accessed only after acquiring Threads.lock.
   Threads.sleeping = false;
 
-  // Allocate 215 Stack slots.
-  // Slots 100-200 form a circular buffer to be filled with game moves.
-  // Slots 0-99 make room for prepending the part of game history relevant
-  // for repetition detection.
-  // Slots 201-214 may be used by TB root probing.
-  pos.stackAllocation = malloc(63 + 215 * sizeof(Stack));
-  pos.stack = (Stack *)(((uintptr_t)pos.stackAllocation + 0x3f) & ~0x3f);
-  pos.moveList = malloc(1000 * sizeof(ExtMove));
-  pos.st = pos.stack + 100;
-  pos.st[-1].endMoves = pos.moveList;
+  root_pos_init(&pos);
 
   size_t buf_size = 1;
   for (int i = 1; i < argc; i++)
@@ -262,12 +620,12 @@ void uci_loop(int argc, char **argv)
     strcat(cmd, " ");
   }
 
-  strcpy(fen, StartFEN);
-  pos_set(&pos, fen, 0);
-  pos.rootKeyFlip = pos.st->key;
-
   do {
+#ifdef USE_MPI
+    if (argc == 1 && !cluster_getline(&cmd, &buf_size))
+#else
     if (argc == 1 && !getline(&cmd, &buf_size, stdin))
+#endif
       strcpy(cmd, "quit");
 
     if (cmd[strlen(cmd) - 1] == '\n')
@@ -277,43 +635,15 @@ void uci_loop(int argc, char **argv)
     while (isblank(*token))
       token++;
 
-    char *str = token;
-    while (*str && !isblank(*str))
-      str++;
-
-    if (*str) {
-      *str++ = 0;
-      while (isblank(*str))
-        str++;
-    }
+    char *str = split_word(token);
 
-    // The GUI sends 'ponderhit' to tell us the player has played the
-    // expected move. In case Threads.stopOnPonderhit is set we are waiting
-    // for 'ponderhit' to stop the search (for instance because we have
-    // already searched long enough), otherwise we should continue searching
-    // but switch from pondering to normal search.
-    if (strcmp(token, "quit") == 0 || strcmp(token, "stop") == 0) {
-      if (Threads.searching) {
-        Threads.stop = true;
-        LOCK(Threads.lock);
-        if (Threads.sleeping)
-          thread_wake_up(threads_main(), THREAD_RESUME);
-        Threads.sleeping = false;
-        UNLOCK(Threads.lock);
-      }
-    }
-    else if (strcmp(token, "ponderhit") == 0) {
-      Threads.ponder = false; // Switch to normal search
-      if (Threads.stopOnPonderhit)
-        Threads.stop = true;
-      LOCK(Threads.lock);
-      if (Threads.sleeping) {
-        Threads.stop = true;
-        thread_wake_up(threads_main(), THREAD_RESUME);
-        Threads.sleeping = false;
-      }
-      UNLOCK(Threads.lock);
-    }
+    if (strcmp(token, "quit") == 0 || strcmp(token, "stop") == 0)
+      stop();
+    else if (strcmp(token, "ponderhit") == 0)
+      ponderhit();
+#ifdef SERVER
+    else if (strcmp(token, "id") == 0)        server_command(str);
+#endif
     else if (strcmp(token, "uci") == 0) {
       flockfile(stdout);
       printf("id name ");
@@ -327,6 +657,7 @@ void uci_loop(int argc, char **argv)
     else if (strcmp(token, "ucinewgame") == 0) {
       process_delayed_settings();
       search_clear();
+      pb_seed_tt(option_value(OPT_BOOK_SEED_DEPTH));
     } else if (strcmp(token, "isready") == 0) {
       process_delayed_settings();
       printf("readyok\n");
@@ -338,13 +669,38 @@ void uci_loop(int argc, char **argv)
 
     // Additional custom non-UCI commands, useful for debugging
     else if (strcmp(token, "bench") == 0)     benchmark(&pos, str);
+    else if (strcmp(token, "benchsuite") == 0) benchmark_suite(&pos, str);
+    else if (strcmp(token, "benchscale") == 0) benchmark_scaling(&pos, str);
+    else if (strcmp(token, "speedtest") == 0) speedtest(&pos, str);
+#ifdef USE_MPI
+    else if (strcmp(token, "benchcluster") == 0) benchmark_cluster(&pos, str);
+#endif
     else if (strcmp(token, "d") == 0)         print_pos(&pos);
+    else if (strcmp(token, "searchbatch") == 0) search_batch(str);
+    else if (strcmp(token, "datagen") == 0)   datagen(str);
+#ifdef NNUE
+    else if (strcmp(token, "evalbatch") == 0) nnue_eval_file(str);
+    else if (strcmp(token, "export_net") == 0) nnue_export(str);
+#endif
+#ifdef SEARCH_STATS
+    else if (strcmp(token, "stats") == 0)     stats();
+#endif
     else if (strcmp(token, "perft") == 0) {
       sprintf(str_buf, "%d %d %d current perft", option_value(OPT_HASH),
                     option_value(OPT_THREADS), atoi(str));
       benchmark(&pos, str_buf);
     }
+    else if (strcmp(token, "ttstats") == 0)
+      tt_print_stats(strtoull(str, NULL, 10));
+    else if (strcmp(token, "ponderstats") == 0) ponder_print_stats();
+    else if (strcmp(token, "learncompact") == 0) learn_compact(str);
     else if (strcmp(token, "compiler") == 0)  print_compiler_info();
+    else if (strcmp(token, "startup") == 0)   print_startup_times();
+    else if (strcmp(token, "memory") == 0)    memory();
+    else if (strcmp(token, "tables") == 0) {
+      char *fileName = strtok(str, " \t");
+      tables_save(fileName ? fileName : "tables.bin");
+    }
     else {
       printf("Unknown command: %s %s\n", token, str);
       fflush(stdout);
@@ -354,9 +710,15 @@ void uci_loop(int argc, char **argv)
   if (Threads.searching)
     thread_wait_until_sleeping(threads_main());
 
+#ifdef SERVER
+  server_exit();
+#endif
+
   free(cmd);
-  free(pos.stackAllocation);
-  free(pos.moveList);
+  root_pos_free(&pos);
+  if (game.pos.stackAllocation)
+    root_pos_free(&game.pos);
+  free(game.moves);
 
   LOCK_DESTROY(Threads.lock);
 }
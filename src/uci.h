@@ -41,33 +41,76 @@ enum {
   OPT_DEPTH,
   OPT_SLEEP,
   OPT_THREADS,
+  OPT_PARK_THREADS,
+  OPT_IDLE_SPIN,
+  OPT_SKIP_DEPTHS,
   OPT_HASH,
   OPT_CLEAR_HASH,
+  OPT_PERFT_HASH,
+#ifndef NNUE_PURE
+  OPT_PAWN_HASH,
+  OPT_MATERIAL_HASH,
+  OPT_SHARED_PAWN_HASH,
+#endif
+  OPT_BG_CLEAR_HASH,
+  OPT_HASH_FILE,
+  OPT_SAVE_HASH,
+  OPT_LOAD_HASH,
   OPT_PONDER,
   OPT_MULTI_PV,
+  OPT_MULTI_PV_SPLIT,
+  OPT_MULTI_PONDER,
+  OPT_PV_INTERVAL,
+  OPT_PV_CHANGED_ONLY,
   OPT_SKILL_LEVEL,
   OPT_MOVE_OVERHEAD,
+  OPT_TIMER_THREAD,
   OPT_SLOW_MOVER,
   OPT_NODES_TIME,
   OPT_ANALYSE_MODE,
+  OPT_RESUME_ANALYSIS,
   OPT_CHESS960,
   OPT_SYZ_PATH,
   OPT_SYZ_PROBE_DEPTH,
   OPT_SYZ_50_MOVE,
   OPT_SYZ_PROBE_LIMIT,
   OPT_SYZ_USE_DTM,
+  OPT_SYZ_PREFETCH,
+  OPT_SYZ_POPULATE,
+  OPT_SYZ_MEMORY,
   OPT_BOOK_FILE,
   OPT_BOOK_FILE2,
   OPT_BOOK_BEST_MOVE,
   OPT_BOOK_DEPTH,
+  OPT_BOOK_INDEX,
+  OPT_BOOK_SEED_DEPTH,
+  OPT_LEARNING_SIZE,
+  OPT_LEARNING_FILE,
 #ifdef NNUE
   OPT_EVAL_FILE,
+  OPT_EVAL_WEIGHTS_FILE,
+  OPT_BG_NET_LOAD,
 #ifndef NNUE_PURE
   OPT_USE_NNUE,
+  OPT_EVAL_FILE_SMALL,
 #endif
 #endif
   OPT_LARGE_PAGES,
-  OPT_NUMA
+  OPT_NUMA,
+#ifdef NUMA
+  OPT_NUMA_TT_SHARDS,
+#endif
+  OPT_THREAD_BINDING,
+#ifdef SERVER
+  OPT_SERVER_THREADS,
+#endif
+#ifdef USE_MPI
+  OPT_CLUSTER_SHARE_DEPTH,
+  OPT_CLUSTER_BANDWIDTH,
+#endif
+#ifdef SEARCH_TRACE
+  OPT_TRACE_FILE,
+#endif
 };
 
 struct Option {
@@ -97,6 +140,16 @@ char *uci_value(char *str, Value v);
 char *uci_square(char *str, Square s);
 char *uci_move(char *str, Move m, int chess960);
 void print_pv(Position *pos, Depth depth, Value alpha, Value beta);
+
+// uci_print_tag() starts an output line of a tagged search in server mode
+// with "id <tag> ". uci_tag() writes that prefix to a string instead.
+#ifdef SERVER
+void uci_print_tag(void);
+char *uci_tag(char *str);
+#else
+INLINE void uci_print_tag(void) {}
+INLINE char *uci_tag(char *str) { str[0] = 0; return str; }
+#endif
 Move uci_to_move(const Position *pos, char *str);
 
 #endif
@@ -27,8 +27,13 @@
 #include <sys/mman.h>
 #endif
 
+#include "affinity.h"
 #include "evaluate.h"
+#include "learn.h"
 #include "misc.h"
+#ifdef NNUE
+#include "nnue.h"
+#endif
 #include "numa.h"
 #include "polybook.h"
 #include "search.h"
@@ -47,6 +52,28 @@ static void on_clear_hash(Option *opt)
     search_clear();
 }
 
+static void on_save_hash(Option *opt)
+{
+  (void)opt;
+
+  const char *fileName = option_string_value(OPT_HASH_FILE);
+  if (tt_save(fileName))
+    printf("info string Hash saved to %s.\n", fileName);
+  else
+    printf("info string Unable to save hash to %s.\n", fileName);
+  fflush(stdout);
+}
+
+static void on_load_hash(Option *opt)
+{
+  (void)opt;
+
+  // The table is replaced once it has been allocated with its final size.
+  delayedSettings.loadHash = true;
+  if (settings.ttSize)
+    process_delayed_settings();
+}
+
 static void on_hash_size(Option *opt)
 {
   delayedSettings.ttSize = opt->value;
@@ -61,11 +88,40 @@ static void on_numa(Option *opt)
 #endif
 }
 
+#ifdef NUMA
+static void on_numa_tt_shards(Option *opt)
+{
+  delayedSettings.ttShards = opt->value;
+}
+#endif
+
+static void on_thread_binding(Option *opt)
+{
+  read_thread_binding(opt->valString);
+}
+
 static void on_threads(Option *opt)
 {
   delayedSettings.numThreads = opt->value;
 }
 
+#ifndef NNUE_PURE
+static void on_pawn_hash(Option *opt)
+{
+  delayedSettings.pawnHash = opt->value;
+}
+
+static void on_material_hash(Option *opt)
+{
+  delayedSettings.materialHash = opt->value;
+}
+
+static void on_shared_pawn_hash(Option *opt)
+{
+  delayedSettings.sharedPawnHash = opt->value;
+}
+#endif
+
 static void on_tb_path(Option *opt)
 {
   TB_init(opt->valString);
@@ -86,6 +142,21 @@ static void on_book_file2(Option *opt)
   pb_init(&polybook2, opt->valString);
 }
 
+#ifdef NNUE
+static void on_eval_file(Option *opt)
+{
+  (void)opt;
+
+  if (option_value(OPT_BG_NET_LOAD))
+    nnue_load_background();
+}
+#endif
+
+static void on_learning_file(Option *opt)
+{
+  learn_init(opt->valString);
+}
+
 static void on_best_book_move(Option *opt)
 {
   pb_set_best_book_move(opt->value);
@@ -96,6 +167,15 @@ static void on_book_depth(Option *opt)
   pb_set_book_depth(opt->value);
 }
 
+static void on_book_index(Option *opt)
+{
+  (void)opt;
+
+  pb_free();
+  pb_init(&polybook, option_string_value(OPT_BOOK_FILE));
+  pb_init(&polybook2, option_string_value(OPT_BOOK_FILE2));
+}
+
 #ifdef IS_64BIT
 #define MAXHASHMB 33554432
 #else
@@ -109,34 +189,77 @@ static Option optionsMap[] = {
   { "Depth", OPT_TYPE_SPIN, 0, 0, 20, NULL, NULL, 0, NULL },
   { "Sleep", OPT_TYPE_SPIN, 0, 0,180, NULL, NULL, 0, NULL },  
   { "Threads", OPT_TYPE_SPIN, 1, 1, MAX_THREADS, NULL, on_threads, 0, NULL },
+  { "Park Threads", OPT_TYPE_CHECK, 1, 0, 0, NULL, NULL, 0, NULL },
+  { "Idle Spin", OPT_TYPE_SPIN, 0, 0, 1000, NULL, NULL, 0, NULL },
+  { "Helper Skip Depths", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
   { "Hash", OPT_TYPE_SPIN, 16, 1, MAXHASHMB, NULL, on_hash_size, 0, NULL },
   { "Clear Hash", OPT_TYPE_BUTTON, 0, 0, 0, NULL, on_clear_hash, 0, NULL },
+  { "Perft Hash", OPT_TYPE_SPIN, 0, 0, MAXHASHMB, NULL, NULL, 0, NULL },
+#ifndef NNUE_PURE
+  { "Pawn Hash", OPT_TYPE_SPIN, 0, 0, 65536, NULL, on_pawn_hash, 0, NULL },
+  { "Material Hash", OPT_TYPE_SPIN, 0, 0, 16384, NULL, on_material_hash, 0, NULL },
+  { "Shared Pawn Hash", OPT_TYPE_SPIN, 0, 0, 65536, NULL, on_shared_pawn_hash, 0, NULL },
+#endif
+  { "Background Clear Hash", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
+  { "HashFile", OPT_TYPE_STRING, 0, 0, 0, "hash.hsh", NULL, 0, NULL },
+  { "SaveHashToFile", OPT_TYPE_BUTTON, 0, 0, 0, NULL, on_save_hash, 0, NULL },
+  { "LoadHashFromFile", OPT_TYPE_BUTTON, 0, 0, 0, NULL, on_load_hash, 0, NULL },
   { "Ponder", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
   { "MultiPV", OPT_TYPE_SPIN, 1, 1, 500, NULL, NULL, 0, NULL },
+  { "MultiPV Split", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
+  { "Multi Ponder", OPT_TYPE_SPIN, 1, 1, 4, NULL, NULL, 0, NULL },
+  { "PV Interval", OPT_TYPE_SPIN, 0, 0, 10000, NULL, NULL, 0, NULL },
+  { "PV Changed Only", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
   { "Skill Level", OPT_TYPE_SPIN, 20, 0, 20, NULL, NULL, 0, NULL },
   { "Move Overhead", OPT_TYPE_SPIN, 10, 0, 5000, NULL, NULL, 0, NULL },
+  { "Timer Thread", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
   { "Slow Mover", OPT_TYPE_SPIN, 100, 10, 1000, NULL, NULL, 0, NULL },
   { "nodestime", OPT_TYPE_SPIN, 0, 0, 10000, NULL, NULL, 0, NULL },
   { "UCI_AnalyseMode", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
+  { "Resume Analysis", OPT_TYPE_CHECK, 1, 0, 0, NULL, NULL, 0, NULL },
   { "UCI_Chess960", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
   { "SyzygyPath", OPT_TYPE_STRING, 0, 0, 0, "<empty>", on_tb_path, 0, NULL },
   { "SyzygyProbeDepth", OPT_TYPE_SPIN, 1, 1, 100, NULL, NULL, 0, NULL },
   { "Syzygy50MoveRule", OPT_TYPE_CHECK, 1, 0, 0, NULL, NULL, 0, NULL },
   { "SyzygyProbeLimit", OPT_TYPE_SPIN, 7, 0, 7, NULL, NULL, 0, NULL },
   { "SyzygyUseDTM", OPT_TYPE_CHECK, 1, 0, 0, NULL, NULL, 0, NULL },
+  { "SyzygyPrefetch", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
+  { "SyzygyPopulate", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
+  { "SyzygyMemory", OPT_TYPE_SPIN, 0, 0, MAXHASHMB, NULL, NULL, 0, NULL },
   { "BookFile", OPT_TYPE_STRING, 0, 0, 0, "<empty>", on_book_file, 0, NULL },
   { "BookFile2", OPT_TYPE_STRING, 0, 0, 0, "<empty>", on_book_file2, 0, NULL },
   { "BestBookMove", OPT_TYPE_CHECK, 1, 0, 0, NULL, on_best_book_move, 0, NULL },
   { "BookDepth", OPT_TYPE_SPIN, 255, 1, 255, NULL, on_book_depth, 0, NULL },
+  { "BookIndex", OPT_TYPE_CHECK, 0, 0, 0, NULL, on_book_index, 0, NULL },
+  { "BookSeedDepth", OPT_TYPE_SPIN, 0, 0, 100, NULL, NULL, 0, NULL },
+  { "LearningSize", OPT_TYPE_SPIN, 16, 1, MAXHASHMB, NULL, NULL, 0, NULL },
+  { "LearningFile", OPT_TYPE_STRING, 0, 0, 0, "<empty>", on_learning_file, 0, NULL },
 #ifdef NNUE
-  { "EvalFile", OPT_TYPE_STRING, 0, 0, 0, EvalFileDefaultName, NULL, 0, NULL },
+  { "EvalFile", OPT_TYPE_STRING, 0, 0, 0, EvalFileDefaultName, on_eval_file, 0, NULL },
+  { "EvalWeightsFile", OPT_TYPE_STRING, 0, 0, 0, "<empty>", NULL, 0, NULL },
+  { "Background Net Load", OPT_TYPE_CHECK, 0, 0, 0, NULL, NULL, 0, NULL },
 #ifndef NNUE_PURE
   { "Use NNUE", OPT_TYPE_COMBO, 0, 0, 0,
     "Hybrid var Hybrid var Pure var Classical", NULL, 0, NULL },
+  { "EvalFileSmall", OPT_TYPE_STRING, 0, 0, 0, "<empty>", NULL, 0, NULL },
 #endif
 #endif
   { "LargePages", OPT_TYPE_CHECK, 1, 0, 0, NULL, on_large_pages, 0, NULL },
   { "NUMA", OPT_TYPE_STRING, 0, 0, 0, "all", on_numa, 0, NULL },
+#ifdef NUMA
+  { "NUMA TT Shards", OPT_TYPE_CHECK, 0, 0, 0, NULL, on_numa_tt_shards, 0, NULL },
+#endif
+  { "Thread Binding", OPT_TYPE_STRING, 0, 0, 0, "none", on_thread_binding, 0, NULL },
+#ifdef SERVER
+  { "Server Threads", OPT_TYPE_SPIN, 1, 1, MAX_THREADS, NULL, NULL, 0, NULL },
+#endif
+#ifdef USE_MPI
+  { "Cluster Share Depth", OPT_TYPE_SPIN, 8, 1, 100, NULL, NULL, 0, NULL },
+  { "Cluster Bandwidth", OPT_TYPE_SPIN, 0, 0, 100000, NULL, NULL, 0, NULL },
+#endif
+#ifdef SEARCH_TRACE
+  { "TraceFile", OPT_TYPE_STRING, 0, 0, 0, "trace.json", NULL, 0, NULL },
+#endif
   { 0 }
 };
 
@@ -150,8 +273,10 @@ void options_init()
 
 #ifdef NUMA
   // On a non-NUMA machine, disable the NUMA option to diminish confusion.
-  if (!numaAvail)
+  if (!numaAvail) {
     optionsMap[OPT_NUMA].type = OPT_TYPE_DISABLED;
+    optionsMap[OPT_NUMA_TT_SHARDS].type = OPT_TYPE_DISABLED;
+  }
 #else
   optionsMap[OPT_NUMA].type = OPT_TYPE_DISABLED;
 #endif
@@ -190,7 +315,7 @@ void options_init()
         *s = tolower(*s);
       break;
     }
-    if (opt->onChange)
+    if (opt->onChange && opt->type != OPT_TYPE_BUTTON)
       opt->onChange(opt);
   }
 }